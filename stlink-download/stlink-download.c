@@ -261,6 +261,11 @@ enum STLinkParamDirection {
  */
 #define Q_BUF_LEN	(6*1024 + 4)
 
+/* The number of commands we keep outstanding on the sg device.
+ * The STLink itself handles one command at a time, but queueing lets us
+ * overlap the kernel and USB round trips of consecutive commands. */
+#define SG_QUEUE_LEN	8
+
 /* Many commands return two bytes of status.
  * Only the lower byte has useful bits, so we often check only that. */
 #define STLINK_OK			0x80
@@ -386,9 +391,22 @@ struct stlink {
 	 * q_buf[]/q_len is now data_buf[]/data_len
 	 * sense_buf is mostly passed-and-ignored and locally declared
 	 */
+#if defined(__linux__)
+	/* Commands submitted to the sg driver but not yet retired. */
+	struct sg_req {
+		struct sg_io_hdr io_hdr;
+		unsigned char cmd_buf[CDB_SIZE];
+		unsigned char sense_buf[SENSE_BUF_LEN];
+		unsigned char resp_buf[4];	/* Discarded short responses. */
+	} sg_queue[SG_QUEUE_LEN];
+	unsigned int sg_head, sg_tail;
+#endif
 };
 
 int stl_do_cmd(struct stlink *stl);
+int stl_queue_cmd(struct stlink *stl, void *data);
+int stl_queue_retire(struct stlink *stl);
+int stl_queue_flush(struct stlink *stl);
 
 // Endianness
 // http://www.ibm.com/developerworks/aix/library/au-endianc/index.html
@@ -461,7 +479,7 @@ struct stlink *stl_init(struct stlink *sl, const char *dev_name)
 	int fd = open(dev_name, O_RDWR);
 #endif
 
-	if (sl->fd < 0) {
+	if (fd < 0) {
 		fprintf(stderr, "Failed to open STLink device %s: %s.\n",
 				dev_name, strerror(errno));
 		return NULL;
@@ -480,6 +498,15 @@ struct stlink *stl_init(struct stlink *sl, const char *dev_name)
 
 	sl->verbose = verbose;
 	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+#if defined(__linux__)
+	{
+		/* Have each read() return the request with the pack_id we ask
+		 * for, and allow several commands to be outstanding. */
+		int one = 1;
+		ioctl(fd, SG_SET_FORCE_PACK_ID, &one);
+		ioctl(fd, SG_SET_COMMAND_Q, &one);
+	}
+#endif
 
 	return sl;
 }
@@ -491,6 +518,7 @@ void stl_close(struct stlink *sl)
 #if defined(__ms_windows__)
 	CloseHandle(sl->fd);
 #else
+	stl_queue_flush(sl);
 	if (sl->fd >= 0)
 		close(sl->fd);
 #endif
@@ -573,6 +601,19 @@ int stlink_cmd(struct stlink *sl, uint8_t st_cmd1, uint8_t st_cmd2,
 
 #define is_core_halted(sl)  (stl_get_status(sl) == STLINK_CORE_HALTED)
 
+/* Queue a regular-form Debug command without waiting for its response.
+ * The short status response is discarded. */
+static int stlink_cmd_queue(struct stlink *sl, uint8_t st_cmd1,
+							uint8_t st_cmd2, int response_len)
+{
+	sl->cmd_buf[0] = STLinkDebugCommand;
+	sl->cmd_buf[1] = st_cmd1;
+	sl->cmd_buf[2] = st_cmd2;
+	sl->data_len = response_len;
+	sl->xfer_dir = STLinkParamFromDev;
+	return stl_queue_cmd(sl, NULL);
+}
+
 /* Basic target memory read and write functions.
  * Both bulk and single 32 bit word functions are here.
  * The 32 bit versions use function parameters and return a value.
@@ -582,7 +623,8 @@ int stlink_cmd(struct stlink *sl, uint8_t st_cmd1, uint8_t st_cmd2,
  * The *_mem8 variant has a maximum LEN of 64 bytes.
  * The *_mem32 variant must have LEN be a multiple of 4.
  */
-static inline int stl_wr32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
+static inline int stl_wr32_queue(struct stlink* sl, uint32_t addr,
+								 uint16_t len)
 {
 	sl->cmd_buf[0] = STLinkDebugCommand;
 	if ((len & 3) == 0)
@@ -596,14 +638,26 @@ static inline int stl_wr32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
 	sl->cmd_len = 8;
 	sl->data_len = len;
 	sl->xfer_dir = STLinkParamToDev;
-	stl_do_cmd(sl);
-	return 0;
+	return stl_queue_cmd(sl, sl->data_buf);
+}
+static inline int stl_wr32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
+{
+	if (stl_wr32_queue(sl, addr, len) < 0)
+		return -1;
+	return stl_queue_flush(sl);
 }
 static inline void sl_wr32(struct stlink* sl, uint32_t addr, uint32_t val)
 {
 	write_uint32(sl->data_buf, val);
 	stl_wr32_cmd(sl, addr, sizeof(uint32_t));
 }
+/* Queue a single word write.  The data is copied when submitted. */
+static inline void sl_wr32_queue(struct stlink* sl, uint32_t addr,
+								 uint32_t val)
+{
+	write_uint32(sl->data_buf, val);
+	stl_wr32_queue(sl, addr, sizeof(uint32_t));
+}
 
 /* Read target memory command.
  * Reads must be aligned 32 bit words.
@@ -634,56 +688,132 @@ static inline uint32_t sl_rd32(struct stlink *sl, uint32_t addr)
 	stl_rd32_cmd(sl, addr, sizeof(uint32_t));
 	return *(uint32_t*)sl->data_buf;
 }
+/* Queue a read of LEN bytes, a multiple of 4, at ADDR directly into DEST.
+ * DEST is filled in when the command is retired. */
+static int stl_rd32_queue(struct stlink* sl, uint32_t addr, uint16_t len,
+						  void *dest)
+{
+	sl->cmd_buf[0] = STLinkDebugCommand;
+	sl->cmd_buf[1] = STLinkDebugReadMem32bit;
+	write_uint32(sl->cmd_buf + 2, addr);
+	write_uint16(sl->cmd_buf + 6, len);
+	sl->data_len = len;
+	sl->xfer_dir = STLinkParamFromDev;
+	return stl_queue_cmd(sl, dest);
+}
 
 #if defined(linux)
-/* Enqueue a command to the STLink.
+/* Queue a command to the STLink.
  * v1 uses SCSI transport over USB.
  * Most of the work is filling in the struct sg_io_hdr.
  * stl->cmd_buf
- * stl->data_buf, stl->data_len
+ * stl->xfer_dir, stl->data_len with the data at DATA
+ *
+ * We use the asynchronous sg interface, write() to submit and read() to
+ * retire, rather than a blocking ioctl(SG_IO) per command.  That lets the
+ * next commands be submitted while the STLink works on this one.  Each
+ * request is tagged with its queue slot as the pack_id.
+ * The sg driver copies outgoing data when the request is written, so
+ * stl->data_buf may be reused immediately.  Incoming data is only filled
+ * in when the request is retired, so DATA must remain valid until then.
+ * A NULL DATA discards a short response e.g. the status of a register
+ * write.
  */
-int stl_do_cmd(struct stlink *stl)
+int stl_queue_cmd(struct stlink *stl, void *data)
 {
-    struct sg_io_hdr io_hdr = {0,};
-	/* Sense (error information) data */
-	unsigned char sense_buf[SENSE_BUF_LEN];
-	int ret;
+	struct sg_req *rq;
+	struct sg_io_hdr *io_hdr;
+
+	if (stl->sg_head - stl->sg_tail >= SG_QUEUE_LEN &&
+		stl_queue_retire(stl) < 0)
+		return -1;
+	rq = &stl->sg_queue[stl->sg_head % SG_QUEUE_LEN];
+	io_hdr = &rq->io_hdr;
+	memset(io_hdr, 0, sizeof *io_hdr);
+	memcpy(rq->cmd_buf, stl->cmd_buf, sizeof rq->cmd_buf);
+	if (data == NULL && stl->data_len <= sizeof rq->resp_buf)
+		data = rq->resp_buf;
 
-	io_hdr.interface_id = 'S';
-    io_hdr.pack_id = 0;
+	io_hdr->interface_id = 'S';
+	io_hdr->pack_id = stl->sg_head % SG_QUEUE_LEN;
 
 	/* Provide buffers for the SCSI transfer.
 	 * The Request Sense (error info) command is used for responses.
 	 * http://en.wikipedia.org/wiki/SCSI_Request_Sense_Command
 	 */
-	io_hdr.cmdp = stl->cmd_buf;
-	io_hdr.cmd_len = sizeof(stl->cmd_buf);
-	io_hdr.sbp = sense_buf;
-	io_hdr.mx_sb_len = sizeof(sense_buf);
-	memset(io_hdr.sbp, 0, io_hdr.sb_len_wr);
+	io_hdr->cmdp = rq->cmd_buf;
+	io_hdr->cmd_len = sizeof(rq->cmd_buf);
+	io_hdr->sbp = rq->sense_buf;
+	io_hdr->mx_sb_len = sizeof(rq->sense_buf);
 
 	/* Set a buffer to be used for data transferred from/to device */
-	io_hdr.iovec_count = 0;
-	io_hdr.dxferp = stl->data_buf;
-	io_hdr.dxfer_len = stl->data_len;
-	io_hdr.dxfer_direction =
+	io_hdr->iovec_count = 0;
+	io_hdr->dxferp = data;
+	io_hdr->dxfer_len = stl->data_len;
+	io_hdr->dxfer_direction =
 		(stl->xfer_dir == STLinkParamToDev ? SG_DXFER_TO_DEV:SG_DXFER_FROM_DEV);
 
-	io_hdr.timeout = TIMEOUT_MSEC;
-	io_hdr.flags = 0;
-	ret = ioctl(stl->fd, SG_IO, &io_hdr);
+	io_hdr->timeout = TIMEOUT_MSEC;
+	io_hdr->flags = 0;
+	if (write(stl->fd, io_hdr, sizeof *io_hdr) < 0) {
+		fprintf(stderr, " SCSI command %2.2x %2.2x submit failed: %s.\n",
+				rq->cmd_buf[0], rq->cmd_buf[1], strerror(errno));
+		return -1;
+	}
+	stl->sg_head++;
+	return 0;
+}
+
+/* Wait for the oldest queued command to complete and report its results. */
+int stl_queue_retire(struct stlink *stl)
+{
+	struct sg_req *rq = &stl->sg_queue[stl->sg_tail % SG_QUEUE_LEN];
+	struct sg_io_hdr *io_hdr = &rq->io_hdr;
+	int ret;
+
+	if (stl->sg_tail == stl->sg_head)
+		return 0;
+	/* The read() blocks until the request with io_hdr->pack_id is done. */
+	ret = read(stl->fd, io_hdr, sizeof *io_hdr);
+	stl->sg_tail++;
+	if (ret < 0) {
+		fprintf(stderr, " SCSI command %2.2x %2.2x failed: %s.\n",
+				rq->cmd_buf[0], rq->cmd_buf[1], strerror(errno));
+		return -1;
+	}
 	/* Report SCSI results.  Really, note useful variable if we need
 	 * to write better reporting code. */
 	if (stl->verbose) {
 		if (stl->verbose > 3)
 			fprintf(stderr, " SCSI command status %4.4x, took %d ms.\n",
-					io_hdr.status, io_hdr.duration);
-		if (io_hdr.resid || io_hdr.sb_len_wr)
+					io_hdr->status, io_hdr->duration);
+		if (io_hdr->resid || io_hdr->sb_len_wr)
 			fprintf(stderr, " SCSI residue was %d, sense length %d.\n",
-					io_hdr.resid, io_hdr.sb_len_wr);
+					io_hdr->resid, io_hdr->sb_len_wr);
 	}
+	return 0;
+}
+
+/* Wait for all queued commands. */
+int stl_queue_flush(struct stlink *stl)
+{
+	int ret = 0;
+
+	while (stl->sg_tail != stl->sg_head)
+		if (stl_queue_retire(stl) < 0)
+			ret = -1;
 	return ret;
 }
+
+/* Execute a command, waiting for it and anything queued before it. */
+int stl_do_cmd(struct stlink *stl)
+{
+	if (stl_queue_cmd(stl, stl->data_buf) < 0) {
+		stl_queue_flush(stl);
+		return -1;
+	}
+	return stl_queue_flush(stl);
+}
 #elif defined(__ms_windows__)
 /* Code written by Anto Eltchaninov */
 #define IOCTL_SCSI_PASS_THROUGH_DIRECT 0x4D014
@@ -768,6 +898,24 @@ GetLastError ());
    }
    return ret;
 }
+
+/* There is no command queue here: a queued command completes immediately. */
+int stl_queue_cmd(struct stlink *stl, void *data)
+{
+	int ret;
+
+	if (data && data != stl->data_buf && stl->xfer_dir == STLinkParamToDev)
+		memcpy(stl->data_buf, data, stl->data_len);
+	ret = stl_do_cmd(stl);
+	if (data && data != stl->data_buf && stl->xfer_dir == STLinkParamFromDev)
+		memcpy(data, stl->data_buf, stl->data_len);
+	return ret ? 0 : -1;
+}
+
+int stl_queue_flush(struct stlink *stl)
+{
+	return 0;
+}
 #endif
 
 static void stl_print_version(struct STLinkVersion *ver)
@@ -1015,12 +1163,17 @@ static int stl_loader(struct stlink *sl, stm32_addr_t flash_addr,
 	params[-2] = flash_addr;
 	params[-1] = size>>1;
 	memcpy(params, buf, size);
-
-	/* Transfer both the loader and data at once. */
-	stl_wr32_cmd(sl, prog_base, offset + size);
-	/* Run the program by setting the PC aka r15. */
-	stl_write_reg(sl, prog_base, 15);
-	stl_state_run(sl);
+	/* The 32 bit write needs a whole number of words. */
+	while (size & 3)
+		sl->data_buf[offset + size++] = 0xff;
+
+	/* Transfer both the loader and data at once, run the program by
+	 * setting the PC aka r15.  These are queued back-to-back, and
+	 * complete with the caller's first status poll. */
+	stl_wr32_queue(sl, prog_base, offset + size);
+	write_uint32(sl->cmd_buf + 3, prog_base);
+	stlink_cmd_queue(sl, STLinkDebugWriteReg, 15, 2);
+	stlink_cmd_queue(sl, STLinkDebugRunCore, 0, 2);
 
 	return 0;
 }
@@ -1035,11 +1188,12 @@ static int stl_flash_write(struct stlink *sl, stm32_addr_t flash_addr,
 
 	if (sl->verbose)
 		printf("Flash write %8.8x..%8.8x.\n", flash_addr, flash_addr+size);
-	/* Unlock the flash register. */
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY1);
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY2);
+	/* Unlock the flash register.  These are queued with the first
+	 * loader download. */
+	sl_wr32_queue(sl, FLASH_KEYR, FLASH_KEY1);
+	sl_wr32_queue(sl, FLASH_KEYR, FLASH_KEY2);
 	/* Clear the error bits in the control register. */
-	sl_wr32(sl, FLASH_SR, 0x34);
+	sl_wr32_queue(sl, FLASH_SR, 0x34);
 	if (sl->verbose)
 		printf("Flash status %2.2x, control %4.4x.\n",
 			   sl_rd32(sl, FLASH_SR), sl_rd32(sl, FLASH_CR));
@@ -1138,27 +1292,31 @@ static int stl_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
 int stl_read(struct stlink* sl, stm32_addr_t addr, void *buf, ssize_t size)
 {
 	size_t offset = 0;
+	int ret;
 
 	if (addr & 3) {
 		int psz = 4 - (addr & 3);
+		if (psz > size)
+			psz = size;
 		stl_rd32_cmd(sl, addr & ~3, sizeof(uint32_t));
 		memcpy(buf, sl->data_buf + (addr & 3), psz);
 		offset = psz;
+		size -= psz;
 	}
-	do {
-		int xfer_size;
-		if (size > READ_BLK_SIZE)
-			xfer_size = READ_BLK_SIZE;
-		else
-			xfer_size = (size+3)&~3;
-		stl_rd32_cmd(sl, addr+offset, xfer_size);
-		if (size & 3)
-			xfer_size = size;
-		memcpy(buf + offset, sl->data_buf, xfer_size);
+	/* Queue the whole-word blocks to read directly into BUF, keeping
+	 * several requests in flight. */
+	while (size >= 4) {
+		int xfer_size = size > READ_BLK_SIZE ? READ_BLK_SIZE : size & ~3;
+		stl_rd32_queue(sl, addr + offset, xfer_size, buf + offset);
 		offset += xfer_size;
 		size -= xfer_size;
-	} while (size > 0);
-	return size;
+	}
+	ret = stl_queue_flush(sl);
+	if (size > 0) {
+		stl_rd32_cmd(sl, addr + offset, sizeof(uint32_t));
+		memcpy(buf + offset, sl->data_buf, size);
+	}
+	return ret;
 }
 
 
@@ -77,6 +77,8 @@ Usage notes on the original STLink v1 firmware only:
 #include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -86,12 +88,27 @@ Usage notes on the original STLink v1 firmware only:
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <scsi/sg.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
 
 #elif defined(__ms_windows__)
 #include <windows.h>
 
 #elif defined(__APPLE__)
 #include <libusb-1.0/libusb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
 #else
 #error "No host OS defined."
 #endif
@@ -111,11 +128,35 @@ static const char usage_msg[] =
 #endif
 	"Commands are:\n"
 	"  program=<file>           Erase whole flash and write firmware file\n"
+	"  update=<file>            Erase and write only the pages that changed\n"
 	"  info version blink\n"
 	"  debug reg<regnum> wreg<regnum>=<value> regs reset run step status\n"
+	"  run=<seconds>            Run until the core halts, e.g. a breakpoint\n"
 	"  erase=<addr> erase=all<addr>\n"
 	"  read<memaddr> write<memaddr>=<val>\n"
 	"  flash:r:<file> flash:w:<file> flash:v:<file>\n"
+	"  stats stats=<file>       Report the STLink command statistics\n"
+	"  calibrate                Find the best read transfer size again\n"
+	"  watch:<log>=<addr>[+<len>],...[@<seconds>]\n"
+	"                           Sample memory while running, to a log\n"
+	"\n"
+	"With several STLinks attached, --list shows them, --probe=<serial or\n"
+	" USB path> selects one, and --all runs the commands on every STLink\n"
+	" in parallel, e.g. gang programming with --all program=<file>\n"
+	" --wait=<seconds> waits for the STLink to be plugged in.\n"
+	"\n"
+	"--transport=sim[:<idcode>] talks to a simulated STLink and STM32 instead\n"
+	" of hardware, and --transport=/dev/sgN to a v1 STLink.\n"
+	"--stats=<file> writes per-command counts and latencies as JSON at exit.\n"
+	"--cache-dir=<dir> keeps the target's ID and system memory between runs.\n"
+	"--vpp programs an F2/F4 64 bits at a time, with 8-9V on its VPP pin.\n"
+	"--export=<file.csv or file.vcd> converts a watch log when it ends.\n"
+	"Memory read into a file named *.stld is stored as a compact dump, which\n"
+	" programming and verify accept in place of a raw image.\n"
+	"\n"
+	"--server=<socket or [host]:port> stays attached and takes commands from\n"
+	" clients, such as another run with --connect=<socket or host:port>.\n"
+	" With no commands, --connect sends its stdin, one command per line.\n"
 	"\n"
 	"Note: The STLink firmware does a flawed job of pretending to be a USB\n"
 	" storage devices.  It may take several minutes after plugging in before\n"
@@ -125,17 +166,31 @@ static const char usage_msg[] =
 	"sudo modprobe usb-storage quirks=483:3744:lrwsro\n"
 ;
 
-static char short_opts[] = "BC:D:U:huvV";
+static char short_opts[] = "aBc:C:D:E:K:L:U:hlP:q:RS:T:uvVW:X";
 static struct option long_options[] = {
+    {"all",		0, NULL, 	'a'},	/* Run on every attached STLink. */
     {"blink",	0, NULL, 	'B'},
+    {"connect",	1, NULL, 	'c'},	/* Send the commands to a server. */
     {"check",	1, NULL, 	'C'},
     {"verify",	1, NULL, 	'C'},
     {"download", 1, NULL, 	'D'},
+    {"export",	1, NULL,	'E'},	/* Convert a watch log to CSV/VCD. */
+    {"cache-dir", 1, NULL,	'K'},	/* Keep the ID/system memory cache. */
     {"upload",	1, NULL, 	'U'},
     {"help",	0, NULL,	'h'},	/* Print a long usage message. */
+    {"list",	0, NULL,	'l'},	/* List the attached STLinks. */
+    {"listen",	1, NULL,	'L'},	/* Serve commands on a socket. */
+    {"server",	1, NULL,	'L'},
+    {"probe",	1, NULL,	'P'},	/* Select a STLink by serial or path. */
+    {"queue-depth", 1, NULL,	'q'},	/* Commands kept in flight. */
+    {"usb-reset", 0, NULL,	'R'},	/* Always do the slow full attach. */
+    {"stats",	1, NULL,	'S'},	/* Write command statistics as JSON. */
+    {"transport", 1, NULL,	'T'},	/* usb, sim[:idcode] or /dev/sgN */
     {"usage",	0, NULL,	'u'},
     {"verbose", 0, NULL,	'v'},	/* Report each action taken.  */
     {"version", 0, NULL,	'V'},	/* Emit version information.  */
+    {"vpp",		0, NULL,	'X'},	/* The F4 has VPP for x64 programming. */
+    {"wait",	1, NULL,	'W'},	/* Wait for a STLink to be plugged in. */
     {NULL,		0, NULL,	0},
 };
 
@@ -204,11 +259,6 @@ struct stm_chip_params {			/* Unused/placeholder parameter table. */
 	  0x08000000, 64*1024, 1024,
 	  0x1ffff000, 2*1024, 1024,
 	  0x20000000, 20*1024},
-	{ "STM32F105RB", 0,
-	  0x3ba00477, 0x10016430,	/* XL-density device. */
-	  0x08000000, 32*1024, 1024,
-	  0x1ffff000, 2*1024, 1024,
-	  0x20000000, 4*1024},
 	{ "STM32F10x", 0,
 	  0x1ba01477, 0x10016412,	/* Low-density devices. */
 	  0x08000000, 32*1024, 1024,
@@ -221,7 +271,7 @@ struct stm_chip_params {			/* Unused/placeholder parameter table. */
 	  0x20000000, 8*1024},
 	{ "STM32F10x", 0,
 	  0x1ba01477, 0x10016414,	/* High-density devices. */
-	  0x08000000, 512*1024, 1024,
+	  0x08000000, 512*1024, 2048,
 	  0x1ffff000, 2*1024, 1024,
 	  0x20000000, 8*1024},
 	{ "STM32F10x", 0,
@@ -254,6 +304,23 @@ struct stm_chip_params {			/* Unused/placeholder parameter table. */
 	  0x08000000, 256*1024, 2048,
 	  0x1fffb000, 18*1024, 1024,
 	  0x20000000, 8*1024},
+	/* The F2 and F4 flash is in sectors of 16K to 128K, see stl_f4_sector().
+	 * The page size given is the smallest sector. */
+	{ "STM32F405/407", ChipCapF4Flash,
+	  0x2ba01477, 0x10076413,	/* F407VG as on STM32F4Discovery. */
+	  0x08000000, 1024*1024, 16*1024,
+	  0x1fff0000, 30*1024, 1024,
+	  0x20000000, 128*1024},
+	{ "STM32F42x/43x", ChipCapF4Flash,
+	  0x2ba01477, 0x10036419,	/* Two banks of 1M. */
+	  0x08000000, 2048*1024, 16*1024,
+	  0x1fff0000, 30*1024, 1024,
+	  0x20000000, 192*1024},
+	{ "STM32F401xB/C", ChipCapF4Flash,
+	  0x2ba01477, 0x10006423,
+	  0x08000000, 256*1024, 16*1024,
+	  0x1fff0000, 30*1024, 1024,
+	  0x20000000, 64*1024},
 	{0, 0, 0,}
 };
 
@@ -275,13 +342,159 @@ enum STLinkParamDirection {
 
 /* A command should complete in well under one second. Most take a few
  * milliseconds, with a more complex ones taking about 250 ms.
+ * Rather than always waiting the worst case, each command gets a timeout
+ * from its transfer size, see stl_cmd_timeout().  Only the mode changes
+ * and resets get the full TIMEOUT_MSEC.
  */
 #define TIMEOUT_MSEC	800
-/* The maximum number of times to loop waiting for the flash page write
- * program to finish.  This is under 50 cycles for a 1 millisecond USB 1.0
- * poll, but takes 120-140 cycles for a 250 microsecond poll 
+#define TIMEOUT_BASE_MSEC	50		/* A small command, with a wide margin */
+#define TIMEOUT_BYTES_PER_MSEC	256	/* A quarter of full-speed USB */
+#define TIMEOUT_MAX_MSEC	2000
+/* A failed command that is safe to repeat is retried this many times,
+ * after the transport has abandoned the commands in flight and resynced. */
+#define STL_RETRY_LIMIT	3
+/* The longest we wait for a STLink to come back after leaving DFU mode. */
+#define STL_REPLUG_MSEC	10000
+
+/* FPEC flash controller interface, PM0063 or PM0075 manual. */
+#define FLASH_REGS_ADDR 0x40022000
+
+#define FLASH_ACR	(FLASH_REGS_ADDR + 0x00)
+#define FLASH_KEYR	(FLASH_REGS_ADDR + 0x04)
+#define FLASH_SR	(FLASH_REGS_ADDR + 0x0c)
+#define FLASH_CR	(FLASH_REGS_ADDR + 0x10)
+#define FLASH_AR	(FLASH_REGS_ADDR + 0x14)
+#define FLASH_OBR	(FLASH_REGS_ADDR + 0x1c)
+#define FLASH_WRPR	(FLASH_REGS_ADDR + 0x20)
+/* The XL parts, over 512K, have a second controller for the bank from
+ * 0x08080000.  Its registers are at the same offsets from +0x40. */
+#define FLASH_BANK2_ADDR	0x08080000
+#define FLASH_BANK2_REGS	(FLASH_REGS_ADDR + 0x40)
+#define FLASH_REG(base, reg)	((base) + ((reg) - FLASH_REGS_ADDR))
+
+/* Flash unlock key values from PM0075 2.3.1 */
+#define FLASH_RDPTR_KEY 0x00a5
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xcdef89ab
+
+/* 32L15x flash controller. */
+#define L15_FLASH_BASE 0x40023C00
+#define L15_FLASH_ACR		(L15_FLASH_BASE + 0x00)
+#define L15_FLASH_PECR		(L15_FLASH_BASE + 0x04)
+#define L15_FLASH_PDKEYR	(L15_FLASH_BASE + 0x08)
+#define L15_FLASH_PEKEYR	(L15_FLASH_BASE + 0x0C)
+#define L15_FLASH_PRGKEYR	(L15_FLASH_BASE + 0x10)
+#define L15_FLASH_OPTKEYR	(L15_FLASH_BASE + 0x14)
+#define L15_FLASH_SR		(L15_FLASH_BASE + 0x18)
+#define L15_FLASH_OBR		(L15_FLASH_BASE + 0x1C)
+#define L15_FLASH_WRPR1		(L15_FLASH_BASE + 0x20)
+#define L15_FLASH_WRPR2		(L15_FLASH_BASE + 0x80)
+#define L15_FLASH_WRPR3		(L15_FLASH_BASE + 0x84)
+
+#define L15_FLASH_PEKEY1 0x89abcdef
+#define L15_FLASH_PEKEY2 0x02030405
+#define L15_FLASH_PRGKEY1 0x8C9DAEBF
+#define L15_FLASH_PRGKEY2 0x13141516
+#define L15_FLASH_OPTKEY1 0xFBEAD9C8
+#define L15_FLASH_OPTKEY2 0x24252627
+
+#define FLASH_SR_BSY 0x0001
+#define FLASH_SR_PGERR 0x0004
+#define FLASH_SR_WRPRTERR 0x0010
+#define FLASH_SR_EOP 0x0020
+
+/* Names and definitions from PM0075 sec 3.5 */
+#define FLASH_CR_PG  0x0001
+#define FLASH_CR_PER 0x0002
+#define FLASH_CR_MER 0x0004
+#define FLASH_CR_OPTPG 0x0010
+#define FLASH_CR_OPTER 0x0020
+#define FLASH_CR_STRT 0x0040
+#define FLASH_CR_LOCK 0x0080
+
+/* Typical flash operation times, from which stl_wait() starts polling.
+ * PM0075 for the F1, RM0090 for the F4 and RM0038 for the L1. */
+#define FLASH_PROG_US		53			/* Halfword, 40-70 us */
+#define FLASH_ERASE_US		20000		/* Page erase, 20-40 ms */
+#define FLASH_MASS_ERASE_US	20000		/* 20-40 ms */
+#define F4_FLASH_PROG_US	16			/* Halfword */
+#define F4_ERASE_KB_US		16000		/* x32: 250 ms for 16K, 2 s for 128K */
+#define F4_MASS_ERASE_US	16000000
+#define L15_FLASH_ERASE_US	3300		/* Page erase, 3.28 ms */
+/* And the datasheet maximum program times, from which the time outs are. */
+#define FLASH_PROG_MAX_US	70
+#define F4_FLASH_PROG_MAX_US	100
+
+/* Names and definitions from PM0081 (STM32F4). */
+#define F4_FLASH_REGS 0x40023C00
+
+#define F4_FLASH_ACR	(F4_FLASH_REGS + 0x00)
+#define F4_FLASH_KEYR	(F4_FLASH_REGS + 0x04)
+#define F4_FLASH_OPTKEYR 	(F4_FLASH_REGS + 0x08)
+#define F4_FLASH_SR	(F4_FLASH_REGS + 0x0c)
+#define  F4_FLASH_SR_EOP 0x00000001
+#define  F4_FLASH_SR_ERRS 0x000000F2	/* OPERR WRPERR PGAERR PGPERR PGSERR */
+#define  F4_FLASH_SR_WRPERR 0x00000010
+#define  F4_FLASH_SR_PGAERR 0x00000020	/* Write not aligned to its size */
+#define  F4_FLASH_SR_PGPERR 0x00000040	/* Write size is not PSIZE */
+#define  F4_FLASH_SR_PGSERR 0x00000080	/* PG not set before the write */
+#define  F4_FLASH_SR_BSY 0x00010000
+#define F4_FLASH_CR	(F4_FLASH_REGS + 0x10)
+#define  F4_FLASH_CR_SER 0x00000002
+#define  F4_FLASH_CR_SNB_SHIFT 3
+#define  F4_FLASH_CR_PSIZE_SHIFT 8		/* x8, x16, x32, x64 */
+#define  F4_FLASH_CR_MER1 0x00008000	/* The second bank of 2M parts */
+#define  F4_FLASH_CR_STRT 0x00010000
+#define  F4_FLASH_CR_LOCK 0x80000000
+
+/* The F2 and F4 flash sectors, RM0033 and RM0090 sec 3.3.
+ * Every F2 and F4 bank has four 16K sectors, one of 64K and then 128K
+ * sectors, as many as its size needs.  The 2M F42x/F43x have a second 1M
+ * bank of the same layout, sectors 12 to 23, selected by SNB 16 to 27.
  */
-#define FLASH_POLL_LIMIT 200
+#define F4_BANK_SIZE	(1024*1024)
+static const uint8_t f4_sector_kb[] = {
+	16, 16, 16, 16, 64, 128, 128, 128, 128, 128, 128, 128,
+};
+
+/* Find the sector holding the byte at flash offset OFF.
+ * Returns its FLASH_CR SNB value, and its offset and size in *START and
+ * *SIZE. */
+static int stl_f4_sector(uint32_t off, uint32_t *start, uint32_t *size)
+{
+	const int bank = off / F4_BANK_SIZE;
+	uint32_t pos = bank * F4_BANK_SIZE;
+	int i;
+
+	for (i = 0; i < sizeof f4_sector_kb - 1 &&
+			 off >= pos + f4_sector_kb[i] * 1024; i++)
+		pos += f4_sector_kb[i] * 1024;
+	*start = pos;
+	*size = f4_sector_kb[i] * 1024;
+	return bank ? 16 + i : i;
+}
+
+/* The CRC calculation unit, at the same address on every family.
+ * It is clocked by CRCEN in the AHB clock enable register. */
+#define CRC_DR		0x40023000
+#define CRC_CR		0x40023008
+#define  CRC_CR_RESET 0x01
+#define F1_RCC_AHBENR	0x40021014		/* Also the F0 */
+#define  F1_RCC_AHBENR_CRCEN 0x0040
+#define F4_RCC_AHB1ENR	0x40023830		/* Also the F2 */
+#define L15_RCC_AHBENR	0x4002381C
+#define  F4_RCC_AHB1ENR_CRCEN 0x1000	/* And the L1 */
+
+/* The Cortex-M debug halting control and status register, ARMv7-M
+ * C1.6.2.  Writes need the key in the top half, reads have the status. */
+#define DHCSR		0xE000EDF0
+#define  DHCSR_KEY		0xA05F0000
+#define  DHCSR_C_DEBUGEN	0x01
+#define  DHCSR_C_HALT		0x02
+#define  DHCSR_C_STEP		0x04
+#define  DHCSR_C_MASKINTS	0x08
+#define  DHCSR_S_REGRDY		0x00010000
+#define  DHCSR_S_HALT		0x00020000
 
 /* The v1 device presents itself as a USB mass storage device.  Debug access
  * is through additional SCSI Command Descriptor Blocks (CDB) commands.
@@ -307,7 +520,6 @@ enum STLinkParamDirection {
 #define USB_PIPE_IN 0x81	   /* Bulk output endpoint for responses */
 #define USB_PIPE_OUT  0x02	   /* Bulk input endpoint for commands */
 #define USB_PIPE_ERR 0x83	   /* An apparently-unused bulk endpoint. */
-#define USB_TIMEOUT_MSEC	800		/* Generous */
 
 /* The maximum data transfer seems to be about 6KB, likely limited by
  * the RAM on the STLink 32F103 chip.  This is not a painful limit.  There
@@ -333,7 +545,7 @@ enum STLinkParamDirection {
  * I started with gdb-friendly enums, so they do slightly differ.
  */
 /* STLink commands.
- * 0xF1, 0xF3, and 0xF5 operate only on the STLink interface.
+ * 0xF1, 0xF3, 0xF5 and 0xF7 operate only on the STLink interface.
  * 0xF2, 0xF4 and F6 are interact with the target MCU.
  */
 enum STLink_Cmds {
@@ -343,6 +555,7 @@ enum STLink_Cmds {
 	STLinkV2Command=0xF4,		/* Command set 2, used for the STM8 */
 	STLinkGetCurrentMode=0xF5,	/* Returns 2 byte STLink mode */
 	STLinkV3Command=0xF6,		/* Command set 3, used for the Cortex-M4 */
+	STLinkGetTargetVoltage=0xF7,	/* Returns two 32 bit ADC readings */
 };
 
 enum STLink_Device_Modes {		/* Response to STLinkGetCurrentMode */
@@ -418,10 +631,109 @@ struct STLinkVersion {
 /* Hmmm, briefly seemed like a good idea. */
 typedef uint32_t stm32_addr_t;
 
+/* The asynchronous command queue.
+ * The STLink v2 executes commands strictly in order, and the USB host
+ * controller keeps the transfers for each endpoint in order.  So we may
+ * submit the command, data and response transfers for several commands
+ * at once and retire them in the order submitted.  The probe then never
+ * waits for us between commands, which is where most of the time went.
+ * STL_QUEUE_LEN is the ring size, sl->q_depth the number actually allowed
+ * in flight.  A depth of 1 is the old one-command-at-a-time behavior.
+ */
+#define STL_QUEUE_LEN	16
+#define STL_QUEUE_DEPTH	8			/* Default in-flight command limit */
+#define STL_CMD_LEN		16			/* USB command block is always 16 bytes */
+
+struct stlink;
+struct stl_req {
+	unsigned char cmd_buf[STL_CMD_LEN];
+	int cmd_len;
+	enum STLinkParamDirection xfer_dir;
+	unsigned char *data;		/* Data phase buffer, usually rq->buf */
+	int data_len;
+	int actual_len;				/* Data phase bytes actually transferred */
+	int status;					/* 0 or a libusb error code. */
+	int done;					/* All transfers for this command finished. */
+	int xfers_pending;
+	void *copy_to;				/* If set, copy the response here on retire. */
+	int copy_len;
+	unsigned char *buf;			/* Per-slot bounce buffer, Q_BUF_LEN bytes */
+	uint64_t submit_ns;			/* When submitted, for the statistics */
+	int timeout_ms;				/* From submission, including those ahead */
+	int retries;
+#if defined(__linux__) || defined(__APPLE__)
+	struct libusb_transfer *cmd_xfer, *data_xfer;
+#endif
+#if defined(__linux__)
+	struct sg_io_hdr sg_hdr;	/* The SCSI transport's request */
+	unsigned char sense_buf[SENSE_BUF_LEN];
+#endif
+};
+
+/* The transport that carries commands to the STLink.
+ * submit() starts a command and may return before it finishes.
+ * wait() blocks until that command is done.  Commands are normally waited
+ * for in the order submitted, but wait() must work in any order.
+ * recover(), which may be NULL, is called after a failure.  It abandons
+ * every command still in flight, marking them done with an error, and
+ * returns the link to a state where the next command will work.
+ * replug() waits for a STLink that has been told to leave DFU mode to
+ * drop off the bus and come back, then reopens it.
+ * idle(), which may be NULL, lets USECS microseconds pass while we wait
+ * for the target.  NULL means sleeping.
+ * The SCSI Generic (v1), libusb (v2) and simulated STLink transports all
+ * provide the same operations, so nothing above the command queue knows
+ * or cares which one is in use.
+ */
+struct stl_transport {
+	const char *name;
+	int (*submit)(struct stlink *sl, struct stl_req *rq);
+	int (*wait)(struct stlink *sl, struct stl_req *rq);
+	void (*close)(struct stlink *sl);
+	int (*recover)(struct stlink *sl);
+	int (*replug)(struct stlink *sl);
+	void (*idle)(struct stlink *sl, unsigned int usecs);
+};
+
+/* Always-on command statistics.
+ * Each distinct opcode, the first two command bytes, gets counters and a
+ * histogram of the submit-to-retire latency.  Histogram bucket N counts
+ * latencies of 2^N..2^(N+1)-1 microseconds, with bucket 0 also taking
+ * anything quicker.  The cost is two clock reads per command.
+ */
+#define STL_STATS_OPS		32
+#define STL_STATS_BUCKETS	24			/* The last bucket is 8 seconds+ */
+
+struct stl_op_stats {
+	unsigned char cmd0, cmd1;
+	unsigned int calls, failures, short_xfers, retries;
+	uint64_t bytes;
+	uint64_t total_ns, min_ns, max_ns;
+	unsigned int hist[STL_STATS_BUCKETS];
+};
+
+/* Target memory that does not change during a session, and so may be
+ * cached.  See stl_cache_get().  Peripheral space is never cached, apart
+ * from the read-only Cortex-M0 DBGMCU_IDCODE.
+ */
+static const struct stl_cache_region {
+	uint32_t base, size;
+} stl_cache_regions[] = {
+	{ 0x1FFF0000, 0x10000 },	/* F1/F2/F4 system memory, IDs, option bytes */
+	{ 0x1FF00000, 0x1000 },		/* L1 system memory */
+	{ 0x1FF80000, 0x100 },		/* L1 option bytes, flash size and UID */
+	{ 0xE0042000, 4 },			/* DBGMCU_IDCODE */
+	{ 0x40015800, 4 },			/* DBGMCU_IDCODE on the Cortex-M0 */
+	{ 0xE000ED00, 4 },			/* CPUID */
+};
+#define STL_CACHE_REGIONS \
+	(int)(sizeof stl_cache_regions / sizeof stl_cache_regions[0])
+
 struct stlink {
 	const char *dev_path;
 #if defined(__linux__) || defined(__APPLE__)
 	int fd;
+	libusb_context *usb_ctx;
 	libusb_device_handle *usb_hand;
 #elif defined(__ms_windows__)
 	HANDLE fd;
@@ -429,17 +741,23 @@ struct stlink {
 #warning "Undefined OS."
 	int fd;
 #endif
+	const struct stl_transport *tp;
+	void *tp_priv;				/* Transport-private state */
 	int verbose;				/* A local copy of 'verbose'. */
+	char serial[64];			/* USB serial number string, if known. */
 
 	int chip_index;				/* Index into stm_devids[], if known. */
 	uint32_t cpu_idcode;		/* DBGMCU_IDCODE */
 	int flash_mem_size;			/* Reported flash memory size in KB. */
+	int target_mv;				/* Supply voltage, 0 if not read, -1 unknown */
 	stm32_addr_t flash_base;
 
 	/* Information we keep about the device state and recent transfers. */
 	int core_state;
 	struct STLinkVersion ver;
 	struct ARMcoreRegs reg;
+	int rd_max;					/* Largest good read, 0 until calibrated */
+	uint32_t rd_bad_kb;			/* Bit N set: N KB reads fail */
 
 	/* Parameters for the SCSI data transfer blocks. */
 	enum STLinkParamDirection xfer_dir;
@@ -447,9 +765,50 @@ struct stlink {
 	unsigned char cmd_buf[CDB_SIZE];
 	int data_len;
 	unsigned char data_buf[Q_BUF_LEN];
+
+	/* The asynchronous command queue, submit at q_head, retire at q_tail. */
+	struct stl_req queue[STL_QUEUE_LEN];
+	unsigned int q_head, q_tail;
+	int q_depth;
+
+	/* The read cache, each region allocated on first use with a valid
+	 * flag per word.  cache_path is set if it persists on disk. */
+	uint8_t *cache_data[STL_CACHE_REGIONS];
+	uint8_t *cache_valid[STL_CACHE_REGIONS];
+	unsigned int cache_hits;
+	char cache_path[256];
+
+	/* Per-opcode statistics, see stl_stats_record(). */
+	uint64_t stats_start_ns;
+	int n_stats;
+	struct stl_op_stats stats[STL_STATS_OPS];
 };
 
 int stl_do_cmd(struct stlink *stl);
+struct stl_req *stl_queue_cmd(struct stlink *sl, const unsigned char *cmd,
+							  int cmd_len, enum STLinkParamDirection dir,
+							  void *data, int data_len);
+int stl_queue_retire(struct stlink *sl);
+int stl_queue_flush(struct stlink *sl);
+static void stl_cache_save(struct stlink *sl);
+static void stl_cache_free(struct stlink *sl);
+
+/* The number of commands we keep in flight to each STLink. */
+int queue_depth = STL_QUEUE_DEPTH;
+/* Write the command statistics here when the session ends. */
+const char *stats_path = NULL;
+/* Always reset the STLink's USB port when opening it. */
+int usb_reset_attach = 0;
+/* The F2/F4 target has an external programming voltage on VPP. */
+int f4_vpp = 0;
+/* Wait this long for a STLink to be plugged in. */
+int wait_secs = 0;
+/* Keep the read cache in this directory between runs. */
+const char *cache_dir = NULL;
+/* Convert a watch log to CSV or VCD here when the watch ends. */
+const char *export_path = NULL;
+/* Serve commands on this socket after the command list, see stl_serve(). */
+const char *server_addr = NULL;
 
 // Endianness
 // http://www.ibm.com/developerworks/aix/library/au-endianc/index.html
@@ -506,12 +865,12 @@ static uint32_t read_uint32(const unsigned char *c, const int pt)
 	return ui;
 }
 
-struct stlink global_stlink;		/* Yes, there can be only one. */
-
 /* Open the STLink device at path DEV_NAME.
  * The program expects to open a SCSI Generic device, but
  * we do not verify that we have opened such a device.
  */
+extern const struct stl_transport stl_sg_transport;
+static void stl_sg_setup(int fd);
 struct stlink *stl_init(struct stlink *sl, const char *dev_name)
 {
 #if defined(__ms_windows__)
@@ -522,12 +881,6 @@ struct stlink *stl_init(struct stlink *sl, const char *dev_name)
 	int fd = open(dev_name, O_RDWR);
 #endif
 
-	if (sl->fd < 0) {
-		fprintf(stderr, "Failed to open STLink device %s: %s.\n",
-				dev_name, strerror(errno));
-		return NULL;
-	}
-
 	memset(sl, 0, sizeof *sl);
 	sl->dev_path = dev_name;
 	sl->fd = fd;
@@ -539,8 +892,13 @@ struct stlink *stl_init(struct stlink *sl, const char *dev_name)
 		fprintf(stderr, " Open the STLink '%s': %s\n",
 				dev_name, strerror(errno));
 
+#if defined(__linux__)
+	sl->tp = &stl_sg_transport;
+	stl_sg_setup(fd);
+#endif
 	sl->verbose = verbose;
 	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+	sl->q_depth = queue_depth;
 
 	return sl;
 }
@@ -552,12 +910,15 @@ void stl_close(struct stlink *sl)
 #if defined(__ms_windows__)
 	CloseHandle(sl->fd);
 #else
-	if (sl->usb_hand)
-		libusb_close(sl->usb_hand);
-	if (sl->fd >= 0)
-		close(sl->fd);
-	libusb_exit(NULL);
+	int i;
+
+	stl_queue_flush(sl);
+	sl->tp->close(sl);
+	for (i = 0; i < STL_QUEUE_LEN; i++)
+		free(sl->queue[i].buf);
 #endif
+	stl_cache_save(sl);
+	stl_cache_free(sl);
 }
 
 /* Execute a general command, with arbitrary parameters.
@@ -632,6 +993,148 @@ int stlink_cmd(struct stlink *sl, uint8_t st_cmd1, uint8_t st_cmd2,
 
 #define is_core_halted(sl)  (stl_get_status(sl) == STLINK_CORE_HALTED)
 
+/* The target read cache.
+ * Reads that are entirely within one region of stl_cache_regions[] are
+ * kept, and later reads of the same words answered without a USB round
+ * trip.  A write by us to a cached region, e.g. programming the option
+ * bytes, drops the words written.  Partial hits are treated as misses.
+ */
+static int stl_cache_region(uint32_t addr, uint32_t len)
+{
+	int i;
+
+	for (i = 0; i < STL_CACHE_REGIONS; i++)
+		if (len <= stl_cache_regions[i].size &&
+			addr >= stl_cache_regions[i].base &&
+			addr - stl_cache_regions[i].base <=
+			stl_cache_regions[i].size - len)
+			return i;
+	return -1;
+}
+
+/* Copy LEN bytes at ADDR into BUF if they are all cached.
+ * Returns 0 on a hit, -1 on a miss. */
+static int stl_cache_get(struct stlink *sl, uint32_t addr, void *buf,
+						 uint32_t len)
+{
+	int r = len ? stl_cache_region(addr, len) : -1;
+	uint32_t offset, w;
+
+	if (r < 0 || sl->cache_data[r] == NULL)
+		return -1;
+	offset = addr - stl_cache_regions[r].base;
+	for (w = offset >> 2; w <= (offset + len - 1) >> 2; w++)
+		if ( ! sl->cache_valid[r][w])
+			return -1;
+	memcpy(buf, sl->cache_data[r] + offset, len);
+	sl->cache_hits++;
+	return 0;
+}
+
+/* Remember the whole words of LEN bytes read from ADDR. */
+static void stl_cache_put(struct stlink *sl, uint32_t addr, const void *buf,
+						  uint32_t len)
+{
+	int r = len ? stl_cache_region(addr, len) : -1;
+	uint32_t offset, w;
+
+	if (r < 0)
+		return;
+	if (sl->cache_data[r] == NULL) {
+		sl->cache_data[r] = malloc(stl_cache_regions[r].size);
+		sl->cache_valid[r] = calloc(stl_cache_regions[r].size / 4, 1);
+		if (sl->cache_data[r] == NULL || sl->cache_valid[r] == NULL) {
+			free(sl->cache_data[r]);
+			free(sl->cache_valid[r]);
+			sl->cache_data[r] = sl->cache_valid[r] = NULL;
+			return;
+		}
+	}
+	offset = addr - stl_cache_regions[r].base;
+	memcpy(sl->cache_data[r] + offset, buf, len);
+	for (w = (offset + 3) >> 2; w < (offset + len) >> 2; w++)
+		sl->cache_valid[r][w] = 1;
+}
+
+/* Forget anything cached that overlaps ADDR..ADDR+LEN. */
+static void stl_cache_drop(struct stlink *sl, uint32_t addr, uint32_t len)
+{
+	int i;
+
+	for (i = 0; i < STL_CACHE_REGIONS; i++) {
+		uint32_t base = stl_cache_regions[i].base;
+		uint32_t end = base + stl_cache_regions[i].size;
+		uint32_t w;
+		if (sl->cache_valid[i] == NULL || addr >= end || addr + len <= base)
+			continue;
+		for (w = addr > base ? (addr - base) >> 2 : 0;
+			 w < stl_cache_regions[i].size >> 2 && base + w*4 < addr + len; w++)
+			sl->cache_valid[i][w] = 0;
+	}
+}
+
+/* The on-disk copy is a sequence of records, each an address and length
+ * followed by that many bytes of target memory.  It is in host byte order,
+ * since the file is only meant for this machine. */
+static void stl_cache_load(struct stlink *sl)
+{
+	FILE *fp = fopen(sl->cache_path, "rb");
+	uint32_t rec[2];
+	unsigned char buf[4096];
+	int n = 0;
+
+	if (fp == NULL)
+		return;
+	while (fread(rec, sizeof rec, 1, fp) == 1 && rec[1] <= sizeof buf &&
+		   fread(buf, 1, rec[1], fp) == rec[1]) {
+		stl_cache_put(sl, rec[0], buf, rec[1]);
+		n += rec[1];
+	}
+	fclose(fp);
+	if (sl->verbose)
+		printf("Loaded %d cached bytes from %s.\n", n, sl->cache_path);
+}
+
+static void stl_cache_save(struct stlink *sl)
+{
+	FILE *fp;
+	int i;
+
+	if (sl->cache_path[0] == 0 || (fp = fopen(sl->cache_path, "wb")) == NULL)
+		return;
+	for (i = 0; i < STL_CACHE_REGIONS; i++) {
+		uint32_t w = 0, nwords = stl_cache_regions[i].size >> 2;
+		if (sl->cache_valid[i] == NULL)
+			continue;
+		while (w < nwords) {
+			uint32_t rec[2], start;
+			for (; w < nwords && ! sl->cache_valid[i][w]; w++)
+				;
+			for (start = w; w < nwords && sl->cache_valid[i][w] &&
+					 w - start < 1024; w++)
+				;
+			if (w == start)
+				break;
+			rec[0] = stl_cache_regions[i].base + start*4;
+			rec[1] = (w - start)*4;
+			fwrite(rec, sizeof rec, 1, fp);
+			fwrite(sl->cache_data[i] + start*4, 1, rec[1], fp);
+		}
+	}
+	fclose(fp);
+}
+
+static void stl_cache_free(struct stlink *sl)
+{
+	int i;
+
+	for (i = 0; i < STL_CACHE_REGIONS; i++) {
+		free(sl->cache_data[i]);
+		free(sl->cache_valid[i]);
+		sl->cache_data[i] = sl->cache_valid[i] = NULL;
+	}
+}
+
 /* Basic target memory read and write functions.
  * Both bulk and single 32 bit word functions are here.
  * The 32 bit versions use function parameters and return value.
@@ -655,6 +1158,7 @@ static inline int stl_wr32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
 	sl->cmd_len = 8;
 	sl->data_len = len;
 	sl->xfer_dir = STLinkParamToDev;
+	stl_cache_drop(sl, addr, len);
 	stl_do_cmd(sl);
 	return 0;
 }
@@ -672,6 +1176,8 @@ static inline void sl_wr32(struct stlink* sl, uint32_t addr, uint32_t val)
  */
 uint32_t stl_rd32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
 {
+	if (stl_cache_get(sl, addr & ~3, sl->data_buf, (len+3) & ~3) == 0)
+		return *(uint32_t*)sl->data_buf;
 #if 1
 	/* This version forces alignment, which should never be needed as
 	 * calls always pass the correct alignment and size. */
@@ -686,6 +1192,9 @@ uint32_t stl_rd32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
 	write_uint16(sl->cmd_buf + 6, len+1);
 #endif
 	stlink_cmd(sl, STLinkDebugReadMem32bit, addr, len);
+	/* The last command retired is this read. */
+	if (sl->queue[(sl->q_tail - 1) % STL_QUEUE_LEN].status == 0)
+		stl_cache_put(sl, addr & ~3, sl->data_buf, (len+3) & ~3);
 	return *(uint32_t*)sl->data_buf;
 }
 static inline uint32_t sl_rd32(struct stlink *sl, uint32_t addr)
@@ -694,1716 +1203,6360 @@ static inline uint32_t sl_rd32(struct stlink *sl, uint32_t addr)
 	return *(uint32_t*)sl->data_buf;
 }
 
-#if 1							/* Force libusb-1.0 transport during devel */
-/* Enqueue a command to the STLink.
- * v1 uses SCSI transport over USB.
- * v2 uses USB bulk endpoints.
- * stl->cmd_buf
- * stl->data_buf, stl->data_len
- */
-int stl_do_cmd(struct stlink *stl)
+/* A monotonic clock in nanoseconds, for timing and the simulator. */
+static uint64_t stl_now_ns(void)
 {
-	int ret, actual_xfer_len;
-
-	if (stl->verbose > 3)
-		printf("Starting command %2.2x %2.2x ..., data length %d.\n",
-			   stl->cmd_buf[0], stl->cmd_buf[1],
-			   stl->data_len);
-
-	/* The stl->cmd_len value doesn't need to be precise.  Bytes after
-	 * the command are ignored. */
-	ret = libusb_bulk_transfer(stl->usb_hand, USB_PIPE_OUT,
-							   stl->cmd_buf, stl->cmd_len, &actual_xfer_len,
-							   USB_TIMEOUT_MSEC);
-	if (stl->verbose && actual_xfer_len != stl->cmd_len)
-		fprintf(stderr, "Mismatched USB transfer for command, tried %d "
-				"vs %d sent.\n",
-				stl->cmd_len, actual_xfer_len);
-	if (stl->verbose > 3)
-		printf("Sent command, status %d length %d.\n", ret, actual_xfer_len);
-
-	if (stl->xfer_dir == STLinkParamToDev) {
-		ret = libusb_bulk_transfer(stl->usb_hand, USB_PIPE_OUT,
-								   stl->data_buf, stl->data_len,
-								   &actual_xfer_len, USB_TIMEOUT_MSEC);
-		if (ret != 0 || actual_xfer_len != stl->data_len)
-			printf(" * Failed USB output, %d, Command %2.2x %2.2x transfer "
-				   "length %d vs %d expected.\n",
-				   ret, stl->cmd_buf[0], stl->cmd_buf[1],
-				   actual_xfer_len, stl->data_len);
-		if (stl->verbose > 3)
-			printf("Transfer done, status %d write length %d of %d.\n",
-				   ret, actual_xfer_len, stl->data_len);
-	} else if (stl->data_len != 0) {
-		ret = libusb_bulk_transfer(stl->usb_hand, USB_PIPE_IN,
-								   stl->data_buf, stl->data_len,
-								   &actual_xfer_len, USB_TIMEOUT_MSEC);
-		if (ret != 0 || actual_xfer_len != stl->data_len) {
-			printf(" * Failed USB input, status %d, Command %2.2x %2.2x "
-				   "expected %d bytes, received %d.\n",
-				   ret, stl->cmd_buf[0], stl->cmd_buf[1],
-				   stl->data_len, actual_xfer_len);
-		}
-		if (stl->verbose > 3)
-			printf("Transfer done, status %d read length %d of %d.\n",
-				   ret, actual_xfer_len, stl->data_len);
-	}
-
-	return ret;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
-#elif defined(linux)
-/* Enqueue a command to the SCSI Generic driver.
- * Most of the work is filling in the struct sg_io_hdr.
+
+/* Account for a retired command in the per-opcode statistics.
+ * The table is small and searched linearly, most recent additions last.
+ * Opcodes beyond STL_STATS_OPS are lumped into the final entry.
  */
-int stl_do_cmd(struct stlink *stl)
+static void stl_stats_record(struct stlink *sl, struct stl_req *rq,
+							 uint64_t now_ns)
 {
-    struct sg_io_hdr io_hdr = {0,};
-	/* Sense (error information) data */
-	unsigned char sense_buf[SENSE_BUF_LEN];
-	int ret;
-
-	io_hdr.interface_id = 'S';
-    io_hdr.pack_id = 0;
+	struct stl_op_stats *st;
+	uint64_t ns = now_ns - rq->submit_ns;
+	unsigned int us = ns / 1000;
+	int i, bucket;
+
+	for (i = 0; i < sl->n_stats; i++)
+		if (sl->stats[i].cmd0 == rq->cmd_buf[0] &&
+			sl->stats[i].cmd1 == rq->cmd_buf[1])
+			break;
+	if (i == sl->n_stats) {
+		if (i == STL_STATS_OPS)
+			i--;
+		else {
+			sl->n_stats++;
+			sl->stats[i].cmd0 = rq->cmd_buf[0];
+			sl->stats[i].cmd1 = rq->cmd_buf[1];
+			sl->stats[i].min_ns = ns;
+		}
+	}
+	st = &sl->stats[i];
+	st->calls++;
+	st->retries += rq->retries;
+	st->bytes += rq->actual_len;
+	if (rq->status != 0)
+		st->failures++;
+	else if (rq->actual_len != rq->data_len)
+		st->short_xfers++;
+	st->total_ns += ns;
+	if (ns < st->min_ns)
+		st->min_ns = ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	for (bucket = 0; us > 1 && bucket < STL_STATS_BUCKETS - 1; bucket++)
+		us >>= 1;
+	st->hist[bucket]++;
+}
 
-	/* Provide buffers for the SCSI transfer.
-	 * The Request Sense (error info) command is used for responses.
-	 * http://en.wikipedia.org/wiki/SCSI_Request_Sense_Command
-	 */
-	io_hdr.cmdp = stl->cmd_buf;
-	io_hdr.cmd_len = sizeof(stl->cmd_buf);
-	io_hdr.sbp = stl->sense_buf;
-	io_hdr.mx_sb_len = sizeof(stl->sense_buf);
-	memset(io_hdr.sbp, 0, io_hdr.sb_len_wr);
+/* A readable name for an opcode in the statistics report. */
+static const char *stl_cmd_name(int cmd0, int cmd1)
+{
+	static const char *debug_names[] = {
+		[STLinkDebugGetStatus] = "GetStatus",
+		[STLinkDebugForceDebug] = "ForceDebug",
+		[STLinkDebugResetSys] = "ResetSys",
+		[STLinkDebugReadAllRegs] = "ReadAllRegs",
+		[STLinkDebugReadOneReg] = "ReadOneReg",
+		[STLinkDebugWriteReg] = "WriteReg",
+		[STLinkDebugReadMem32bit] = "ReadMem32bit",
+		[STLinkDebugWriteMem32bit] = "WriteMem32bit",
+		[STLinkDebugRunCore] = "RunCore",
+		[STLinkDebugStepCore] = "StepCore",
+		[STLinkDebugSetFP] = "SetFP",
+		[STLinkDebugWriteMem8bit] = "WriteMem8bit",
+		[STLinkDebugClearFP] = "ClearFP",
+		[STLinkDebugWriteDebugReg] = "WriteDebugReg",
+		[STLinkDebugEnterMode] = "EnterMode",
+		[STLinkDebugExit] = "Exit",
+		[STLinkDebugReadCoreID] = "ReadCoreID",
+	};
+
+	switch (cmd0) {
+	case STLinkGetVersion: return "GetVersion";
+	case STLinkGetCurrentMode: return "GetCurrentMode";
+	case STLinkGetTargetVoltage: return "GetTargetVoltage";
+	case STLinkDFUCommand: return "DFU";
+	case STLinkDebugCommand:
+		if (cmd1 < sizeof debug_names / sizeof debug_names[0] &&
+			debug_names[cmd1])
+			return debug_names[cmd1];
+		return "Debug";
+	}
+	return "Unknown";
+}
 
-	/* Set a buffer to be used for data transferred from/to device */
-	io_hdr.iovec_count = 0;
-	io_hdr.dxferp = stl->data_buf;
-	io_hdr.dxfer_len = stl->data_len;
-	io_hdr.dxfer_direction =
-		(stl->xfer_dir == STLinkParamToDev ? SG_DXFER_TO_DEV:SG_DXFER_FROM_DEV);
-
-	io_hdr.timeout = TIMEOUT_MSEC;
-	io_hdr.flags = 0;
-	ret = ioctl(stl->fd, SG_IO, &io_hdr);
-	/* Report SCSI results.  Really, note useful variable if we need
-	 * to write better reporting code. */
-	if (stl->verbose) {
-		if (stl->verbose > 3)
-			fprintf(stderr, " SCSI command status %4.4x, took %d ms.\n",
-					io_hdr.status, io_hdr.duration);
-		if (io_hdr.resid || io_hdr.sb_len_wr)
-			fprintf(stderr, " SCSI residue was %d, sense length %d.\n",
-					io_hdr.resid, io_hdr.sb_len_wr);
+/* Emit the command statistics as a JSON object. */
+static void stl_stats_json(struct stlink *sl, FILE *fp)
+{
+	int i, j;
+
+	flockfile(fp);				/* Gang runs may share stdout. */
+	fprintf(fp, "{\n  \"probe\": \"%s\",\n  \"serial\": \"%s\",\n"
+			"  \"transport\": \"%s\",\n  \"elapsed_us\": %llu,\n"
+			"  \"cache_hits\": %u,\n  \"commands\": [",
+			sl->dev_path ? sl->dev_path : "",
+			sl->serial, sl->tp ? sl->tp->name : "",
+			sl->stats_start_ns ? (unsigned long long)
+			(stl_now_ns() - sl->stats_start_ns) / 1000 : 0ULL,
+			sl->cache_hits);
+	for (i = 0; i < sl->n_stats; i++) {
+		struct stl_op_stats *st = &sl->stats[i];
+		const char *sep = "";
+		fprintf(fp, "%s\n    {\"cmd\": \"%2.2x %2.2x\", \"name\": \"%s\", "
+				"\"calls\": %u, \"bytes\": %llu, \"failures\": %u, "
+				"\"short\": %u, \"retries\": %u,\n     \"total_us\": %llu, "
+				"\"min_us\": %llu, \"max_us\": %llu,\n"
+				"     \"histogram_us\": {", i ? "," : "",
+				st->cmd0, st->cmd1, stl_cmd_name(st->cmd0, st->cmd1),
+				st->calls, (unsigned long long)st->bytes, st->failures,
+				st->short_xfers, st->retries,
+				(unsigned long long)st->total_ns / 1000,
+				(unsigned long long)st->min_ns / 1000,
+				(unsigned long long)st->max_ns / 1000);
+		/* Keyed by the bucket's lower bound. */
+		for (j = 0; j < STL_STATS_BUCKETS; j++)
+			if (st->hist[j]) {
+				fprintf(fp, "%s\"%u\": %u", sep, j ? 1U << j : 0, st->hist[j]);
+				sep = ", ";
+			}
+		fprintf(fp, "}}");
 	}
-	return ret;
+	fprintf(fp, "\n  ]\n}\n");
+	funlockfile(fp);
 }
-#elif defined(MS_WINDOWS)
-#endif
 
-static void stl_print_version(struct STLinkVersion *ver)
+/* Write the statistics to PATH, or stdout for "-". */
+static int stl_stats_write(struct stlink *sl, const char *path)
 {
-	if (ver->ST_VendorID == USB_ST_VID &&
-		(ver->ST_ProductID == USB_STLINK_PID ||
-		 ver->ST_ProductID == USB_STLINKv2_PID))
-		fprintf(stderr, "STLink Vendor/Product ID 0x%04x 0x%04x (STMicro)\n",
-				ver->ST_VendorID, ver->ST_ProductID);
-	else
-		fprintf(stderr, "STLink Vendor/Product ID 0x%04x 0x%04x (NOT STMicro!)"
-				"(%04x %04x expected)\n",
-				ver->ST_VendorID, ver->ST_ProductID,
-				USB_ST_VID, USB_STLINK_PID);
-	/* Expected versions  STLink: 3  JTAG: 2  SWIM: 0x20 */
-	fprintf(stderr, " Versions  STLink: 0x%x  JTAG: 0x%x  SWIM: 0x%x\n"
-			"    The firmware %s a JTAG/SWD interface.\n"
-			"    The firmware %s a SWIM interface.\n",
-			ver->STLink_ver, ver->JTAG_ver, ver->SWIM_ver,
-			ver->JTAG_ver == 0 ? "does not support" : "supports",
-			ver->SWIM_ver == 0 ? "does not support" : "supports");
+	FILE *fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open the statistics file '%s': %s\n",
+				path, strerror(errno));
+		return 1;
+	}
+	stl_stats_json(sl, fp);
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
 }
 
-void stlink_print_arm_regs(struct ARMcoreRegs *regs)
+/* The time allowed for a command, from its transfer size and opcode.
+ * Once an opcode has some history the timeout also covers four times the
+ * slowest it has been, so a slow probe or hub does not cause false alarms.
+ */
+static int stl_cmd_timeout(struct stlink *sl, struct stl_req *rq)
 {
+	int ms = TIMEOUT_BASE_MSEC + rq->data_len / TIMEOUT_BYTES_PER_MSEC;
 	int i;
-	for (i = 0; i < 16; i++)
-		fprintf(stderr, "r%02d=0x%08x%c", i, regs->r[i], i%4 == 3 ? '\n' : ' ');
-	fprintf(stderr,
-			"xPSR       = 0x%08x\n"
-			"main_sp    = 0x%08x  process_sp = 0x%08x\n"
-			"rw         = 0x%08x  rw2        = 0x%08x\n",
-			regs->xpsr, regs->main_sp, regs->process_sp, regs->rw, regs->rw2);
-	return;
+
+	if (rq->cmd_buf[0] == STLinkDFUCommand ||
+		(rq->cmd_buf[0] == STLinkDebugCommand &&
+		 (rq->cmd_buf[1] == STLinkDebugEnterMode ||
+		  rq->cmd_buf[1] == STLinkDebugExit ||
+		  rq->cmd_buf[1] == STLinkDebugResetSys)))
+		ms = TIMEOUT_MSEC;
+	for (i = 0; i < sl->n_stats; i++)
+		if (sl->stats[i].cmd0 == rq->cmd_buf[0] &&
+			sl->stats[i].cmd1 == rq->cmd_buf[1]) {
+			if (sl->stats[i].calls >= 4 &&
+				sl->stats[i].max_ns / 250000 > ms)
+				ms = sl->stats[i].max_ns / 250000;
+			break;
+		}
+	return ms < TIMEOUT_MAX_MSEC ? ms : TIMEOUT_MAX_MSEC;
 }
 
-/*
- * Set and clear hardware breakpoints.
- * A breakpoint is set with the "flash patch" module.
- * When executing from Flash instead of RAM, we need hardware support
- * to implement breakpoints.  We only get four registers, but that is
- * enough for most debugging.
- * 2  The index, 0..3, of the Flash Patch register.
- * 3-6 Address of the breakpoint (LSB first)
- * 7 FP_ALL (0x02) / FP_UPPER (0x01) / FP_LOWER (0x00)
+/* Report if a command only reads: the status queries, and reads of
+ * memory and the core registers.  It does not change the target state.
  */
-int stl_set_breakpoint(struct stlink *sl, int fp_nr, uint32_t addr, int fp)
+static int stl_cmd_readonly(const unsigned char *cmd)
 {
-	write_uint32(sl->data_buf+3, addr);
-	sl->data_buf[7] = fp;
-	return stl_set_fp(sl, fp_nr);
+	if (cmd[0] == STLinkGetVersion || cmd[0] == STLinkGetCurrentMode ||
+		cmd[0] == STLinkGetTargetVoltage)
+		return 1;
+	if (cmd[0] != STLinkDebugCommand)
+		return 0;
+	switch (cmd[1]) {
+	case STLinkDebugGetStatus:
+	case STLinkDebugReadCoreID:
+	case STLinkDebugReadAllRegs:
+	case STLinkDebugReadOneReg:
+	case STLinkDebugReadMem32bit:
+		return 1;
+	}
+	return 0;
 }
 
-/* FPEC flash controller interface, PM0063 or PM0075 manual. */
-#define FLASH_REGS_ADDR 0x40022000
-
-#define FLASH_ACR	(FLASH_REGS_ADDR + 0x00)
-#define FLASH_KEYR	(FLASH_REGS_ADDR + 0x04)
-#define FLASH_SR	(FLASH_REGS_ADDR + 0x0c)
-#define FLASH_CR	(FLASH_REGS_ADDR + 0x10)
-#define FLASH_AR	(FLASH_REGS_ADDR + 0x14)
-#define FLASH_OBR	(FLASH_REGS_ADDR + 0x1c)
-#define FLASH_WRPR	(FLASH_REGS_ADDR + 0x20)
-
-/* Flash unlock key values from PM0075 2.3.1 */
-#define FLASH_RDPTR_KEY 0x00a5
-#define FLASH_KEY1 0x45670123
-#define FLASH_KEY2 0xcdef89ab
-
-/* 32L15x flash controller. */
-#define L15_FLASH_BASE 0x40023C00
-#define L15_FLASH_ACR		(L15_FLASH_BASE + 0x00)
-#define L15_FLASH_PECR		(L15_FLASH_BASE + 0x04)
-#define L15_FLASH_PDKEYR	(L15_FLASH_BASE + 0x08)
-#define L15_FLASH_PEKEYR	(L15_FLASH_BASE + 0x0C)
-#define L15_FLASH_PRGKEYR	(L15_FLASH_BASE + 0x10)
-#define L15_FLASH_OPTKEYR	(L15_FLASH_BASE + 0x14)
-#define L15_FLASH_SR		(L15_FLASH_BASE + 0x18)
-#define L15_FLASH_OBR		(L15_FLASH_BASE + 0x1C)
-#define L15_FLASH_WRPR1		(L15_FLASH_BASE + 0x20)
-#define L15_FLASH_WRPR2		(L15_FLASH_BASE + 0x80)
-#define L15_FLASH_WRPR3		(L15_FLASH_BASE + 0x84)
-
-#define L15_FLASH_PEKEY1 0x89abcdef
-#define L15_FLASH_PEKEY2 0x02030405
-#define L15_FLASH_PRGKEY1 0x8C9DAEBF
-#define L15_FLASH_PRGKEY2 0x13141516
-#define L15_FLASH_OPTKEY1 0xFBEAD9C8
-#define L15_FLASH_OPTKEY2 0x24252627
-
-#define FLASH_SR_BSY 0x0001
-#define FLASH_SR_PGERR 0x0004
-#define FLASH_SR_WRPRTERR 0x0010
-#define FLASH_SR_EOP 0x0020
-
-/* Names and definitions from PM0075 sec 3.5 */
-#define FLASH_CR_PG  0x0001
-#define FLASH_CR_PER 0x0002
-#define FLASH_CR_MER 0x0004
-#define FLASH_CR_OPTPG 0x0010
-#define FLASH_CR_OPTER 0x0020
-#define FLASH_CR_STRT 0x0040
-#define FLASH_CR_LOCK 0x0080
-
-/* Names and definitions from PM0081 (STM32F4). */
-#define F4_FLASH_REGS 0x40023C00
-
-#define F4_FLASH_ACR	(F4_FLASH_REGS + 0x00)
-#define F4_FLASH_KEYR	(F4_FLASH_REGS + 0x04)
-#define F4_FLASH_OPTKEYR 	(F4_FLASH_REGS + 0x08)
-#define F4_FLASH_SR	(F4_FLASH_REGS + 0x0c)
-#define  F4_FLASH_SR_BSY 0x00010000
-#define F4_FLASH_CR	(F4_FLASH_REGS + 0x10)
-#define  F4_FLASH_CR_STRT 0x00010000
-
-/* Unlock the flash.  This takes two write cycles with two key values.
- * The two key values are sequentially written to the FLASH_KEYR register.
+/* Report if a command may safely be repeated.
+ * Reads are, as are writes to the core registers and SRAM, which is
+ * where the flash loader and its data go.  Writes elsewhere may hit a
+ * peripheral register with side effects, e.g. the flash controller keys
+ * or start bit.
  */
+static int stl_cmd_idempotent(const unsigned char *cmd)
+{
+	if (stl_cmd_readonly(cmd))
+		return 1;
+	if (cmd[0] != STLinkDebugCommand)
+		return 0;
+	switch (cmd[1]) {
+	case STLinkDebugWriteReg:
+		return 1;
+	case STLinkDebugWriteMem32bit:
+	case STLinkDebugWriteMem8bit:
+		return (read_uint32(cmd, 2) >> 29) == 1;	/* 0x2000000-0x3fffffff */
+	}
+	return 0;
+}
 
-/*
- * After much experimentation, I finally came to understand that the
- * STLink cannot generate the 16 bit memory cycle needed to directly
- * write the flash.
- * You have to download a program that writes it.
- *
- * This was confirmed by reading the OpenOCD code.
- * My implementation uses a similar approach, with a better implementation.
- * They download a program, the data, pass parameters using registers
- * (individually written) and run the program.  This might seem
- * efficient, but the cost is largely in triggering a transfer, not how
- * much is in each transfer.
- *
- * It's a bit more work to embed the parameters in the program and pack
- * it together with the data into a single transfer, but the better
- * performance is worth it.
- *
- * Note: RAM starts at 0x20000000.  Some chips have up to 32KB, but we
- * must support the devices with only 4KB.
+/* What a read or an idempotent write touches: 1 for memory, with the
+ * range from *ADDR of *LEN bytes, 2 for one core register *ADDR, 3 for
+ * all of them, or 0 for neither, the status queries.
  */
+static int stl_cmd_touches(const unsigned char *cmd, uint32_t *addr,
+						   uint32_t *len)
+{
+	if (cmd[0] != STLinkDebugCommand)
+		return 0;
+	switch (cmd[1]) {
+	case STLinkDebugReadMem32bit:
+	case STLinkDebugWriteMem32bit:
+	case STLinkDebugWriteMem8bit:
+		*addr = read_uint32(cmd, 2);
+		*len = cmd[6] | cmd[7] << 8;
+		return 1;
+	case STLinkDebugReadOneReg:
+	case STLinkDebugWriteReg:
+		*addr = cmd[2];
+		return 2;
+	case STLinkDebugReadAllRegs:
+		return 3;
+	}
+	return 0;
+}
 
-/* The OpenOCD code. Someday I'll do a speed comparisons.
- * From openocd, contrib/loaders/flash/stm32.s
- * i = STM32_FLASH_BASE;      0x08+r3  0x0800,0000
- * r0 = fl->buf_addr;//source
- * r1 = target;		// target
- * r2 = count;		// count (16 bits half words)
- * r3 = 0;			// flash bank 0 (input)
- * r15 = fl->loader_addr;  // pc register
+/* Report if command B, completed after command A, stops A from being
+ * retried.  A repeated after B must not read what B wrote, nor write
+ * what B read or wrote, as that is not what running them in order gives.
+ * Any command with other side effects conflicts with everything.
  */
+static int stl_cmd_conflict(const unsigned char *a, const unsigned char *b)
+{
+	uint32_t a_addr = 0, a_len = 0, b_addr = 0, b_len = 0;
+	int a_kind, b_kind;
 
-static const uint8_t loader_code[] = {
-	0x08, 0x4c,			/* ldr	r4, STM32_FLASH_BASE */
-	0x1c, 0x44,			/* add	r4, r3 */
-	/* write_half_word: */
-	0x01, 0x23,			/* movs	r3, #0x01 */
-	0x23, 0x61,			/* str	r3, [r4, #STM32_FLASH_CR_OFFSET] */
-	0x30, 0xf8, 0x02, 0x3b,	/* ldrh	r3, [r0], #0x02 */
-	0x21, 0xf8, 0x02, 0x3b,	/* strh	r3, [r1], #0x02 */
-	/* busy: */
-	0xe3, 0x68,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	0x13, 0xf0, 0x01, 0x0f,	/* tst	r3, #0x01 */
-	0xfb, 0xd0,			/* beq	busy */
-	0x13, 0xf0, 0x14, 0x0f,	/* tst	r3, #0x14 */
-	0x01, 0xd1,			/* bne	exit */
-	0x01, 0x3a,			/* subs	r2, r2, #0x01 */
-	0xf0, 0xd1,			/* bne	write_half_word */
-	/* exit: */
-	0x00, 0xbe,			/* bkpt	#0x00 */
-	 0x00, 0x20, 0x02, 0x40,	/* STM32_FLASH_BASE: .word 0x40022000 */
- };
+	if (stl_cmd_readonly(a) && stl_cmd_readonly(b))
+		return 0;
+	if ( ! stl_cmd_idempotent(a) || ! stl_cmd_idempotent(b))
+		return 1;
+	a_kind = stl_cmd_touches(a, &a_addr, &a_len);
+	b_kind = stl_cmd_touches(b, &b_addr, &b_len);
+	if (a_kind == 1 && b_kind == 1)
+		return a_addr < b_addr + b_len && b_addr < a_addr + a_len;
+	if (a_kind >= 2 && b_kind >= 2)
+		return a_kind == 3 || b_kind == 3 || a_addr == b_addr;
+	return 0;
+}
 
-/* A working version of our ARM code.  Here as a back-up since we break it
- * so frequently. */
- static const uint16_t db_loader_code_working[] = {
-	 0x480B,			/* ldr	r0, .SRC_ADDR */
-	 0x490C,			/* ldr	r1, .TARGET_ADDR */
-	 0x4A0C,			/* ldr	r2, .COUNT  */
-	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
-	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001 */
-	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* write_hword: */
-	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
-	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
-	 /* busy: */
-#if 0
-	 0x3201,			/* add	r2, r2, #0x01 */
-#endif
-	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	 0xf013, 0x0f01,	/* tst	r3, #0x01 */
-	 0xd1fb,			/* bne	busy */
-	 0xf013, 0x0f14,	/* tst	r3, #0x14 */
-	 0xd101,			/* bne	exit */
-	 0x3a01,			/* subs	r2, r2, #0x01 */
-	 0xd1f2,			/* bne	write_hword */
-	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
-#if 0
-	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
-#endif
-	 /* exit: */
-	 0xbe00,			/* bkpt	#0x00 */
-	 0x0000, 0x0000,
-	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
-	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
-	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
-	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
- };
+#define stl_req_failed(rq) ((rq)->status != 0 || \
+							(rq)->actual_len != (rq)->data_len)
 
-/* The flash write program.
- * The STLink apparently cannot directly generate the memory operations
- * required to write the flash.  So we download and run a small program that
- * writes the flash for us.
- *
- * While inconvenient, this does result in much faster writes.  To improve
- * the performance even more, we download the program, parameters and data to
- * write in a single transfer.
- * The program finishes by turning off the flash programming enable in
- * FLASH_CR and calling breakpoint#0 -- halting.
- * The status is reflected in the registers.
- * A successful completion leaves R2 with a count of zero.
- * The final FLASH_SR status is returned in R3.
- * A count of the busy loop iterations in kept in R5 -- a rough estimation
- * of the write speed.
- */
-static const uint16_t db_loader_code[] = {
-	 0x480B,			/* ldr	r0, .SRC_ADDR */
-	 0x490C,			/* ldr	r1, .TARGET_ADDR */
-	 0x4A0C,			/* ldr	r2, .COUNT  */
-	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
-	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001, then busy_count */
-	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* copy_hword: */
-	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
-	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
-	 /* busy: */
-	 0x3501,			/* add	r5, r5, #0x01 ; Increment busy_count */
-	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	 0xf013, 0x0f01,	/* tst	r3, #0x01 ;  check FLASH_SR_BSY */
-	 0xd1fa,			/* bne	busy */
-	 0xf013, 0x0f14,	/* tst	r3, #0x14 ; check for WRPRTERR/PGERR errors */
-	 0xd102,			/* bne	exit */
-	 0x3a01,			/* subs	r2, r2, #0x01 ;  Decrement COUNT*/
-	 0xd1f1,			/* bne	copy_hword */
-	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
-	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* exit: */
-	 0xbe00,			/* bkpt	#0x00 */
-	 /* The following parameters will be overwritten before download. */
-	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
-	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
-	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
-	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
- };
+/* Recover from the failure of RQ, the oldest queued command.
+ * Everything behind it is completed or abandoned, the transport resyncs,
+ * and RQ is resubmitted if it is safe to repeat.  The retry runs after
+ * the commands behind it that completed, so it is not safe if any of
+ * them conflicts with it, e.g. a read of SRAM followed by a write to the
+ * same SRAM: the retried read would return the new value.  Those behind
+ * it that were abandoned are retried in turn as they are retired.
+ */
+static void stl_queue_recover(struct stlink *sl, struct stl_req *rq)
+{
+	unsigned int i;
+	int safe = stl_cmd_idempotent(rq->cmd_buf);
+
+	if (sl->tp->recover)
+		sl->tp->recover(sl);
+	for (i = sl->q_tail + 1; i != sl->q_head; i++) {
+		struct stl_req *next = &sl->queue[i % STL_QUEUE_LEN];
+		if ( ! next->done)
+			sl->tp->wait(sl, next);
+		if ( ! stl_req_failed(next) &&
+			stl_cmd_conflict(rq->cmd_buf, next->cmd_buf))
+			safe = 0;
+	}
+	while (safe && stl_req_failed(rq) && rq->retries < STL_RETRY_LIMIT) {
+		int ret;
+		rq->retries++;
+		if (sl->verbose)
+			fprintf(stderr, " Retrying command %2.2x %2.2x, status %d, "
+					"%d of %d bytes.\n", rq->cmd_buf[0], rq->cmd_buf[1],
+					rq->status, rq->actual_len, rq->data_len);
+		rq->status = 0;
+		rq->actual_len = 0;
+		rq->done = 0;
+		/* Allow more time on each attempt. */
+		rq->timeout_ms = stl_cmd_timeout(sl, rq) << rq->retries;
+		ret = sl->tp->submit(sl, rq);
+		if (ret != 0) {
+			rq->status = ret;
+			rq->done = 1;
+		} else if ( ! rq->done)
+			sl->tp->wait(sl, rq);
+		if (stl_req_failed(rq) && sl->tp->recover)
+			sl->tp->recover(sl);
+	}
+}
 
-/* The same code for the STM32F4 flash peripheral.
- * The code is similar, but status bit positions and write size differences
- * make it unwise to use the same code.
- * The F4 can do 8/16/32 bit writes (even 64 bits, with 8 Volt Vpp)
- * We use 32 bit writes for best speed.
+/* The command queue, independent of the transport.
+ * stl_queue_cmd() hands each command to sl->tp->submit(), which starts it
+ * and returns without waiting.  Commands retire strictly in order through
+ * sl->tp->wait().  A transport that cannot overlap commands simply
+ * finishes the work in submit() and marks the request done.
  */
-static const uint16_t f4_loader_code[] = {
-	 0x480B,			/* ldr	r0, .SRC_ADDR */
-	 0x490C,			/* ldr	r1, .TARGET_ADDR */
-	 0x4A0C,			/* ldr	r2, .COUNT  */
-	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
-	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001, then busy_count */
-	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* copy_hword: */
-	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
-	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
-	 /* busy: */
-	 0x3501,			/* add	r5, r5, #0x01 ; Increment busy_count */
-	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
-	 0xf013, 0x0f01,	/* tst	r3, #0x01 ;  check FLASH_SR_BSY */
-	 0xd1fa,			/* bne	busy */
-	 0xf013, 0x0ff0,	/* tst	r3, #0xF0 ; check for PG*ERR errors */
-	 0xd102,			/* bne	exit */
-	 0x3a01,			/* subs	r2, r2, #0x01 ;  Decrement COUNT*/
-	 0xd1f1,			/* bne	copy_hword */
-	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
-	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
-	 /* exit: */
-	 0xbe00,			/* bkpt	#0x00 */
-	 /* The following parameters will be overwritten before download. */
-	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
-	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
-	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
-	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
- };
 
-/*
- * Write the flash at FLASH_ADDR with data BUF of SIZE bytes.
- * This routine downloads the flash-write program, parameters
- * and data to be written, then runs the program.
- * It assumes that the flash address, size and any rounding has been
- * checked by the caller.
- * The flash needs to be unlocked by the caller, but the downloaded code
- * writes FLASH_CR_PG_BIT to enable and disable user flash programing.
+/* Queue a command to the STLink, returning the queue slot.
+ * DATA is the buffer for the data phase.  If NULL the slot's own buffer
+ * is used, and for output the caller fills rq->buf before the data is
+ * needed -- which is immediately, so copy it in first with
+ * stl_queue_wr32().  Input data stays valid until the slot is retired.
+ * The queue never has more than sl->q_depth commands outstanding; when
+ * full we retire the oldest before submitting.
  */
-static int stl_loader(struct stlink *sl, stm32_addr_t flash_addr,
-					  const void *buf, int size)
+struct stl_req *stl_queue_cmd(struct stlink *sl, const unsigned char *cmd,
+							  int cmd_len, enum STLinkParamDirection dir,
+							  void *data, int data_len)
 {
-	int offset = 0;
-	uint32_t prog_base = stm_devids[0].sram_base;
-	uint32_t *params;
-	uint32_t flash_ctrl_base;
+	struct stl_req *rq;
+	int ret;
 
-	if (stm_devids[sl->chip_index].cap_flags & ChipCapF4Flash) {
-		offset = sizeof(f4_loader_code);
-		memcpy(sl->data_buf, f4_loader_code, offset);
-		flash_ctrl_base = F4_FLASH_REGS;
-	} else {
-		offset = sizeof(db_loader_code);
-		memcpy(sl->data_buf, db_loader_code, offset);
-		if (stm_devids[sl->chip_index].flash_size > 256*1024  &&
-			flash_addr >= 0x08080000)
-			flash_ctrl_base = 0x40022040;
-		else
-			flash_ctrl_base = FLASH_REGS_ADDR;
-	}
-	params = (uint32_t *)(sl->data_buf+offset);
-
-	/* Write params[-4] to change the FLASH_REGS_ADDR base.
-	 * Connectivity devices use an offset of +0x40 e.g. 0x40022040
-	 * for a second bank of flash. */
-	params[-4] = flash_ctrl_base;
-	params[-3] = prog_base + offset;
-	params[-2] = flash_addr;
-	params[-1] = size>>1;
-	memcpy(params, buf, size);
-
-	/* Transfer both the loader and data at once. */
-	stl_wr32_cmd(sl, prog_base, offset + size);
-	/* Run the program by setting the PC aka r15. */
-	stl_write_reg(sl, prog_base, 15);
-	stl_state_run(sl);
+	while (sl->q_head - sl->q_tail >= sl->q_depth)
+		stl_queue_retire(sl);
+	rq = &sl->queue[sl->q_head % STL_QUEUE_LEN];
+	if (rq->buf == NULL && (rq->buf = malloc(Q_BUF_LEN)) == NULL) {
+		fprintf(stderr, "Failed to allocate a STLink queue buffer.\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(rq->cmd_buf, 0, sizeof rq->cmd_buf);
+	memcpy(rq->cmd_buf, cmd, cmd_len);
+	rq->cmd_len = STL_CMD_LEN;
+	rq->xfer_dir = dir;
+	rq->data = data ? data : rq->buf;
+	rq->data_len = data_len;
+	rq->actual_len = 0;
+	rq->status = 0;
+	rq->done = 0;
+	rq->copy_to = NULL;
+	rq->copy_len = 0;
+	rq->submit_ns = stl_now_ns();
+	if (sl->stats_start_ns == 0)
+		sl->stats_start_ns = rq->submit_ns;
+	rq->retries = 0;
+	/* A transport's timeout runs from submission, so also allow for the
+	 * time the commands ahead of this one may still take. */
+	rq->timeout_ms = stl_cmd_timeout(sl, rq);
+	if (sl->q_head != sl->q_tail) {
+		struct stl_req *prev = &sl->queue[(sl->q_head - 1) % STL_QUEUE_LEN];
+		int64_t ahead = (int64_t)(prev->submit_ns - rq->submit_ns) / 1000000
+			+ prev->timeout_ms;
+		if ( ! prev->done && ahead > 0)
+			rq->timeout_ms += ahead;
+	}
 
-	return 0;
+	if (sl->verbose > 3)
+		printf("Queueing command %2.2x %2.2x ..., data length %d.\n",
+			   rq->cmd_buf[0], rq->cmd_buf[1], rq->data_len);
+	ret = sl->tp->submit(sl, rq);
+	if (ret != 0) {
+		printf(" * Failed %s submit, %d, Command %2.2x %2.2x.\n",
+			   sl->tp->name, ret, rq->cmd_buf[0], rq->cmd_buf[1]);
+		rq->status = ret;
+		rq->done = 1;
+	}
+	sl->q_head++;
+	return rq;
 }
 
-#define FLASH_WR_BLK_SIZE 2048
-
-static int stl_flash_write(struct stlink *sl, stm32_addr_t flash_addr,
-						   const void *buf, int size)
+/* Wait for the oldest queued command to finish and release its slot.
+ * Returns the command status, or 0 if the queue was empty. */
+int stl_queue_retire(struct stlink *sl)
 {
-	int offset = 0;
-	int status;
+	struct stl_req *rq;
 
-	if (sl->verbose)
-		printf("Flash write %8.8x..%8.8x.\n", flash_addr, flash_addr+size);
-	/* Unlock the flash register. */
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY1);
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY2);
-	/* Clear the error bits in the control register. */
-	sl_wr32(sl, FLASH_SR, 0x34);
-	if (sl->verbose)
-		printf("Flash status %2.2x, control %4.4x.\n",
-			   sl_rd32(sl, FLASH_SR), sl_rd32(sl, FLASH_CR));
-
-	do {
-		int this_size;
-		int failcount = 0;
-		if (size > FLASH_WR_BLK_SIZE)
-			this_size = FLASH_WR_BLK_SIZE;
-		else if (size & 1)
-			this_size = size+1;
-		else
-			this_size = size;
-		stl_loader(sl, flash_addr + offset, buf + offset, this_size);
-		/* Writing 2KB takes 40-70 msec according to sec. 5.3.9 */
-		while (stl_get_status(sl) != STLINK_CORE_HALTED)
-			if (++failcount > FLASH_POLL_LIMIT) {
-				if (sl->verbose)
-					printf("Flash status %2.2x, control %4.4x status %x.\n",
-						   sl_rd32(sl, FLASH_SR), sl_rd32(sl, FLASH_CR),
-						   stl_get_status(sl));
-				return 0;
-			}
-		offset += this_size;
-		size -= this_size;
-	} while (size > 0);
+	if (sl->q_tail == sl->q_head)
+		return 0;
+	rq = &sl->queue[sl->q_tail % STL_QUEUE_LEN];
+	if ( ! rq->done)
+		sl->tp->wait(sl, rq);
+	if (stl_req_failed(rq))
+		stl_queue_recover(sl, rq);
+	stl_stats_record(sl, rq, stl_now_ns());
+
+	if (stl_req_failed(rq))
+		printf(" * Failed %s %s, status %d, Command %2.2x %2.2x "
+			   "expected %d bytes, transferred %d.\n", sl->tp->name,
+			   rq->xfer_dir == STLinkParamToDev ? "output" : "input",
+			   rq->status, rq->cmd_buf[0], rq->cmd_buf[1],
+			   rq->data_len, rq->actual_len);
+	else if (sl->verbose > 3)
+		printf("Transfer done, status %d length %d of %d.\n",
+			   rq->status, rq->actual_len, rq->data_len);
+	if (rq->copy_to)
+		memcpy(rq->copy_to, rq->data, rq->copy_len);
+	sl->q_tail++;
+	return rq->status;
+}
 
-	status = sl_rd32(sl, FLASH_SR) & 0x15;
-	if (status) {
-		if (status & 0x04)
-			fprintf(stderr, "Flash write failed: trying to write a location "
-					"that was not erased. (%2.2x)\n", status);
-		else if (status & 0x10)
-			fprintf(stderr, "Flash write failed: trying to modify a "
-					"write-protected region. (%2.2x)\n", status);
+/* Retire every queued command.  Returns the first error seen. */
+int stl_queue_flush(struct stlink *sl)
+{
+	int ret = 0;
+
+	while (sl->q_tail != sl->q_head) {
+		int status = stl_queue_retire(sl);
+		if (ret == 0)
+			ret = status;
 	}
-	/* Re-lock the flash. */
-	sl_wr32(sl, FLASH_CR, 0x80);
-	return status;
+	return ret;
 }
 
-/* Erase flash memory.
- * Typical use: erase the page of flash memory that contains address ADDR.
- * Pass the address 0xA11 to do a mass erase ("user flash" only).
- * The flash controller should be idle at entry, and this waits for idle
- * before exit.
+/* Execute the single command in stl->cmd_buf synchronously.
+ * This is the wrapper used by all of the simple one-at-a-time commands.
+ * The data phase uses stl->data_buf, stl->data_len directly.
+ * Anything already queued finishes first, so ordering is preserved.
  */
+int stl_do_cmd(struct stlink *stl)
+{
+	stl_queue_flush(stl);
+	stl_queue_cmd(stl, stl->cmd_buf,
+				  stl->cmd_len < CDB_SIZE ? stl->cmd_len : CDB_SIZE,
+				  stl->xfer_dir, stl->data_buf, stl->data_len);
+	return stl_queue_retire(stl);
+}
 
-static int stl_f1_flash_erase(struct stlink *sl, stm32_addr_t addr_page);
-static int stl_f4_flash_erase(struct stlink *sl, stm32_addr_t addr_page);
-static int stl_L1_flash_erase(struct stlink *sl, stm32_addr_t addr_page);
-
-static int stl_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
+/* Queued memory access.
+ * These are the bulk-path equivalents of stl_rd32_cmd() and stl_wr32_cmd().
+ * The read result is valid in DEST once the command retires, which happens
+ * at the latest on the next stl_queue_flush().
+ * When LEN is a whole number of words the USB transfer lands directly in
+ * DEST, with no intermediate copy.  Only a trailing partial word needs
+ * the slot's bounce buffer.
+ */
+int stl_queue_rd32(struct stlink *sl, uint32_t addr, int len, void *dest)
 {
-	if (stm_devids[sl->chip_index].cap_flags & ChipCapF4Flash)
-		return stl_f4_flash_erase(sl, addr_page);
-	else if (stm_devids[sl->chip_index].cap_flags & ChipCapL15Flash)
-		return stl_L1_flash_erase(sl, addr_page);
+	unsigned char cmd[8];
+	struct stl_req *rq;
+	int xfer_len = (len + 3) & ~3;
+
+	if (xfer_len > Q_BUF_LEN)
+		return -1;
+	cmd[0] = STLinkDebugCommand;
+	cmd[1] = STLinkDebugReadMem32bit;
+	write_uint32(cmd + 2, addr & ~3);
+	write_uint16(cmd + 6, xfer_len);
+	if (xfer_len == len) {
+		stl_queue_cmd(sl, cmd, sizeof cmd, STLinkParamFromDev, dest, len);
+		return 0;
+	}
+	rq = stl_queue_cmd(sl, cmd, sizeof cmd, STLinkParamFromDev, NULL, xfer_len);
+	rq->copy_to = dest;
+	rq->copy_len = len;
+	return 0;
+}
+
+int stl_queue_wr32(struct stlink *sl, uint32_t addr, const void *src, int len)
+{
+	unsigned char cmd[8];
+	struct stl_req *rq;
+
+	if (len > Q_BUF_LEN)
+		return -1;
+	cmd[0] = STLinkDebugCommand;
+	if ((len & 3) == 0)
+		cmd[1] = STLinkDebugWriteMem32bit;
+	else if (len < 64)
+		cmd[1] = STLinkDebugWriteMem8bit;
 	else
-		return stl_f1_flash_erase(sl, addr_page);
+		return -1;
+	write_uint32(cmd + 2, addr);
+	write_uint16(cmd + 6, len);
+	stl_cache_drop(sl, addr, len);
+	/* Stage the data in the slot the next command will use, then queue. */
+	while (sl->q_head - sl->q_tail >= sl->q_depth)
+		stl_queue_retire(sl);
+	rq = &sl->queue[sl->q_head % STL_QUEUE_LEN];
+	if (rq->buf == NULL && (rq->buf = malloc(Q_BUF_LEN)) == NULL)
+		return -1;
+	memcpy(rq->buf, src, len);
+	stl_queue_cmd(sl, cmd, sizeof cmd, STLinkParamToDev, NULL, len);
+	return 0;
 }
 
-static int stl_f1_flash_erase(struct stlink *sl, stm32_addr_t addr_page)
+/* Queue a simple debug command with a two byte status response.
+ * The response is discarded unless the caller reads it from the slot. */
+struct stl_req *stl_queue_dbg(struct stlink *sl, uint8_t st_cmd1,
+							  uint8_t st_cmd2, uint32_t param)
 {
-	int i = 0, status;
+	unsigned char cmd[7];
 
-	/* Unlock the flash register and clear any previous errors. */
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY1);
-	sl_wr32(sl, FLASH_KEYR, FLASH_KEY2);
-	sl_wr32(sl, FLASH_SR, FLASH_SR_EOP | FLASH_SR_WRPRTERR | FLASH_SR_PGERR);
+	cmd[0] = STLinkDebugCommand;
+	cmd[1] = st_cmd1;
+	cmd[2] = st_cmd2;
+	write_uint32(cmd + 3, param);
+	return stl_queue_cmd(sl, cmd, sizeof cmd, STLinkParamFromDev, NULL, 2);
+}
 
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink erase flash: status %8.8x "
-				"Flash_CR %8.8x.\n",
-				sl_rd32(sl, FLASH_SR), sl_rd32(sl, FLASH_CR));
+/* The libusb-1.0 transport for the v2 STLink.
+ * v1 uses SCSI transport over USB.
+ * v2 uses USB bulk endpoints.
+ * Each queued command is one command-block transfer on USB_PIPE_OUT,
+ * followed by an optional data transfer on USB_PIPE_OUT or USB_PIPE_IN.
+ * We submit both immediately and let libusb call us back when they
+ * finish, so that several commands are on the wire at once.
+ */
+static void LIBUSB_CALL stl_usb_xfer_done(struct libusb_transfer *xfer)
+{
+	struct stl_req *rq = xfer->user_data;
+
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED && rq->status == 0)
+		rq->status = xfer->status == LIBUSB_TRANSFER_TIMED_OUT ?
+			LIBUSB_ERROR_TIMEOUT : xfer->status == LIBUSB_TRANSFER_STALL ?
+			LIBUSB_ERROR_PIPE : LIBUSB_ERROR_IO;
+	if (xfer == rq->data_xfer)
+		rq->actual_len = xfer->actual_length;
+	else if (xfer->actual_length != rq->cmd_len && rq->status == 0)
+		rq->status = LIBUSB_ERROR_IO;
+	if (--rq->xfers_pending == 0)
+		rq->done = 1;
+}
 
-	if (addr_page == 0xa11) {
-		/* Start the erase-all operation, PM0075 sec 3.5. */
-		sl_wr32(sl, FLASH_CR, FLASH_CR_MER);
-		sl_wr32(sl, FLASH_CR, FLASH_CR_STRT | FLASH_CR_MER);
-	} else {
-		/* Select the page to erase PM0075 sec 3.6 */
-		sl_wr32(sl, FLASH_AR, addr_page);
-		/* Start the erase operation, PM0075 sec 3.5.
-		 * Note that a single combined write will not work! */
-		sl_wr32(sl, FLASH_CR, FLASH_CR_PER);
-		sl_wr32(sl, FLASH_CR, FLASH_CR_STRT | FLASH_CR_PER);
-	}
-	/* Monitor the busy bit to check for completion.  This typically takes
-	 * only two iterations. */
-	do {
-		status = sl_rd32(sl, FLASH_SR);
-		i++;
-	} while ((status & FLASH_SR_BSY) && i < 1000);
-	if ( ! (status & FLASH_SR_EOP)) {
-		fprintf(stderr, "STLink erase flash page failed, status %8.8x "
-				"Flash_CR %8.8x (%d checks).\n",
-				status, sl_rd32(sl, FLASH_SR), i);
-		return 1;
+static int stl_usb_submit(struct stlink *sl, struct stl_req *rq)
+{
+	int ret;
+
+	if (rq->cmd_xfer == NULL) {
+		rq->cmd_xfer = libusb_alloc_transfer(0);
+		rq->data_xfer = libusb_alloc_transfer(0);
+		if (rq->cmd_xfer == NULL || rq->data_xfer == NULL)
+			return LIBUSB_ERROR_NO_MEM;
+	}
+	/* The rq->cmd_len value doesn't need to be precise.  Bytes after
+	 * the command are ignored. */
+	libusb_fill_bulk_transfer(rq->cmd_xfer, sl->usb_hand, USB_PIPE_OUT,
+							  rq->cmd_buf, rq->cmd_len, stl_usb_xfer_done,
+							  rq, rq->timeout_ms);
+	ret = libusb_submit_transfer(rq->cmd_xfer);
+	if (ret != 0)
+		return ret;
+	rq->xfers_pending = 1;
+	if (rq->data_len == 0)
+		return 0;
+
+	libusb_fill_bulk_transfer(rq->data_xfer, sl->usb_hand,
+							  rq->xfer_dir == STLinkParamToDev ?
+							  USB_PIPE_OUT : USB_PIPE_IN,
+							  rq->data, rq->data_len, stl_usb_xfer_done,
+							  rq, rq->timeout_ms);
+	ret = libusb_submit_transfer(rq->data_xfer);
+	if (ret == 0)
+		rq->xfers_pending++;
+	else
+		rq->status = ret;
+	return 0;
+}
+
+static int stl_usb_wait(struct stlink *sl, struct stl_req *rq)
+{
+	while ( ! rq->done) {
+		int ret = libusb_handle_events_completed(sl->usb_ctx, &rq->done);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, " * USB event handling failed: %s.\n",
+					libusb_error_name(ret));
+			if (rq->status == 0)
+				rq->status = ret;
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* Abandon the transfers in flight and resync with the STLink.
+ * A stalled endpoint must have its halt cleared before it will move data
+ * again.  After a timeout the STLink may still deliver a response that
+ * we gave up on, which would be taken as the next command's, so we
+ * drain anything pending on the input pipe.
+ */
+static int stl_usb_recover(struct stlink *sl)
+{
+	unsigned char drain[64];
+	unsigned int i;
+	int n, actual;
+
+	for (i = sl->q_tail; i != sl->q_head; i++) {
+		struct stl_req *rq = &sl->queue[i % STL_QUEUE_LEN];
+		if (rq->done)
+			continue;
+		libusb_cancel_transfer(rq->cmd_xfer);
+		if (rq->xfers_pending > 1 || rq->data_len)
+			libusb_cancel_transfer(rq->data_xfer);
 	}
+	for (i = sl->q_tail; i != sl->q_head; i++) {
+		struct stl_req *rq = &sl->queue[i % STL_QUEUE_LEN];
+		while ( ! rq->done &&
+				libusb_handle_events_completed(sl->usb_ctx, &rq->done) >= 0)
+			;
+		if (rq->status == 0 && rq->actual_len != rq->data_len)
+			rq->status = LIBUSB_ERROR_INTERRUPTED;
+	}
+	libusb_clear_halt(sl->usb_hand, USB_PIPE_IN);
+	libusb_clear_halt(sl->usb_hand, USB_PIPE_OUT);
+	for (n = 0; n < 16; n++)
+		if (libusb_bulk_transfer(sl->usb_hand, USB_PIPE_IN, drain,
+								 sizeof drain, &actual, 10) != 0)
+			break;
 	if (sl->verbose)
-		fprintf(stderr, "STLink erase flash page %8.8x: %d status checks to "
-				"complete %8.8x.\n", addr_page, i, status);
+		fprintf(stderr, " Resynced the STLink, %d stale responses "
+				"discarded.\n", n);
 	return 0;
 }
 
-static int stl_f4_flash_erase(struct stlink *sl, stm32_addr_t addr_page)
+static void stl_usb_close(struct stlink *sl)
 {
-	int i = 0, status;
+	if (sl->usb_hand) {
+		libusb_release_interface(sl->usb_hand, 0);
+		libusb_close(sl->usb_hand);
+	}
+	libusb_exit(sl->usb_ctx);
+}
 
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink STM32F4 erase flash: Flash_SR %8.8x "
-				"Flash_CR %8.8x.\n",
-				sl_rd32(sl, F4_FLASH_SR), sl_rd32(sl, F4_FLASH_CR));
+static int stl_usb_replug(struct stlink *sl);
+const struct stl_transport stl_usb_transport = {
+	"USB", stl_usb_submit, stl_usb_wait, stl_usb_close, stl_usb_recover,
+	stl_usb_replug, NULL,
+};
 
+#if defined(__linux__)
+/* The SCSI Generic transport for the v1 STLink.
+ * Most of the work is filling in the struct sg_io_hdr.
+ * We use the asynchronous sg interface: write() submits the request and
+ * read() retires it, rather than a blocking ioctl(SG_IO) per command.
+ * That keeps up to q_depth commands queued in the kernel so the USB
+ * storage driver can start the next one as soon as the STLink finishes.
+ * Each request is tagged with its queue slot as the pack_id, and
+ * SG_SET_FORCE_PACK_ID makes read() return the one we ask for.
+ * The sg driver copies outgoing data at write(), incoming data at read().
+ */
+static int stl_sg_submit(struct stlink *sl, struct stl_req *rq)
+{
+	struct sg_io_hdr *io_hdr = &rq->sg_hdr;
 
-	/* Unlock the flash register and clear any previous errors. */
-	sl_wr32(sl, F4_FLASH_KEYR, FLASH_KEY1);
-	sl_wr32(sl, F4_FLASH_KEYR, FLASH_KEY2);
-	sl_wr32(sl, F4_FLASH_SR, 0xF3); 		/* Clear error bits. */
+	memset(io_hdr, 0, sizeof *io_hdr);
+	io_hdr->interface_id = 'S';
+	io_hdr->pack_id = rq - sl->queue;
 
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink STM32F4 erase flash: status %8.8x "
-				"Flash_CR %8.8x.\n",
-				sl_rd32(sl, F4_FLASH_SR), sl_rd32(sl, F4_FLASH_CR));
+	/* Provide buffers for the SCSI transfer.
+	 * The Request Sense (error info) command is used for responses.
+	 * http://en.wikipedia.org/wiki/SCSI_Request_Sense_Command
+	 */
+	io_hdr->cmdp = rq->cmd_buf;
+	io_hdr->cmd_len = CDB_SIZE;
+	io_hdr->sbp = rq->sense_buf;
+	io_hdr->mx_sb_len = sizeof(rq->sense_buf);
 
-	if (addr_page == 0xa11) {
-		/* Start the erase-all operation, PM0075 sec 3.5. */
-		sl_wr32(sl, F4_FLASH_CR, FLASH_CR_MER);
-		sl_wr32(sl, F4_FLASH_CR, F4_FLASH_CR_STRT | FLASH_CR_MER);
-	} else {
-		int sector = addr_page & 0x0f;
-		/* Select the sector to erase. */
-		sl_wr32(sl, F4_FLASH_CR, 0x00202 | (sector<<3));
-		sl_wr32(sl, F4_FLASH_CR, 0x10202 | (sector<<3));
-	}
-	/* Monitor the busy bit to check for completion.  This typically takes
-	 * only two iterations. */
-	do {
-		status = sl_rd32(sl, F4_FLASH_SR);
-		i++;
-	} while ((status & F4_FLASH_SR_BSY) && i < 1000);
-	if (sl->verbose)
-		fprintf(stderr, "STLink erase flash page %8.8x: %d status checks to "
-				"complete %8.8x.\n", addr_page, i, status);
+	/* Set a buffer to be used for data transferred from/to device */
+	io_hdr->iovec_count = 0;
+	io_hdr->dxferp = rq->data;
+	io_hdr->dxfer_len = rq->data_len;
+	io_hdr->dxfer_direction = rq->data_len == 0 ? SG_DXFER_NONE :
+		(rq->xfer_dir == STLinkParamToDev ? SG_DXFER_TO_DEV:SG_DXFER_FROM_DEV);
+
+	io_hdr->timeout = rq->timeout_ms;
+	io_hdr->flags = 0;
+	if (write(sl->fd, io_hdr, sizeof *io_hdr) < 0)
+		return -errno;
 	return 0;
 }
 
-static int stl_L1_flash_erase(struct stlink *sl, stm32_addr_t addr_page)
+static int stl_sg_wait(struct stlink *sl, struct stl_req *rq)
 {
-	int i = 0, status;
-
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink STM32L erase flash: Flash_ACR %8.8x "
-				"Flash_PECR %8.8x.\n",
-				sl_rd32(sl, L15_FLASH_ACR), sl_rd32(sl, L15_FLASH_ACR));
+	struct sg_io_hdr *io_hdr = &rq->sg_hdr;
+	int ret;
 
-	/* Unlock the flash register and clear any previous errors. */
-	sl_wr32(sl, L15_FLASH_PEKEYR, L15_FLASH_PEKEY1);
-	sl_wr32(sl, L15_FLASH_PEKEYR, L15_FLASH_PEKEY2);
-	/* Clear the program-lock bit with another magic write sequence. */
-	sl_wr32(sl, L15_FLASH_PRGKEYR, L15_FLASH_PRGKEY1);
-	sl_wr32(sl, L15_FLASH_PRGKEYR, L15_FLASH_PRGKEY2);
+	/* The read() blocks until the request with io_hdr->pack_id is done. */
+	ret = read(sl->fd, io_hdr, sizeof *io_hdr);
+	/* Report SCSI results.  Really, note useful variable if we need
+	 * to write better reporting code. */
+	if (ret >= 0 && sl->verbose) {
+		if (sl->verbose > 3)
+			fprintf(stderr, " SCSI command status %4.4x, took %d ms.\n",
+					io_hdr->status, io_hdr->duration);
+		if (io_hdr->resid || io_hdr->sb_len_wr)
+			fprintf(stderr, " SCSI residue was %d, sense length %d.\n",
+					io_hdr->resid, io_hdr->sb_len_wr);
+	}
+	rq->status = ret < 0 ? -errno : 0;
+	/* A timeout or transport error is reported in the header, and the
+	 * SCSI layer has already reset the device. */
+	if (ret >= 0 && (io_hdr->info & SG_INFO_OK_MASK) != SG_INFO_OK)
+		rq->status = -EIO;
+	rq->actual_len = ret < 0 ? 0 : rq->data_len - io_hdr->resid;
+	rq->done = 1;
+	return rq->status;
+}
 
-	if (sl->verbose > 1)
-		fprintf(stderr, "STLink STM32L erase flash: status %8.8x "
-				"Flash_CR %8.8x, OBR %8.8x.\n",
-				sl_rd32(sl, L15_FLASH_PECR), sl_rd32(sl, L15_FLASH_ACR),
-				sl_rd32(sl, L15_FLASH_OBR));
+static void stl_sg_close(struct stlink *sl)
+{
+	if (sl->fd >= 0)
+		close(sl->fd);
+	sl->fd = -1;
+}
 
-	if (addr_page == 0xa11) {
-		/* Do a mass erase / erase-all turning on read protection and then
-		 * turning it off. */
-		sl_wr32(sl, L15_FLASH_OBR, 0x01);
-		sl_wr32(sl, L15_FLASH_OBR, 0xAA);
-	} else {
-		int sector = addr_page & 0x0f;
-		/* Select the sector to erase. */
-		sl_wr32(sl, F4_FLASH_CR, 0x00202 | (sector<<3));
-		sl_wr32(sl, F4_FLASH_CR, 0x10202 | (sector<<3));
-	}
-	/* Monitor the busy bit to check for completion.  This typically takes
-	 * only two iterations. */
-	do {
-		status = sl_rd32(sl, L15_FLASH_SR);
-		i++;
-	} while ((status & FLASH_SR_BSY) && i < 1000);
-	if (sl->verbose)
-		fprintf(stderr, "STLink STM32L erase flash page %8.8x: %d status checks to "
-				"complete %8.8x.\n", addr_page, i, status);
-	return 0;
+/* Set up the sg device for queued commands.
+ * Have each read() return the request with the pack_id we ask for, and
+ * allow several commands to be outstanding. */
+static void stl_sg_setup(int fd)
+{
+	int one = 1;
+	ioctl(fd, SG_SET_FORCE_PACK_ID, &one);
+	ioctl(fd, SG_SET_COMMAND_Q, &one);
 }
 
-/* Read from device memory at ADDR into BUF for SIZE bytes.
- * This handles alignment and block size internally.
+/* Wait for the v1 STLink's device node to come back after it leaves DFU
+ * mode, and reopen it.
+ * Rather than polling, we watch the node's directory with inotify, so we
+ * try again the moment udev (see 10-stlink.rules) creates or updates it.
+ * The node may appear some time before the USB storage driver lets
+ * commands through, so while it exists we also retry with a backoff.
  */
-#define READ_BLK_SIZE 1024
-int stl_read(struct stlink* sl, stm32_addr_t addr, void *buf, ssize_t size)
+static int stl_sg_replug(struct stlink *sl)
 {
-	size_t offset = 0;
+	char dir[256], *slash;
+	int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	int backoff_ms = 20;
+	uint64_t deadline = stl_now_ns() + (uint64_t)STL_REPLUG_MSEC * 1000000;
+
+	snprintf(dir, sizeof dir, "%s", sl->dev_path);
+	slash = strrchr(dir, '/');
+	if (slash == dir)
+		slash[1] = 0;
+	else if (slash)
+		*slash = 0;
+	else
+		strcpy(dir, ".");
+	if (ifd >= 0)
+		inotify_add_watch(ifd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+	if (sl->fd >= 0)
+		close(sl->fd);
 
-	if (addr & 3) {
-		int psz = 4 - (addr & 3);
-		stl_rd32_cmd(sl, addr & ~3, sizeof(uint32_t));
-		memcpy(buf, sl->data_buf + (addr & 3), psz);
-		offset = psz;
-	}
-	do {
-		int xfer_size;
-		if (size > READ_BLK_SIZE)
-			xfer_size = READ_BLK_SIZE;
-		else
-			xfer_size = (size+3)&~3;
-		stl_rd32_cmd(sl, addr+offset, xfer_size);
-		if (size & 3)
-			xfer_size = size;
-		memcpy(buf + offset, sl->data_buf, xfer_size);
-		offset += xfer_size;
-		size -= xfer_size;
-	} while (size > 0);
-	return size;
+	fprintf(stderr, "Waiting to reopen the STLink device at '%s' ...\n",
+			sl->dev_path);
+	for (;;) {
+		struct pollfd pfd;
+		char events[1024];
+		int64_t remaining_ms;
+
+		sl->fd = open(sl->dev_path, O_RDWR);
+		if (sl->fd >= 0) {
+			stl_sg_setup(sl->fd);
+			stl_enter_SWD_mode(sl);
+			sl->core_state = stl_get_status(sl);
+			if (sl->verbose)
+				printf(" ARM status is 0x%4.4x: %s.\n", sl->core_state,
+					   sl->core_state==STLINK_CORE_RUNNING ? "running" :
+					   (sl->core_state==STLINK_CORE_HALTED ? "halted" :
+						"unknown"));
+			if (sl->core_state==STLINK_CORE_RUNNING ||
+				sl->core_state==STLINK_CORE_HALTED)
+				break;
+			close(sl->fd);
+			sl->fd = -1;
+		} else if (sl->verbose)
+			printf(" Reopen failed.\n");
+		remaining_ms = (int64_t)(deadline - stl_now_ns()) / 1000000;
+		if (remaining_ms <= 0)
+			break;
+		/* Sleep until the node changes.  If it is already there, or we
+		 * cannot watch it, also wake after the backoff. */
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		if (ifd < 0 || access(sl->dev_path, F_OK) == 0) {
+			if (remaining_ms > backoff_ms)
+				remaining_ms = backoff_ms;
+			if (backoff_ms < 500)
+				backoff_ms *= 2;
+		}
+		if (poll(&pfd, ifd >= 0, remaining_ms) > 0)
+			while (read(ifd, events, sizeof events) > 0)
+				;
+	}
+	if (ifd >= 0)
+		close(ifd);
+	return sl->fd >= 0 ? 0 : -1;
 }
 
+const struct stl_transport stl_sg_transport = {
+	"SCSI", stl_sg_submit, stl_sg_wait, stl_sg_close, NULL, stl_sg_replug,
+	NULL,
+};
+#endif
 
-/* Write the contents of file PATH into flash starting at ADDR. */
-static int stl_flash_fwrite(struct stlink *sl, const char* path,
-							stm32_addr_t addr, int max_size)
+/* The CRC-32 of the STM32 CRC unit: polynomial 0x04C11DB7, fed 32 bit
+ * words MSB first with no bit reversal or final inversion.  LEN bytes of
+ * little-endian words at P are added to CRC, 0xFFFFFFFF to start. */
+static uint32_t stm32_crc_table[256];
+static pthread_once_t stm32_crc_once = PTHREAD_ONCE_INIT;
+
+static void stm32_crc_init(void)
 {
-	char buf[128*1024];
-	int ret;
-	ssize_t size;
-	const int fd = open(path, O_RDONLY);
+	int i, j;
 
-	if (fd < 0) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
-		return -1;
-	}
-	size = read(fd, buf, sizeof buf);
-	if (size < 0) {
-		fprintf(stderr, " Failed to read '%s': %s\n", path, strerror(errno));
-		return -1;
-	}
-	if (size > max_size) {
-		fprintf(stderr, " Program is LARGER THAN FLASH and may not fit."
-				"  Trying anyway.\n"
-				"  Program at %s is %#8.8x bytes, flash is %#8.8x bytes.\n",
-				path, (int)size, max_size);
+	for (i = 0; i < 256; i++) {
+		uint32_t c = (uint32_t)i << 24;
+		for (j = 0; j < 8; j++)
+			c = c & 0x80000000 ? (c << 1) ^ 0x04C11DB7 : c << 1;
+		stm32_crc_table[i] = c;
 	}
+}
 
-	ret = stl_flash_write(sl, addr, buf, size);
-	close(fd);
-	if (ret & 0x0004) {
-		fprintf(stderr, "\n");
+static uint32_t stm32_crc32(uint32_t crc, const unsigned char *p, size_t len)
+{
+	size_t i;
+	int j;
+
+	pthread_once(&stm32_crc_once, stm32_crc_init);
+	for (i = 0; i + 4 <= len; i += 4) {
+		crc ^= read_uint32(p, i);
+		for (j = 0; j < 4; j++)
+			crc = (crc << 8) ^ stm32_crc_table[crc >> 24];
 	}
-	return ret;
+	return crc;
 }
 
-/* Routines still left to implement. */
-
-/* Read from the ARM memory starting at offet ADDR, writing SIZE bytes
- * into file PATH.
+/* The simulated STLink.
+ * This transport emulates the STLink v2 command set against an in-memory
+ * STM32 model: flash, SRAM, system memory, the ID registers and an F1
+ * flash controller (FPEC) that follows the PM0075 rules -- unlock keys,
+ * halfword-only programming, no programming of unerased locations -- with
+ * realistic erase and program times.  The F2/F4 controller is modelled
+ * the same way, with the RM0090 sector erase and PSIZE parallelism.
+ * Code downloaded into SRAM, such as the flash loader, runs on a small
+ * Thumb-2 interpreter.  Code in flash, which would be the user's
+ * application, is not interpreted.  The core is simply reported as
+ * running.
+ * This lets every transfer and flash optimization be exercised and timed
+ * without hardware, e.g.
+ *   stlinkv2-util --transport=sim program=firmware.bin
+ * Simulated time is the host time since the open plus the USB time of
+ * every command so far, SIM_CMD_NS per command and SIM_BYTE_NS per data
+ * byte, a full-speed STLink v2.  Nothing sleeps.  The core runs lazily:
+ * each command first advances it to the current time at SIM_CYCLE_NS per
+ * instruction.
  */
-int stl_fread(struct stlink* sl, const char* path,
-				 stm32_addr_t addr, size_t size)
+#define SIM_CYCLE_NS		125			/* 8MHz HSI, one instruction/cycle */
+#define SIM_CMD_NS			500000		/* USB round trip of a command */
+#define SIM_BYTE_NS			1000		/* Bulk data, about 1MB/sec */
+#define SIM_PROG_NS			52500		/* Halfword program, PM0075 t_PROG */
+#define SIM_PAGE_ERASE_NS	20000000	/* Page erase, t_ERASE */
+#define SIM_MASS_ERASE_NS	40000000	/* Mass erase, t_ME */
+#define SIM_F4_PROG_NS		16000		/* Any PSIZE, RM0090 t_PROG */
+#define SIM_F4_ERASE_KB_NS	16000000	/* Sector erase, x32 */
+#define SIM_F4_MASS_ERASE_NS 16000000000ULL	/* Each bank */
+#define SIM_SYSMEM_BASE		0x1FFF0000	/* System memory, OTP and option bytes */
+#define SIM_SYSMEM_SIZE		0x10000
+#define SIM_MISC_REGS		256
+#define SIM_DEFAULT_IDCODE	0x10016410	/* Medium-density STM32F10x */
+#define SIM_XPSR			16			/* Register indices after r0..r15 */
+#define SIM_MSP				17
+#define SIM_NREGS			21
+
+/* Program status register flags. */
+#define SIM_N 0x80000000
+#define SIM_Z 0x40000000
+#define SIM_C 0x20000000
+#define SIM_V 0x10000000
+
+struct stm_sim {
+	const struct stm_chip_params *chip;
+	uint8_t *flash, *sram, *sysmem;
+	uint32_t flash_base, flash_size, sram_base, sram_size;
+	/* The F1 flash controller, or the F4 one with its bits.  The F1 XL
+	 * parts have a second controller for bank 2. */
+	int f4_fpec;
+	struct sim_fpec {
+		uint32_t cr, sr, ar;
+		int key;				/* Unlock key sequence progress. */
+		uint64_t busy_until;
+	} fpec[2];
+	uint32_t crc_dr;			/* The CRC unit. */
+	uint32_t dhcsr;				/* The DHCSR control bits. */
+	/* The ARM core registers, in the ARMcoreRegs / ReadAllRegs order. */
+	uint32_t r[SIM_NREGS];
+	int halted;
+	int free_run;				/* Running code we do not interpret. */
+	int in_core;				/* The access is from the core, not debug. */
+	uint64_t now_ns, run_until, t0_ns, usb_ns;
+	int stlink_mode;
+	/* Fault injection: every glitch_every'th command times out. */
+	unsigned int glitch_every, n_cmds;
+	/* Registers of unmodelled peripherals are simply stored. */
+	int n_misc;
+	struct { uint32_t addr, val; } misc[SIM_MISC_REGS];
+};
+
+/* Check that ADDR..ADDR+SIZE is within a region, without overflow. */
+#define sim_in(addr, size, base, len) \
+	((addr) >= (base) && (addr) - (base) <= (len) - (size))
+
+/* Return the backing store for a memory range, or NULL if not memory. */
+static uint8_t *sim_mem(struct stm_sim *sim, uint32_t addr, int size)
 {
-	char buf[size+8];
-	const int fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 0664);
-	size_t wsize, offset;
+	if (sim_in(addr, size, sim->flash_base, sim->flash_size))
+		return sim->flash + (addr - sim->flash_base);
+	if (sim_in(addr, size, 0, sim->flash_size))	/* Boot alias at 0 */
+		return sim->flash + addr;
+	if (sim_in(addr, size, sim->sram_base, sim->sram_size))
+		return sim->sram + (addr - sim->sram_base);
+	if (sim_in(addr, size, SIM_SYSMEM_BASE, SIM_SYSMEM_SIZE))
+		return sim->sysmem + (addr - SIM_SYSMEM_BASE);
+	return NULL;
+}
 
-	if (fd < 0) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
-		return -1;
+static uint32_t sim_get(const uint8_t *p, int size)
+{
+	uint32_t val = p[0];
+	if (size > 1)
+		val |= p[1] << 8;
+	if (size > 2)
+		val |= p[2] << 16 | (uint32_t)p[3] << 24;
+	return val;
+}
+
+static void sim_put(uint8_t *p, int size, uint32_t val)
+{
+	p[0] = val;
+	if (size > 1)
+		p[1] = val >> 8;
+	if (size > 2) {
+		p[2] = val >> 16;
+		p[3] = val >> 24;
 	}
+}
 
-	stl_read(sl, addr, buf, size);
+#define sim_fpec_bsy(sim) ((sim)->f4_fpec ? F4_FLASH_SR_BSY : FLASH_SR_BSY)
+#define sim_fpec_lock(sim) ((sim)->f4_fpec ? F4_FLASH_CR_LOCK : FLASH_CR_LOCK)
 
-	/* Should loop until error. */
-	offset = 0;
-	wsize = size;
-	while (wsize > 0) {
-		int res = write(fd, buf+offset, wsize);
-		if (res < 0) break;
-		offset += res;
-		wsize -= res;
-	}
-	if (wsize != 0) {
-		fprintf(stderr, " Failed to write '%s': %s\n", path, strerror(errno));
-		close(fd);
-		return -1;
+/* Complete a flash operation if its time has passed.
+ * The F4 sets EOP only with its interrupt enabled, so never here. */
+static void sim_fpec_update(struct stm_sim *sim, struct sim_fpec *f)
+{
+	if ((f->sr & sim_fpec_bsy(sim)) && sim->now_ns >= f->busy_until) {
+		f->sr &= ~sim_fpec_bsy(sim);
+		if ( ! sim->f4_fpec)
+			f->sr |= FLASH_SR_EOP;
 	}
-	close(fd);
-	return 0;
 }
 
+static void sim_fpec_start(struct stm_sim *sim, struct sim_fpec *f,
+						   uint64_t duration)
+{
+	f->sr = (f->sr & ~FLASH_SR_EOP) | sim_fpec_bsy(sim);
+	f->busy_until = sim->now_ns + duration;
+}
 
-#if 0
-/* Verify that ARM memory starting at ADDR matches the next chunk from FD.
- * Return the number of bytes successfully compared, zero if finished,
- * or -1 if a mismatch occured.
- */
+/* The F1 XL bank 2 starts 512K into the flash. */
+#define SIM_XL_BANK_SIZE	(512*1024)
 
-int stlink_verify_chunk(struct stlink* sl, int fd, stm32_addr_t addr)
+/* The flash bank, 0 or 1, holding flash offset OFF. */
+static int sim_fpec_bank(struct stm_sim *sim, uint32_t off)
 {
-	char filebuf[128*1024], flashbuf[128*1024];
-	ssize_t file_rdsize, flash_rdsize;
-
-	file_rdsize = read(fd, filebuf, sizeof filebuf);
-	if (size < 0) {
-		fprintf(stderr, " Failed to read file '%s' during verify: %s\n",
-				path, strerror(errno));
-		return -1;
-		}
-		if (size == 0)
-			return 0;
+	return ! sim->f4_fpec && off >= SIM_XL_BANK_SIZE;
+}
 
-		flash_rdsize = stl_read(sl, addr, flashbuf, file_rdsize);
-		/* Unlikely, but check anyway. */
-		if (flash_rdsize != file_rdsize) {
-			fprintf(stderr, " Mismatched read size during verify, %d vs %d.\n",
-					flash_rdsize, file_rdsize);
-			return -1;
-		}
+/* Map the flash controller registers of the simulated family to the F1
+ * addresses, which are at the same offsets, and set *BANK to the bank
+ * they control.  The other family's registers are not there, and map
+ * to 0.  Only the XL parts have the bank 2 registers. */
+static uint32_t sim_fpec_reg(struct stm_sim *sim, uint32_t addr, int *bank)
+{
+	uint32_t base = sim->f4_fpec ? F4_FLASH_REGS : FLASH_REGS_ADDR;
 
-		/* Extremely uninformative about the failure. */
-		if (memcmp(filebuf, flashbuf, file_rdsize) != 0) {
-			fprintf(stderr, " Failed flash verify.\n");
-			return -1;
-		}
-		addr += file_rdsize;
+	*bank = 0;
+	if (addr - base < 0x18)
+		return FLASH_REGS_ADDR + (addr - base);
+	if (addr - FLASH_REGS_ADDR < 0x18)
+		return 0;
+	if (sim_fpec_bank(sim, sim->flash_size - 1) &&
+		addr - (FLASH_REGS_ADDR + 0x40) < 0x18) {
+		*bank = 1;
+		return FLASH_REGS_ADDR + (addr - (FLASH_REGS_ADDR + 0x40));
 	}
-#endif
+	return addr;
+}
 
-/* Verify that ARM memory starting at ADDR matches the contents of file PATH. */
-int stlink_fverify(struct stlink* sl, const char* path,
-						stm32_addr_t addr)
+/* An F4 program of SIZE bytes, which must match the PSIZE parallelism.
+ * Bits may be programmed from 1 to 0 at any time. */
+static int sim_f4_flash_program(struct stm_sim *sim, uint32_t addr,
+								int size, uint32_t val)
 {
-	char filebuf[128*1024], flashbuf[128*1024];
-	ssize_t file_rdsize, flash_rdsize;
-	const int fd = open(path, O_RDONLY);
+	uint8_t *p = sim->flash + (addr - sim->flash_base);
+	struct sim_fpec *f = &sim->fpec[0];
+	int psize = (f->cr >> F4_FLASH_CR_PSIZE_SHIFT) & 3;
 
-	if (fd < 0) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+	if ( ! (f->cr & FLASH_CR_PG) || (f->cr & F4_FLASH_CR_LOCK))
 		return -1;
+	if (size != 1 << psize && ! (psize == 3 && size == 4)) {
+		f->sr |= 0x40;						/* PGPERR */
+		return 0;
 	}
-
-	while ((file_rdsize = read(fd, filebuf, sizeof filebuf)) > 0) {
-		flash_rdsize = stl_read(sl, addr, flashbuf, file_rdsize);
-		/* Unlikely, but check anyway. */
-		if (flash_rdsize != 0 && flash_rdsize != file_rdsize) {
-			fprintf(stderr, " Mismatched read size during verify, %d vs %d.\n",
-					flash_rdsize, file_rdsize);
-			goto fail;
-		}
-
-		/* Extremely uninformative about the failure. */
-		if (memcmp(filebuf, flashbuf, file_rdsize) != 0) {
-			fprintf(stderr, " Failed flash verify.\n");
-			goto fail;
-		}
-		addr += file_rdsize;
-	}
-	if (file_rdsize < 0) {
-		fprintf(stderr, " Failed to read file '%s' during verify: %s\n",
-				path, strerror(errno));
-		goto fail;
+	if (addr & (size - 1)) {
+		f->sr |= 0x20;						/* PGAERR */
+		return 0;
 	}
-	close(fd);
+	if ((f->sr & F4_FLASH_SR_BSY) && sim->now_ns < f->busy_until)
+		sim->now_ns = f->busy_until;
+	sim_fpec_update(sim, f);
+	sim_put(p, size, sim_get(p, size) & val);
+	/* x64 programs the double word when its second word arrives. */
+	if (psize < 3 || (addr & 4))
+		sim_fpec_start(sim, f, SIM_F4_PROG_NS);
 	return 0;
- fail:
-	close(fd);
-	return -1;
 }
 
-#if 0
-#define STLINK_XFER_BLKSZ 2048
-static int stl_fread(struct stlink* sl, const char* path,
-						stm32_addr_t addr, size_t size)
+static void sim_f4_fpec_write_cr(struct stm_sim *sim, struct sim_fpec *f,
+								 uint32_t val)
 {
-	size_t off;
+	uint32_t start, size;
+	int i;
 
-	const int fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 00664);
-	if (fd == -1) {
-		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+	if ((f->cr & F4_FLASH_CR_LOCK) || (f->sr & F4_FLASH_SR_BSY))
+		return;
+	f->cr = val & ~F4_FLASH_CR_STRT;
+	if ( ! (val & F4_FLASH_CR_STRT))
+		return;
+	if (val & (FLASH_CR_MER | F4_FLASH_CR_MER1)) {
+		for (i = 0; i < 2; i++)
+			if ((val & (i ? F4_FLASH_CR_MER1 : FLASH_CR_MER)) &&
+				i * F4_BANK_SIZE < sim->flash_size)
+				memset(sim->flash + i * F4_BANK_SIZE, 0xff,
+					   sim->flash_size - i * F4_BANK_SIZE < F4_BANK_SIZE ?
+					   sim->flash_size - i * F4_BANK_SIZE : F4_BANK_SIZE);
+		sim_fpec_start(sim, f, SIM_F4_MASS_ERASE_NS);
+	} else if (val & F4_FLASH_CR_SER) {
+		int snb = (val >> F4_FLASH_CR_SNB_SHIFT) & 0x1f;
+		uint32_t off = (snb & 0x10 ? F4_BANK_SIZE : 0);
+		/* Walk the bank to the sector numbered. */
+		for (i = 0; i < (snb & 0x0f) && i < sizeof f4_sector_kb; i++)
+			off += f4_sector_kb[i] * 1024;
+		if ((snb & 0x0f) >= sizeof f4_sector_kb || off >= sim->flash_size) {
+			f->sr |= 0x80;					/* PGSERR */
+			return;
+		}
+		stl_f4_sector(off, &start, &size);
+		memset(sim->flash + start, 0xff, size);
+		sim_fpec_start(sim, f, (size / 1024) * (uint64_t)SIM_F4_ERASE_KB_NS);
+	}
+}
+
+static int sim_flash_program(struct stm_sim *sim, uint32_t addr, int size,
+							 uint32_t val)
+{
+	uint32_t off = addr - sim->flash_base;
+	uint8_t *p = sim->flash + off;
+	struct sim_fpec *f = &sim->fpec[sim_fpec_bank(sim, off)];
+
+	if (sim->f4_fpec)
+		return sim_f4_flash_program(sim, addr, size, val);
+	if ( ! (f->cr & FLASH_CR_PG) || (f->cr & FLASH_CR_LOCK))
+		return -1;				/* A bus fault on real hardware. */
+	/* PM0075: any write that is not a halfword is a bus error. */
+	if (size != 2 || (addr & 1)) {
+		f->sr |= FLASH_SR_PGERR;
 		return -1;
 	}
+	/* A write while busy stalls the bus until the previous one is done. */
+	if ((f->sr & FLASH_SR_BSY) && sim->now_ns < f->busy_until)
+		sim->now_ns = f->busy_until;
+	sim_fpec_update(sim, f);
+	if (sim_get(p, 2) != 0xFFFF && (val & 0xFFFF) != 0) {
+		f->sr |= FLASH_SR_PGERR;
+		return 0;
+	}
+	sim_put(p, 2, val);
+	sim_fpec_start(sim, f, SIM_PROG_NS);
+	return 0;
+}
 
-	/* Copy using 1K/2K/4K blocks. */
-	for (off = 0; off < size; off += STLINK_XFER_BLKSZ) {
-		size_t read_size = STLINK_XFER_BLKSZ;
-		if ((off + read_size) > size)
-			read_size = off + read_size;
+static void sim_fpec_write_cr(struct stm_sim *sim, struct sim_fpec *f,
+							  uint32_t val)
+{
+	uint32_t old_cr = f->cr;
+	/* The flash offsets controlled by this bank. */
+	uint32_t bank_start = f == &sim->fpec[1] ? SIM_XL_BANK_SIZE : 0;
+	uint32_t bank_end = sim_fpec_bank(sim, sim->flash_size - 1) &&
+		f == &sim->fpec[0] ? SIM_XL_BANK_SIZE : sim->flash_size;
+
+	if (sim->f4_fpec) {
+		sim_f4_fpec_write_cr(sim, f, val);
+		return;
+	}
+	if ((old_cr & FLASH_CR_LOCK) || (f->sr & FLASH_SR_BSY))
+		return;
+	f->cr = val & (FLASH_CR_PG | FLASH_CR_PER | FLASH_CR_MER |
+				   FLASH_CR_OPTPG | FLASH_CR_OPTER | FLASH_CR_LOCK);
+	if ( ! (val & FLASH_CR_STRT))
+		return;
+	/* The erase type must already be selected when STRT is written. */
+	if ((old_cr & FLASH_CR_MER) && (val & FLASH_CR_MER)) {
+		memset(sim->flash + bank_start, 0xff, bank_end - bank_start);
+		sim_fpec_start(sim, f, SIM_MASS_ERASE_NS);
+	} else if ((old_cr & FLASH_CR_PER) && (val & FLASH_CR_PER)) {
+		uint32_t pgsize = sim->chip->flash_pgsize;
+		uint32_t offset = (f->ar - sim->flash_base) & ~(pgsize - 1);
+		if (offset >= bank_start && offset < bank_end)
+			memset(sim->flash + offset, 0xff, pgsize);
+		sim_fpec_start(sim, f, SIM_PAGE_ERASE_NS);
+	}
+}
+
+static uint32_t *sim_misc_reg(struct stm_sim *sim, uint32_t addr, int create)
+{
+	int i;
+
+	for (i = 0; i < sim->n_misc; i++)
+		if (sim->misc[i].addr == addr)
+			return &sim->misc[i].val;
+	if ( ! create || sim->n_misc >= SIM_MISC_REGS)
+		return NULL;
+	sim->misc[sim->n_misc].addr = addr;
+	sim->misc[sim->n_misc].val = 0;
+	return &sim->misc[sim->n_misc++].val;
+}
+
+/* Read SIZE bytes at ADDR through the simulated bus.
+ * Returns 0, or -1 on a bus fault. */
+static int sim_read(struct stm_sim *sim, uint32_t addr, int size, uint32_t *val)
+{
+	uint8_t *p = sim_mem(sim, addr, size);
+	uint32_t word, *reg, fpec_reg;
+	struct sim_fpec *f;
+	int bank;
+
+	if (p) {
+		*val = sim_get(p, size);
+		return 0;
+	}
+	fpec_reg = sim_fpec_reg(sim, addr & ~3, &bank);
+	f = &sim->fpec[bank];
+	switch (fpec_reg) {
+	case FLASH_SR:
+		/* A core polling a busy flash would just spin.  Skip ahead. */
+		if (sim->in_core && (f->sr & sim_fpec_bsy(sim)) &&
+			sim->now_ns < f->busy_until)
+			sim->now_ns = f->busy_until < sim->run_until ?
+				f->busy_until : sim->run_until;
+		sim_fpec_update(sim, f);
+		word = f->sr;
+		break;
+	case FLASH_CR:	word = f->cr; break;
+	case FLASH_AR:	word = f->ar; break;
+	case CRC_DR:	word = sim->crc_dr; break;
+	case FLASH_OBR:	word = 0x03fffffc; break;
+	case FLASH_WRPR: word = 0xffffffff; break;
+	case DBGMCU_IDCODE: word = sim->chip->dbgmcu_idcode; break;
+	case DHCSR:
+		word = sim->dhcsr | DHCSR_S_REGRDY | (sim->halted ? DHCSR_S_HALT : 0);
+		break;
+	case 0x1FF8004C:				/* L1 flash size, outside system memory */
+		word = (sim->chip->cap_flags & ChipCapL1Addrs) ?
+			sim->flash_size / 1024 : 0;
+		break;
+	case 0xE000ED00:				/* CPUID base register */
+		word = sim->chip->core_id == 0x0bb11477 ? 0x410CC200 :
+			(sim->chip->cap_flags & ChipCapF4Flash) ? 0x410FC241 : 0x411FC231;
+		break;
+	default:
+		reg = sim_misc_reg(sim, addr & ~3, 0);
+		word = reg ? *reg : 0;
+		break;
+	}
+	word >>= (addr & 3) * 8;
+	*val = size == 4 ? word : word & ((1 << (size * 8)) - 1);
+	return 0;
+}
+
+/* Let the core run from its PC. */
+static void sim_resume(struct stm_sim *sim)
+{
+	sim->halted = 0;
+	/* Only code downloaded into SRAM is interpreted. */
+	sim->free_run = ! (sim->r[15] >= sim->sram_base &&
+					   sim->r[15] < sim->sram_base + sim->sram_size);
+}
+
+static int sim_write(struct stm_sim *sim, uint32_t addr, int size, uint32_t val)
+{
+	uint8_t *p;
+	uint32_t *reg, fpec_reg;
+	struct sim_fpec *f;
+	int bank;
+
+	if (addr >= sim->flash_base && addr < sim->flash_base + sim->flash_size)
+		return sim_flash_program(sim, addr, size, val);
+	p = sim_mem(sim, addr, size);
+	if (p) {
+		if (addr >= sim->sram_base)			/* System memory is ROM. */
+			sim_put(p, size, val);
+		return 0;
+	}
+	fpec_reg = sim_fpec_reg(sim, addr & ~3, &bank);
+	f = &sim->fpec[bank];
+	switch (fpec_reg) {
+	case FLASH_KEYR:
+		if (val == FLASH_KEY1)
+			f->key = 1;
+		else if (val == FLASH_KEY2 && f->key == 1)
+			f->cr &= ~sim_fpec_lock(sim);
+		else
+			f->key = 0;
+		break;
+	case FLASH_SR:
+		sim_fpec_update(sim, f);
+		f->sr &= ~(val & (sim->f4_fpec ?
+						  F4_FLASH_SR_EOP | F4_FLASH_SR_ERRS :
+						  FLASH_SR_EOP | FLASH_SR_WRPRTERR |
+						  FLASH_SR_PGERR));
+		break;
+	case FLASH_CR:
+		sim_fpec_update(sim, f);
+		sim_fpec_write_cr(sim, f, val);
+		break;
+	case FLASH_AR:
+		f->ar = val;
+		break;
+	case CRC_DR: {
+		unsigned char le_val[4];
+		write_uint32(le_val, val);
+		sim->crc_dr = stm32_crc32(sim->crc_dr, le_val, 4);
+		break;
+	}
+	case CRC_CR:
+		if (val & CRC_CR_RESET)
+			sim->crc_dr = 0xffffffff;
+		break;
+	case DHCSR:
+		if ((val & 0xffff0000) != DHCSR_KEY)
+			break;
+		sim->dhcsr = val & (DHCSR_C_DEBUGEN | DHCSR_C_HALT | DHCSR_C_STEP |
+							DHCSR_C_MASKINTS);
+		if (val & DHCSR_C_HALT) {
+			sim->halted = 1;
+			sim->free_run = 0;
+		} else if (sim->halted)
+			sim_resume(sim);
+		break;
+	default:
+		reg = sim_misc_reg(sim, addr & ~3, 1);
+		if (reg && size == 4)
+			*reg = val;
+		else if (reg) {
+			int shift = (addr & 3) * 8;
+			uint32_t mask = ((1 << (size * 8)) - 1) << shift;
+			*reg = (*reg & ~mask) | ((val << shift) & mask);
+		}
+		break;
+	}
+	return 0;
+}
+
+/* The Thumb-2 interpreter.
+ * This covers the instructions a compiler or a person uses for small
+ * position-independent stubs: data processing, loads and stores of all
+ * sizes and addressing modes, LDM/STM/PUSH/POP, branches, BL and the
+ * multiply and divide instructions.  IT blocks, exceptions and the system
+ * instructions are not supported.
+ */
+static void sim_nz(struct stm_sim *sim, uint32_t res)
+{
+	sim->r[SIM_XPSR] = (sim->r[SIM_XPSR] & ~(SIM_N | SIM_Z)) |
+		(res & SIM_N) | (res ? 0 : SIM_Z);
+}
+
+static void sim_carry(struct stm_sim *sim, int carry)
+{
+	sim->r[SIM_XPSR] = (sim->r[SIM_XPSR] & ~SIM_C) | (carry ? SIM_C : 0);
+}
+
+static uint32_t sim_addc(struct stm_sim *sim, uint32_t a, uint32_t b,
+						 int carry_in, int setflags)
+{
+	uint64_t usum = (uint64_t)a + b + carry_in;
+	int64_t ssum = (int64_t)(int32_t)a + (int32_t)b + carry_in;
+	uint32_t res = usum;
+
+	if (setflags) {
+		sim_nz(sim, res);
+		sim_carry(sim, usum >> 32);
+		sim->r[SIM_XPSR] &= ~SIM_V;
+		if (ssum != (int32_t)res)
+			sim->r[SIM_XPSR] |= SIM_V;
+	}
+	return res;
+}
+
+static int sim_cond(struct stm_sim *sim, int cond)
+{
+	uint32_t psr = sim->r[SIM_XPSR];
+	int n = !!(psr & SIM_N), z = !!(psr & SIM_Z);
+	int c = !!(psr & SIM_C), v = !!(psr & SIM_V);
+	int res;
+
+	switch (cond >> 1) {
+	case 0: res = z; break;
+	case 1: res = c; break;
+	case 2: res = n; break;
+	case 3: res = v; break;
+	case 4: res = c && ! z; break;
+	case 5: res = n == v; break;
+	case 6: res = ! z && n == v; break;
+	default: return 1;
+	}
+	return (cond & 1) ? ! res : res;
+}
+
+/* Shift VAL by AMOUNT, type 0..3 is LSL, LSR, ASR, ROR.
+ * *CARRY is updated with the shifter carry out. */
+static uint32_t sim_shift(uint32_t val, int type, int amount, int *carry)
+{
+	if (amount == 0)
+		return val;
+	switch (type) {
+	case 0:
+		if (amount < 32) {
+			*carry = (val >> (32 - amount)) & 1;
+			return val << amount;
+		}
+		*carry = amount == 32 ? val & 1 : 0;
+		return 0;
+	case 1:
+		if (amount < 32) {
+			*carry = (val >> (amount - 1)) & 1;
+			return val >> amount;
+		}
+		*carry = amount == 32 ? val >> 31 : 0;
+		return 0;
+	case 2:
+		if (amount < 32) {
+			*carry = ((int32_t)val >> (amount - 1)) & 1;
+			return (int32_t)val >> amount;
+		}
+		*carry = val >> 31;
+		return (int32_t)val >> 31;
+	default:
+		amount &= 31;
+		if (amount)
+			val = (val >> amount) | (val << (32 - amount));
+		*carry = val >> 31;
+		return val;
+	}
+}
+
+/* The register value as an operand: reading the PC gives PC+4. */
+static uint32_t sim_reg(struct stm_sim *sim, int n, uint32_t pc)
+{
+	return n == 15 ? pc + 4 : sim->r[n];
+}
+
+static int sim_load(struct stm_sim *sim, uint32_t addr, int size, int sign,
+					uint32_t *val)
+{
+	if (sim_read(sim, addr, size, val) < 0)
+		return -1;
+	if (sign && size == 1)
+		*val = (int8_t)*val;
+	else if (sign && size == 2)
+		*val = (int16_t)*val;
+	return 0;
+}
+
+/* Write a register from a load or data operation, handling PC writes. */
+static void sim_set_reg(struct stm_sim *sim, int n, uint32_t val)
+{
+	sim->r[n] = n == 15 ? val & ~1 : val;
+}
+
+/* A Thumb-2 data processing operation, shared by the modified immediate
+ * and shifted register encodings. */
+static int sim_dp32(struct stm_sim *sim, int op, int setflags, int rn, int rd,
+					uint32_t operand, int carry)
+{
+	uint32_t a = sim->r[rn], res;
+	int c_in = !!(sim->r[SIM_XPSR] & SIM_C);
+	int write = 1, logical = 1;
+
+	switch (op) {
+	case 0: res = a & operand; write = rd != 15; break;		/* AND, TST */
+	case 1: res = a & ~operand; break;						/* BIC */
+	case 2: res = (rn == 15 ? 0 : a) | operand; break;		/* ORR, MOV */
+	case 3: res = (rn == 15 ? 0 : a) | ~operand; break;		/* ORN, MVN */
+	case 4: res = a ^ operand; write = rd != 15; break;		/* EOR, TEQ */
+	case 8:													/* ADD, CMN */
+		res = sim_addc(sim, a, operand, 0, setflags);
+		logical = 0; write = rd != 15;
+		break;
+	case 10: res = sim_addc(sim, a, operand, c_in, setflags); logical = 0; break;
+	case 11: res = sim_addc(sim, a, ~operand, c_in, setflags); logical = 0; break;
+	case 13:												/* SUB, CMP */
+		res = sim_addc(sim, a, ~operand, 1, setflags);
+		logical = 0; write = rd != 15;
+		break;
+	case 14: res = sim_addc(sim, operand, ~a, 1, setflags); logical = 0; break;
+	default:
+		return -1;
+	}
+	if (setflags && logical) {
+		sim_nz(sim, res);
+		sim_carry(sim, carry);
+	}
+	if (write)
+		sim->r[rd] = res;
+	return 0;
+}
+
+/* Execute a 32 bit Thumb-2 instruction HW1:HW2 at PC.
+ * The PC has already been advanced past the instruction. */
+static int sim_step32(struct stm_sim *sim, uint32_t hw1, uint32_t hw2,
+					  uint32_t pc)
+{
+	uint32_t *r = sim->r;
+	int rn = hw1 & 15, rd = (hw2 >> 8) & 15, rt = hw2 >> 12;
+	int carry = !!(sim->r[SIM_XPSR] & SIM_C);
+	uint32_t val, addr;
+	int i;
+
+	if ((hw1 & 0xF800) == 0xF000 && (hw2 & 0x8000)) {
+		/* Branches: B.W, B<cond>.W and BL */
+		int s = (hw1 >> 10) & 1, j1 = (hw2 >> 13) & 1, j2 = (hw2 >> 11) & 1;
+		int32_t offset;
+		if ((hw2 & 0x5000) == 0x0000) {				/* B<cond>.W */
+			int cond = (hw1 >> 6) & 15;
+			offset = (s ? 0xFFF00000 : 0) | j2 << 19 | j1 << 18 |
+				(hw1 & 0x3f) << 12 | (hw2 & 0x7ff) << 1;
+			if (cond >= 14)
+				return -1;
+			if (sim_cond(sim, cond))
+				r[15] = pc + 4 + offset;
+			return 0;
+		}
+		offset = (s ? 0xFF000000 : 0) | (!(j1 ^ s)) << 23 | (!(j2 ^ s)) << 22 |
+			(hw1 & 0x3ff) << 12 | (hw2 & 0x7ff) << 1;
+		if ((hw2 & 0x5000) == 0x5000)				/* BL */
+			r[14] = (pc + 4) | 1;
+		else if ((hw2 & 0x5000) != 0x1000)
+			return -1;
+		r[15] = pc + 4 + offset;
+		return 0;
+	}
+	if ((hw1 & 0xFA00) == 0xF000) {
+		/* Data processing, modified immediate. */
+		uint32_t imm12 = (hw1 & 0x400) << 1 | (hw2 & 0x7000) >> 4 | (hw2 & 0xff);
+		uint32_t imm8 = imm12 & 0xff;
+		if ((imm12 >> 10) == 0) {
+			switch ((imm12 >> 8) & 3) {
+			case 0: val = imm8; break;
+			case 1: val = imm8 << 16 | imm8; break;
+			case 2: val = imm8 << 24 | imm8 << 8; break;
+			default: val = imm8 * 0x01010101; break;
+			}
+		} else {
+			val = sim_shift(0x80 | (imm12 & 0x7f), 3, imm12 >> 7, &carry);
+		}
+		return sim_dp32(sim, (hw1 >> 5) & 15, (hw1 >> 4) & 1, rn, rd, val,
+						carry);
+	}
+	if ((hw1 & 0xFA00) == 0xF200) {
+		/* Data processing, plain binary immediate. */
+		uint32_t imm12 = (hw1 & 0x400) << 1 | (hw2 & 0x7000) >> 4 | (hw2 & 0xff);
+		uint32_t imm16 = (hw1 & 15) << 12 | imm12;
+		switch ((hw1 >> 4) & 0x1f) {
+		case 0x00: r[rd] = (rn == 15 ? (pc + 4) & ~3 : r[rn]) + imm12; break;
+		case 0x0A: r[rd] = (rn == 15 ? (pc + 4) & ~3 : r[rn]) - imm12; break;
+		case 0x04: r[rd] = imm16; break;				/* MOVW */
+		case 0x0C: r[rd] = (r[rd] & 0xffff) | imm16 << 16; break;	/* MOVT */
+		default: return -1;
+		}
+		return 0;
+	}
+	if ((hw1 & 0xFE00) == 0xEA00) {
+		/* Data processing, shifted register. */
+		int imm5 = (hw2 >> 10) & 0x1c, type = (hw2 >> 4) & 3;
+		imm5 |= (hw2 >> 6) & 3;
+		if (imm5 == 0 && type == 3) {				/* RRX */
+			int c_in = carry;
+			carry = r[hw2 & 15] & 1;
+			val = (r[hw2 & 15] >> 1) | (c_in << 31);
+		} else
+			val = sim_shift(r[hw2 & 15], type,
+							(imm5 == 0 && type) ? 32 : imm5, &carry);
+		return sim_dp32(sim, (hw1 >> 5) & 15, (hw1 >> 4) & 1, rn, rd, val,
+						carry);
+	}
+	if ((hw1 & 0xFF80) == 0xFA00 && (hw2 & 0xF0F0) == 0xF000) {
+		/* LSL, LSR, ASR, ROR by register. */
+		val = sim_shift(r[rn], (hw1 >> 5) & 3, r[hw2 & 15] & 0xff, &carry);
+		r[rd] = val;
+		if (hw1 & 0x10) {
+			sim_nz(sim, val);
+			sim_carry(sim, carry);
+		}
+		return 0;
+	}
+	if ((hw1 & 0xFFF0) == 0xFB00 && (hw2 & 0xE0) == 0) {
+		/* MUL, MLA, MLS */
+		val = r[rn] * r[hw2 & 15];
+		if (hw2 & 0x10)
+			r[rd] = r[rt] - val;
+		else
+			r[rd] = rt == 15 ? val : r[rt] + val;
+		return 0;
+	}
+	if ((hw1 & 0xFFD0) == 0xFB90 && (hw2 & 0xF0F0) == 0xF0F0) {
+		/* SDIV, UDIV.  Division by zero gives zero. */
+		uint32_t divisor = r[hw2 & 15];
+		if (divisor == 0)
+			r[rd] = 0;
+		else if (hw1 & 0x20)
+			r[rd] = r[rn] / divisor;
+		else
+			r[rd] = (int32_t)r[rn] / (int32_t)divisor;
+		return 0;
+	}
+	if ((hw1 & 0xFE00) == 0xF800) {
+		/* Load and store single, all sizes and addressing modes. */
+		int size = 1 << ((hw1 >> 5) & 3), sign = hw1 & 0x100;
+		int load = hw1 & 0x10, writeback = 0;
+		uint32_t wb_addr = 0;
+		if (size > 4)
+			return -1;
+		if (rn == 15) {
+			if ( ! load)
+				return -1;
+			addr = (pc + 4) & ~3;
+			addr = (hw1 & 0x80) ? addr + (hw2 & 0xfff) : addr - (hw2 & 0xfff);
+		} else if (hw1 & 0x80) {
+			addr = r[rn] + (hw2 & 0xfff);
+		} else if (hw2 & 0x800) {
+			uint32_t imm8 = hw2 & 0xff;
+			wb_addr = (hw2 & 0x200) ? r[rn] + imm8 : r[rn] - imm8;
+			addr = (hw2 & 0x400) ? wb_addr : r[rn];
+			writeback = hw2 & 0x100;
+		} else if ((hw2 & 0xFC0) == 0) {
+			addr = r[rn] + (r[hw2 & 15] << ((hw2 >> 4) & 3));
+		} else
+			return -1;
+		if (load) {
+			if (sim_load(sim, addr, size, sign, &val) < 0)
+				return -2;
+		} else if (sim_write(sim, addr, size, r[rt]) < 0)
+			return -2;
+		if (writeback)
+			r[rn] = wb_addr;
+		if (load)
+			sim_set_reg(sim, rt, val);
+		return 0;
+	}
+	if ((hw1 & 0xFE40) == 0xE840 && (hw1 & 0x120)) {
+		/* LDRD, STRD */
+		uint32_t imm8 = (hw2 & 0xff) << 2;
+		uint32_t off_addr = (hw1 & 0x80) ? r[rn] + imm8 : r[rn] - imm8;
+		addr = (hw1 & 0x100) ? off_addr : r[rn];
+		if (hw1 & 0x10) {
+			uint32_t v1, v2;
+			if (sim_load(sim, addr, 4, 0, &v1) < 0 ||
+				sim_load(sim, addr + 4, 4, 0, &v2) < 0)
+				return -2;
+			r[rt] = v1;
+			r[rd] = v2;
+		} else if (sim_write(sim, addr, 4, r[rt]) < 0 ||
+				   sim_write(sim, addr + 4, 4, r[rd]) < 0)
+			return -2;
+		if (hw1 & 0x20)
+			r[rn] = off_addr;
+		return 0;
+	}
+	if ((hw1 & 0xFE40) == 0xE800 && ((hw1 >> 7) & 3) != 0 &&
+		((hw1 >> 7) & 3) != 3) {
+		/* LDM/STM IA and DB, including PUSH.W and POP.W */
+		int count = 0, decrement = ((hw1 >> 7) & 3) == 2;
+		for (i = 0; i < 16; i++)
+			count += (hw2 >> i) & 1;
+		addr = decrement ? r[rn] - 4 * count : r[rn];
+		val = decrement ? addr : r[rn] + 4 * count;
+		for (i = 0; i < 16; i++) {
+			if ( ! (hw2 & (1 << i)))
+				continue;
+			if (hw1 & 0x10) {
+				uint32_t word;
+				if (sim_load(sim, addr, 4, 0, &word) < 0)
+					return -2;
+				sim_set_reg(sim, i, word);
+			} else if (sim_write(sim, addr, 4, r[i]) < 0)
+				return -2;
+			addr += 4;
+		}
+		if ((hw1 & 0x20) && ! ((hw1 & 0x10) && (hw2 & (1 << rn))))
+			r[rn] = val;
+		return 0;
+	}
+	return -1;
+}
+
+/* Execute one instruction.
+ * Returns 0 to continue, 1 on a breakpoint, -1 for an instruction we
+ * cannot interpret and -2 for a bus fault. */
+static int sim_step(struct stm_sim *sim)
+{
+	uint32_t *r = sim->r;
+	uint32_t pc = r[15] & ~1, insn, hw2, val, addr;
+	int rd = 0, rm, rn, carry = !!(sim->r[SIM_XPSR] & SIM_C);
+	int i, count;
+
+	if (sim_read(sim, pc, 2, &insn) < 0)
+		return -2;
+	sim->now_ns += SIM_CYCLE_NS;
+	if ((insn & 0xF800) >= 0xE800) {
+		if (sim_read(sim, pc + 2, 2, &hw2) < 0)
+			return -2;
+		r[15] = pc + 4;
+		return sim_step32(sim, insn, hw2, pc);
+	}
+	r[15] = pc + 2;
+	rd = insn & 7;
+	rm = (insn >> 3) & 7;
+
+	switch (insn >> 12) {
+	case 0x0: case 0x1:
+		if ((insn & 0x1800) == 0x1800) {			/* ADDS/SUBS reg, imm3 */
+			val = (insn & 0x400) ? (insn >> 6) & 7 : r[(insn >> 6) & 7];
+			r[rd] = (insn & 0x200) ? sim_addc(sim, r[rm], ~val, 1, 1)
+				: sim_addc(sim, r[rm], val, 0, 1);
+		} else {									/* LSLS/LSRS/ASRS imm */
+			int type = (insn >> 11) & 3, imm5 = (insn >> 6) & 31;
+			val = sim_shift(r[rm], type, (imm5 == 0 && type) ? 32 : imm5,
+							&carry);
+			r[rd] = val;
+			sim_nz(sim, val);
+			sim_carry(sim, carry);
+		}
+		return 0;
+	case 0x2: case 0x3:								/* MOVS/CMP/ADDS/SUBS */
+		rd = (insn >> 8) & 7;
+		val = insn & 0xff;
+		switch ((insn >> 11) & 3) {
+		case 0: r[rd] = val; sim_nz(sim, val); break;
+		case 1: sim_addc(sim, r[rd], ~val, 1, 1); break;
+		case 2: r[rd] = sim_addc(sim, r[rd], val, 0, 1); break;
+		case 3: r[rd] = sim_addc(sim, r[rd], ~val, 1, 1); break;
+		}
+		return 0;
+	case 0x4:
+		if ((insn & 0xFC00) == 0x4000) {			/* Data processing */
+			uint32_t a = r[rd], b = r[rm];
+			int op = (insn >> 6) & 15;
+			switch (op) {
+			case 0x0: val = a & b; break;			/* AND */
+			case 0x1: val = a ^ b; break;			/* EOR */
+			case 0x2: val = sim_shift(a, 0, b & 0xff, &carry); break;
+			case 0x3: val = sim_shift(a, 1, b & 0xff, &carry); break;
+			case 0x4: val = sim_shift(a, 2, b & 0xff, &carry); break;
+			case 0x5: r[rd] = sim_addc(sim, a, b, carry, 1); return 0;
+			case 0x6: r[rd] = sim_addc(sim, a, ~b, carry, 1); return 0;
+			case 0x7: val = sim_shift(a, 3, b & 0xff, &carry); break;
+			case 0x8: sim_nz(sim, a & b); return 0;	/* TST */
+			case 0x9: r[rd] = sim_addc(sim, ~b, 0, 1, 1); return 0; /* RSB #0 */
+			case 0xA: sim_addc(sim, a, ~b, 1, 1); return 0;		/* CMP */
+			case 0xB: sim_addc(sim, a, b, 0, 1); return 0;		/* CMN */
+			case 0xC: val = a | b; break;			/* ORR */
+			case 0xD: val = a * b; break;			/* MUL */
+			case 0xE: val = a & ~b; break;			/* BIC */
+			default:  val = ~b; break;				/* MVN */
+			}
+			r[rd] = val;
+			sim_nz(sim, val);
+			sim_carry(sim, carry);
+			return 0;
+		}
+		if ((insn & 0xFC00) == 0x4400) {			/* Hi register ops, BX */
+			rd = (insn & 7) | ((insn >> 4) & 8);
+			rm = (insn >> 3) & 15;
+			switch ((insn >> 8) & 3) {
+			case 0: sim_set_reg(sim, rd, sim_reg(sim, rd, pc) + sim_reg(sim, rm, pc)); break;
+			case 1: sim_addc(sim, sim_reg(sim, rd, pc), ~sim_reg(sim, rm, pc), 1, 1); break;
+			case 2: sim_set_reg(sim, rd, sim_reg(sim, rm, pc)); break;
+			case 3:
+				if (insn & 0x80)					/* BLX */
+					r[14] = (pc + 2) | 1;
+				r[15] = sim_reg(sim, rm, pc) & ~1;
+				break;
+			}
+			return 0;
+		}
+		/* LDR literal */
+		addr = ((pc + 4) & ~3) + (insn & 0xff) * 4;
+		if (sim_load(sim, addr, 4, 0, &val) < 0)
+			return -2;
+		r[(insn >> 8) & 7] = val;
+		return 0;
+	case 0x5: {										/* Load/store register */
+		static const int sizes[8] = { 4, 2, 1, 1, 4, 2, 1, 2 };
+		int op = (insn >> 9) & 7;
+		addr = r[rm] + r[(insn >> 6) & 7];
+		if (op < 3)
+			return sim_write(sim, addr, sizes[op], r[rd]) < 0 ? -2 : 0;
+		if (sim_load(sim, addr, sizes[op], op == 3 || op == 7, &val) < 0)
+			return -2;
+		r[rd] = val;
+		return 0;
+	}
+	case 0x6: case 0x7: case 0x8: {					/* Load/store immediate */
+		int size = (insn >> 12) == 6 ? 4 : (insn >> 12) == 7 ? 1 : 2;
+		addr = r[rm] + ((insn >> 6) & 31) * size;
+		if ( ! (insn & 0x800))
+			return sim_write(sim, addr, size, r[rd]) < 0 ? -2 : 0;
+		if (sim_load(sim, addr, size, 0, &val) < 0)
+			return -2;
+		r[rd] = val;
+		return 0;
+	}
+	case 0x9:										/* SP-relative */
+		rd = (insn >> 8) & 7;
+		addr = r[13] + (insn & 0xff) * 4;
+		if ( ! (insn & 0x800))
+			return sim_write(sim, addr, 4, r[rd]) < 0 ? -2 : 0;
+		if (sim_load(sim, addr, 4, 0, &val) < 0)
+			return -2;
+		r[rd] = val;
+		return 0;
+	case 0xA:										/* ADR, ADD rd, SP */
+		rd = (insn >> 8) & 7;
+		r[rd] = ((insn & 0x800) ? r[13] : (pc + 4) & ~3) + (insn & 0xff) * 4;
+		return 0;
+	case 0xB:										/* Miscellaneous */
+		if ((insn & 0xFF00) == 0xB000) {			/* ADD/SUB SP, #imm */
+			val = (insn & 0x7f) * 4;
+			r[13] = (insn & 0x80) ? r[13] - val : r[13] + val;
+		} else if ((insn & 0xF500) == 0xB100) {		/* CBZ, CBNZ */
+			val = ((insn >> 3) & 0x1f) << 1 | ((insn >> 9) & 1) << 6;
+			if ((r[rd] == 0) != !!(insn & 0x800))
+				r[15] = pc + 4 + val;
+		} else if ((insn & 0xFF00) == 0xB200) {		/* SXTH/SXTB/UXTH/UXTB */
+			static const uint32_t masks[4] = { 0xffff, 0xff, 0xffff, 0xff };
+			int op = (insn >> 6) & 3;
+			val = r[rm] & masks[op];
+			r[rd] = op == 0 ? (int16_t)val : op == 1 ? (int8_t)val : val;
+		} else if ((insn & 0xFE00) == 0xB400) {		/* PUSH */
+			uint32_t list = (insn & 0xff) | ((insn & 0x100) << 6);
+			for (i = 0, count = 0; i < 16; i++)
+				count += (list >> i) & 1;
+			addr = r[13] - 4 * count;
+			r[13] = addr;
+			for (i = 0; i < 16; i++)
+				if (list & (1 << i)) {
+					if (sim_write(sim, addr, 4, r[i]) < 0)
+						return -2;
+					addr += 4;
+				}
+		} else if ((insn & 0xFE00) == 0xBC00) {		/* POP */
+			uint32_t list = (insn & 0xff) | ((insn & 0x100) << 7);
+			addr = r[13];
+			for (i = 0; i < 16; i++)
+				if (list & (1 << i)) {
+					if (sim_load(sim, addr, 4, 0, &val) < 0)
+						return -2;
+					addr += 4;
+					r[13] = addr;
+					sim_set_reg(sim, i, val);
+				}
+			r[13] = addr;
+		} else if ((insn & 0xFFC0) == 0xBA00) {		/* REV */
+			val = r[rm];
+			r[rd] = val << 24 | (val & 0xff00) << 8 | (val >> 8 & 0xff00) |
+				val >> 24;
+		} else if ((insn & 0xFF00) == 0xBE00) {		/* BKPT */
+			r[15] = pc;
+			return 1;
+		} else if ((insn & 0xFF0F) == 0xBF00) {		/* NOP and other hints */
+			;
+		} else
+			return -1;
+		return 0;
+	case 0xC: {										/* STMIA/LDMIA rn! */
+		rn = (insn >> 8) & 7;
+		addr = r[rn];
+		for (i = 0; i < 8; i++)
+			if (insn & (1 << i)) {
+				if (insn & 0x800) {
+					if (sim_load(sim, addr, 4, 0, &val) < 0)
+						return -2;
+					r[i] = val;
+				} else if (sim_write(sim, addr, 4, r[i]) < 0)
+					return -2;
+				addr += 4;
+			}
+		if ( ! ((insn & 0x800) && (insn & (1 << rn))))
+			r[rn] = addr;
+		return 0;
+	}
+	case 0xD:										/* B<cond> */
+		if (((insn >> 8) & 15) >= 14)				/* UDF, SVC */
+			return -1;
+		if (sim_cond(sim, (insn >> 8) & 15))
+			r[15] = pc + 4 + (int32_t)(int8_t)(insn & 0xff) * 2;
+		return 0;
+	case 0xE:										/* B */
+		r[15] = pc + 4 + (((int32_t)(insn << 21)) >> 20);
+		return 0;
+	}
+	return -1;
+}
+
+/* Run the simulated core up to time UNTIL. */
+static void sim_run_core(struct stm_sim *sim, uint64_t until)
+{
+	sim->in_core = 1;
+	sim->run_until = until;
+	while ( ! sim->halted && ! sim->free_run && sim->now_ns < until) {
+		int ret = sim_step(sim);
+		if (ret == 1)
+			sim->halted = 1;
+		else if (ret == -2) {
+			/* A bus fault.  Report it as a halt, as if the debugger had
+			 * vector catch enabled for HardFault. */
+			sim->r[SIM_XPSR] = (sim->r[SIM_XPSR] & ~0x1ff) | 3;
+			sim->halted = 1;
+		} else if (ret < 0) {
+			if (verbose)
+				fprintf(stderr, " Simulated core: cannot interpret the "
+						"instruction at %8.8x.\n", sim->r[15]);
+			sim->free_run = 1;
+		}
+	}
+	sim->in_core = 0;
+	if (sim->now_ns < until)
+		sim->now_ns = until;
+}
+
+static void sim_reset_core(struct stm_sim *sim)
+{
+	int i;
+
+	memset(sim->r, 0, sizeof sim->r);
+	sim->r[SIM_MSP] = sim->r[13] = sim_get(sim->flash, 4);
+	sim->r[15] = sim_get(sim->flash + 4, 4) & ~1;
+	sim->r[14] = 0xffffffff;
+	sim->r[SIM_XPSR] = 0x01000000;
+	for (i = 0; i < 2; i++) {
+		sim->fpec[i].cr = sim_fpec_lock(sim);
+		sim->fpec[i].sr = 0;
+		sim->fpec[i].key = 0;
+	}
+	sim->crc_dr = 0xffffffff;
+	/* A running core is now running the application. */
+	sim->free_run = ! sim->halted;
+}
+
+static void sim_reply(struct stl_req *rq, uint32_t val, int len)
+{
+	unsigned char le_val[4];
+	write_uint32(le_val, val);
+	memcpy(rq->data, le_val, len < rq->data_len ? len : rq->data_len);
+}
+
+static void sim_debug_cmd(struct stm_sim *sim, struct stl_req *rq)
+{
+	unsigned char *cmd = rq->cmd_buf;
+	uint32_t addr = read_uint32(cmd, 2), val;
+	int len = cmd[6] | cmd[7] << 8;
+	int i;
+
+	switch (cmd[1]) {
+	case STLinkDebugEnterMode:
+		sim->stlink_mode = STLinkDevMode_Debug;
+		break;
+	case STLinkDebugExit:
+		sim->stlink_mode = STLinkDevMode_Mass;
+		break;
+	case STLinkDebugReadCoreID:
+		sim_reply(rq, sim->chip->core_id, 4);
+		break;
+	case STLinkDebugGetStatus:
+		sim_reply(rq, sim->halted ? STLINK_CORE_HALTED : STLINK_CORE_RUNNING,
+				  2);
+		break;
+	case STLinkDebugForceDebug:
+		sim->dhcsr = (sim->dhcsr & ~DHCSR_C_STEP) | DHCSR_C_DEBUGEN |
+			DHCSR_C_HALT;
+		sim->halted = 1;
+		sim->free_run = 0;
+		sim_reply(rq, STLINK_OK, 2);
+		break;
+	case STLinkDebugResetSys:
+		sim_reset_core(sim);
+		sim_reply(rq, STLINK_OK, 2);
+		break;
+	case STLinkDebugReadAllRegs:
+		for (i = 0; i < SIM_NREGS && 4*i + 4 <= rq->data_len; i++)
+			write_uint32(rq->data + 4*i, sim->r[i]);
+		break;
+	case STLinkDebugReadOneReg:
+		sim_reply(rq, cmd[2] < SIM_NREGS ? sim->r[cmd[2]] : 0, 4);
+		break;
+	case STLinkDebugWriteReg:
+		if (cmd[2] < SIM_NREGS)
+			sim->r[cmd[2]] = read_uint32(cmd, 3);
+		sim_reply(rq, STLINK_OK, 2);
+		break;
+	case STLinkDebugReadMem32bit:
+		for (i = 0; i + 4 <= len && i + 4 <= rq->data_len; i += 4) {
+			if (sim_read(sim, addr + i, 4, &val) < 0)
+				val = 0;
+			write_uint32(rq->data + i, val);
+		}
+		break;
+	case STLinkDebugWriteMem32bit:
+		if ((addr & 3) == 0)
+			for (i = 0; i + 4 <= len && i + 4 <= rq->data_len; i += 4)
+				sim_write(sim, addr + i, 4, read_uint32(rq->data, i));
+		break;
+	case STLinkDebugWriteMem8bit:
+		for (i = 0; i < len && i < rq->data_len; i++)
+			sim_write(sim, addr + i, 1, rq->data[i]);
+		break;
+	case STLinkDebugRunCore:
+		/* The STLink writes DHCSR with only C_DEBUGEN. */
+		sim->dhcsr = DHCSR_C_DEBUGEN;
+		sim_resume(sim);
+		sim_reply(rq, STLINK_OK, 2);
+		break;
+	case STLinkDebugStepCore:
+		if (sim->halted) {
+			sim->in_core = 1;
+			sim->run_until = sim->now_ns + SIM_CYCLE_NS;
+			sim_step(sim);
+			sim->in_core = 0;
+		}
+		sim_reply(rq, STLINK_OK, 2);
+		break;
+	default:				/* Breakpoints and debug registers */
+		sim_reply(rq, STLINK_OK, 2);
+		break;
+	}
+}
+
+/* Execute a command immediately.  The simulated STLink never overlaps
+ * commands, so there is nothing to wait for afterwards. */
+static int stl_sim_submit(struct stlink *sl, struct stl_req *rq)
+{
+	struct stm_sim *sim = sl->tp_priv;
+
+	/* Bring the target up to date before it sees the command. */
+	sim->usb_ns += SIM_CMD_NS + (uint64_t)rq->data_len * SIM_BYTE_NS;
+	sim_run_core(sim, stl_now_ns() - sim->t0_ns + sim->usb_ns);
+	if (rq->xfer_dir == STLinkParamFromDev)
+		memset(rq->data, 0, rq->data_len);
+	/* A glitched output command is lost.  The response of an input
+	 * command is lost after the command has taken effect. */
+	if (sim->glitch_every && ++sim->n_cmds % sim->glitch_every == 0) {
+		sim->usb_ns += (uint64_t)rq->timeout_ms * 1000000;
+		rq->status = LIBUSB_ERROR_TIMEOUT;
+		rq->actual_len = 0;
+		rq->done = 1;
+		if (rq->xfer_dir == STLinkParamToDev && rq->data_len)
+			return 0;
+	}
+
+	switch (rq->cmd_buf[0]) {
+	case STLinkGetVersion: {
+		struct STLinkVersion ver = {2, 17, 0, USB_ST_VID, USB_STLINKv2_PID};
+		memcpy(rq->data, &ver, rq->data_len < sizeof ver ?
+			   rq->data_len : sizeof ver);
+		break;
+	}
+	case STLinkGetCurrentMode:
+		sim_reply(rq, sim->stlink_mode, 2);
+		break;
+	case STLinkGetTargetVoltage:		/* 3.3V against the 1.2V reference */
+		sim_reply(rq, 1489, 4);
+		if (rq->data_len >= 8)
+			write_uint32(rq->data + 4, 2048);
+		break;
+	case STLinkDFUCommand:
+		if (rq->cmd_buf[1] == STLinkDFUModeExit)
+			sim->stlink_mode = STLinkDevMode_Mass;
+		break;
+	case STLinkDebugCommand:
+		sim_debug_cmd(sim, rq);
+		break;
+	}
+	if ( ! rq->done) {
+		rq->actual_len = rq->data_len;
+		rq->status = 0;
+		rq->done = 1;
+	}
+	return 0;
+}
+
+static int stl_sim_wait(struct stlink *sl, struct stl_req *rq)
+{
+	return rq->status;
+}
+
+static void stl_sim_close(struct stlink *sl)
+{
+	struct stm_sim *sim = sl->tp_priv;
+
+	free(sim->flash);
+	free(sim->sram);
+	free(sim->sysmem);
+	free(sim);
+	sl->tp_priv = NULL;
+}
+
+/* Waiting passes simulated time without sleeping. */
+static void stl_sim_idle(struct stlink *sl, unsigned int usecs)
+{
+	struct stm_sim *sim = sl->tp_priv;
+
+	sim->usb_ns += (uint64_t)usecs * 1000;
+}
+
+const struct stl_transport stl_sim_transport = {
+	"simulated", stl_sim_submit, stl_sim_wait, stl_sim_close, NULL, NULL,
+	stl_sim_idle,
+};
+
+/* Create a simulated STLink with an attached target.
+ * SPEC is "sim" for the default medium-density STM32F10x, or
+ * "sim:<DBGMCU_IDCODE>" for any chip in stm_devids[].  Either may be
+ * followed by ",glitch=<N>" to have every Nth command time out.
+ */
+struct stlink *stl_sim_open(struct stlink *sl, const char *spec)
+{
+	uint32_t idcode = SIM_DEFAULT_IDCODE;
+	struct stm_sim *sim;
+	uint8_t *flash_size_reg, *uid;
+	const char *glitch = strstr(spec, ",glitch=");
+	int i;
+
+	if (spec[3] == ':')
+		idcode = strtoul(spec + 4, 0, 0);
+	for (i = 0; stm_devids[i].name; i++)
+		if (stm_devids[i].dbgmcu_idcode == idcode)
+			break;
+	if (stm_devids[i].name == NULL) {
+		fprintf(stderr, "No simulated chip matches ID code %8.8x.\n", idcode);
+		return NULL;
+	}
+
+	sim = calloc(1, sizeof *sim);
+	if (sim == NULL)
+		return NULL;
+	sim->chip = &stm_devids[i];
+	sim->f4_fpec = (sim->chip->cap_flags & ChipCapF4Flash) != 0;
+	sim->flash_base = sim->chip->flash_base;
+	sim->flash_size = sim->chip->flash_size;
+	sim->sram_base = sim->chip->sram_base;
+	sim->sram_size = sim->chip->sram_size;
+	sim->flash = malloc(sim->flash_size);
+	sim->sram = calloc(1, sim->sram_size);
+	sim->sysmem = malloc(SIM_SYSMEM_SIZE);
+	if ( ! sim->flash || ! sim->sram || ! sim->sysmem) {
+		free(sim->flash);
+		free(sim->sram);
+		free(sim->sysmem);
+		free(sim);
+		return NULL;
+	}
+	memset(sim->flash, 0xff, sim->flash_size);
+	memset(sim->sysmem, 0xff, SIM_SYSMEM_SIZE);
+
+	/* The factory-programmed flash size (in KB) and unique device ID. */
+	if (sim->chip->cap_flags & ChipCapF4Flash) {
+		flash_size_reg = sim->sysmem + (0x1FFF7A22 - SIM_SYSMEM_BASE);
+		uid = sim->sysmem + (0x1FFF7A10 - SIM_SYSMEM_BASE);
+	} else {
+		flash_size_reg = sim->sysmem + (0x1FFFF7E0 - SIM_SYSMEM_BASE);
+		uid = sim->sysmem + (0x1FFFF7E8 - SIM_SYSMEM_BASE);
+		memcpy(sim->sysmem + (0x1FFFF800 - SIM_SYSMEM_BASE),
+			   "\xa5\x5a\xff\x00\xff\x00\xff\x00\xff\x00\xff\x00\xff\x00\xff\x00",
+			   16);
+	}
+	sim_put(flash_size_reg, 2, sim->flash_size / 1024);
+	for (i = 0; i < 12; i++)
+		uid[i] = "SimSTLink-01"[i];
+
+	sim->stlink_mode = STLinkDevMode_Mass;
+	if (glitch)
+		sim->glitch_every = strtoul(glitch + 8, 0, 0);
+	sim->t0_ns = stl_now_ns();
+	sim_reset_core(sim);
+
+	memset(sl, 0, sizeof *sl);
+	sl->dev_path = "simulated STLink";
+	sl->fd = -1;
+	sl->tp = &stl_sim_transport;
+	sl->tp_priv = sim;
+	sl->verbose = verbose;
+	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+	sl->q_depth = queue_depth;
+	snprintf(sl->serial, sizeof sl->serial, "SIM%8.8x", idcode);
+
+	return sl;
+}
+
+/* Command batching.
+ * Register set-up sequences, such as the flash unlock key writes, are
+ * many tiny commands where the cost is entirely the per-command USB round
+ * trip.  A batch queues them back to back without waiting for any
+ * response.  Read results are stored through the RESULT pointers in the
+ * order the reads were queued, and are only valid after
+ * stl_batch_flush() returns.  Any synchronous command also flushes the
+ * batch first, so mixing the two styles is safe, just slower.
+ */
+static void stl_batch_wr32(struct stlink *sl, uint32_t addr, uint32_t val)
+{
+	unsigned char le_val[4];
+	write_uint32(le_val, val);
+	stl_queue_wr32(sl, addr, le_val, sizeof le_val);
+}
+
+static void stl_batch_rd32(struct stlink *sl, uint32_t addr, uint32_t *result)
+{
+	stl_queue_rd32(sl, addr, sizeof(uint32_t), result);
+}
+
+/* Write ARM core register REG_IDX, see 'struct ARMcoreRegs' for the index. */
+static void stl_batch_wreg(struct stlink *sl, int reg_idx, uint32_t val)
+{
+	stl_queue_dbg(sl, STLinkDebugWriteReg, reg_idx, val);
+}
+
+/* Complete every batched command.  Returns 0 or the first USB error. */
+static inline int stl_batch_flush(struct stlink *sl)
+{
+	return stl_queue_flush(sl);
+}
+
+/* Waiting for the target.
+ * Flash programming and erasing, and code run on the target, take from
+ * a millisecond to seconds.  Rather than polling back to back, stl_wait()
+ * first lets 3/4 of the EXPECT_US typical time pass, then polls at an
+ * interval starting at 1/16 of it and doubling up to STL_WAIT_MAX_US.
+ * With an ADDR of STL_WAIT_HALT it waits for the core to halt, otherwise
+ * for the word at ADDR to equal VAL under MASK: a flash status register's
+ * busy bit, or a completion word written by a loader in SRAM or DCRDR.
+ * Returns 0, -ETIMEDOUT after TIMEOUT_MS, or -EIO if the STLink fails.
+ * The last value read, or the core state, is left in *LAST if not NULL.
+ */
+#define STL_WAIT_HALT	0
+#define STL_WAIT_MIN_US	250			/* About a USB round trip */
+#define STL_WAIT_MAX_US	5000
+
+static void stl_idle(struct stlink *sl, unsigned int usecs)
+{
+	if (sl->tp->idle)
+		sl->tp->idle(sl, usecs);
+	else
+		usleep(usecs);
+}
+
+static int stl_wait(struct stlink *sl, uint32_t addr, uint32_t mask,
+					uint32_t val, uint32_t *last, unsigned int expect_us,
+					unsigned int timeout_ms)
+{
+	uint64_t start_ns = stl_now_ns(), waited_us = 0, idle_us = 0;
+	unsigned int interval = expect_us / 16;
+	unsigned char word[4];
+	uint32_t value;
+
+	if (interval < STL_WAIT_MIN_US)
+		interval = STL_WAIT_MIN_US;
+	else if (interval > STL_WAIT_MAX_US)
+		interval = STL_WAIT_MAX_US;
+	if (expect_us / 4 * 3 > STL_WAIT_MIN_US) {
+		idle_us = expect_us / 4 * 3;
+		stl_idle(sl, idle_us);
+	}
+	for (;;) {
+		if (addr == STL_WAIT_HALT) {
+			static const unsigned char get_status[2] = {
+				STLinkDebugCommand, STLinkDebugGetStatus };
+			stl_queue_cmd(sl, get_status, sizeof get_status,
+						  STLinkParamFromDev, word, 2);
+			if (stl_queue_flush(sl) != 0)
+				return -EIO;
+			value = word[0] | word[1] << 8;
+			if (value == STLINK_CORE_HALTED)
+				break;
+		} else {
+			stl_queue_rd32(sl, addr, sizeof word, word);
+			if (stl_queue_flush(sl) != 0)
+				return -EIO;
+			value = read_uint32(word, 0);
+			if ((value & mask) == val)
+				break;
+		}
+		/* The idle time is not wall-clock time on the simulator. */
+		waited_us = (stl_now_ns() - start_ns) / 1000;
+		if (waited_us < idle_us)
+			waited_us = idle_us;
+		if (waited_us >= (uint64_t)timeout_ms * 1000) {
+			if (last)
+				*last = value;
+			return -ETIMEDOUT;
+		}
+		stl_idle(sl, interval);
+		idle_us += interval;
+		interval = interval * 2 < STL_WAIT_MAX_US ? interval * 2 :
+			STL_WAIT_MAX_US;
+	}
+	if (last)
+		*last = value;
+	return 0;
+}
+
+static void stl_print_version(struct STLinkVersion *ver)
+{
+	if (ver->ST_VendorID == USB_ST_VID &&
+		(ver->ST_ProductID == USB_STLINK_PID ||
+		 ver->ST_ProductID == USB_STLINKv2_PID))
+		fprintf(stderr, "STLink Vendor/Product ID 0x%04x 0x%04x (STMicro)\n",
+				ver->ST_VendorID, ver->ST_ProductID);
+	else
+		fprintf(stderr, "STLink Vendor/Product ID 0x%04x 0x%04x (NOT STMicro!)"
+				"(%04x %04x expected)\n",
+				ver->ST_VendorID, ver->ST_ProductID,
+				USB_ST_VID, USB_STLINK_PID);
+	/* Expected versions  STLink: 3  JTAG: 2  SWIM: 0x20 */
+	fprintf(stderr, " Versions  STLink: 0x%x  JTAG: 0x%x  SWIM: 0x%x\n"
+			"    The firmware %s a JTAG/SWD interface.\n"
+			"    The firmware %s a SWIM interface.\n",
+			ver->STLink_ver, ver->JTAG_ver, ver->SWIM_ver,
+			ver->JTAG_ver == 0 ? "does not support" : "supports",
+			ver->SWIM_ver == 0 ? "does not support" : "supports");
+}
+
+void stlink_print_arm_regs(struct ARMcoreRegs *regs)
+{
+	int i;
+	for (i = 0; i < 16; i++)
+		fprintf(stderr, "r%02d=0x%08x%c", i, regs->r[i], i%4 == 3 ? '\n' : ' ');
+	fprintf(stderr,
+			"xPSR       = 0x%08x\n"
+			"main_sp    = 0x%08x  process_sp = 0x%08x\n"
+			"rw         = 0x%08x  rw2        = 0x%08x\n",
+			regs->xpsr, regs->main_sp, regs->process_sp, regs->rw, regs->rw2);
+	return;
+}
+
+/*
+ * Set and clear hardware breakpoints.
+ * A breakpoint is set with the "flash patch" module.
+ * When executing from Flash instead of RAM, we need hardware support
+ * to implement breakpoints.  We only get four registers, but that is
+ * enough for most debugging.
+ * 2  The index, 0..3, of the Flash Patch register.
+ * 3-6 Address of the breakpoint (LSB first)
+ * 7 FP_ALL (0x02) / FP_UPPER (0x01) / FP_LOWER (0x00)
+ */
+int stl_set_breakpoint(struct stlink *sl, int fp_nr, uint32_t addr, int fp)
+{
+	write_uint32(sl->data_buf+3, addr);
+	sl->data_buf[7] = fp;
+	return stl_set_fp(sl, fp_nr);
+}
+
+/* Unlock the flash.  This takes two write cycles with two key values.
+ * The two key values are sequentially written to the FLASH_KEYR register.
+ */
+
+/*
+ * After much experimentation, I finally came to understand that the
+ * STLink cannot generate the 16 bit memory cycle needed to directly
+ * write the flash.
+ * You have to download a program that writes it.
+ *
+ * This was confirmed by reading the OpenOCD code.
+ * My implementation uses a similar approach, with a better implementation.
+ * They download a program, the data, pass parameters using registers
+ * (individually written) and run the program.  This might seem
+ * efficient, but the cost is largely in triggering a transfer, not how
+ * much is in each transfer.
+ *
+ * It's a bit more work to embed the parameters in the program and pack
+ * it together with the data into a single transfer, but the better
+ * performance is worth it.
+ *
+ * Note: RAM starts at 0x20000000.  Some chips have up to 32KB, but we
+ * must support the devices with only 4KB.
+ */
+
+/* The OpenOCD code. Someday I'll do a speed comparisons.
+ * From openocd, contrib/loaders/flash/stm32.s
+ * i = STM32_FLASH_BASE;      0x08+r3  0x0800,0000
+ * r0 = fl->buf_addr;//source
+ * r1 = target;		// target
+ * r2 = count;		// count (16 bits half words)
+ * r3 = 0;			// flash bank 0 (input)
+ * r15 = fl->loader_addr;  // pc register
+ */
+
+static const uint8_t loader_code[] = {
+	0x08, 0x4c,			/* ldr	r4, STM32_FLASH_BASE */
+	0x1c, 0x44,			/* add	r4, r3 */
+	/* write_half_word: */
+	0x01, 0x23,			/* movs	r3, #0x01 */
+	0x23, 0x61,			/* str	r3, [r4, #STM32_FLASH_CR_OFFSET] */
+	0x30, 0xf8, 0x02, 0x3b,	/* ldrh	r3, [r0], #0x02 */
+	0x21, 0xf8, 0x02, 0x3b,	/* strh	r3, [r1], #0x02 */
+	/* busy: */
+	0xe3, 0x68,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
+	0x13, 0xf0, 0x01, 0x0f,	/* tst	r3, #0x01 */
+	0xfb, 0xd0,			/* beq	busy */
+	0x13, 0xf0, 0x14, 0x0f,	/* tst	r3, #0x14 */
+	0x01, 0xd1,			/* bne	exit */
+	0x01, 0x3a,			/* subs	r2, r2, #0x01 */
+	0xf0, 0xd1,			/* bne	write_half_word */
+	/* exit: */
+	0x00, 0xbe,			/* bkpt	#0x00 */
+	 0x00, 0x20, 0x02, 0x40,	/* STM32_FLASH_BASE: .word 0x40022000 */
+ };
+
+/* A working version of our ARM code.  Here as a back-up since we break it
+ * so frequently. */
+ static const uint16_t db_loader_code_working[] = {
+	 0x480B,			/* ldr	r0, .SRC_ADDR */
+	 0x490C,			/* ldr	r1, .TARGET_ADDR */
+	 0x4A0C,			/* ldr	r2, .COUNT  */
+	 0x4c09,			/* ldr	r4, .STM32_FLASH_BASE */
+	 0x2501,			/* movs	r5, #FLASH_CR_PG_BIT  0x0001 */
+	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
+	 /* write_hword: */
+	 0xf830, 0x3b02,	/* ldrh	r3, [r0], #0x02 */
+	 0xf821, 0x3b02,	/* strh	r3, [r1], #0x02 */
+	 /* busy: */
+#if 0
+	 0x3201,			/* add	r2, r2, #0x01 */
+#endif
+	 0x68e3,			/* ldr	r3, [r4, #STM32_FLASH_SR_OFFSET] */
+	 0xf013, 0x0f01,	/* tst	r3, #0x01 */
+	 0xd1fb,			/* bne	busy */
+	 0xf013, 0x0f14,	/* tst	r3, #0x14 */
+	 0xd101,			/* bne	exit */
+	 0x3a01,			/* subs	r2, r2, #0x01 */
+	 0xd1f2,			/* bne	write_hword */
+	 /* Normal completion, clear #FLASH_CR_PG_BIT.  Note that r2 is now 0. */
+#if 0
+	 0x6122,			/* str	r2, [r4, #STM32_FLASH_CR_OFFSET] */
+#endif
+	 /* exit: */
+	 0xbe00,			/* bkpt	#0x00 */
+	 0x0000, 0x0000,
+	 0x2000, 0x4002,	/* .STM32_FLASH_BASE: .word 0x40022000 */
+	 0x0040, 0x2000,	/* .SRC_ADDR: .word 0x20000040 */
+	 0x0bd0, 0x0800,	/* .TARGET_ADDR: .word 0x0800xxxx */
+	 0x0006, 0x0000,	/* .COUNT: .word 0x00000100 */
+ };
+
+/* The target supply voltage in millivolts, or -1 if the STLink cannot
+ * measure it.  The v2 firmware from J13 reads it with an ADC, against
+ * its own 1.2V reference.  It is read once. */
+static int stl_target_mv(struct stlink *sl)
+{
+	uint32_t ref, adc;
+
+	if (sl->target_mv != 0)
+		return sl->target_mv;
+	sl->target_mv = -1;
+	if (sl->ver.STLink_ver >= 2 && sl->ver.JTAG_ver >= 13 &&
+		st_gcmd(sl, STLinkGetTargetVoltage, 0, 8) == 0) {
+		ref = read_uint32(sl->data_buf, 0);
+		adc = read_uint32(sl->data_buf, 4);
+		if (ref != 0)
+			sl->target_mv = 2 * adc * 1200 / ref;
+	}
+	if (sl->verbose)
+		fprintf(stderr, " Target supply %d mV.\n", sl->target_mv);
+	return sl->target_mv;
+}
+
+/* The widest F2/F4 program and erase parallelism for the supply, as the
+ * FLASH_CR PSIZE value, RM0090 table 7: x32 from 2.7V, x16 from 2.1V and
+ * x8 below.  An unknown supply is taken to be the usual 3.3V. */
+static int stl_f4_psize(struct stlink *sl)
+{
+	int mv = stl_target_mv(sl);
+
+	if (mv < 0 || mv >= 2700)
+		return 2;
+	return mv >= 2100 ? 1 : 0;
+}
+
+/* The flash write program.
+ * The STLink apparently cannot directly generate the memory operations
+ * required to write the flash.  So we download and run a small program that
+ * writes the flash for us.
+ *
+ * The program stays resident for the whole write.  It works through two
+ * data slots in turn, ping-pong fashion: while the target programs one
+ * slot we transfer the next block into the other, so the USB transfer time
+ * hides behind the 40-70 msec it takes to program 2KB.
+ *
+ * Each slot has a descriptor, 32 bytes apart after the parameter block.
+ *   +0  target address     +4  count of writes       +8  source address
+ *   +12 flash register base  +16 final FLASH_SR       +20 state
+ * We fill the data, then the descriptor with state last, LOADER_FULL.  The
+ * STLink writes a block in ascending address order, so the program never
+ * sees a full slot with a stale descriptor.  When done it stores the flash
+ * status and the remaining count (zero on success), then sets the state to
+ * LOADER_EMPTY.  The register base is per-block since the XL parts have a
+ * second bank controller at 0x40022040.
+ * On a write error, or a state of LOADER_QUIT, the program hits bkpt#0.
+ * The parameter block holds the error mask, the FLASH_CR program enable
+ * value and the busy bit mask, which differ between the F1 and F4.
+ * The F1 is written by halfwords.  The F2/F4 write width is its PSIZE
+ * setting, so the copy instructions are replaced to match it, with words
+ * for x32 and x64: the two words of a double word are programmed together.
+ */
+static const uint16_t resident_loader_code[] = {
+	 0xA714,			/* adr	r7, params */
+	 0x68FE,			/* ldr	r6, [r7, #12] ; busy mask */
+	 0x2320,			/* movs	r3, #32 */
+	 0x19DB,			/* adds	r3, r3, r7 ; the slot 0 descriptor */
+	 /* wait: */
+	 0x695A,			/* ldr	r2, [r3, #20] ; state */
+	 0x2A00,			/* cmp	r2, #LOADER_EMPTY */
+	 0xD0FC,			/* beq	wait */
+	 0x2A01,			/* cmp	r2, #LOADER_FULL */
+	 0xD000,			/* beq	go */
+	 /* halt: */
+	 0xBE00,			/* bkpt	#0x00 */
+	 /* go: */
+	 0x68DC,			/* ldr	r4, [r3, #12] ; flash register base */
+	 0x6819,			/* ldr	r1, [r3, #0] ; target */
+	 0x685A,			/* ldr	r2, [r3, #4] ; count */
+	 0x6898,			/* ldr	r0, [r3, #8] ; source */
+	 0x68BD,			/* ldr	r5, [r7, #8] ; program enable */
+	 0x6125,			/* str	r5, [r4, #STM32_FLASH_CR_OFFSET] */
+	 /* copy: */
+	 0xf830, 0x5b02,	/* ldrh	r5, [r0], #0x02 ; at LOADER_COPY */
+	 0xf821, 0x5b02,	/* strh	r5, [r1], #0x02 */
+	 /* busy: */
+	 0x68E5,			/* ldr	r5, [r4, #STM32_FLASH_SR_OFFSET] */
+	 0x4235,			/* tst	r5, r6 */
+	 0xD1FC,			/* bne	busy */
+	 0x687E,			/* ldr	r6, [r7, #4] ; error mask */
+	 0x4235,			/* tst	r5, r6 */
+	 0x68FE,			/* ldr	r6, [r7, #12] ; busy mask, flags unchanged */
+	 0xD101,			/* bne	done */
+	 0x3A01,			/* subs	r2, r2, #0x01 */
+	 0xD1F2,			/* bne	copy */
+	 /* done: */
+	 0x2000,			/* movs	r0, #0 */
+	 0x6120,			/* str	r0, [r4, #STM32_FLASH_CR_OFFSET] */
+	 0x611D,			/* str	r5, [r3, #16] ; status */
+	 0x605A,			/* str	r2, [r3, #4] ; remaining count */
+	 0x6158,			/* str	r0, [r3, #20] ; LOADER_EMPTY */
+	 0x2A00,			/* cmp	r2, #0 */
+	 0xD1E4,			/* bne	halt */
+	 0x3320,			/* adds	r3, #32 ; next slot */
+	 0x1BDD,			/* subs	r5, r3, r7 */
+	 0x2D60,			/* cmp	r5, #96 */
+	 0xD1DB,			/* bne	wait */
+	 0x3B40,			/* subs	r3, #64 ; back to slot 0 */
+	 0xE7D9,			/* b	wait */
+	 /* params: */
+	 0x0000, 0x0000,	/* Reserved */
+	 0x0014, 0x0000,	/* .ERROR_MASK: .word 0x14 */
+	 0x0001, 0x0000,	/* .PROGRAM_ENABLE: .word FLASH_CR_PG */
+	 0x0001, 0x0000,	/* .BUSY_MASK: .word FLASH_SR_BSY */
+ };
+
+/* The copy instructions for each F4 PSIZE, x8, x16, x32 and x64. */
+static const uint16_t loader_copy_code[4][4] = {
+	{ 0xf810, 0x5b01, 0xf801, 0x5b01 },	/* ldrb/strb r5, [rN], #0x01 */
+	{ 0xf830, 0x5b02, 0xf821, 0x5b02 },	/* ldrh/strh r5, [rN], #0x02 */
+	{ 0xf850, 0x5b04, 0xf841, 0x5b04 },	/* ldr/str r5, [rN], #0x04 */
+	{ 0xf850, 0x5b04, 0xf841, 0x5b04 },
+};
+
+#define LOADER_COPY		0x20	/* Offset of the copy instructions */
+#define LOADER_PARAMS	0x54	/* Offset of the parameter block */
+#define LOADER_DESC		(LOADER_PARAMS + 32)	/* Slot descriptors */
+#define LOADER_DESC_LEN	24
+#define LOADER_DATA		0x100	/* Data slots start here */
+#define LOADER_SLOTS	2
+#define LOADER_EMPTY	0
+#define LOADER_FULL		1
+#define LOADER_QUIT		2
+
+/* A slot is written by one STLink transfer. */
+#define FLASH_WR_BLK_MAX (Q_BUF_LEN & ~255)
+
+/* The largest flash write block for the detected chip.
+ * Both data slots must fit in its SRAM after the loader, which uses no
+ * stack.  The 4K parts get 1792 byte blocks, 20K and larger the maximum.
+ * Fewer, larger blocks mean fewer slot hand-overs and status polls. */
+static int stl_flash_blk_size(struct stlink *sl)
+{
+	int blk_size = (stm_devids[sl->chip_index].sram_size - LOADER_DATA) /
+		LOADER_SLOTS;
+
+	if (blk_size > FLASH_WR_BLK_MAX)
+		blk_size = FLASH_WR_BLK_MAX;
+	return blk_size & ~255;
+}
+
+/* Download the resident loader with empty slot descriptors and start it.
+ * PSIZE is the F2/F4 parallelism, or -1 for the F1.
+ * It must be followed by a flush before anything is expected of it. */
+static void stl_loader_start(struct stlink *sl, uint32_t prog_base, int psize)
+{
+	unsigned char *p = sl->data_buf;
+	int i;
+
+	memcpy(p, resident_loader_code, sizeof resident_loader_code);
+	memset(p + sizeof resident_loader_code, 0,
+		   LOADER_DATA - sizeof resident_loader_code);
+	if (psize >= 0) {
+		for (i = 0; i < 4; i++)
+			write_uint16(p + LOADER_COPY + 2*i, loader_copy_code[psize][i]);
+		write_uint32(p + LOADER_PARAMS + 4, F4_FLASH_SR_WRPERR |
+					 F4_FLASH_SR_PGAERR | F4_FLASH_SR_PGPERR |
+					 F4_FLASH_SR_PGSERR);
+		write_uint32(p + LOADER_PARAMS + 8,
+					 FLASH_CR_PG | psize << F4_FLASH_CR_PSIZE_SHIFT);
+		write_uint32(p + LOADER_PARAMS + 12, F4_FLASH_SR_BSY);
+	}
+	stl_queue_wr32(sl, prog_base, p, LOADER_DATA);
+	stl_batch_wreg(sl, 15, prog_base);
+	stl_queue_dbg(sl, STLinkDebugRunCore, 0, 0);
+}
+
+/* Wait for the loader to finish with the slot descriptor at DESC_ADDR,
+ * which should take about EXPECT_US and at most MAX_US.  Returns the
+ * writes left undone, zero on success, or the negative stl_wait() error
+ * if the loader never finished.  The final FLASH_SR is stored in
+ * *FLASH_SR. */
+static int stl_loader_wait(struct stlink *sl, uint32_t desc_addr,
+						   unsigned int expect_us, unsigned int max_us,
+						   uint32_t *flash_sr)
+{
+	unsigned char desc[LOADER_DESC_LEN];
+	uint32_t state = 0;
+	int ret;
+
+	/* First poll at the typical time.  Allow the maximum, and for a slow
+	 * poll or two. */
+	ret = stl_wait(sl, desc_addr + 20, ~0, LOADER_EMPTY, &state, expect_us,
+				   max_us / 1000 + 100);
+	if (ret == 0) {
+		stl_queue_rd32(sl, desc_addr, sizeof desc, desc);
+		if (stl_queue_flush(sl) != 0)
+			ret = -EIO;
+	}
+	if (ret != 0) {
+		fprintf(stderr, "Flash loader %s, slot state %x, core status %x.\n",
+				ret == -ETIMEDOUT ? "timed out" : "failed", state,
+				stl_get_status(sl));
+		return ret;
+	}
+	*flash_sr = read_uint32(desc, 16);
+	return read_uint32(desc, 4);
+}
+
+static uint32_t stl_flash_size(struct stlink *sl);
+
+/* The F1 flash controller for the bank holding ADDR. */
+static uint32_t stl_f1_bank_regs(struct stlink *sl, stm32_addr_t addr)
+{
+	const struct stm_chip_params *chip = &stm_devids[sl->chip_index];
+
+	if (addr >= FLASH_BANK2_ADDR && chip->flash_base < FLASH_BANK2_ADDR &&
+		stl_flash_size(sl) > FLASH_BANK2_ADDR - chip->flash_base)
+		return FLASH_BANK2_REGS;
+	return FLASH_REGS_ADDR;
+}
+
+/*
+ * Write the flash at FLASH_ADDR with data BUF of SIZE bytes.
+ * This routine downloads the resident flash-write program once, then
+ * feeds it blocks through the two data slots, keeping one slot filling
+ * while the other is programmed.
+ * It assumes that the flash address, size and any rounding has been
+ * checked by the caller.
+ */
+static int stl_flash_write(struct stlink *sl, stm32_addr_t flash_addr,
+						   const void *buf, int size)
+{
+	uint32_t prog_base = stm_devids[sl->chip_index].sram_base;
+	uint32_t flash_ctrl_base = FLASH_REGS_ADDR;
+	uint32_t flash_sr = 0, slot_addr[LOADER_SLOTS];
+	uint32_t sr_clear = 0x34, sr_fail = 0x15, cr_lock = FLASH_CR_LOCK;
+	uint32_t core_status = 0;
+	int bank2 = 0;				/* The write reaches an XL bank 2. */
+	int slot_writes[LOADER_SLOTS];
+	unsigned char blk[FLASH_WR_BLK_MAX + 8];
+	unsigned int prog_us = FLASH_PROG_US, prog_max_us = FLASH_PROG_MAX_US;
+	int psize = -1, wr_shift = 1;	/* F1 halfword writes */
+	int offset = 0, slot_size, k, i;
+	int pending = 0;			/* Slots handed to the loader, a bitmap. */
+	int status = 0;
+
+	if (stm_devids[sl->chip_index].cap_flags & ChipCapF4Flash) {
+		flash_ctrl_base = F4_FLASH_REGS;
+		sr_clear = F4_FLASH_SR_EOP | F4_FLASH_SR_ERRS;
+		sr_fail = F4_FLASH_SR_BSY | F4_FLASH_SR_ERRS;
+		cr_lock = F4_FLASH_CR_LOCK;
+		/* The widest writes the supply allows, x64 only with VPP, and
+		 * narrower if the start is not aligned to them.  A write takes
+		 * the same time at any width, a double word the time of one. */
+		psize = stl_f4_psize(sl);
+		if (psize == 2 && f4_vpp)
+			psize = 3;
+		while (psize > 0 && (flash_addr & ((1 << psize) - 1)))
+			psize--;
+		wr_shift = psize < 2 ? psize : 2;
+		prog_us = psize == 3 ? F4_FLASH_PROG_US / 2 : F4_FLASH_PROG_US;
+		prog_max_us = psize == 3 ? F4_FLASH_PROG_MAX_US / 2 :
+			F4_FLASH_PROG_MAX_US;
+	} else
+		bank2 = stl_f1_bank_regs(sl, flash_addr + size - 1) ==
+			FLASH_BANK2_REGS;
+	slot_size = stl_flash_blk_size(sl);
+	for (i = 0; i < LOADER_SLOTS; i++)
+		slot_addr[i] = prog_base + LOADER_DATA + i*slot_size;
+
+	if (sl->verbose)
+		printf("Flash write %8.8x..%8.8x.\n", flash_addr, flash_addr+size);
+	/* Unlock the flash register and clear the error bits in the status
+	 * register.  These are batched with the loader download.  The F4
+	 * registers are at the same offsets from their base. */
+	stl_batch_wr32(sl, flash_ctrl_base + 4, FLASH_KEY1);	/* KEYR */
+	stl_batch_wr32(sl, flash_ctrl_base + 4, FLASH_KEY2);
+	stl_batch_wr32(sl, flash_ctrl_base + 0x0c, sr_clear);	/* SR */
+	if (bank2) {
+		stl_batch_wr32(sl, FLASH_REG(FLASH_BANK2_REGS, FLASH_KEYR),
+					   FLASH_KEY1);
+		stl_batch_wr32(sl, FLASH_REG(FLASH_BANK2_REGS, FLASH_KEYR),
+					   FLASH_KEY2);
+		stl_batch_wr32(sl, FLASH_REG(FLASH_BANK2_REGS, FLASH_SR), sr_clear);
+	}
+	if (sl->verbose) {
+		uint32_t flash_sr, flash_cr;
+		stl_batch_rd32(sl, flash_ctrl_base + 0x0c, &flash_sr);
+		stl_batch_rd32(sl, flash_ctrl_base + 0x10, &flash_cr);
+		stl_batch_flush(sl);
+		printf("Flash status %2.2x, control %4.4x.\n", flash_sr, flash_cr);
+	}
+	stl_loader_start(sl, prog_base, psize);
+
+	for (k = 0; offset < size; k++) {
+		int slot = k % LOADER_SLOTS;
+		uint32_t addr = flash_addr + offset;
+		uint32_t desc_addr = prog_base + LOADER_DESC + 32*slot;
+		unsigned char desc[LOADER_DESC_LEN];
+		int this_size = size - offset;
+
+		/* Wait for the loader to free the slot, checking the result of
+		 * the block it held.  Our last transfer finishes first. */
+		if (pending & (1 << slot)) {
+			pending &= ~(1 << slot);
+			status = stl_loader_wait(sl, desc_addr,
+									 prog_us * slot_writes[slot],
+									 prog_max_us * slot_writes[slot],
+									 &flash_sr);
+			if (status != 0)
+				break;
+		}
+		if (this_size > slot_size)
+			this_size = slot_size;
+		/* The XL bank 2 has its own controller.  A block must not
+		 * straddle the banks. */
+		if (bank2 && flash_ctrl_base == FLASH_REGS_ADDR) {
+			if (addr >= FLASH_BANK2_ADDR)
+				flash_ctrl_base = FLASH_BANK2_REGS;
+			else if (addr + this_size > FLASH_BANK2_ADDR)
+				this_size = FLASH_BANK2_ADDR - addr;
+		}
+		memcpy(blk, buf + offset, this_size);
+		/* The 32 bit transfer needs a whole number of words, and x64
+		 * programming of double words. */
+		for (i = this_size; i & (psize == 3 ? 7 : 3); i++)
+			blk[i] = 0xff;
+		stl_queue_wr32(sl, slot_addr[slot], blk, i);
+		write_uint32(desc + 0, addr);
+		write_uint32(desc + 4, (psize == 3 ? i : this_size + (1 << wr_shift)
+								- 1) >> wr_shift);
+		write_uint32(desc + 8, slot_addr[slot]);
+		write_uint32(desc + 12, flash_ctrl_base);
+		write_uint32(desc + 16, 0);
+		write_uint32(desc + 20, LOADER_FULL);
+		stl_queue_wr32(sl, desc_addr, desc, sizeof desc);
+		pending |= 1 << slot;
+		slot_writes[slot] = read_uint32(desc, 4);
+		offset += this_size;
+	}
+	/* Collect the outstanding slots in the order the loader runs them. */
+	for (i = 0; i < LOADER_SLOTS && status == 0; i++, k++) {
+		int slot = k % LOADER_SLOTS;
+		if (pending & (1 << slot))
+			status = stl_loader_wait(sl, prog_base + LOADER_DESC + 32*slot,
+									 prog_us * slot_writes[slot],
+									 prog_max_us * slot_writes[slot],
+									 &flash_sr);
+	}
+	/* Tell the loader to stop, unless an error already did. */
+	for (i = 0; i < LOADER_SLOTS; i++)
+		stl_batch_wr32(sl, prog_base + LOADER_DESC + 32*i + 20, LOADER_QUIT);
+	if (stl_wait(sl, STL_WAIT_HALT, 0, 0, &core_status, 0, 100) != 0) {
+		fprintf(stderr, "Flash loader did not stop, status %x.\n",
+				core_status);
+		stl_enter_debug(sl);
+		if (status == 0)
+			status = -ETIMEDOUT;
+	}
+
+	/* Re-lock the flash on every path.  A failed block already has its
+	 * status. */
+	if (status == 0)
+		stl_batch_rd32(sl, flash_ctrl_base + 0x0c, &flash_sr);
+	stl_batch_wr32(sl, flash_ctrl_base + 0x10, cr_lock);
+	if (bank2)					/* And the other bank. */
+		stl_batch_wr32(sl, flash_ctrl_base == FLASH_REGS_ADDR ?
+					   FLASH_REG(FLASH_BANK2_REGS, FLASH_CR) : FLASH_CR,
+					   cr_lock);
+	stl_batch_flush(sl);
+	if (status < 0)
+		return status;
+	status = flash_sr & sr_fail;
+	if (status && psize >= 0) {
+		if (status & F4_FLASH_SR_WRPERR)
+			fprintf(stderr, "Flash write failed: trying to modify a "
+					"write-protected sector. (%2.2x)\n", status);
+		else if (status & (F4_FLASH_SR_PGAERR | F4_FLASH_SR_PGPERR))
+			fprintf(stderr, "Flash write failed: the x%d write size is not "
+					"allowed or not aligned. (%2.2x)\n", 8 << psize, status);
+		else if (status & F4_FLASH_SR_PGSERR)
+			fprintf(stderr, "Flash write failed: programming sequence "
+					"error. (%2.2x)\n", status);
+	} else if (status) {
+		if (status & 0x04)
+			fprintf(stderr, "Flash write failed: trying to write a location "
+					"that was not erased. (%2.2x)\n", status);
+		else if (status & 0x10)
+			fprintf(stderr, "Flash write failed: trying to modify a "
+					"write-protected region. (%2.2x)\n", status);
+	}
+	return status;
+}
+
+/* Erase flash memory.
+ * Typical use: erase the page of flash memory that contains address ADDR.
+ * Pass the address 0xA11 to do a mass erase ("user flash" only).
+ * The flash controller should be idle at entry, and this waits for idle
+ * before exit.
+ */
+
+static int stl_f1_flash_erase(struct stlink *sl, stm32_addr_t addr_page);
+static int stl_f4_flash_erase(struct stlink *sl, stm32_addr_t addr_page);
+static int stl_L1_flash_erase(struct stlink *sl, stm32_addr_t addr_page);
+
+static int stl_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
+{
+	if (stm_devids[sl->chip_index].cap_flags & ChipCapF4Flash)
+		return stl_f4_flash_erase(sl, addr_page);
+	else if (stm_devids[sl->chip_index].cap_flags & ChipCapL15Flash)
+		return stl_L1_flash_erase(sl, addr_page);
+	else
+		return stl_f1_flash_erase(sl, addr_page);
+}
+
+/* The XL parts erase each bank with its own controller, and a mass
+ * erase is of both banks together. */
+static int stl_f1_flash_erase(struct stlink *sl, stm32_addr_t addr_page)
+{
+	uint32_t status = 0, regs[2];
+	int nbanks = 1, i, ret;
+
+	if (addr_page == 0xa11) {
+		regs[0] = FLASH_REGS_ADDR;
+		if (stl_f1_bank_regs(sl, FLASH_BANK2_ADDR) == FLASH_BANK2_REGS)
+			regs[nbanks++] = FLASH_BANK2_REGS;
+	} else
+		regs[0] = stl_f1_bank_regs(sl, addr_page);
+
+	for (i = 0; i < nbanks; i++) {
+		/* Unlock the flash register and clear any previous errors.
+		 * The whole set-up sequence is a single batch. */
+		stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_KEYR), FLASH_KEY1);
+		stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_KEYR), FLASH_KEY2);
+		stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_SR),
+					   FLASH_SR_EOP | FLASH_SR_WRPRTERR | FLASH_SR_PGERR);
+
+		if (sl->verbose > 1) {
+			uint32_t flash_sr, flash_cr;
+			stl_batch_rd32(sl, FLASH_REG(regs[i], FLASH_SR), &flash_sr);
+			stl_batch_rd32(sl, FLASH_REG(regs[i], FLASH_CR), &flash_cr);
+			stl_batch_flush(sl);
+			fprintf(stderr, "STLink erase flash: status %8.8x "
+					"Flash_CR %8.8x.\n", flash_sr, flash_cr);
+		}
+
+		if (addr_page == 0xa11) {
+			/* Start the erase-all operation, PM0075 sec 3.5. */
+			stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_CR), FLASH_CR_MER);
+			stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_CR),
+						   FLASH_CR_STRT | FLASH_CR_MER);
+		} else {
+			/* Select the page to erase PM0075 sec 3.6 */
+			stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_AR), addr_page);
+			/* Start the erase operation, PM0075 sec 3.5.
+			 * Note that a single combined write will not work! */
+			stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_CR), FLASH_CR_PER);
+			stl_batch_wr32(sl, FLASH_REG(regs[i], FLASH_CR),
+						   FLASH_CR_STRT | FLASH_CR_PER);
+		}
+	}
+	stl_batch_flush(sl);
+	/* Wait for the busy bits to clear, polling from near the typical time.
+	 * The banks erase in parallel. */
+	for (i = 0; i < nbanks; i++) {
+		ret = stl_wait(sl, FLASH_REG(regs[i], FLASH_SR), FLASH_SR_BSY, 0,
+					   &status, addr_page == 0xa11 ? FLASH_MASS_ERASE_US :
+					   FLASH_ERASE_US, 200);
+		if (ret != 0 || ! (status & FLASH_SR_EOP)) {
+			fprintf(stderr, "STLink erase flash page %s, status %8.8x "
+					"Flash_CR %8.8x.\n",
+					ret == -ETIMEDOUT ? "timed out" : "failed", status,
+					sl_rd32(sl, FLASH_REG(regs[i], FLASH_CR)));
+			return 1;
+		}
+	}
+	if (sl->verbose)
+		fprintf(stderr, "STLink erase flash page %8.8x: complete %8.8x.\n",
+				addr_page, status);
+	return 0;
+}
+
+/* On the F2 and F4 ADDR_PAGE is any address in the sector to erase.
+ * The erase runs at the PSIZE parallelism for the supply voltage. */
+static int stl_f4_flash_erase(struct stlink *sl, stm32_addr_t addr_page)
+{
+	const struct stm_chip_params *chip = &stm_devids[sl->chip_index];
+	uint32_t psize = stl_f4_psize(sl), status = 0, start, size, cr;
+	unsigned int expect_us;
+	int ret;
+
+	if (psize == 2 && f4_vpp)
+		psize = 3;
+	psize <<= F4_FLASH_CR_PSIZE_SHIFT;
+	if (addr_page == 0xa11) {
+		/* Both banks of the 2M parts. */
+		cr = psize | FLASH_CR_MER;
+		if (stl_flash_size(sl) > F4_BANK_SIZE)
+			cr |= F4_FLASH_CR_MER1;
+		expect_us = F4_MASS_ERASE_US;
+	} else if (addr_page >= chip->flash_base &&
+			   addr_page - chip->flash_base < stl_flash_size(sl)) {
+		int snb = stl_f4_sector(addr_page - chip->flash_base, &start, &size);
+		cr = psize | F4_FLASH_CR_SER | (snb << F4_FLASH_CR_SNB_SHIFT);
+		expect_us = (size / 1024) * F4_ERASE_KB_US;
+	} else {
+		fprintf(stderr, "STLink erase flash: 0x%8.8x is not in the flash.\n",
+				addr_page);
+		return 1;
+	}
+
+	/* Unlock the flash register and clear any previous errors. */
+	stl_batch_wr32(sl, F4_FLASH_KEYR, FLASH_KEY1);
+	stl_batch_wr32(sl, F4_FLASH_KEYR, FLASH_KEY2);
+	stl_batch_wr32(sl, F4_FLASH_SR, F4_FLASH_SR_EOP | F4_FLASH_SR_ERRS);
+
+	if (sl->verbose > 1) {
+		uint32_t flash_sr, flash_cr;
+		stl_batch_rd32(sl, F4_FLASH_SR, &flash_sr);
+		stl_batch_rd32(sl, F4_FLASH_CR, &flash_cr);
+		stl_batch_flush(sl);
+		fprintf(stderr, "STLink STM32F4 erase flash: status %8.8x "
+				"Flash_CR %8.8x.\n", flash_sr, flash_cr);
+	}
+
+	/* Select the sector or mass erase, then start it. */
+	stl_batch_wr32(sl, F4_FLASH_CR, cr);
+	stl_batch_wr32(sl, F4_FLASH_CR, cr | F4_FLASH_CR_STRT);
+	stl_batch_flush(sl);
+	/* A mass erase takes 8-32 seconds, a 128K sector 1-4, depending on
+	 * the supply voltage. */
+	ret = stl_wait(sl, F4_FLASH_SR, F4_FLASH_SR_BSY, 0, &status,
+				   expect_us, expect_us / 250 + 1000);
+	stl_batch_wr32(sl, F4_FLASH_CR, F4_FLASH_CR_LOCK);
+	stl_batch_flush(sl);
+	if (ret != 0 || (status & F4_FLASH_SR_ERRS)) {
+		fprintf(stderr, "STLink erase flash sector %s, status %8.8x.\n",
+				ret == -ETIMEDOUT ? "timed out" : "failed", status);
+		return 1;
+	}
+	if (sl->verbose)
+		fprintf(stderr, "STLink erase flash page %8.8x: complete %8.8x.\n",
+				addr_page, status);
+	return 0;
+}
+
+static int stl_L1_flash_erase(struct stlink *sl, stm32_addr_t addr_page)
+{
+	uint32_t status = 0;
+	int ret;
+
+	if (sl->verbose > 1)
+		fprintf(stderr, "STLink STM32L erase flash: Flash_ACR %8.8x "
+				"Flash_PECR %8.8x.\n",
+				sl_rd32(sl, L15_FLASH_ACR), sl_rd32(sl, L15_FLASH_ACR));
+
+	/* Unlock the flash register and clear any previous errors. */
+	stl_batch_wr32(sl, L15_FLASH_PEKEYR, L15_FLASH_PEKEY1);
+	stl_batch_wr32(sl, L15_FLASH_PEKEYR, L15_FLASH_PEKEY2);
+	/* Clear the program-lock bit with another magic write sequence. */
+	stl_batch_wr32(sl, L15_FLASH_PRGKEYR, L15_FLASH_PRGKEY1);
+	stl_batch_wr32(sl, L15_FLASH_PRGKEYR, L15_FLASH_PRGKEY2);
+
+	if (sl->verbose > 1) {
+		uint32_t flash_pecr, flash_acr, flash_obr;
+		stl_batch_rd32(sl, L15_FLASH_PECR, &flash_pecr);
+		stl_batch_rd32(sl, L15_FLASH_ACR, &flash_acr);
+		stl_batch_rd32(sl, L15_FLASH_OBR, &flash_obr);
+		stl_batch_flush(sl);
+		fprintf(stderr, "STLink STM32L erase flash: status %8.8x "
+				"Flash_CR %8.8x, OBR %8.8x.\n",
+				flash_pecr, flash_acr, flash_obr);
+	}
+
+	if (addr_page == 0xa11) {
+		/* Do a mass erase / erase-all turning on read protection and then
+		 * turning it off. */
+		stl_batch_wr32(sl, L15_FLASH_OBR, 0x01);
+		stl_batch_wr32(sl, L15_FLASH_OBR, 0xAA);
+	} else {
+		int sector = addr_page & 0x0f;
+		/* Select the sector to erase. */
+		stl_batch_wr32(sl, F4_FLASH_CR, 0x00202 | (sector<<3));
+		stl_batch_wr32(sl, F4_FLASH_CR, 0x10202 | (sector<<3));
+	}
+	stl_batch_flush(sl);
+	ret = stl_wait(sl, L15_FLASH_SR, FLASH_SR_BSY, 0, &status,
+				   L15_FLASH_ERASE_US, 1000);
+	if (ret != 0) {
+		fprintf(stderr, "STLink STM32L erase flash %s, status %8.8x.\n",
+				ret == -ETIMEDOUT ? "timed out" : "failed", status);
+		return 1;
+	}
+	if (sl->verbose)
+		fprintf(stderr, "STLink STM32L erase flash page %8.8x: complete "
+				"%8.8x.\n", addr_page, status);
+	return 0;
+}
+
+/* Flash geometry.
+ * The chip table has one entry for each family, but the parts in a
+ * family differ in flash size.  The factory-programmed size register is
+ * read once, and used instead of the table size when it is plausible.
+ * Returns the flash size in bytes.
+ */
+static uint32_t stl_flash_size(struct stlink *sl)
+{
+	const struct stm_chip_params *chip = &stm_devids[sl->chip_index];
+	uint32_t reg;
+	int kb;
+
+	if (sl->flash_mem_size == 0) {
+		if (chip->cap_flags & ChipCapL15Flash) {
+			reg = sl_rd32(sl, 0x1FF8004C);
+			if ((sl->cpu_idcode & 0x0FFF) == 0x436)
+				kb = (reg & 1) ? 256 : 384;
+			else
+				kb = reg & 0xffff;
+		} else if (chip->cap_flags & ChipCapF4Flash) {
+			kb = sl_rd32(sl, 0x1FFF7A20) >> 16;
+		} else {
+			reg = sl_rd32(sl, 0x1FFFF7E0);
+			if (reg == 0xffffffff)			/* The F0 keeps it elsewhere. */
+				reg = sl_rd32(sl, 0x1FFFF7CC);
+			kb = reg & 0xffff;
+		}
+		sl->flash_mem_size = kb ? kb : -1;
+	}
+	kb = sl->flash_mem_size;
+	if (kb > 0 && kb < 0xffff && (kb * 1024) % chip->flash_pgsize == 0)
+		return kb * 1024;
+	return chip->flash_size;
+}
+
+/* Erase planning.
+ * Erasing only the pages an image covers takes time in proportion to the
+ * image, but each page is its own erase with its own round trips, while
+ * a mass erase takes about the time of one F1 page erase.  The cheaper is
+ * used for the range ADDR..ADDR+LEN, clipped to the flash.  The F2 and F4
+ * are erased by sectors of 16K to 128K, and a mass erase takes as long
+ * as erasing all of them, so only the sectors the range touches are
+ * erased.  The L1 is not erased by pages here, and is always mass erased.
+ * Returns 0, or non-zero if ADDR is not in flash or an erase fails.
+ */
+#define FLASH_ERASE_CMD_US	1000		/* Set-up and status round trips */
+
+static int stl_flash_erase_range(struct stlink *sl, stm32_addr_t addr,
+								 uint32_t len)
+{
+	const struct stm_chip_params *chip = &stm_devids[sl->chip_index];
+	const int f4 = (chip->cap_flags & ChipCapF4Flash) != 0;
+	uint32_t base = chip->flash_base, size = stl_flash_size(sl);
+	uint32_t off, end, start, unit, n = 0;
+	uint64_t part_us = 0, mass_us = FLASH_MASS_ERASE_US + FLASH_ERASE_CMD_US;
+
+	if (addr < base || addr >= base + size) {
+		fprintf(stderr, " Address 0x%8.8x is not in the flash at "
+				"0x%8.8x..0x%8.8x.\n", addr, base, base + size);
+		return -1;
+	}
+	if (len > base + size - addr) {
+		fprintf(stderr, " Only 0x%8.8x..0x%8.8x is flash, the rest will "
+				"not be erased.\n", addr, base + size);
+		len = base + size - addr;
+	}
+	/* Count the pages or sectors from the one holding ADDR. */
+	end = addr - base + len;
+	for (off = addr - base; off < end; off = start + unit, n++) {
+		if (f4) {
+			stl_f4_sector(off, &start, &unit);
+			part_us += (unit / 1024) * F4_ERASE_KB_US + FLASH_ERASE_CMD_US;
+		} else {
+			unit = chip->flash_pgsize;
+			start = off & ~(unit - 1);
+			part_us += FLASH_ERASE_US + FLASH_ERASE_CMD_US;
+		}
+	}
+	if (f4)
+		mass_us = (size / 1024) * (uint64_t)F4_ERASE_KB_US;
+	else if (chip->cap_flags & ChipCapL15Flash)
+		part_us = ~(uint64_t)0;
+	if (sl->verbose)
+		fprintf(stderr, " Erase plan: %d %s from 0x%8.8x, about %d ms, "
+				"or a %d ms mass erase.  Using %s.\n", n,
+				f4 ? "sectors" : "pages", addr, (int)(part_us / 1000),
+				(int)(mass_us / 1000),
+				mass_us < part_us ? "the mass erase" : "them");
+
+	if (mass_us < part_us) {
+		/* The first mass erase after a reset sometimes fails. */
+		if (stl_flash_erase_page(sl, 0xa11) == 0)
+			return 0;
+		return stl_flash_erase_page(sl, 0xa11);
+	}
+	for (off = addr - base; off < end; off = start + unit) {
+		if (f4)
+			stl_f4_sector(off, &start, &unit);
+		else {
+			unit = chip->flash_pgsize;
+			start = off & ~(unit - 1);
+		}
+		if (stl_flash_erase_page(sl, base + start) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Read transfer size calibration.
+ * Some STLink firmware versions fail reads of particular sizes, with
+ * residue errors or bad data on exact 1K multiples.  Rather than always
+ * reading in conservative 1K blocks, we find what works for each probe
+ * once: read a reference in small blocks, then once at each whole KB size
+ * up to the transfer buffer size, and compare.  The reference must not be
+ * uniform, or dropped and shifted words would go unnoticed, as they
+ * would in erased flash.  With the core halted a pattern of distinct
+ * words is written to the start of SRAM, which is then put back.  With
+ * it running, the system memory bootloader is read instead, up to its
+ * size.  A calibration that could not try every size is used only for
+ * this connection.  The results are kept by probe serial number and
+ * firmware version, in this process and in the cache directory if there
+ * is one.
+ */
+#define READ_BLK_SIZE 1024
+#define READ_REF_SIZE 512			/* Never a 1K multiple */
+#define READ_CAL_SIZE (Q_BUF_LEN & ~1023)
+#define READ_CAL_PROBES 16
+
+static struct stl_xfer_cal {
+	char serial[64];
+	int stlink_ver, jtag_ver;
+	int rd_max;
+	uint32_t rd_bad_kb;
+} stl_xfer_cals[READ_CAL_PROBES];
+static pthread_mutex_t stl_xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int stl_xfer_bad(struct stlink *sl, int len)
+{
+	return (len & 1023) == 0 && (sl->rd_bad_kb >> (len >> 10)) & 1;
+}
+
+/* Find the calibration for this probe and firmware, or a free entry for
+ * it.  The oldest entry is reused if there are none free.  Call with
+ * stl_xfer_lock held. */
+static struct stl_xfer_cal *stl_xfer_cal_find(struct stlink *sl)
+{
+	const char *serial = sl->serial[0] ? sl->serial : "noserial";
+	struct stl_xfer_cal *cal;
+	int i;
+
+	for (i = 0; i < READ_CAL_PROBES; i++) {
+		cal = &stl_xfer_cals[i];
+		if (cal->serial[0] && strcmp(cal->serial, serial) == 0 &&
+			cal->stlink_ver == sl->ver.STLink_ver &&
+			cal->jtag_ver == sl->ver.JTAG_ver)
+			return cal;
+	}
+	for (i = 0; i < READ_CAL_PROBES - 1 && stl_xfer_cals[i].serial[0]; i++)
+		;
+	cal = &stl_xfer_cals[i];
+	memset(cal, 0, sizeof *cal);
+	snprintf(cal->serial, sizeof cal->serial, "%s", serial);
+	cal->stlink_ver = sl->ver.STLink_ver;
+	cal->jtag_ver = sl->ver.JTAG_ver;
+	return cal;
+}
+
+static int stl_xfer_calibrate(struct stlink *sl, int force)
+{
+	const struct stm_chip_params *chip = &stm_devids[sl->chip_index];
+	struct stl_xfer_cal *cal, this_cal;
+	unsigned char ref[READ_CAL_SIZE], buf[READ_CAL_SIZE];
+	unsigned char saved[READ_CAL_SIZE];
+	uint32_t base, cal_len;
+	char path[256] = "";
+	FILE *fp;
+	int kb, i, halted, saved_ok, ret = 0;
+
+	pthread_mutex_lock(&stl_xfer_lock);
+	cal = stl_xfer_cal_find(sl);
+	if (cache_dir)
+		snprintf(path, sizeof path, "%s/stlink-%s-V%dJ%d.xfer", cache_dir,
+				 cal->serial, sl->ver.STLink_ver, sl->ver.JTAG_ver);
+	if (cal->rd_max == 0 && ! force && path[0] &&
+		(fp = fopen(path, "r")) != NULL) {
+		if (fscanf(fp, "%d %i", &cal->rd_max, &cal->rd_bad_kb) != 2 ||
+			cal->rd_max < READ_REF_SIZE || cal->rd_max > READ_CAL_SIZE)
+			cal->rd_max = 0;
+		fclose(fp);
+	}
+	if (cal->rd_max && ! force)
+		goto done;
+
+	/* The reference: a written pattern in SRAM, or the bootloader.  If
+	 * even this fails, e.g. a target that is not answering, stay with the
+	 * old block size for now without recording it. */
+	halted = stl_get_status(sl) == STLINK_CORE_HALTED;
+	base = halted ? chip->sram_base : chip->sysflash_base;
+	cal_len = (halted ? chip->sram_size : chip->sysflash_size) & ~1023;
+	if (cal_len > READ_CAL_SIZE)
+		cal_len = READ_CAL_SIZE;
+	for (i = 0; i < cal_len; i += READ_REF_SIZE)
+		stl_queue_rd32(sl, base + i, READ_REF_SIZE, saved + i);
+	saved_ok = cal_len && stl_queue_flush(sl) == 0;
+	if ( ! saved_ok)
+		ret = -1;
+	else if (halted) {
+		for (i = 0; i < cal_len; i += 4)
+			write_uint32(buf + i, (i + 4) * 0x9E3779B1);
+		stl_queue_wr32(sl, base, buf, cal_len);
+		for (i = 0; i < cal_len; i += READ_REF_SIZE)
+			stl_queue_rd32(sl, base + i, READ_REF_SIZE, ref + i);
+		if (stl_queue_flush(sl) != 0 || memcmp(ref, buf, cal_len) != 0)
+			ret = -1;
+	} else
+		memcpy(ref, saved, cal_len);
+	if (ret == 0) {
+		this_cal.rd_max = READ_REF_SIZE;
+		this_cal.rd_bad_kb = 0;
+		for (kb = 1; kb <= cal_len >> 10; kb++) {
+			memset(buf, 0x5A, sizeof buf);
+			stl_queue_rd32(sl, base, kb << 10, buf);
+			if (stl_queue_flush(sl) == 0 && memcmp(buf, ref, kb << 10) == 0)
+				this_cal.rd_max = kb << 10;
+			else
+				this_cal.rd_bad_kb |= 1 << kb;
+		}
+	}
+	/* Put back the SRAM, unless we could not read it to begin with. */
+	if (halted && saved_ok) {
+		stl_queue_wr32(sl, base, saved, cal_len);
+		stl_queue_flush(sl);
+	}
+	if (ret != 0) {
+		pthread_mutex_unlock(&stl_xfer_lock);
+		sl->rd_max = READ_BLK_SIZE;
+		sl->rd_bad_kb = 0;
+		return -1;
+	}
+	if (cal_len < READ_CAL_SIZE) {
+		cal = &this_cal;
+		goto done;
+	}
+	cal->rd_max = this_cal.rd_max;
+	cal->rd_bad_kb = this_cal.rd_bad_kb;
+	if (path[0] && (fp = fopen(path, "w")) != NULL) {
+		fprintf(fp, "%d %#x\n", cal->rd_max, cal->rd_bad_kb);
+		fclose(fp);
+	}
+done:
+	sl->rd_max = cal->rd_max;
+	sl->rd_bad_kb = cal->rd_bad_kb;
+	pthread_mutex_unlock(&stl_xfer_lock);
+	if (sl->verbose || force) {
+		const char *sep = ", avoiding";
+		printf("STLink V%dJ%d reads up to %d bytes per transfer",
+			   sl->ver.STLink_ver, sl->ver.JTAG_ver, sl->rd_max);
+		for (kb = 1; kb <= READ_CAL_SIZE >> 10; kb++)
+			if ((sl->rd_bad_kb >> kb) & 1) {
+				printf("%s %dK", sep, kb);
+				sep = ",";
+			}
+		printf("%s.\n", cal == &this_cal ?
+			   ", for this connection" : "");
+	}
+	return 0;
+}
+
+/* Read from device memory at ADDR into BUF for SIZE bytes.
+ * This handles alignment and block size internally.
+ * All of the block reads are queued at once, so the STLink streams them
+ * without waiting for us between blocks.  The word-aligned body of the
+ * region is transferred directly into BUF, so there is no limit on SIZE
+ * other than the caller's buffer.
+ * Returns 0, or the USB error code if any block failed.
+ */
+int stl_read(struct stlink* sl, stm32_addr_t addr, void *buf, ssize_t size)
+{
+	size_t offset = 0;
+	uint32_t head_word;
+	int head_len = 0;
+	int ret;
+
+	if (stl_cache_get(sl, addr, buf, size) == 0)
+		return 0;
+	if (addr & 3) {
+		head_len = 4 - (addr & 3);
+		if (head_len > size)
+			head_len = size;
+		stl_queue_rd32(sl, addr & ~3, sizeof(uint32_t), &head_word);
+		offset = head_len;
+		size -= head_len;
+	}
+	if (sl->rd_max == 0 && size > READ_BLK_SIZE)
+		stl_xfer_calibrate(sl, 0);
+	while (size > 0) {
+		int xfer_size = sl->rd_max ? sl->rd_max : READ_BLK_SIZE;
+		if (xfer_size > size)
+			xfer_size = size;
+		/* Steer around the sizes this firmware gets wrong. */
+		while (stl_xfer_bad(sl, (xfer_size + 3) & ~3))
+			xfer_size -= 4;
+		stl_queue_rd32(sl, addr + offset, xfer_size, buf + offset);
+		offset += xfer_size;
+		size -= xfer_size;
+	}
+	ret = stl_queue_flush(sl);
+	if (head_len)
+		memcpy(buf, (char *)&head_word + (addr & 3), head_len);
+	if (ret == 0)
+		stl_cache_put(sl, addr, buf, offset);
+	return ret;
+}
+
+
+/* The compact dump format, used for files named *.stld.
+ * Flash dumps are mostly erased pages, so the image is stored as a
+ * sequence of STL_DUMP_CHUNK byte chunks, each a four byte record header
+ * (kind, fill byte, little-endian stored length) followed by its data:
+ *   STL_DUMP_FILL      every byte is the fill byte, nothing stored
+ *   STL_DUMP_PACKBITS  PackBits run-length encoded
+ *   STL_DUMP_RAW       stored as is, when PackBits would not be smaller
+ * A 20 byte file header holds the magic, then the target address, image
+ * size and chunk size as 32 bit little-endian values.  Encoding is a
+ * single pass at memory speed, and the file may be streamed.
+ */
+#define STL_DUMP_MAGIC		"STLDUMP1"
+#define STL_DUMP_HDR_LEN	20
+#define STL_DUMP_CHUNK		1024
+enum stl_dump_kind { STL_DUMP_FILL, STL_DUMP_RAW, STL_DUMP_PACKBITS };
+
+static int stl_dump_name(const char *path)
+{
+	size_t n = strlen(path);
+	return n > 5 && strcmp(path + n - 5, ".stld") == 0;
+}
+
+static int stl_dump_magic(const unsigned char *buf, size_t len)
+{
+	return len >= STL_DUMP_HDR_LEN && memcmp(buf, STL_DUMP_MAGIC, 8) == 0;
+}
+
+/* PackBits: a control byte N of 0..127 is followed by N+1 literal bytes,
+ * and 129..255 by one byte repeated 257-N times. */
+static int stl_packbits(const unsigned char *src, int len, unsigned char *dst)
+{
+	int i = 0, out = 0;
+
+	while (i < len) {
+		int start = i, n = 1;
+		while (i + n < len && n < 128 && src[i + n] == src[i])
+			n++;
+		if (n >= 3) {
+			dst[out++] = 257 - n;
+			dst[out++] = src[i];
+			i += n;
+			continue;
+		}
+		/* Literals up to the next run of three or more. */
+		for (n = 0; i < len && n < 128; i++, n++)
+			if (i + 2 < len && src[i] == src[i+1] && src[i] == src[i+2])
+				break;
+		dst[out++] = n - 1;
+		memcpy(dst + out, src + start, n);
+		out += n;
+	}
+	return out;
+}
+
+static int stl_unpackbits(const unsigned char *src, int len,
+						  unsigned char *dst, int dst_len)
+{
+	int i = 0, out = 0;
+
+	while (i < len) {
+		int n = src[i++];
+		if (n < 128) {
+			if (i + n + 1 > len || out + n + 1 > dst_len)
+				return -1;
+			memcpy(dst + out, src + i, n + 1);
+			i += n + 1;
+			out += n + 1;
+		} else if (n > 128) {
+			if (i >= len || out + 257 - n > dst_len)
+				return -1;
+			memset(dst + out, src[i++], 257 - n);
+			out += 257 - n;
+		}
+	}
+	return out;
+}
+
+static void stl_dump_header(unsigned char *hdr, uint32_t addr, uint32_t size)
+{
+	memcpy(hdr, STL_DUMP_MAGIC, 8);
+	write_uint32(hdr + 8, addr);
+	write_uint32(hdr + 12, size);
+	write_uint32(hdr + 16, STL_DUMP_CHUNK);
+}
+
+/* The worst case encoding of LEN bytes. */
+#define STL_DUMP_MAXLEN(len) \
+	((len) + 4 * (((len) + STL_DUMP_CHUNK - 1) / STL_DUMP_CHUNK))
+
+/* Encode LEN bytes of image into chunk records at DST.
+ * Returns the encoded length, at most STL_DUMP_MAXLEN(LEN). */
+static size_t stl_dump_pack(const unsigned char *src, size_t len,
+							unsigned char *dst)
+{
+	unsigned char tmp[STL_DUMP_CHUNK + STL_DUMP_CHUNK/128 + 1];
+	size_t off, out = 0;
+
+	for (off = 0; off < len; off += STL_DUMP_CHUNK) {
+		int n = len - off < STL_DUMP_CHUNK ? len - off : STL_DUMP_CHUNK;
+		unsigned char *rec = dst + out;
+		int i, stored;
+		for (i = 1; i < n && src[off + i] == src[off]; i++)
+			;
+		rec[1] = 0;
+		if (i == n) {
+			rec[0] = STL_DUMP_FILL;
+			rec[1] = src[off];
+			stored = 0;
+		} else if ((stored = stl_packbits(src + off, n, tmp)) < n) {
+			rec[0] = STL_DUMP_PACKBITS;
+			memcpy(rec + 4, tmp, stored);
+		} else {
+			rec[0] = STL_DUMP_RAW;
+			memcpy(rec + 4, src + off, n);
+			stored = n;
+		}
+		write_uint16(rec + 2, stored);
+		out += 4 + stored;
+	}
+	return out;
+}
+
+/* Decode the dump file contents SRC into a newly allocated image.
+ * Returns the image, with its target address and size, or NULL if the
+ * dump is damaged.
+ */
+static unsigned char *stl_dump_unpack(const unsigned char *src, size_t len,
+									  uint32_t *addr, size_t *size)
+{
+	uint32_t chunk = read_uint32(src, 16);
+	unsigned char *img;
+	size_t off, pos = STL_DUMP_HDR_LEN;
+
+	*addr = read_uint32(src, 8);
+	*size = read_uint32(src, 12);
+	if (chunk == 0 || chunk > 0xffff || (img = malloc(*size + 1)) == NULL)
+		return NULL;
+	for (off = 0; off < *size; off += chunk) {
+		int n = *size - off < chunk ? *size - off : chunk;
+		int stored;
+		if (pos + 4 > len ||
+			pos + 4 + (stored = src[pos+2] | src[pos+3] << 8) > len)
+			break;
+		if (src[pos] == STL_DUMP_FILL && stored == 0)
+			memset(img + off, src[pos+1], n);
+		else if (src[pos] == STL_DUMP_RAW && stored == n)
+			memcpy(img + off, src + pos + 4, n);
+		else if (src[pos] != STL_DUMP_PACKBITS ||
+				 stl_unpackbits(src + pos + 4, stored, img + off, n) != n)
+			break;
+		pos += 4 + stored;
+	}
+	if (off < *size) {
+		free(img);
+		return NULL;
+	}
+	return img;
+}
+
+static unsigned char *stl_image_load(const char *path, size_t min_size,
+									 size_t *size);
+
+/* Write the contents of file PATH into flash starting at ADDR.
+ * A compact dump is expanded first, and written at ADDR as a raw image
+ * would be.
+ */
+static int stl_flash_fwrite(struct stlink *sl, const char* path,
+							stm32_addr_t addr, int max_size)
+{
+	unsigned char *image;
+	size_t size;
+	int ret;
+
+	image = stl_image_load(path, 0, &size);
+	if (image == NULL)
+		return -1;
+	if (size > max_size) {
+		fprintf(stderr, " Program is LARGER THAN FLASH and may not fit."
+				"  Trying anyway.\n"
+				"  Program at %s is %#8.8x bytes, flash is %#8.8x bytes.\n",
+				path, (int)size, max_size);
+	}
+
+	ret = stl_flash_write(sl, addr, image, size);
+	free(image);
+	if (ret & 0x0004) {
+		fprintf(stderr, "\n");
+	}
+	return ret;
+}
+
+/* Routines still left to implement. */
+
+/* Scattered reads.
+ * Code that shows or inspects target state wants many small reads at
+ * nearby addresses, and each separate read costs a USB round trip.
+ * stl_read_scatter() takes the whole list, merges reads that overlap or
+ * are within GAP bytes into aligned word transfers no longer than the
+ * STLink handles, queues them all at once and copies the results back.
+ * The gap only applies below peripheral space: reading an extra register
+ * may clear a status flag or pop a FIFO, so peripheral reads are merged
+ * only when they touch.
+ */
+#define STL_READ_GAP	64
+
+struct stl_rd_req {
+	uint32_t addr, len;
+	void *dest;					/* Where the result goes */
+	uint32_t buf_off;			/* Set by stl_read_plan() */
+};
+
+static int stl_rd_req_cmp(const void *a, const void *b)
+{
+	const struct stl_rd_req *ra = *(void **)a, *rb = *(void **)b;
+	return ra->addr < rb->addr ? -1 : ra->addr > rb->addr;
+}
+
+/* Plan the transfers for the N reads in REQS.
+ * The transfers are written to XFERS, packed end to end in a buffer of
+ * *BUF_LEN bytes, and each request's buf_off set to where its data lands.
+ * Returns the number of transfers, or -1 if there would be more than
+ * MAX_XFERS.
+ */
+static int stl_read_plan(struct stlink *sl, struct stl_rd_req *reqs, int n,
+						 int gap, struct stl_rd_req *xfers, int max_xfers,
+						 uint32_t *buf_len)
+{
+	struct stl_rd_req **sorted = malloc(n * sizeof *sorted);
+	uint32_t max_len = sl->rd_max ? sl->rd_max : READ_BLK_SIZE;
+	int i, nx = 0;
+
+	if (sorted == NULL)
+		return -1;
+	for (i = 0; i < n; i++)
+		sorted[i] = &reqs[i];
+	qsort(sorted, n, sizeof *sorted, stl_rd_req_cmp);
+	*buf_len = 0;
+	for (i = 0; i < n; i++) {
+		struct stl_rd_req *rq = sorted[i], *x = nx > 0 ? &xfers[nx - 1] : NULL;
+		uint32_t start = rq->addr & ~3, end = (rq->addr + rq->len + 3) & ~3;
+		uint32_t merge_gap = end <= 0x40000000 ? gap : 0;
+		if (x && start <= x->addr + x->len + merge_gap &&
+			end - x->addr <= max_len &&
+			! stl_xfer_bad(sl, end - x->addr)) {
+			if (end > x->addr + x->len) {
+				*buf_len += end - (x->addr + x->len);
+				x->len = end - x->addr;
+			}
+			rq->buf_off = x->buf_off + rq->addr - x->addr;
+			continue;
+		}
+		/* New transfers, split if longer than one read.  They are
+		 * contiguous in the buffer, so the request is too. */
+		rq->buf_off = *buf_len + (rq->addr & 3);
+		while (start < end) {
+			uint32_t len = end - start > max_len ? max_len : end - start;
+			while (stl_xfer_bad(sl, len))
+				len -= 4;
+			if (nx >= max_xfers) {
+				free(sorted);
+				return -1;
+			}
+			xfers[nx].addr = start;
+			xfers[nx].len = len;
+			xfers[nx].buf_off = *buf_len;
+			*buf_len += len;
+			start += len;
+			nx++;
+		}
+	}
+	free(sorted);
+	return nx;
+}
+
+/* Read each of the N requests in REQS into its dest.
+ * Requests already in the read cache are not read again.  A transfer
+ * that fails leaves its requests filled with ones, as unimplemented
+ * memory reads, so that display code can carry on.
+ * Returns 0, or the first USB error.
+ */
+static int stl_read_scatter(struct stlink *sl, struct stl_rd_req *reqs,
+							int n, int gap)
+{
+	struct stl_rd_req *todo = malloc(n * sizeof *todo), *xfers = NULL;
+	unsigned char *buf = NULL;
+	uint32_t buf_len;
+	int i, j, m = 0, nx = n, ret = 0;
+
+	if (todo == NULL)
+		return -1;
+	for (i = 0; i < n; i++)
+		if (stl_cache_get(sl, reqs[i].addr, reqs[i].dest, reqs[i].len) != 0) {
+			todo[m] = reqs[i];
+			nx += reqs[i].len / (READ_REF_SIZE - 4) + 1;
+			m++;
+		}
+	if (m == 0)
+		goto done;
+	if ((xfers = malloc(nx * sizeof *xfers)) == NULL ||
+		(nx = stl_read_plan(sl, todo, m, gap, xfers, nx, &buf_len)) < 0 ||
+		(buf = malloc(buf_len)) == NULL) {
+		ret = -1;
+		goto done;
+	}
+	/* Retire each ring's worth before queuing more, so the status of
+	 * every transfer is still in its queue slot when checked. */
+	for (i = 0; i < nx; i += STL_QUEUE_LEN) {
+		unsigned int first = sl->q_head;
+		int group = nx - i < STL_QUEUE_LEN ? nx - i : STL_QUEUE_LEN;
+		for (j = 0; j < group; j++)
+			stl_queue_rd32(sl, xfers[i+j].addr, xfers[i+j].len,
+						   buf + xfers[i+j].buf_off);
+		stl_queue_flush(sl);
+		for (j = 0; j < group; j++) {
+			struct stl_req *rq = &sl->queue[(first + j) % STL_QUEUE_LEN];
+			struct stl_rd_req *x = &xfers[i+j];
+			if (stl_req_failed(rq)) {
+				memset(buf + x->buf_off, 0xff, x->len);
+				if (ret == 0)
+					ret = rq->status ? rq->status : -1;
+			} else
+				stl_cache_put(sl, x->addr, buf + x->buf_off, x->len);
+		}
+	}
+	for (i = 0; i < m; i++)
+		memcpy(todo[i].dest, buf + todo[i].buf_off, todo[i].len);
+done:
+	free(buf);
+	free(xfers);
+	free(todo);
+	return ret;
+}
+
+/* Streaming upload to a file.
+ * The target is read in STL_STREAM_CHUNK pieces on this thread, which owns
+ * the STLink, and a writer thread puts them on disk.  The STL_STREAM_BUFS
+ * buffers rotate between the two: the reader fills buffer N while the
+ * writer empties N-1.  Memory use is fixed whatever the flash size, and
+ * the disk write overlaps the USB transfer rather than following it.
+ */
+#define STL_STREAM_CHUNK	(64*1024)
+#define STL_STREAM_BUFS		4
+
+struct stl_stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	unsigned char *buf[STL_STREAM_BUFS];
+	size_t len[STL_STREAM_BUFS];
+	unsigned int filled, written;	/* Buffer sequence numbers */
+	unsigned char *packed;		/* Encode into this for a compact dump */
+	int done;					/* The reader has finished */
+	int error;					/* The writer's errno, stops both */
+};
+
+static void *stl_stream_writer(void *arg)
+{
+	struct stl_stream *st = arg;
+
+	pthread_mutex_lock(&st->lock);
+	for (;;) {
+		unsigned char *p;
+		size_t len;
+		while (st->written == st->filled && ! st->done)
+			pthread_cond_wait(&st->cond, &st->lock);
+		if (st->written == st->filled)
+			break;
+		p = st->buf[st->written % STL_STREAM_BUFS];
+		len = st->len[st->written % STL_STREAM_BUFS];
+		pthread_mutex_unlock(&st->lock);
+		if (st->packed) {
+			len = stl_dump_pack(p, len, st->packed);
+			p = st->packed;
+		}
+		while (len > 0 && ! st->error) {
+			ssize_t n = write(st->fd, p, len);
+			if (n < 0 && errno != EINTR)
+				st->error = errno;
+			else if (n > 0)
+				p += n, len -= n;
+		}
+		pthread_mutex_lock(&st->lock);
+		if (st->error)
+			break;
+		st->written++;
+		pthread_cond_signal(&st->cond);
+	}
+	st->done = 1;
+	pthread_cond_signal(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+/* Read from the ARM memory starting at offet ADDR, writing SIZE bytes
+ * into file PATH, or to stdout if PATH is "-".
+ * The file need not be seekable, so a pipe works as well.  A PATH ending
+ * in ".stld" gets the compact dump format.
+ */
+int stl_fread(struct stlink* sl, const char* path,
+				 stm32_addr_t addr, size_t size)
+{
+	struct stl_stream st = {
+		PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t writer;
+	size_t off = 0;
+	int i, ret = 0;
+
+	st.fd = strcmp(path, "-") == 0 ? dup(1) :
+		open(path, O_WRONLY | O_TRUNC | O_CREAT, 0664);
+	if (st.fd < 0) {
+		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < STL_STREAM_BUFS; i++)
+		if ((st.buf[i] = malloc(STL_STREAM_CHUNK)) == NULL)
+			ret = -1;
+	if (stl_dump_name(path)) {
+		unsigned char hdr[STL_DUMP_HDR_LEN];
+		stl_dump_header(hdr, addr, size);
+		if ((st.packed = malloc(STL_DUMP_MAXLEN(STL_STREAM_CHUNK))) == NULL ||
+			write(st.fd, hdr, sizeof hdr) != sizeof hdr)
+			ret = -1;
+	}
+	if (ret || pthread_create(&writer, NULL, stl_stream_writer, &st) != 0) {
+		fprintf(stderr, " Failed to start writing '%s'.\n", path);
+		for (i = 0; i < STL_STREAM_BUFS; i++)
+			free(st.buf[i]);
+		free(st.packed);
+		close(st.fd);
+		return -1;
+	}
+
+	while (off < size) {
+		size_t len = size - off > STL_STREAM_CHUNK ? STL_STREAM_CHUNK
+			: size - off;
+		unsigned char *p;
+		int quit;
+		/* Wait for a free buffer, or the writer to give up. */
+		pthread_mutex_lock(&st.lock);
+		while (st.filled - st.written == STL_STREAM_BUFS && ! st.done)
+			pthread_cond_wait(&st.cond, &st.lock);
+		p = st.buf[st.filled % STL_STREAM_BUFS];
+		quit = st.done;
+		pthread_mutex_unlock(&st.lock);
+		if (quit)
+			break;
+		if ((ret = stl_read(sl, addr + off, p, len)) != 0)
+			break;
+		pthread_mutex_lock(&st.lock);
+		st.len[st.filled % STL_STREAM_BUFS] = len;
+		st.filled++;
+		pthread_cond_signal(&st.cond);
+		pthread_mutex_unlock(&st.lock);
+		off += len;
+	}
+	pthread_mutex_lock(&st.lock);
+	st.done = 1;
+	pthread_cond_signal(&st.cond);
+	pthread_mutex_unlock(&st.lock);
+	pthread_join(writer, NULL);
+
+	for (i = 0; i < STL_STREAM_BUFS; i++)
+		free(st.buf[i]);
+	free(st.packed);
+	if (close(st.fd) < 0 && st.error == 0)
+		st.error = errno;
+	if (ret != 0 || st.error) {
+		fprintf(stderr, " Failed to write '%s': %s\n", path,
+				ret ? "target read error" : strerror(st.error));
+		return -1;
+	}
+	return 0;
+}
+
+#if 0
+/* Verify that ARM memory starting at ADDR matches the next chunk from FD.
+ * Return the number of bytes successfully compared, zero if finished,
+ * or -1 if a mismatch occured.
+ */
+
+int stlink_verify_chunk(struct stlink* sl, int fd, stm32_addr_t addr)
+{
+	char filebuf[128*1024], flashbuf[128*1024];
+	ssize_t file_rdsize, flash_rdsize;
+
+	file_rdsize = read(fd, filebuf, sizeof filebuf);
+	if (size < 0) {
+		fprintf(stderr, " Failed to read file '%s' during verify: %s\n",
+				path, strerror(errno));
+		return -1;
+		}
+		if (size == 0)
+			return 0;
+
+		flash_rdsize = stl_read(sl, addr, flashbuf, file_rdsize);
+		/* Unlikely, but check anyway. */
+		if (flash_rdsize != file_rdsize) {
+			fprintf(stderr, " Mismatched read size during verify, %d vs %d.\n",
+					flash_rdsize, file_rdsize);
+			return -1;
+		}
+
+		/* Extremely uninformative about the failure. */
+		if (memcmp(filebuf, flashbuf, file_rdsize) != 0) {
+			fprintf(stderr, " Failed flash verify.\n");
+			return -1;
+		}
+		addr += file_rdsize;
+	}
+#endif
+
+/* Read the image file PATH, a raw image or a compact dump, into a newly
+ * allocated buffer of at least MIN_SIZE bytes, padded with the 0xff of
+ * erased flash.  Returns the buffer and the image size in *SIZE, or NULL.
+ */
+static unsigned char *stl_image_load(const char *path, size_t min_size,
+									 size_t *size)
+{
+	const int fd = open(path, O_RDONLY);
+	unsigned char *filebuf, *image;
+	struct stat st;
+	ssize_t len;
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	filebuf = malloc(st.st_size + 1);
+	len = filebuf ? read(fd, filebuf, st.st_size) : -1;
+	close(fd);
+	if (len != st.st_size) {
+		fprintf(stderr, " Failed to read '%s'.\n", path);
+		free(filebuf);
+		return NULL;
+	}
+	*size = len;
+	if (stl_dump_magic(filebuf, len)) {
+		uint32_t dump_addr;
+		unsigned char *dump = stl_dump_unpack(filebuf, len, &dump_addr, size);
+		free(filebuf);
+		if (dump == NULL) {
+			fprintf(stderr, " The dump '%s' is damaged.\n", path);
+			return NULL;
+		}
+		filebuf = dump;
+	}
+	if (*size >= min_size)
+		return filebuf;
+	image = realloc(filebuf, min_size);
+	if (image == NULL) {
+		free(filebuf);
+		return NULL;
+	}
+	memset(image + *size, 0xff, min_size - *size);
+	return image;
+}
+
+/* On-target checksums.
+ * Reading flash back costs about a microsecond a byte over USB.  The CRC
+ * unit takes a word every few cycles, so instead we run this program to
+ * checksum NBLK blocks of BLK_WORDS words from SRC_ADDR and read back
+ * only the CRCs, stored from RESULT_ADDR.  Each is stm32_crc32() of one
+ * block.  The CRC unit clock must be enabled by the caller.
+ */
+static const uint16_t crc_stub_code[] = {
+	 0xA708,			/* adr	r7, params */
+	 0x683C,			/* ldr	r4, [r7, #0] ; .CRC_DR */
+	 0x6878,			/* ldr	r0, [r7, #4] ; .SRC_ADDR */
+	 0x68FB,			/* ldr	r3, [r7, #12] ; .NBLK */
+	 0x6939,			/* ldr	r1, [r7, #16] ; .RESULT_ADDR */
+	 /* block: */
+	 0x2501,			/* movs	r5, #CRC_CR_RESET */
+	 0x60A5,			/* str	r5, [r4, #8] ; CRC_CR */
+	 0x68BA,			/* ldr	r2, [r7, #8] ; .BLK_WORDS */
+	 /* word: */
+	 0xC820,			/* ldmia	r0!, {r5} */
+	 0x6025,			/* str	r5, [r4, #0] ; CRC_DR */
+	 0x3A01,			/* subs	r2, r2, #0x01 */
+	 0xD1FB,			/* bne	word */
+	 0x6825,			/* ldr	r5, [r4, #0] */
+	 0xC120,			/* stmia	r1!, {r5} */
+	 0x3B01,			/* subs	r3, r3, #0x01 */
+	 0xD1F4,			/* bne	block */
+	 0xBE00,			/* bkpt	#0x00 */
+	 0xBF00,			/* nop */
+	 /* params: the following are overwritten before download. */
+	 0x3000, 0x4002,	/* .CRC_DR: .word 0x40023000 */
+	 0x0000, 0x0800,	/* .SRC_ADDR: .word 0x08000000 */
+	 0x0100, 0x0000,	/* .BLK_WORDS: .word 0x00000100 */
+	 0x0001, 0x0000,	/* .NBLK: .word 0x00000001 */
+	 0x0040, 0x2000,	/* .RESULT_ADDR: .word 0x20000040 */
+ };
+
+/* The same CRC without the CRC unit, a byte at a time from a 256 entry
+ * table downloaded to TABLE_ADDR.  It is six times slower, about the
+ * speed of reading over USB, but still sends only the CRCs.
+ */
+static const uint16_t crc_table_stub_code[] = {
+	 0xA711,			/* adr	r7, params */
+	 0x697C,			/* ldr	r4, [r7, #20] ; .TABLE_ADDR */
+	 0x6878,			/* ldr	r0, [r7, #4] ; .SRC_ADDR */
+	 0x68FB,			/* ldr	r3, [r7, #12] ; .NBLK */
+	 0x6939,			/* ldr	r1, [r7, #16] ; .RESULT_ADDR */
+	 /* block: */
+	 0x683E,			/* ldr	r6, [r7, #0] ; .CRC_INIT */
+	 0x68BA,			/* ldr	r2, [r7, #8] ; .BLK_WORDS */
+	 /* word: */
+	 0xC820,			/* ldmia	r0!, {r5} */
+	 0x406E,			/* eors	r6, r5 */
+	 0x0E35,			/* lsrs	r5, r6, #24 ; four times, MSB first */
+	 0x00AD,			/* lsls	r5, r5, #2 */
+	 0x5965,			/* ldr	r5, [r4, r5] */
+	 0x0236,			/* lsls	r6, r6, #8 */
+	 0x406E,			/* eors	r6, r5 */
+	 0x0E35, 0x00AD, 0x5965, 0x0236, 0x406E,
+	 0x0E35, 0x00AD, 0x5965, 0x0236, 0x406E,
+	 0x0E35, 0x00AD, 0x5965, 0x0236, 0x406E,
+	 0x3A01,			/* subs	r2, r2, #0x01 */
+	 0xD1E7,			/* bne	word */
+	 0xC140,			/* stmia	r1!, {r6} */
+	 0x3B01,			/* subs	r3, r3, #0x01 */
+	 0xD1E2,			/* bne	block */
+	 0xBE00,			/* bkpt	#0x00 */
+	 0xBF00,			/* nop */
+	 /* params: the following are overwritten before download. */
+	 0xFFFF, 0xFFFF,	/* .CRC_INIT: .word 0xFFFFFFFF */
+	 0x0000, 0x0800,	/* .SRC_ADDR: .word 0x08000000 */
+	 0x0100, 0x0000,	/* .BLK_WORDS: .word 0x00000100 */
+	 0x0001, 0x0000,	/* .NBLK: .word 0x00000001 */
+	 0x0460, 0x2000,	/* .RESULT_ADDR: .word 0x20000460 */
+	 0x0060, 0x2000,	/* .TABLE_ADDR: .word 0x20000060 */
+ };
+
+#define CRC_STUB_PARAMS		0x24
+#define CRC_STUB_RESULTS	0x40
+#define CRC_TABLE_PARAMS	0x48
+#define CRC_TABLE_ADDR		0x60
+#define CRC_TABLE_RESULTS	(CRC_TABLE_ADDR + 1024)
+
+/* The most blocks stl_target_crc() can do at once, with either program. */
+static int stl_target_crc_max(struct stlink *sl)
+{
+	return (stm_devids[sl->chip_index].sram_size - CRC_TABLE_RESULTS) / 4;
+}
+
+/* Compute the CRC of NBLK blocks of BLK_LEN bytes from ADDR on the target,
+ * into CRCS.  The core must be halted.  The CRC unit is checked with a
+ * known word first, and if it does not answer correctly the table-driven
+ * program is used.  The SRAM and core registers the program uses are
+ * restored afterwards, as is the CRC unit clock enable.  The CRC unit
+ * itself is reset: its data register cannot be written back on the F1
+ * or F4, so an application that was part way through a CRC when halted
+ * gets a wrong result.  CRC_IDR is not touched.
+ * The program runs with C_MASKINTS set, so a pending interrupt cannot run
+ * the application's handler over it and the SRAM it uses, and DHCSR is
+ * then put back.  RunCore cannot be used, since the STLink clears
+ * C_MASKINTS with it.
+ * Returns 0, or non-zero if the program could not be run or did not finish.
+ */
+static int stl_target_crc(struct stlink *sl, uint32_t addr, uint32_t blk_len,
+						  int nblk, uint32_t *crcs)
+{
+	static const unsigned char test_word[4] = {0x78, 0x56, 0x34, 0x12};
+	const struct stm_chip_params *chip = &stm_devids[sl->chip_index];
+	uint32_t prog_base = chip->sram_base;
+	uint32_t enr_addr = F1_RCC_AHBENR, enr_bit = F1_RCC_AHBENR_CRCEN, enr;
+	uint32_t crc_dr, results, regs[SIM_XPSR + 1], dhcsr = DHCSR_C_DEBUGEN;
+	unsigned char *p = sl->data_buf, *saved;
+	unsigned int expect_us;
+	int i, ret, hw_crc, save_len;
+
+	if ((blk_len & 3) || blk_len == 0 || nblk > stl_target_crc_max(sl))
+		return -1;
+	if (chip->cap_flags & ChipCapF4Flash) {
+		enr_addr = F4_RCC_AHB1ENR;
+		enr_bit = F4_RCC_AHB1ENR_CRCEN;
+	} else if (chip->cap_flags & ChipCapL15Flash) {
+		enr_addr = L15_RCC_AHBENR;
+		enr_bit = F4_RCC_AHB1ENR_CRCEN;
+	}
+	/* Enable the CRC unit and check it in a single batch. */
+	stl_batch_rd32(sl, enr_addr, &enr);
+	stl_batch_rd32(sl, DHCSR, &dhcsr);
+	stl_batch_flush(sl);
+	stl_batch_wr32(sl, enr_addr, enr | enr_bit);
+	stl_batch_wr32(sl, CRC_CR, CRC_CR_RESET);
+	stl_batch_wr32(sl, CRC_DR, read_uint32(test_word, 0));
+	stl_batch_rd32(sl, CRC_DR, &crc_dr);
+	stl_batch_flush(sl);
+	hw_crc = crc_dr == stm32_crc32(0xffffffff, test_word, 4);
+	results = hw_crc ? CRC_STUB_RESULTS : CRC_TABLE_RESULTS;
+
+	/* Save what the program will overwrite. */
+	save_len = results + 4*nblk;
+	saved = malloc(save_len);
+	if (saved == NULL || stl_read(sl, prog_base, saved, save_len) != 0) {
+		free(saved);
+		return -1;
+	}
+	stl_get_allregs(sl);
+	for (i = 0; i <= SIM_XPSR; i++)
+		regs[i] = read_uint32(sl->data_buf, 4*i);
+
+	if (hw_crc) {
+		memcpy(p, crc_stub_code, sizeof crc_stub_code);
+		write_uint32(p + CRC_STUB_PARAMS + 4, addr);
+		write_uint32(p + CRC_STUB_PARAMS + 8, blk_len / 4);
+		write_uint32(p + CRC_STUB_PARAMS + 12, nblk);
+		write_uint32(p + CRC_STUB_PARAMS + 16, prog_base + results);
+		stl_queue_wr32(sl, prog_base, p, sizeof crc_stub_code);
+		/* Four instructions a word, at the 8MHz clock out of reset. */
+		expect_us = (uint64_t)nblk * blk_len / 8;
+	} else {
+		if (sl->verbose)
+			fprintf(stderr, " No CRC unit, using a CRC table.\n");
+		pthread_once(&stm32_crc_once, stm32_crc_init);
+		memcpy(p, crc_table_stub_code, sizeof crc_table_stub_code);
+		write_uint32(p + CRC_TABLE_PARAMS + 4, addr);
+		write_uint32(p + CRC_TABLE_PARAMS + 8, blk_len / 4);
+		write_uint32(p + CRC_TABLE_PARAMS + 12, nblk);
+		write_uint32(p + CRC_TABLE_PARAMS + 16, prog_base + results);
+		write_uint32(p + CRC_TABLE_PARAMS + 20, prog_base + CRC_TABLE_ADDR);
+		for (i = 0; i < 256; i++)
+			write_uint32(p + CRC_TABLE_ADDR + 4*i, stm32_crc_table[i]);
+		stl_queue_wr32(sl, prog_base, p, CRC_TABLE_ADDR + 1024);
+		/* 24 instructions a word. */
+		expect_us = (uint64_t)nblk * blk_len * 6 / 8;
+	}
+	stl_batch_wreg(sl, 15, prog_base);
+	/* Mask interrupts while still halted, then run. */
+	stl_batch_wr32(sl, DHCSR, DHCSR_KEY | DHCSR_C_DEBUGEN | DHCSR_C_MASKINTS |
+				   DHCSR_C_HALT);
+	stl_batch_wr32(sl, DHCSR, DHCSR_KEY | DHCSR_C_DEBUGEN | DHCSR_C_MASKINTS);
+	stl_batch_flush(sl);
+	ret = stl_wait(sl, STL_WAIT_HALT, 0, 0, NULL, expect_us,
+				   expect_us / 250 + 100);
+	if (ret == 0)
+		ret = stl_read(sl, prog_base + results, crcs, 4*nblk);
+	else
+		stl_enter_debug(sl);
+
+	/* Put back the SRAM, registers, DHCSR and CRC unit clock, but not
+	 * CRC_DR.  The core stays halted. */
+	for (i = 0; i < save_len; i += READ_CAL_SIZE)
+		stl_queue_wr32(sl, prog_base + i, saved + i,
+					   save_len - i < READ_CAL_SIZE ? save_len - i :
+					   READ_CAL_SIZE);
+	for (i = 0; i < 8; i++)
+		stl_batch_wreg(sl, i, regs[i]);
+	stl_batch_wreg(sl, 15, regs[15]);
+	stl_batch_wreg(sl, SIM_XPSR, regs[SIM_XPSR]);
+	stl_batch_wr32(sl, enr_addr, enr);
+	stl_batch_wr32(sl, DHCSR, DHCSR_KEY | DHCSR_C_HALT |
+				   (dhcsr & (DHCSR_C_DEBUGEN | DHCSR_C_MASKINTS)));
+	stl_batch_flush(sl);
+	free(saved);
+	for (i = 0; i < nblk; i++)
+		crcs[i] = read_uint32((unsigned char *)crcs, 4*i);
+	return ret;
+}
+
+/* Verify that ARM memory starting at ADDR matches the contents of file PATH.
+ * When the core is halted, the target computes a CRC for each block of
+ * STL_VERIFY_BLK bytes or more, and only blocks whose CRC differs from
+ * the file are read back, to report where they differ.  A running core
+ * is not disturbed, and the whole range is read back instead.
+ */
+#define STL_VERIFY_BLK		1024
+#define STL_VERIFY_REPORTS	8		/* Differing blocks described */
+
+int stlink_fverify(struct stlink* sl, const char* path,
+						stm32_addr_t addr)
+{
+	unsigned char *image, *flashbuf = NULL;
+	uint32_t *crcs = NULL, blk_len = STL_VERIFY_BLK;
+	struct stl_rd_req *reqs = NULL;
+	size_t size, off;
+	int i, nblk, nreq = 0, nbad = 0, ret = -1;
+
+	image = stl_image_load(path, 0, &size);
+	if (image == NULL)
+		return -1;
+	if (size == 0) {
+		free(image);
+		return 0;
+	}
+	while (size / blk_len > stl_target_crc_max(sl))
+		blk_len *= 2;
+	nblk = size / blk_len;
+	flashbuf = malloc(size);
+	crcs = malloc((nblk + 1) * sizeof *crcs);
+	reqs = malloc((nblk + 1) * sizeof *reqs);
+	if (flashbuf == NULL || crcs == NULL || reqs == NULL) {
+		fprintf(stderr, " Failed to allocate memory to verify '%s'.\n", path);
+		goto done;
+	}
+
+	/* Read back the blocks with a different CRC and any final part block,
+	 * or all of it if the CRCs cannot be computed on the target. */
+	if (nblk == 0 || stl_get_status(sl) != STLINK_CORE_HALTED ||
+		stl_target_crc(sl, addr, blk_len, nblk, crcs) != 0) {
+		for (i = 0; i < nblk; i++)
+			crcs[i] = ~stm32_crc32(0xffffffff, image + i*blk_len, blk_len);
+	}
+	for (i = 0; i <= nblk; i++) {
+		off = (size_t)i * blk_len;
+		if (i == nblk ? off == size :
+			crcs[i] == stm32_crc32(0xffffffff, image + off, blk_len))
+			continue;
+		reqs[nreq].addr = addr + off;
+		reqs[nreq].len = i == nblk ? size - off : blk_len;
+		reqs[nreq].dest = flashbuf + off;
+		nreq++;
+	}
+	if (nreq && stl_read_scatter(sl, reqs, nreq, STL_READ_GAP) != 0) {
+		fprintf(stderr, " Target memory read failed during verify.\n");
+		goto done;
+	}
+	for (i = 0; i < nreq; i++) {
+		unsigned char *want = image + (reqs[i].addr - addr);
+		unsigned char *got = reqs[i].dest;
+		uint32_t j, first = 0, ndiff = 0;
+		for (j = 0; j < reqs[i].len; j++)
+			if (got[j] != want[j] && ndiff++ == 0)
+				first = j;
+		if (ndiff == 0)
+			continue;
+		if (nbad++ < STL_VERIFY_REPORTS)
+			fprintf(stderr, " Failed flash verify at 0x%8.8x: "
+					"%2.2x instead of %2.2x, %d bytes differ in "
+					"0x%8.8x..0x%8.8x.\n", reqs[i].addr + first, got[first],
+					want[first], ndiff, reqs[i].addr,
+					reqs[i].addr + reqs[i].len);
+	}
+	if (nbad > STL_VERIFY_REPORTS)
+		fprintf(stderr, " ... %d blocks differ in all.\n", nbad);
+	if (sl->verbose)
+		fprintf(stderr, " Verify: %d blocks of %d bytes checked by CRC, "
+				"%d read back.\n", nblk, blk_len, nreq);
+	if (nbad == 0)
+		ret = 0;
+done:
+	free(reqs);
+	free(crcs);
+	free(flashbuf);
+	free(image);
+	return ret;
+}
+
+/* Differential programming.
+ * Reflashing an image that differs from the target in a few pages need
+ * not erase and write all of it.  The image, padded with 0xff to the end
+ * of its last page, is checksummed per page and compared with the CRCs
+ * computed on the target.  Only the pages that differ are erased,
+ * skipping those already blank, and only the changed pages with data are
+ * written.  A final on-target CRC pass checks them all again.  As with
+ * program=, the pages after the image are left as they were, e.g. for
+ * EEPROM emulation or configuration data.
+ * The compare unit must be the erase page, so the page size comes from
+ * the chip table entry matching the device ID.  The erases go through
+ * stl_flash_erase_page(), which picks the XL bank 2 controller.  The F4
+ * sectors and L1 flash are not handled, nor is a device that matched
+ * only the generic entry, whose page size is a guess.  These get a full
+ * erase and write instead.
+ */
+static int stl_flash_update(struct stlink *sl, const char *path)
+{
+	static const unsigned char erased_word[4] = {0xff, 0xff, 0xff, 0xff};
+	const struct stm_chip_params *chip = &stm_devids[sl->chip_index];
+	uint32_t base = chip->flash_base, pgsize = chip->flash_pgsize;
+	int flash_pages = stl_flash_size(sl) / pgsize, npages;
+	uint32_t *want = NULL, *have = NULL, blank;
+	unsigned char *image;
+	size_t size;
+	int i, j, n_changed = 0, n_erased = 0, n_written = 0, ret = -1;
+
+	image = stl_image_load(path, flash_pages * pgsize, &size);
+	if (image == NULL)
+		return -1;
+	if (size > flash_pages * pgsize) {
+		fprintf(stderr, " Program at %s is %#8.8x bytes, larger than the "
+				"%#8.8x byte flash.\n", path, (int)size, flash_pages * pgsize);
+		goto done;
+	}
+	npages = (size + pgsize - 1) / pgsize;
+	if (npages == 0) {
+		fprintf(stderr, " Program at %s is empty.\n", path);
+		goto done;
+	}
+	if ((chip->cap_flags & (ChipCapF4Flash | ChipCapL15Flash)) ||
+		sl->chip_index == 0) {
+		fprintf(stderr, " %s, so the whole image is written.\n",
+				sl->chip_index == 0 ? "The flash page size of this part is "
+				"not known" : "This flash is not erased by pages");
+		if (stl_flash_erase_range(sl, base, size) == 0 &&
+			stl_flash_write(sl, base, image, size) == 0)
+			ret = stlink_fverify(sl, path, base);
+		goto done;
+	}
+
+	want = malloc(npages * sizeof *want);
+	have = malloc(npages * sizeof *have);
+	if (want == NULL || have == NULL)
+		goto done;
+	for (i = 0; i < npages; i++)
+		want[i] = stm32_crc32(0xffffffff, image + i*pgsize, pgsize);
+	for (blank = 0xffffffff, i = 0; i < pgsize; i += 4)
+		blank = stm32_crc32(blank, erased_word, 4);
+	if (stl_target_crc(sl, base, pgsize, npages, have) != 0) {
+		fprintf(stderr, " The on-target flash checksum failed.\n");
+		goto done;
+	}
+
+	for (i = 0; i < npages; i++) {
+		if (want[i] == have[i])
+			continue;
+		n_changed++;
+		if (have[i] != blank) {
+			if (stl_flash_erase_page(sl, base + i*pgsize) != 0)
+				goto done;
+			n_erased++;
+		}
+	}
+	/* Write each run of changed pages that are not blank in the image. */
+	for (i = 0; i < npages; i = j + 1) {
+		for (j = i; j < npages && want[j] != have[j] && want[j] != blank; j++)
+			;
+		if (j == i)
+			continue;
+		if (stl_flash_write(sl, base + i*pgsize, image + i*pgsize,
+							(j - i) * pgsize) != 0)
+			goto done;
+		n_written += j - i;
+	}
+	printf(" %d of %d pages changed: %d erased, %d written.\n",
+		   n_changed, npages, n_erased, n_written);
+
+	if (stl_target_crc(sl, base, pgsize, npages, have) != 0) {
+		fprintf(stderr, " The on-target flash checksum failed.\n");
+		goto done;
+	}
+	for (i = 0; i < npages && want[i] == have[i]; i++)
+		;
+	if (i < npages)
+		fprintf(stderr, " Failed flash verify in the page at 0x%8.8x.\n",
+				base + i*pgsize);
+	else
+		ret = 0;
+done:
+	free(want);
+	free(have);
+	free(image);
+	return ret;
+}
+
+#if 0
+#define STLINK_XFER_BLKSZ 2048
+static int stl_fread(struct stlink* sl, const char* path,
+						stm32_addr_t addr, size_t size)
+{
+	size_t off;
+
+	const int fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 00664);
+	if (fd == -1) {
+		fprintf(stderr, " Failed to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* Copy using 1K/2K/4K blocks. */
+	for (off = 0; off < size; off += STLINK_XFER_BLKSZ) {
+		size_t read_size = STLINK_XFER_BLKSZ;
+		if ((off + read_size) > size)
+			read_size = off + read_size;
+
+		/* Round up size to always read whole words. */
+		if (read_size & 3)
+			read_size = (read_size + 4) & ~(3);
+
+		stlink_read_mem32(sl, addr + off, read_size);
+
+		if (write(fd, sl->data_buf, read_size) != (ssize_t)read_size) {
+			fprintf(stderr, "write() != read_size\n");
+			close(fd);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/*
+ * Kick a STLink until it is in a workable mode.
+ * If the STLink is not in an expected mode, attempt to have it exit back
+ * to mass storage mode.
+ * The only known unexpected mode is DFU mode, which requires a reset
+ * and re-plug process to exit.
+ * This has many status messages sinces it's ugly, bogus and flakey.
+ */
+int stl_kick_mode(struct stlink *sl)
+{
+	int stlink_mode = stl_mode(sl);
+
+	/* Check if we are already in a usable mode. */
+	if (stlink_mode == STLinkDevMode_Debug ||
+		stlink_mode == STLinkDevMode_Mass)
+		return 0;
+
+#if 0
+	if (sl->verbose) {
+		sl->core_state = stl_get_status(sl);
+		fprintf(stderr, " STLink mode is %4.4x.\n"
+				" ARM status is 0x%4.4x: %s.\n",
+				stlink_mode, sl->core_state,
+				sl->core_state==STLINK_CORE_RUNNING ? "running" :
+				(sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
+	}
+#endif
+
+	/* Otherwise assume that we are in DFU mode and attempt to exit back
+	 * to mass storage mode.  The STLink drops off the bus and comes back,
+	 * which the transport waits for with hotplug events rather than
+	 * sleeping and retrying. */
+	fprintf(stderr, "\nAttempting to switch the STLink to a known mode...\n");
+	stl_exit_dfu_mode(sl);
+	if (sl->tp->replug)
+		return sl->tp->replug(sl);
+	return 0;
+}
+
+/* Set sl->chip_index based on target chip ID or other characteristics.
+ * Called after the STLink type has been determined. */
+static int stm_id_chip(struct stlink* sl)
+{
+	uint32_t core_id = stl_get_core_id(sl);
+	uint32_t idcode, cpuid;
+	struct stl_rd_req rd[] = {
+		{ DBGMCU_IDCODE, 4, &idcode },				/* At 0xE0042000 */
+		{ 0xE000ED00, 4, &cpuid },					/* CPUID */
+	};
+	int i;
+
+	/* The CPUID is read along with the ID code into the read cache, as
+	 * stm_info() wants it next.
+	 * The Cortex-M0 parts read zero here, with the DBGMCU in peripheral
+	 * space at 0x40015800 instead.  It is read there only when needed,
+	 * since that address may not exist on other parts. */
+	stl_read_scatter(sl, rd, 2, STL_READ_GAP);
+	if (idcode == 0)
+		idcode = sl_rd32(sl, 0x40015800);
+	sl->cpu_idcode = idcode;
+
+	if (verbose)
+		printf("SWD core ID %8.8x, MCU ID is %8.8x.\n",
+			   core_id, idcode);
+	for (i = 0; arm_cores[i].core_id; i++)
+		if (arm_cores[i].core_id == core_id)
+			break;
+	if (arm_cores[i].core_id == 0)
+		fprintf(stderr, "Warning: SWD core ID %8.8x did not match the "
+				"expected value of 0x-B--1477.\n", core_id);
+	if (verbose)
+		printf("  %s\n", arm_cores[i].name);
+
+	for (i = 0; stm_devids[i].name; i++)
+		if (idcode == stm_devids[i].dbgmcu_idcode) {
+			sl->chip_index = i;
+			break;
+		}
+	/* Another revision of a listed device has the same flash layout. */
+	if (stm_devids[i].name == NULL)
+		for (i = 0; stm_devids[i].name; i++)
+			if ((idcode & 0x0FFF) == (stm_devids[i].dbgmcu_idcode & 0x0FFF)) {
+				sl->chip_index = i;
+				break;
+			}
+
+	return 0;
+}
+
+/* The address of the 96 bit factory-programmed unique device ID. */
+static uint32_t stm_uid_addr(struct stlink *sl)
+{
+	int cap_flags = stm_devids[sl->chip_index].cap_flags;
+
+	if (cap_flags & ChipCapL1Addrs)
+		return 0x1FF80050;
+	if (cap_flags & ChipCapF4Flash)
+		return 0x1FFF7A10;
+	if ((sl->cpu_idcode & 0x0FFF) == 0x440)		/* STM32F0 */
+		return 0x1FFFF7AC;
+	return 0x1FFFF7E8;
+}
+
+/* Load the on-disk read cache for this STLink and target.
+ * The file is named by the STLink serial number and the target's unique
+ * ID, so a target moved to another STLink, or a new target on the same
+ * STLink, does not pick up the wrong contents.  It is rewritten when the
+ * STLink is closed.
+ */
+static void stm_cache_open(struct stlink *sl, const char *dir)
+{
+	unsigned char uid[12];
+	char uid_hex[sizeof uid * 2 + 1];
+	int i;
+
+	if (stl_read(sl, stm_uid_addr(sl), uid, sizeof uid) != 0)
+		return;
+	for (i = 0; i < sizeof uid; i++)
+		sprintf(uid_hex + i*2, "%2.2x", uid[i]);
+	snprintf(sl->cache_path, sizeof sl->cache_path, "%s/%s-%s.cache", dir,
+			 sl->serial[0] ? sl->serial : "noserial", uid_hex);
+	stl_cache_load(sl);
+}
+
+static void stm_info(struct stlink* sl)
+{
+	uint32_t cpu_id, chip_dev_id, devparam;
+	/* Every place a chip family keeps its flash size and information
+	 * block, read together.  Those not present read as ones. */
+	uint32_t f1_size, f1_info[4], f2_size, f2_info[4], f0_size;
+	struct stl_rd_req rd[] = {
+		{ 0xe000ed00, 4, &cpu_id },
+		{ 0x1FFFF7E0, 4, &f1_size },
+		{ 0x1FFFF800, 16, f1_info },
+		{ 0x1FFF7A20, 4, &f2_size },
+		{ 0x1FFFC000, 16, f2_info },
+		{ 0x1FFFF7CC, 4, &f0_size },
+	};
+
+	printf("Target STM32 MCU information:\n");
+
+	/* Should also read the CPU ID base register at 0xe000ed00
+	 * Cortex-M0 0x41--c20-
+	 * Cortex-M3 0x411fc231
+	 */
+	chip_dev_id = sl->cpu_idcode & 0x0FFF;
+	printf(" Target DBGMC_IDCODE %3.3x (Rev ID %4.4x) %s.\n",
+		   chip_dev_id, sl->cpu_idcode,
+		   stm_devids[sl->chip_index].name);
+
+	/* Read the device parameters: flash size and serial number. */
+	/* STMicro changes how to do this, seemingly for every chip. */
+	/* First we explicitly recognize a few chips. */
+	if (chip_dev_id == 0x416 || chip_dev_id == 0x427 || chip_dev_id == 0x436) {
+		rd[1] = (struct stl_rd_req){ 0x1FF8004C, 4, &devparam };
+		stl_read_scatter(sl, rd, 2, STL_READ_GAP);
+	} else
+		stl_read_scatter(sl, rd, sizeof rd / sizeof rd[0], STL_READ_GAP);
+	printf(" CPU ID base %8.8x.\n", cpu_id);
+
+	if (chip_dev_id == 0x416 || chip_dev_id == 0x427) {
+		sl->flash_mem_size = devparam & 0xffff;
+		printf(" Flash size %dK (register %4.4x).\n",
+			   sl->flash_mem_size, devparam);
+	} else if (chip_dev_id == 0x436) {
+		sl->flash_mem_size = (devparam & 1) ? 256 : 384; 	/* WTF? */
+		printf(" Flash size %dK (register %4.4x).\n",
+			   sl->flash_mem_size, devparam);
+	} else if (0xffffffff != (devparam = f1_size)) {
+	/* The STM32F1 has the flash size at 0x1FFFf7e0. */
+		sl->flash_mem_size = devparam & 0xffff;
+		printf(" Flash size %dK (register %4.4x).\n",
+			   sl->flash_mem_size, devparam);
+		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
+			   f1_info[0], f1_info[1], f1_info[2], f1_info[3]);
+	} else if (0xffffffff != (devparam = f2_size)) {
+		/* The STM32F2 and STM32F4 have the flash size at 0x1FFF7A22. */
+		sl->flash_mem_size = devparam >> 16;
+		printf(" Flash size %dK (register 0x1FFF7A20 %4.4x).\n",
+			   sl->flash_mem_size, devparam);
+		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
+			   f2_info[0], f2_info[1], f2_info[2], f2_info[3]);
+	} else if (0xffffffff != (devparam = f0_size)) {
+		sl->flash_mem_size = devparam & 0xFFFF;
+		printf(" Flash size %dK (register 0x1FFFF7CC %4.4x).\n",
+			   sl->flash_mem_size, devparam);
+		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
+			   f1_info[0], f1_info[1], f1_info[2], f1_info[3]);
+	}
+
+	return;
+}
+
+/* Blink the LEDs on a STM32VLDiscovery board.
+ * This may be used as a visual liveness test in scripts.
+ * The LEDs are on PortC pins PC8 and PC9
+ * RM0041 Reference manual - STM32F100xx advanced ARM-based 32-bit MCUs
+ */
+#define GPIOB		0x40010C08		/* PortB register base */
+#define GPIOC		0x40011000		/* PortC register base */
+#define GPIOC_CRH	(GPIOC + 0x04)	/* Port configuration register high */
+#define GPIOC_ODR	(GPIOC + 0x0c)	/* Port output data register */
+#define LED_BLUE	(1<<8)
+#define LED_GREEN	(1<<9)
+
+static void stm_discovery_blink(struct stlink* sl)
+{
+	uint32_t PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig;
+	uint32_t APBnENR_orig[2];
+	int i;
+
+	PortC_hi_iocfg = sl_rd32(sl, GPIOC_CRH);
+	/* Read APB2ENR and APB1ENR at 0x40021018-1F */
+	stl_read(sl, 0x40021018, APBnENR_orig, sizeof APBnENR_orig);
+
+	/* Future: Enable GPIO ports. */
+	APB2ENR_orig = APBnENR_orig[0];  /* 0x40021018 */
+	APB1ENR_orig = APBnENR_orig[1];  /* 0x4002101C (yes, 1 is higher) */
+
+	if (sl->verbose)
+		fprintf(stderr, "GPIOC_CRH = 0x%08x, APB1ENR=%#08x, APB2ENR=%#08x\n",
+				PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig);
+
+	/* Make certain PC8/PC9 are GPIO outputs -- any speed will do. */
+	if ((PortC_hi_iocfg & 0xCC) != 0x00)
+		sl_wr32(sl, GPIOC_CRH, (PortC_hi_iocfg & ~0xff) | 0x11);
+	for (i = 0; i < 10; i++) {
+		sl_wr32(sl, GPIOC_ODR, LED_GREEN);
+		usleep(100* 1000);
+		sl_wr32(sl, GPIOC_ODR, LED_BLUE);
+		usleep(100* 1000);
+	}
+	/* Conditionally restore original GPIO settings. */
+	if ((PortC_hi_iocfg & 0xCC) != 0x00)
+		sl_wr32(sl, GPIOC_CRH, PortC_hi_iocfg);
+	return;
+}
+
+#if 0
+/* Set an interrupt to pending.  This should be used with caution as some
+ * interrupt handlers expect only hardware events e.g. a serial character
+ * has arrived. */
+/* Bitmap, must write as 32 bit word */
+const int IntrSetPendingBase = 0xE000E200;
+
+static void stm_raise_irq(struct stlink* sl, int irq_num)
+{
+	if (irq_num > 248) {
+		printf("Invalid interrupt number %d.  Cannot set pending.\n", irq_num);
+		return;
+	}
+	sl_wr32(sl, IntrSetPendingBase + ((irq_num & 0xE0)>>3),
+			1 << (irq_num & 0x1F));
+	return;
+}
+#endif
+
+/* Further register blocks of a peripheral, relative to its address.
+ * Their contents follow the main region in the show function's data. */
+struct dev_extent {
+	int32_t offset;
+	int len;					/* 0 ends the list */
+};
+
+struct dev_peripheral {			/* Peripheral device table */
+	const char *name;			/* TIM1, CAN1 etc */
+	uint32_t addr;				/* Address in STM32 space */
+	int unit_num;				/* Unit number, 0 if sole unit */
+	void (*show_func1)(struct stlink* sl, struct dev_peripheral *dev_per,
+					   uint32_t data_blk[]);
+	int extent;					/* Size of peripheral region */
+	const struct dev_extent *more;	/* Other regions to read, or NULL */
+	uint32_t avail;				/* Chip feature bitmap */
+	int feature;				/* Dev feature bitmap e.g. ADC2 misisng regs  */
+};
+
+static void stm_show_timer(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data[])
+{
+	char active_map[4] = " H L";
+
+	printf("%s Timer %d at %8.8x:  %4.4x %4.4x %4.4x %4.4x"
+		   "  %4.4x %4.4x %4.4x %4.4x  %4.4x\n"
+		   " IntrEnb:%4.4x Status:%4.4x\n"
+		   " Count: %d Prescale: x%d Top: %d.\n"
+		   " Ch1: %d %c Ch2: %d %c Ch3: %d %c Ch4: %d %c.\n",
+		   dp->name, dp->unit_num, dp->addr,
+		   data[0], data[1], data[2], data[3],
+		   data[4], data[5], data[6], data[7], data[8],
+		   data[3], data[4],
+		   data[9], data[10]+1, data[11],
+		   data[13], active_map[(data[8] >> 0) & 3],
+		   data[14], active_map[(data[8] >> 4) & 3],
+		   data[15], active_map[(data[8] >> 8) & 3],
+		   data[16], active_map[(data[8] >> 12) & 3]);
+}		
+
+/* The mailboxes and FIFOs, then the filters.  The filters belong to
+ * CAN1, and CAN2 shares them. */
+static const struct dev_extent can1_more[] = {
+	{0x180, 80}, {0x200, 32}, {0x240, 28*8}, {0, 0}};
+static const struct dev_extent can2_more[] = {
+	{0x180, 80}, {-0x200, 32}, {-0x1C0, 28*8}, {0, 0}};
+
+static void stm_show_CAN(struct stlink *sl, struct dev_peripheral *dp,
+						 uint32_t data[])
+{
+	uint32_t *fifo = data + 8, *filt = data + 28, *bank = data + 36;
+	uint32_t mode_map, scale_map, fifo_map, active_map;
+	int i;
+
+	printf("%s at %8.8x: MCR %8.8x MSR %8.8x\n"
+		   " Tx/Rx0/Rx1 %8.8x %8.8x %8.8x\n"
+		   " IntrEnb %8.8x Errors %8.8x BitTiming %8.8x\n",
+		   dp->name, dp->addr,
+		   data[0], data[1], data[2], data[3],
+		   data[4], data[5], data[6], data[7]);
+	/* Show FIFO contents. */
+	printf(" CAN FIFOs\n"
+		   "  Tx0: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Tx1: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Tx2: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Rx0: %8.8x %8.8x %8.8x %8.8x\n"
+		   "  Rx1: %8.8x %8.8x %8.8x %8.8x\n",
+		   fifo[0], fifo[1], fifo[2], fifo[3],
+		   fifo[4], fifo[5], fifo[6], fifo[7],
+		   fifo[8], fifo[9], fifo[10], fifo[11],
+		   fifo[12], fifo[13], fifo[14], fifo[15],
+		   fifo[16], fifo[17], fifo[18], fifo[19]);
+
+	/* Show filter, Mode/scale/dest/on %8.8x %8.8x %8.8x.\n */
+	printf(" Rx filter   FMR %8.8x\n"
+		   "  Mode/scale/dest/on %8.8x %8.8x %8.8x %8.8x.\n",
+		   filt[0], filt[1], filt[3], filt[5], filt[7]);
+	mode_map = filt[1];
+	scale_map = filt[3];
+	fifo_map = filt[5];
+	active_map = filt[7];
+	for (i = 0; i < 28; i++)
+		if (active_map & (1<<i)) {
+			printf("  Filter %d FIFO %c ", i, fifo_map & (1<<i) ? '1' : '0');
+			if (scale_map & (1<<i))
+				printf("%8.8x %8.8x\n",
+					   bank[i*2], bank[i*2 + 1]);
+			else
+				printf("%4.4x %4.4x (%3.3x %3.3x) %4.4x %4.4x (%3.3x %3.3x)\n",
+					   bank[i*2] & 0xffff, bank[i*2] >> 16,
+					   (bank[i*2] >> 5) & 0x7ff, (bank[i*2] >> 21) & 0x7ff,
+					   bank[i*2 + 1] & 0xffff, bank[i*2 + 1] >> 16,
+					   (bank[i*2+1]>>5) & 0x7ff, (bank[i*2+1]>>21) & 0x7ff);
+		}
+
+	return;
+}
+
+static void stm_show_DMA(struct stlink* sl, struct dev_peripheral *dp,
+						 uint32_t data[])
+{
+	int i;
+	printf("%s at %8.8x: interrupts %8.8x %8.8x\n",
+		   dp->name, dp->addr, data[0], data[1]);
+	for (i = 1; i <= 7; i++) {
+		int cb = i*5-3;
+		printf(" Channel %d: %8.8x  %d words %8.8x%s%s %8.8x%s\n",
+			   i, data[cb], data[cb+1],
+			   data[cb+2], data[cb] & 0x40 ? "++" : "  ",
+			   data[cb] & 0x10 ? "<-" : "->",
+			   data[cb+3], data[cb] & 0x80 ? "++" : "  ");
+	}
+	return;
+}
+
+static void stm_show_SPI(struct stlink* sl, struct dev_peripheral *dp,
+						 uint32_t data[])
+{
+	printf("%s at %8.8x: %8.8x %8.8x\n",
+		   dp->name, dp->addr, data[0], data[1]);
+}
+
+static void stm_show_USART(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data[])
+{
+	printf("%s at %8.8x: %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x\n"
+		   "  Divisor %d residue %d\n",
+		   dp->name, dp->addr, data[0], data[1], data[2], data[3],
+		   data[4], data[5], data[6], data[7],
+		   data[3]>>4, data[3] & 0xF);
+}
+
+static void arm_show_systick(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data_blk[])
+{
+	printf("SysTick at %8.8x: Ctrl %4.4x reload %d, count %d\n"
+		   "  calibration %d (%#x)\n",
+		   dp->addr, data_blk[0], data_blk[1], data_blk[2],
+		   data_blk[3] & 0x00ffffff, data_blk[3]);
+}
+
+static char *lcd_duty_cycle[8] = {
+	"No COM", "2 COM", "3 COM", "4 COM", "8 COM",
+	"invalid", "invalid", "invalid"};
+static void stm_show_LCD(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data_blk[])
+{
+	printf("LCD controller at %8.8x: Ctrl 0x%2.2x Frame 0x%8.8x, Status %2.2x\n"
+		   "  %s %s mode 1/%d-bias, %s pins, %s voltage\n",
+		   dp->addr, data_blk[0], data_blk[1], data_blk[2],
+		   data_blk[0] &0x01 ? "Enabled" : "Disabled",
+		   data_blk[0] &0x80 ? "32 seg" : "44 seg",
+		   data_blk[0] &0x40 ? 3 : data_blk[0] &0x20 ? 2 : 4,
+		   lcd_duty_cycle[(data_blk[0] &0x1F)>>2],
+		   data_blk[0] &0x02 ? "V_lcd pin" : "internal" );
+	printf(" Display: %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x\n"
+		   "          %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x\n",
+		   data_blk[6] & 0xffff, data_blk[5],
+		   data_blk[8] & 0xffff, data_blk[7],
+		   data_blk[10] & 0xffff, data_blk[9],
+		   data_blk[12] & 0xffff, data_blk[11],
+		   data_blk[14] & 0xffff, data_blk[13],
+		   data_blk[16] & 0xffff, data_blk[15],
+		   data_blk[18] & 0xffff, data_blk[17],
+		   data_blk[20] & 0xffff, data_blk[19]);
+}
+
+static void stm_show_dev(struct stlink* sl, struct dev_peripheral *dp,
+							 uint32_t data[])
+{
+	int i;
+	printf("%s at %8.8x:", dp->name, dp->addr);
+	for (i = 0; i < dp->extent/4; i++)
+		printf(" %4.4x", data[i]);
+	printf("\n");
+}
+
+struct dev_peripheral dev_per[] = {
+	{"SysTick", 0xE000E010, 0, arm_show_systick, 16},
+	{"CAN1", 0x40006400, 1, stm_show_CAN, 32, can1_more},
+	{"CAN2", 0x40006800, 2, stm_show_CAN, 32, can2_more},
+	{"DMA1", 0x40020000, 1, stm_show_DMA, 8 + 20*7},
+	{"DMA2", 0x40020400, 2, stm_show_DMA, 8 + 20*7},
+	{"PORTA", 0x40010800, 0, stm_show_dev, 28},
+	{"PORTB", 0x40010C00, 0, stm_show_dev, 28},
+	{"PORTC", 0x40011000, 0, stm_show_dev, 28},
+	{"PORTD", 0x40011400, 0, stm_show_dev, 28},
+	{"PORTE", 0x40011800, 0, stm_show_dev, 28},
+	{"PORTF", 0x40011C00, 0, stm_show_dev, 28},
+	{"PORTG", 0x40012000, 0, stm_show_dev, 28},
+	{"SPI1", 0x40013000, 1, stm_show_SPI, 36},
+	{"SPI2", 0x40003800, 2, stm_show_SPI, 36},
+	{"SPI3", 0x40003C00, 3, stm_show_SPI, 36},
+	{"TIM1", 0x40012C00, 1, stm_show_timer, 76}, /* Do not read TIMx_DMAR */
+	{"TIM1a",0x40010000, 1, stm_show_timer, 76}, /* 32F4xx only */
+	{"TIM2", 0x40000000, 2, stm_show_timer, 76},
+	{"TIM3", 0x40000400, 3, stm_show_timer, 76},
+	{"TIM4", 0x40000800, 4, stm_show_timer, 76},
+	{"TIM5", 0x40000C00, 5, stm_show_timer, 76},
+	{"TIM6", 0x40001000, 6, stm_show_timer, 76},
+	{"TIM7", 0x40001400, 7, stm_show_timer, 76},
+	{"TIM8", 0x40010400, 8, stm_show_timer, 76}, 	/* 32F4xx */
+	{"TIM9", 0x40014000, 9, stm_show_timer, 76}, 	/* 32F4xx */
+	{"TIM10", 0x40014400, 10, stm_show_timer, 76}, /* 32F4xx */
+	{"TIM11", 0x40014800, 11, stm_show_timer, 76}, /* 32F4xx */
+	{"TIM12", 0x40001800, 12, stm_show_timer, 76},
+	{"TIM13", 0x40001C00, 13, stm_show_timer, 76},
+	{"TIM14", 0x40002000, 14, stm_show_timer, 76},
+	{"TIM15", 0x40014000, 15, stm_show_timer, 76},
+	{"TIM16", 0x40014400, 16, stm_show_timer, 76},
+	{"TIM17", 0x40014800, 17, stm_show_timer, 76},
+	{"USART1", 0x40013800, 1, stm_show_USART, 7*4},
+	{"USART2", 0x40004400, 2, stm_show_USART, 7*4},
+	{"USART3", 0x40004800, 3, stm_show_USART, 7*4},
+	{"USART4", 0x40004C00, 4, stm_show_USART, 7*4},
+	{"USART5", 0x40005000, 5, stm_show_USART, 7*4},
+	{"USART1a", 0x40011000, 1, stm_show_USART, 7*4}, /* 32F4xx */
+	{"USART6", 0x40011400, 6, stm_show_USART, 7*4},
+	{"I2C1", 0x40005400, 1, stm_show_dev, 36},
+	{"I2C2", 0x40005800, 2, stm_show_dev, 36},
+	{"I2C3", 0x40005C00, 3, stm_show_dev, 36},
+	{"DAC",  0x40007400, 3, stm_show_dev, 56},
+#if 0
+	{"I2S2", 0x40003400, 2, stm_show_dev, 0},
+	{"RTC", 0x40002800, 0, stm_show_RTC, 0},
+	{"WWDG", 0x40002C00, 0, stm_show_WWDG, 0},
+	{"IWDG", 0x40003000, 0, stm_show_IWDG, 0},
+#endif
+	/* I/O pin configuration on new F3; use 'GPIO' instead of PORT. */
+	{"GPIOA", 0x48000000, 0, stm_show_dev, 44},
+	{"GPIOB", 0x48000400, 0, stm_show_dev, 44},
+	{"GPIOC", 0x48000800, 0, stm_show_dev, 44},
+	{"GPIOD", 0x48000C00, 0, stm_show_dev, 44},
+	{"GPIOE", 0x48001000, 0, stm_show_dev, 44},
+	{"GPIOF", 0x48001400, 0, stm_show_dev, 44},
+};
+
+/* Previously I had hoped to use a single table, but
+ * chips increasing shuffle perhiperals.
+ * Put the L1 series on its own table.
+ */
+struct dev_peripheral dev_per_L1[] = {
+	{"SysTick", 0xE000E010, 0, arm_show_systick, 16},
+	{"LCD", 	0x40002400, 0, stm_show_LCD, 84},
+	{"PWR", 	0x40007000, 0, stm_show_dev, 32},
+	{"RI",		0x40007C00, 0, stm_show_dev, 32},
+	{"OPAMP",	0x40007C5C, 0, stm_show_dev, 32},
+	/* APB2 */
+	{"SYSCFG",	0x40010000, 0, stm_show_dev, 32},
+	{"EXTI",	0x40010400, 0, stm_show_dev, 32},
+	{"TIM9",	0x40010800, 9, stm_show_timer, 76},
+	{"TIM10",	0x40010C00, 10, stm_show_timer, 76},
+	{"TIM11",	0x40011000, 11, stm_show_timer, 76},
+	{"ADC",		0x40012400, 1, stm_show_dev, 32},
+	{"SDIO",	0x40012C00, 1, stm_show_dev, 32},
+	/* AHB perhiperals, all with new locations */
+	{"CRC",		0x40023000, 0, stm_show_dev, 32},
+	{"RCC",		0x40023800, 0, stm_show_dev, 56},
+	{"FLASH",	0x40023C00, 0, stm_show_dev, 32},
+	{"DMA1",	0x40026000, 1, stm_show_DMA, 8 + 20*7},
+	{"DMA2",	0x40026400, 2, stm_show_DMA, 8 + 20*7},
+	{"AES",		0x50060000, 0, stm_show_dev, 32},
+	/* I/O pin configuration on new F3; use 'GPIO' instead of PORT. */
+	{"GPIOA", 0x40020000, 0, stm_show_dev, 44},
+	{"GPIOB", 0x40020400, 0, stm_show_dev, 44},
+	{"GPIOC", 0x40020800, 0, stm_show_dev, 44},
+	{"GPIOD", 0x40020C00, 0, stm_show_dev, 44},
+	{"GPIOE", 0x40021000, 0, stm_show_dev, 44},
+	{"GPIOF", 0x40021800, 0, stm_show_dev, 44}, /* Not in address order */
+	{"GPIOG", 0x40021C00, 0, stm_show_dev, 44},
+	{"GPIOH", 0x40021400, 0, stm_show_dev, 44},
+};
 
-		/* Round up size to always read whole words. */
-		if (read_size & 3)
-			read_size = (read_size + 4) & ~(3);
+static struct dev_peripheral *stm32_dev_find(struct stlink *sl,
+											 const char *name, int len)
+{
+	int i;
 
-		stlink_read_mem32(sl, addr + off, read_size);
+	if (stm_devids[sl->chip_index].cap_flags & ChipCapL1Addrs) {
+		for (i = 0; i < sizeof(dev_per_L1)/sizeof(dev_per_L1[0]); i++)
+			if (strncasecmp(dev_per_L1[i].name, name, len) == 0 &&
+				dev_per_L1[i].name[len] == 0)
+				return &dev_per_L1[i];
+	}
+	for (i = 0; i < sizeof(dev_per)/sizeof(dev_per[0]); i++)
+		if (strncasecmp(dev_per[i].name, name, len) == 0 &&
+			dev_per[i].name[len] == 0)
+			return &dev_per[i];
+	return NULL;
+}
 
-		if (write(fd, sl->data_buf, read_size) != (ssize_t)read_size) {
-			fprintf(stderr, "write() != read_size\n");
-			close(fd);
+/* Show the peripherals named in CMD_NAME, a comma-separated list such as
+ * "TIM1,TIM2,USART1".  The registers of all of them are read in one
+ * scattered read, so a list costs little more than one device.
+ */
+#define STM_DEV_SHOW_MAX	16
+#define STM_DEV_WORDS		128		/* The largest device's registers */
+
+static int stm32_dev_show(struct stlink* sl, const char *cmd_name)
+{
+	struct dev_peripheral *devs[STM_DEV_SHOW_MAX];
+	uint32_t (*data)[STM_DEV_WORDS];
+	struct stl_rd_req rd[STM_DEV_SHOW_MAX * 4];
+	int ndevs = 0, nrd = 0, i;
+
+	while (*cmd_name) {
+		int len = strcspn(cmd_name, ",");
+		if (ndevs >= STM_DEV_SHOW_MAX ||
+			(devs[ndevs] = stm32_dev_find(sl, cmd_name, len)) == NULL)
 			return -1;
+		ndevs++;
+		cmd_name += len + (cmd_name[len] == ',');
+	}
+	if (ndevs == 0 ||
+		(data = calloc(ndevs, sizeof *data)) == NULL)
+		return -1;
+	for (i = 0; i < ndevs; i++) {
+		struct dev_peripheral *dp = devs[i];
+		const struct dev_extent *ext;
+		int off = dp->extent;
+		if (dp->extent)
+			rd[nrd++] = (struct stl_rd_req){ dp->addr, dp->extent, data[i] };
+		for (ext = dp->more; ext && ext->len; ext++) {
+			rd[nrd++] = (struct stl_rd_req){ dp->addr + ext->offset,
+											 ext->len, (char *)data[i] + off };
+			off += ext->len;
 		}
 	}
-
+	stl_read_scatter(sl, rd, nrd, STL_READ_GAP);
+	for (i = 0; i < ndevs; i++)
+		devs[i]->show_func1(sl, devs[i], data[i]);
+	free(data);
 	return 0;
 }
-#endif
 
-/*
- * Kick a STLink until it is in a workable mode.
- * If the STLink is not in an expected mode, attempt to have it exit back
- * to mass storage mode.
- * The only known unexpected mode is DFU mode, which requires a reset
- * and re-plug process to exit.
- * This has many status messages sinces it's ugly, bogus and flakey.
+/* Probe enumeration.
+ * A host may have many STLinks attached, e.g. a gang programming station.
+ * We identify each by its USB bus and port path, which is stable across
+ * re-plugs into the same socket, and by its serial number string.
  */
-int stl_kick_mode(struct stlink *sl)
-{
-	int i;
-	int stlink_mode = stl_mode(sl);
+#define STL_MAX_PROBES	32
+#define STL_SERIAL_LEN	64
+
+struct stl_usb_probe {
+	uint8_t bus;
+	uint8_t port_path[8];
+	int port_depth;
+	char path[32];				/* "bus-port.port..." */
+	char serial[STL_SERIAL_LEN];
+};
 
-	/* Check if we are already in a usable mode. */
-	if (stlink_mode == STLinkDevMode_Debug ||
-		stlink_mode == STLinkDevMode_Mass)
-		return 0;
+/* Format the "bus-port.port..." path of DEV, which names a USB socket
+ * and so stays the same when a STLink is replugged or re-enumerates. */
+static void stl_usb_dev_path(libusb_device *dev, char *path, int size)
+{
+	uint8_t port_path[8];
+	int depth = libusb_get_port_numbers(dev, port_path, sizeof port_path);
+	int j, len;
+
+	len = snprintf(path, size, "%d", libusb_get_bus_number(dev));
+	for (j = 0; j < depth && len < size; j++)
+		len += snprintf(path + len, size - len, "%c%d", j ? '.' : '-',
+						port_path[j]);
+}
 
-#if 0
-	if (sl->verbose) {
-		sl->core_state = stl_get_status(sl);
-		fprintf(stderr, " STLink mode is %4.4x.\n"
-				" ARM status is 0x%4.4x: %s.\n",
-				stlink_mode, sl->core_state,
-				sl->core_state==STLINK_CORE_RUNNING ? "running" :
-				(sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
-	}
-#endif
+/* Open the STLink v2 at USB PATH, or return NULL if it is not there. */
+static libusb_device_handle *stl_usb_path_open(libusb_context *ctx,
+											   const char *path)
+{
+	libusb_device_handle *dev_handle = NULL;
+	libusb_device **devs;
+	ssize_t cnt;
+	int i;
 
-	/* Otherwise assume that we are in DFU mode and attempt to exit back
-	 * to mass storage mode.  This is super painful and slow. */
-	fprintf(stderr, "\nAttempting to switch the STLink to a known mode...\n");
-	stl_exit_dfu_mode(sl);
-#if defined(__ms_windows__)
-	CloseHandle(sl->fd);
-#else
-	close(sl->fd);
-#endif
-	/* If this worked, the device has reset and disconnected.
-	 * A disconnect lasts for several seconds.
-	 * Give the kernel time to handle the fresh plug event.
-	 */
-	fprintf(stderr, "Waiting to reopen the STLink device at '%s' ...\n",
-			sl->dev_path);
-	for (i = 0; i < 10; i++) {
-		sl->fd = open(sl->dev_path, O_RDWR);
-		if (sl->fd >= 0) {
-			/* Give the STLink a few rounds to start working. */
-			stl_enter_SWD_mode(sl);
-			sl->core_state = stl_get_status(sl);
-			if (sl->verbose)
-				printf(" ARM status is 0x%4.4x: %s.\n", sl->core_state,
-					   sl->core_state==STLINK_CORE_RUNNING ? "running" :
-					   (sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
-			if (sl->core_state==STLINK_CORE_RUNNING ||
-				sl->core_state==STLINK_CORE_HALTED)
-					return 0;
-			close(sl->fd);
-			sl->fd = -1;
-		} else {
-			if (sl->verbose)
-				printf(" Reopen failed.\n");
+	cnt = libusb_get_device_list(ctx, &devs);
+	for (i = 0; i < cnt; i++) {
+		struct libusb_device_descriptor desc;
+		char dev_path[32];
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0 ||
+			desc.idVendor != USB_ST_VID || desc.idProduct != USB_STLINKv2_PID)
+			continue;
+		stl_usb_dev_path(devs[i], dev_path, sizeof dev_path);
+		if (strcmp(dev_path, path) == 0) {
+			if (libusb_open(devs[i], &dev_handle) != 0)
+				dev_handle = NULL;
+			break;
 		}
-		sleep(1);
 	}
-	return -1;
+	if (cnt >= 0)
+		libusb_free_device_list(devs, 1);
+	return dev_handle;
 }
 
-/* Set sl->chip_index based on target chip ID or other characteristics.
- * Called after the STLink type has been determined. */
-static int stm_id_chip(struct stlink* sl)
+/* Fill in PROBES[] with up to MAX STLink v2 devices found through CTX.
+ * Returns the number found, or -1 if USB access failed. */
+static int stl_usb_list(libusb_context *ctx, struct stl_usb_probe *probes,
+						int max);
+
+/* Return the index of the first of PROBES[] that SEL, a serial number or
+ * USB path, names.  Any probe matches a NULL SEL.  -1 if none match. */
+static int stl_probe_find(const struct stl_usb_probe *probes, int nprobes,
+						  const char *sel)
 {
-	uint32_t core_id = stl_get_core_id(sl);
-	uint32_t idcode;
 	int i;
 
-	/* This should be conditional on core_id.
-	 * If core_id == 0x0BB11477, then we have a Cortex-M0 and should read
-	 * the idcode from 0x40015800 instead of 0xE0042000. */
-	idcode = sl_rd32(sl, DBGMCU_IDCODE); 			/* At 0xE0042000 */
-	if (idcode == 0)								/* Cortex-M0 */
-		idcode = sl_rd32(sl, 0x40015800);
-	sl->cpu_idcode = idcode;
+	for (i = 0; i < nprobes; i++)
+		if (sel == NULL || strcmp(sel, probes[i].path) == 0 ||
+			strcmp(sel, probes[i].serial) == 0)
+			return i;
+	return -1;
+}
 
-	if (verbose)
-		printf("SWD core ID %8.8x, MCU ID is %8.8x.\n",
-			   core_id, idcode);
-	for (i = 0; arm_cores[i].core_id; i++)
-		if (arm_cores[i].core_id == core_id)
-			break;
-	if (arm_cores[i].core_id == 0)
-		fprintf(stderr, "Warning: SWD core ID %8.8x did not match the "
-				"expected value of 0x-B--1477.\n", core_id);
-	if (verbose)
-		printf("  %s\n", arm_cores[i].name);
+static int stl_usb_list(libusb_context *ctx, struct stl_usb_probe *probes,
+						int max)
+{
+	libusb_device **devs;
+	ssize_t cnt;
+	int i, n = 0;
 
-	for (i = 0; stm_devids[i].name; i++)
-		if (idcode == stm_devids[i].dbgmcu_idcode) {
-			sl->chip_index = i;
-			break;
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt < 0) {
+		fprintf(stderr, "USB access failed, %s.\n", libusb_error_name(cnt));
+		return -1;
+	}
+	for (i = 0; i < cnt && n < max; i++) {
+		struct libusb_device_descriptor desc;
+		struct stl_usb_probe *probe = &probes[n];
+		libusb_device_handle *dev_handle;
+
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0 ||
+			desc.idVendor != USB_ST_VID || desc.idProduct != USB_STLINKv2_PID)
+			continue;
+		memset(probe, 0, sizeof *probe);
+		probe->bus = libusb_get_bus_number(devs[i]);
+		probe->port_depth = libusb_get_port_numbers(devs[i], probe->port_path,
+													sizeof probe->port_path);
+		if (probe->port_depth < 0)
+			probe->port_depth = 0;
+		stl_usb_dev_path(devs[i], probe->path, sizeof probe->path);
+		/* The serial number needs a brief open.  A probe that is in use by
+		 * another process still enumerates, just without a serial. */
+		if (libusb_open(devs[i], &dev_handle) == 0) {
+			if (desc.iSerialNumber)
+				libusb_get_string_descriptor_ascii(dev_handle,
+					desc.iSerialNumber, (unsigned char *)probe->serial,
+					sizeof probe->serial);
+			libusb_close(dev_handle);
 		}
-
-	return 0;
+		n++;
+	}
+	libusb_free_device_list(devs, 1);
+	return n;
 }
 
-static void stm_info(struct stlink* sl)
+/* Open and claim the STLink described by PROBE.
+ * Each probe gets its own libusb context, so that the worker threads of a
+ * gang programming run never share event handling or locks. */
+struct stlink *stl_usb_open(struct stlink *sl, const struct stl_usb_probe *probe)
 {
-	uint32_t cpu_id, chip_dev_id, devparam;
-
-	printf("Target STM32 MCU information:\n");
+	libusb_context *ctx;
+	libusb_device_handle *dev_handle;
+	int r;
 
-	/* Should also read the CPU ID base register at 0xe000ed00
-	 * Cortex-M0 0x41--c20-
-	 * Cortex-M3 0x411fc231
-	 */
-	chip_dev_id = sl->cpu_idcode & 0x0FFF;
-	printf(" Target DBGMC_IDCODE %3.3x (Rev ID %4.4x) %s.\n",
-		   chip_dev_id, sl->cpu_idcode,
-		   stm_devids[sl->chip_index].name);
-	cpu_id = sl_rd32(sl, 0xe000ed00);
-	printf(" CPU ID base %8.8x.\n", cpu_id);
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "Failed to scan USB devices: %s\n",
+				libusb_error_name(r));
+		return NULL;
+	}
+	dev_handle = stl_usb_path_open(ctx, probe->path);
+	if (dev_handle == NULL) {
+		fprintf(stderr, "Failed to open the STLink at USB %s.\n", probe->path);
+		libusb_exit(ctx);
+		return NULL;
+	}
 
-	/* Read the device parameters: flash size and serial number. */
-	/* STMicro changes how to do this, seemingly for every chip. */
-	/* First we explicitly recognize a few chips. */
-	if (chip_dev_id == 0x416 || chip_dev_id == 0x427) {
-		devparam = sl_rd32(sl, 0x1FF8004C);
-		sl->flash_mem_size = devparam & 0xffff;
-		printf(" Flash size %dK (register %4.4x).\n",
-			   sl->flash_mem_size, devparam);
-	} else if (chip_dev_id == 0x436) {
-		devparam = sl_rd32(sl, 0x1FF8004C);
-		sl->flash_mem_size = (devparam & 1) ? 256 : 384; 	/* WTF? */
-		printf(" Flash size %dK (register %4.4x).\n",
-			   sl->flash_mem_size, devparam);
-	} else if (0xffffffff != (devparam = sl_rd32(sl, 0x1FFFf7e0))) {
-	/* The STM32F1 has the flash size at 0x1FFFf7e0. */
-		sl->flash_mem_size = devparam & 0xffff;
-		printf(" Flash size %dK (register %4.4x).\n",
-			   sl->flash_mem_size, devparam);
-		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
-			   sl_rd32(sl, 0x1FFFf800), sl_rd32(sl, 0x1FFFf804),
-			   sl_rd32(sl, 0x1FFFf808), sl_rd32(sl, 0x1FFFf80c));
-	} else if (0xffffffff != (devparam = sl_rd32(sl, 0x1FFF7A20))) {
-		/* The STM32F2 and STM32F4 have the flash size at 0x1FFF7A22. */
-		sl->flash_mem_size = devparam >> 16;
-		printf(" Flash size %dK (register 0x1FFF7A20 %4.4x).\n",
-			   sl->flash_mem_size, devparam);
-		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
-			   sl_rd32(sl, 0x1FFFC000), sl_rd32(sl, 0x1FFFC004),
-			   sl_rd32(sl, 0x1FFFC008), sl_rd32(sl, 0x1FFFC00c));
-	} else if (0xffffffff != (devparam = sl_rd32(sl, 0x1FFFF7CC))) {
-		sl->flash_mem_size = devparam & 0xFFFF;
-		printf(" Flash size %dK (register 0x1FFFF7CC %4.4x).\n",
-			   sl->flash_mem_size, devparam);
-		printf("  Information block %8.8x %8.8x %8.8x %8.8x.\n",
-			   sl_rd32(sl, 0x1FFFF800), sl_rd32(sl, 0x1FFFF804),
-			   sl_rd32(sl, 0x1FFFF808), sl_rd32(sl, 0x1FFFF80c));
+	if (verbose)
+		printf("Found a STLink v2 on USB %s, serial '%s'.\n",
+			   probe->path, probe->serial);
+
+	/* We know that configuration 1 is the only one.
+	 * Normally we claim the interface without disturbing the STLink,
+	 * which leaves it in whatever mode the last run left it.  The bus
+	 * reset is only needed if that fails, see stl_attach(). */
+	if (usb_reset_attach || libusb_get_configuration(dev_handle, &r) != 0 ||
+		r != 1 || libusb_claim_interface(dev_handle, 0) != 0) {
+		r = libusb_reset_device(dev_handle);
+		r = libusb_set_configuration(dev_handle, 1);
+		r = libusb_claim_interface(dev_handle, 0);
+	}
+#if 0
+	if (libusb_set_interface_alt_setting(dev_handle, 0, 0) < 0){
+		printf("usb_set_altinterface failed.\n");
 	}
+#endif
 
-	return;
+	memset(sl, 0, sizeof *sl);
+	sl->dev_path = probe->path;
+	sl->fd = -1;
+	sl->verbose = verbose;
+	sl->tp = &stl_usb_transport;
+	sl->usb_ctx = ctx;
+	sl->usb_hand = dev_handle;
+	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+	sl->q_depth = queue_depth;
+	strncpy(sl->serial, probe->serial, sizeof sl->serial - 1);
+
+	return sl;
 }
 
-/* Blink the LEDs on a STM32VLDiscovery board.
- * This may be used as a visual liveness test in scripts.
- * The LEDs are on PortC pins PC8 and PC9
- * RM0041 Reference manual - STM32F100xx advanced ARM-based 32-bit MCUs
+/* Hotplug support.
+ * A STLink leaving DFU mode, or one just plugged in, takes a variable time
+ * to enumerate.  Instead of sleeping and retrying we have libusb call us
+ * the moment a STLink arrives or leaves.  Without hotplug support in
+ * libusb we fall back to rescanning every STL_HOTPLUG_POLL_MSEC.
  */
-#define GPIOB		0x40010C08		/* PortB register base */
-#define GPIOC		0x40011000		/* PortC register base */
-#define GPIOC_CRH	(GPIOC + 0x04)	/* Port configuration register high */
-#define GPIOC_ODR	(GPIOC + 0x0c)	/* Port output data register */
-#define LED_BLUE	(1<<8)
-#define LED_GREEN	(1<<9)
+#define STL_HOTPLUG_POLL_MSEC	50
 
-static void stm_discovery_blink(struct stlink* sl)
+struct stl_hotplug {
+	const char *path;			/* Only count this USB path, if set. */
+	int arrived, left;
+};
+
+static int LIBUSB_CALL stl_hotplug_event(libusb_context *ctx,
+										 libusb_device *dev,
+										 libusb_hotplug_event event,
+										 void *user_data)
 {
-	uint32_t PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig;
-	uint32_t APBnENR_orig[2];
-	int i;
+	struct stl_hotplug *hp = user_data;
+	char path[32];
 
-	PortC_hi_iocfg = sl_rd32(sl, GPIOC_CRH);
-	/* Read APB2ENR and APB1ENR at 0x40021018-1F */
-	stl_read(sl, 0x40021018, APBnENR_orig, sizeof APBnENR_orig);
+	stl_usb_dev_path(dev, path, sizeof path);
+	if (hp->path && strcmp(path, hp->path) != 0)
+		return 0;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		hp->arrived++;
+	else
+		hp->left++;
+	return 0;							/* Stay registered. */
+}
 
-	/* Future: Enable GPIO ports. */
-	APB2ENR_orig = APBnENR_orig[0];  /* 0x40021018 */
-	APB1ENR_orig = APBnENR_orig[1];  /* 0x4002101C (yes, 1 is higher) */
+/* Register for STLink arrivals and departures.  Returns 0 if hotplug
+ * events will be delivered, or -1 if the caller must poll. */
+static int stl_hotplug_start(libusb_context *ctx, struct stl_hotplug *hp,
+							 libusb_hotplug_callback_handle *handle)
+{
+	if ( ! libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -1;
+	return libusb_hotplug_register_callback(ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_NO_FLAGS, USB_ST_VID, USB_STLINKv2_PID,
+		LIBUSB_HOTPLUG_MATCH_ANY, stl_hotplug_event, hp, handle) == 0 ? 0 : -1;
+}
 
-	if (sl->verbose)
-		fprintf(stderr, "GPIOC_CRH = 0x%08x, APB1ENR=%#08x, APB2ENR=%#08x\n",
-				PortC_hi_iocfg, APB1ENR_orig, APB2ENR_orig);
+/* Wait until DEADLINE for a hotplug event, or for the poll interval
+ * if we do not have hotplug events.  Returns 0 at the deadline. */
+static int stl_hotplug_wait(libusb_context *ctx, int have_events,
+							uint64_t deadline)
+{
+	int64_t remaining_us = (int64_t)(deadline - stl_now_ns()) / 1000;
+	struct timeval tv;
 
-	/* Make certain PC8/PC9 are GPIO outputs -- any speed will do. */
-	if ((PortC_hi_iocfg & 0xCC) != 0x00)
-		sl_wr32(sl, GPIOC_CRH, (PortC_hi_iocfg & ~0xff) | 0x11);
-	for (i = 0; i < 10; i++) {
-		sl_wr32(sl, GPIOC_ODR, LED_GREEN);
-		usleep(100* 1000);
-		sl_wr32(sl, GPIOC_ODR, LED_BLUE);
-		usleep(100* 1000);
-	}
-	/* Conditionally restore original GPIO settings. */
-	if ((PortC_hi_iocfg & 0xCC) != 0x00)
-		sl_wr32(sl, GPIOC_CRH, PortC_hi_iocfg);
-	return;
+	if (remaining_us <= 0)
+		return 0;
+	if ( ! have_events && remaining_us > STL_HOTPLUG_POLL_MSEC * 1000)
+		remaining_us = STL_HOTPLUG_POLL_MSEC * 1000;
+	tv.tv_sec = remaining_us / 1000000;
+	tv.tv_usec = remaining_us % 1000000;
+	libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	return 1;
 }
 
-#if 0
-/* Set an interrupt to pending.  This should be used with caution as some
- * interrupt handlers expect only hardware events e.g. a serial character
- * has arrived. */
-/* Bitmap, must write as 32 bit word */
-const int IntrSetPendingBase = 0xE000E200;
+/* Report if a STLink is listed at USB PATH. */
+static int stl_usb_present(libusb_context *ctx, const char *path)
+{
+	libusb_device_handle *dev_handle = stl_usb_path_open(ctx, path);
 
-static void stm_raise_irq(struct stlink* sl, int irq_num)
+	if (dev_handle == NULL)
+		return 0;
+	libusb_close(dev_handle);
+	return 1;
+}
+
+/* Wait for the STLink that was just told to leave DFU mode to drop off
+ * the bus and re-enumerate at the same USB path, and reclaim it. */
+static int stl_usb_replug(struct stlink *sl)
 {
-	if (irq_num > 248) {
-		printf("Invalid interrupt number %d.  Cannot set pending.\n", irq_num);
-		return;
+	struct stl_hotplug hp = { sl->dev_path, 0, 0 };
+	libusb_hotplug_callback_handle cb;
+	libusb_device_handle *dev_handle = NULL;
+	uint64_t deadline = stl_now_ns() + (uint64_t)STL_REPLUG_MSEC * 1000000;
+	int have_events = stl_hotplug_start(sl->usb_ctx, &hp, &cb) == 0;
+	int gone;
+
+	libusb_release_interface(sl->usb_hand, 0);
+	libusb_close(sl->usb_hand);
+	sl->usb_hand = NULL;
+
+	fprintf(stderr, "Waiting for the STLink at USB %s to return ...\n",
+			sl->dev_path);
+	gone = ! stl_usb_present(sl->usb_ctx, sl->dev_path);
+	while (stl_hotplug_wait(sl->usb_ctx, have_events, deadline)) {
+		/* Without events, it has left once it is no longer listed. */
+		if ( ! gone)
+			gone = have_events ? hp.left :
+				! stl_usb_present(sl->usb_ctx, sl->dev_path);
+		if ( ! gone || (have_events && ! hp.arrived))
+			continue;
+		dev_handle = stl_usb_path_open(sl->usb_ctx, sl->dev_path);
+		if (dev_handle && libusb_claim_interface(dev_handle, 0) == 0)
+			break;
+		if (dev_handle)
+			libusb_close(dev_handle);
+		dev_handle = NULL;
+		hp.arrived = 0;
 	}
-	sl_wr32(sl, IntrSetPendingBase + ((irq_num & 0xE0)>>3),
-			1 << (irq_num & 0x1F));
-	return;
-}
-#endif
 
-struct dev_peripheral {			/* Peripheral device table */
-	const char *name;			/* TIM1, CAN1 etc */
-	uint32_t addr;				/* Address in STM32 space */
-	int unit_num;				/* Unit number, 0 if sole unit */
-	void (*show_func1)(struct stlink* sl, struct dev_peripheral *dev_per,
-					   uint32_t data_blk[]);
-	int extent;					/* Size of peripheral region */
-	uint32_t avail;				/* Chip feature bitmap */
-	int feature;				/* Dev feature bitmap e.g. ADC2 misisng regs  */
-};
+	if (have_events)
+		libusb_hotplug_deregister_callback(sl->usb_ctx, cb);
+	sl->usb_hand = dev_handle;
+	if (dev_handle == NULL) {
+		fprintf(stderr, "The STLink at USB %s did not return.\n",
+				sl->dev_path);
+		return -1;
+	}
+	return 0;
+}
 
-static void stm_show_timer(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data[])
+/* Wait until DEADLINE for another STLink to be plugged in.  Without
+ * hotplug events this returns after the poll interval, and the caller
+ * rescans either way.  We also return after a second, in case a STLink
+ * arrived between the caller's scan and our registering for events.
+ * Returns 0 at the deadline. */
+static int stl_usb_wait_arrival(libusb_context *ctx, uint64_t deadline)
 {
-	char active_map[4] = " H L";
+	struct stl_hotplug hp = { NULL, 0, 0 };
+	libusb_hotplug_callback_handle cb;
+	uint64_t rescan = stl_now_ns() + 1000000000;
+	int have_events = stl_hotplug_start(ctx, &hp, &cb) == 0;
+
+	if (rescan > deadline)
+		rescan = deadline;
+	while (stl_hotplug_wait(ctx, have_events, rescan) && have_events &&
+		   ! hp.arrived)
+		;
+	if (have_events)
+		libusb_hotplug_deregister_callback(ctx, cb);
+	return (int64_t)(deadline - stl_now_ns()) > 0;
+}
 
-	printf("%s Timer %d at %8.8x:  %4.4x %4.4x %4.4x %4.4x"
-		   "  %4.4x %4.4x %4.4x %4.4x  %4.4x\n"
-		   " IntrEnb:%4.4x Status:%4.4x\n"
-		   " Count: %d Prescale: x%d Top: %d.\n"
-		   " Ch1: %d %c Ch2: %d %c Ch3: %d %c Ch4: %d %c.\n",
-		   dp->name, dp->unit_num, dp->addr,
-		   data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7], data[8],
-		   data[3], data[4],
-		   data[9], data[10]+1, data[11],
-		   data[13], active_map[(data[8] >> 0) & 3],
-		   data[14], active_map[(data[8] >> 4) & 3],
-		   data[15], active_map[(data[8] >> 8) & 3],
-		   data[16], active_map[(data[8] >> 12) & 3]);
-}		
+/* Reset a STLink we could not talk to and reclaim it.
+ * The USB reset takes a few hundred milliseconds and puts the STLink back
+ * into mass storage mode, so it is a last resort. */
+static int stl_usb_reset(struct stlink *sl)
+{
+	if (sl->tp != &stl_usb_transport)
+		return -1;
+	fprintf(stderr, " Resetting the STLink at USB %s.\n", sl->dev_path);
+	libusb_release_interface(sl->usb_hand, 0);
+	if (libusb_reset_device(sl->usb_hand) != 0 ||
+		libusb_set_configuration(sl->usb_hand, 1) != 0 ||
+		libusb_claim_interface(sl->usb_hand, 0) != 0)
+		return -1;
+	return 0;
+}
 
-static void stm_show_CAN(struct stlink *sl, struct dev_peripheral *dp,
-						 uint32_t data[])
+/* Identify the STLink and target, leaving the STLink in SWD debug mode.
+ * Returns 0 if we have a working STLink.
+ * This is the fast path: a STLink already in debug mode from an earlier
+ * run is used as-is, with no mode switching.  The mode switches, and
+ * failing those a USB reset, only happen when it does not answer or is
+ * in some other mode.
+ */
+static int stl_attach(struct stlink *sl)
 {
-	uint32_t mode_map, scale_map, fifo_map, active_map;
-	int i;
+	int mode;
+	uint32_t core_id;
 
-	printf("%s at %8.8x: MCR %8.8x MSR %8.8x\n"
-		   " Tx/Rx0/Rx1 %8.8x %8.8x %8.8x\n"
-		   " IntrEnb %8.8x Errors %8.8x BitTiming %8.8x\n",
-		   dp->name, dp->addr,
-		   data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7]);
-	/* Show FIFO contents. */
-	stl_rd32_cmd(sl, dp->addr + 0x180, 80);
-	printf(" CAN FIFOs\n"
-		   "  Tx0: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Tx1: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Tx2: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Rx0: %8.8x %8.8x %8.8x %8.8x\n"
-		   "  Rx1: %8.8x %8.8x %8.8x %8.8x\n",
-		   data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7],
-		   data[8], data[9], data[10], data[11],
-		   data[12], data[13], data[14], data[15],
-		   data[16], data[17], data[18], data[19]);
+	if (stl_get_version(sl) != 0 && stl_usb_reset(sl) == 0)
+		stl_get_version(sl);
+	sl->ver = *(struct STLinkVersion *)sl->data_buf;
+	if (sl->ver.ST_VendorID == 0 && sl->ver.ST_ProductID == 0) {
+		fprintf(stderr, "The device %s is reporting an ID of 0/0.\n"
+				"  Either the STLink is not plugged in or it is still "
+				"being initialized.\n",
+				sl->dev_path);
+		return -1;
+	}
 
-	/* Show filter, Mode/scale/dest/on %8.8x %8.8x %8.8x.\n */
-	stl_rd32_cmd(sl, 0x40006600, 32);
-	printf(" Rx filter   FMR %8.8x\n"
-		   "  Mode/scale/dest/on %8.8x %8.8x %8.8x %8.8x.\n",
-		   data[0], data[1], data[3], data[5], data[7]);
-	mode_map = data[1];
-	scale_map = data[3];
-	fifo_map = data[5];
-	active_map = data[7];
-	stl_rd32_cmd(sl, 0x40006640, 32);
-	for (i = 0; i < 28; i++)
-		if (active_map & (1<<i)) {
-			printf("  Filter %d FIFO %c ", i, fifo_map & (1<<i) ? '1' : '0');
-			if (scale_map & (1<<i))
-				printf("%8.8x %8.8x\n",
-					   data[i*2], data[i*2 + 1]);
-			else
-				printf("%4.4x %4.4x (%3.3x %3.3x) %4.4x %4.4x (%3.3x %3.3x)\n",
-					   data[i*2] & 0xffff, data[i*2] >> 16,
-					   (data[i*2] >> 5) & 0x7ff, (data[i*2] >> 21) & 0x7ff,
-					   data[i*2 + 1] & 0xffff, data[i*2 + 1] >> 16,
-					   (data[i*2+1]>>5) & 0x7ff, (data[i*2+1]>>21) & 0x7ff);
-		}
+	if (sl->verbose)
+		stl_print_version(&sl->ver);
 
-	return;
-}
+	if (sl->ver.ST_VendorID != USB_ST_VID  ||
+		(sl->ver.ST_ProductID != USB_STLINK_PID &&
+		 sl->ver.ST_ProductID != USB_STLINKv2_PID)) {
+		fprintf(stderr, "The device %s is not a STLink\n"
+				"       VID/PID %04x/%04x instead of %04x/%04x.\n",
+				sl->dev_path, sl->ver.ST_VendorID, sl->ver.ST_ProductID,
+				USB_ST_VID, USB_STLINK_PID);
+		return -1;
+	}
 
-static void stm_show_DMA(struct stlink* sl, struct dev_peripheral *dp,
-						 uint32_t data[])
-{
-	int i;
-	printf("%s at %8.8x: interrupts %8.8x %8.8x\n",
-		   dp->name, dp->addr, data[0], data[1]);
-	for (i = 1; i <= 7; i++) {
-		int cb = i*5-3;
-		printf(" Channel %d: %8.8x  %d words %8.8x%s%s %8.8x%s\n",
-			   i, data[cb], data[cb+1],
-			   data[cb+2], data[cb] & 0x40 ? "++" : "  ",
-			   data[cb] & 0x10 ? "<-" : "->",
-			   data[cb+3], data[cb] & 0x80 ? "++" : "  ");
+	/* When we open the device it is in an unknown mode.
+	 * The v1 is likely in mass storage mode.
+	 * Switch to Single Wire Debug (SWD) mode and issue the required
+	 * first command, reading the core ID.
+	 */
+#if 0
+	fprintf(stderr, "STLink status is %8.8x\n", stl_mode(sl));
+	stl_enter_SWD_mode(sl);
+	sleep(1);
+	fprintf(stderr, "STLink status is %8.8x\n", stl_mode(sl));
+
+	fprintf(stderr, "Target core ID is %8.8x\n", stl_get_core_id(sl));
+#endif
+	mode = stl_mode(sl);
+	if (mode == STLinkDevMode_Debug) {
+		/* Still attached from the last run.  Make sure the SWD link
+		 * works: an unpowered or swapped target reads as all zeros or
+		 * ones, and needs the mode entered again. */
+		core_id = stl_get_core_id(sl);
+		if (core_id == 0 || core_id == 0xffffffff)
+			mode = STLinkDevMode_Unknown;
+		else if (sl->verbose)
+			printf(" Reusing the STLink debug mode.\n");
 	}
-	return;
+	if (mode != STLinkDevMode_Debug) {
+		if (mode != STLinkDevMode_Mass)
+			stl_kick_mode(sl);
+		stl_enter_SWD_mode(sl);
+		if (stl_mode(sl) != STLinkDevMode_Debug &&
+			(stl_usb_reset(sl) != 0 || (stl_enter_SWD_mode(sl),
+										stl_mode(sl) != STLinkDevMode_Debug)))
+			fprintf(stderr, "Warning: Failed to switch the STLink into "
+					"debug mode.\n");
+	}
+
+	/* At this point we have identified a working STLink programmer.
+	 * We now check on the target chip ID and state. */
+	stm_id_chip(sl);
+	if (cache_dir)
+		stm_cache_open(sl, cache_dir);
+	return 0;
 }
 
-static void stm_show_SPI(struct stlink* sl, struct dev_peripheral *dp,
-						 uint32_t data[])
+/* Watch mode: sample target memory while the core runs.
+ * The ranges to watch are merged into as few reads as possible by
+ * stl_read_plan(), once, and the same reads repeated.
+ * Several samples are kept in flight, so the STLink reads back to back.
+ * Each sample is stamped with the host monotonic time half way between
+ * queuing its first read and retiring its last.
+ *
+ * The binary log is the header
+ *   "STLWATCH", u32 range count, u32 data bytes per sample,
+ *   u32 address and u32 length for each range,
+ * then per sample a u64 nanoseconds since the watch started and the
+ * contents of each range in order.  All values are little-endian.
+ */
+#define STL_WATCH_MAX		32			/* Ranges */
+#define STL_WATCH_INFLIGHT	4			/* Samples */
+#define STL_WATCH_MAGIC		"STLWATCH"
+
+static volatile sig_atomic_t stl_watch_stop;
+static void stl_watch_sigint(int sig)
 {
-	printf("%s at %8.8x: %8.8x %8.8x\n",
-		   dp->name, dp->addr, data[0], data[1]);
+	stl_watch_stop = 1;
 }
 
-static void stm_show_USART(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data[])
+/* Parse "<addr>[+<len>],..." into word-aligned RANGES.
+ * Returns the number of ranges, or -1 if SPEC is malformed. */
+static int stl_watch_parse(const char *spec, struct stl_rd_req *ranges)
 {
-	printf("%s at %8.8x: %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x %4.4x\n"
-		   "  Divisor %d residue %d\n",
-		   dp->name, dp->addr, data[0], data[1], data[2], data[3],
-		   data[4], data[5], data[6], data[7],
-		   data[3]>>4, data[3] & 0xF);
+	int n = 0;
+
+	while (*spec && *spec != '@') {
+		char *end;
+		uint32_t addr = strtoul(spec, &end, 0), len = 4;
+		if (end == spec || n >= STL_WATCH_MAX)
+			return -1;
+		if (*end == '+')
+			len = strtoul(end + 1, &end, 0);
+		if (len == 0 || (*end && *end != ',' && *end != '@'))
+			return -1;
+		ranges[n].addr = addr & ~3;
+		ranges[n].len = (addr + len - (addr & ~3) + 3) & ~3;
+		n++;
+		spec = *end == ',' ? end + 1 : end;
+	}
+	return n;
 }
 
-static void arm_show_systick(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data_blk[])
+/* A VCD signal identifier: one printable character, two past 94. */
+static const char *stl_vcd_id(int n)
 {
-	printf("SysTick at %8.8x: Ctrl %4.4x reload %d, count %d\n"
-		   "  calibration %d (%#x)\n",
-		   dp->addr, data_blk[0], data_blk[1], data_blk[2],
-		   data_blk[3] & 0x00ffffff, data_blk[3]);
+	static char id[3];
+	id[0] = '!' + n % 94;
+	id[1] = n >= 94 ? '!' + n / 94 : 0;
+	return id;
 }
 
-static char *lcd_duty_cycle[8] = {
-	"No COM", "2 COM", "3 COM", "4 COM", "8 COM",
-	"invalid", "invalid", "invalid"};
-static void stm_show_LCD(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data_blk[])
+/* Convert the watch log at LOG_PATH to CSV, or to VCD if OUT_PATH ends in
+ * ".vcd", one column or signal per watched word. */
+static int stl_watch_export(const char *log_path, const char *out_path)
 {
-	printf("LCD controller at %8.8x: Ctrl 0x%2.2x Frame 0x%8.8x, Status %2.2x\n"
-		   "  %s %s mode 1/%d-bias, %s pins, %s voltage\n",
-		   dp->addr, data_blk[0], data_blk[1], data_blk[2],
-		   data_blk[0] &0x01 ? "Enabled" : "Disabled",
-		   data_blk[0] &0x80 ? "32 seg" : "44 seg",
-		   data_blk[0] &0x40 ? 3 : data_blk[0] &0x20 ? 2 : 4,
-		   lcd_duty_cycle[(data_blk[0] &0x1F)>>2],
-		   data_blk[0] &0x02 ? "V_lcd pin" : "internal" );
-	printf(" Display: %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x\n"
-		   "          %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x %4.4x%8.8x\n",
-		   data_blk[6] & 0xffff, data_blk[5],
-		   data_blk[8] & 0xffff, data_blk[7],
-		   data_blk[10] & 0xffff, data_blk[9],
-		   data_blk[12] & 0xffff, data_blk[11],
-		   data_blk[14] & 0xffff, data_blk[13],
-		   data_blk[16] & 0xffff, data_blk[15],
-		   data_blk[18] & 0xffff, data_blk[17],
-		   data_blk[20] & 0xffff, data_blk[19]);
+	FILE *in = fopen(log_path, "rb"), *out;
+	unsigned char hdr[16], *rec = NULL, *prev = NULL;
+	struct stl_rd_req ranges[STL_WATCH_MAX];
+	uint32_t n, data_len;
+	size_t rec_len;
+	int vcd, i, w, nrec = 0, ret = -1;
+
+	if (in == NULL) {
+		fprintf(stderr, " Failed to open '%s': %s\n", log_path,
+				strerror(errno));
+		return -1;
+	}
+	if (fread(hdr, sizeof hdr, 1, in) != 1 ||
+		memcmp(hdr, STL_WATCH_MAGIC, 8) != 0 ||
+		(n = read_uint32(hdr, 8)) > STL_WATCH_MAX) {
+		fprintf(stderr, " '%s' is not a watch log.\n", log_path);
+		fclose(in);
+		return -1;
+	}
+	data_len = read_uint32(hdr, 12);
+	for (i = 0; i < n; i++) {
+		if (fread(hdr, 8, 1, in) != 1) {
+			fclose(in);
+			return -1;
+		}
+		ranges[i].addr = read_uint32(hdr, 0);
+		ranges[i].len = read_uint32(hdr, 4);
+	}
+	if ((out = fopen(out_path, "w")) == NULL) {
+		fprintf(stderr, " Failed to open '%s': %s\n", out_path,
+				strerror(errno));
+		fclose(in);
+		return -1;
+	}
+	rec_len = 8 + data_len;
+	rec = malloc(rec_len);
+	prev = calloc(1, rec_len);
+	if (rec == NULL || prev == NULL)
+		goto done;
+
+	vcd = strlen(out_path) > 4 && strcmp(out_path + strlen(out_path) - 4,
+										 ".vcd") == 0;
+	if (vcd) {
+		int id = 0;
+		fprintf(out, "$timescale 1 ns $end\n$scope module target $end\n");
+		for (i = 0; i < n; i++)
+			for (w = 0; w < ranges[i].len; w += 4, id++)
+				fprintf(out, "$var wire 32 %s mem_%8.8x $end\n",
+						stl_vcd_id(id), ranges[i].addr + w);
+		fprintf(out, "$upscope $end\n$enddefinitions $end\n");
+	} else {
+		fprintf(out, "time");
+		for (i = 0; i < n; i++)
+			for (w = 0; w < ranges[i].len; w += 4)
+				fprintf(out, ",0x%8.8x", ranges[i].addr + w);
+		fprintf(out, "\n");
+	}
+	while (fread(rec, rec_len, 1, in) == 1) {
+		uint64_t t = read_uint32(rec, 0) | (uint64_t)read_uint32(rec, 4) << 32;
+		unsigned char *data = rec + 8;
+		int id = 0, off = 0, stamped = 0;
+		if ( ! vcd)
+			fprintf(out, "%llu.%9.9llu", (unsigned long long)(t / 1000000000),
+					(unsigned long long)(t % 1000000000));
+		for (i = 0; i < n; i++)
+			for (w = 0; w < ranges[i].len; w += 4, id++, off += 4) {
+				uint32_t val = read_uint32(data, off);
+				int bit;
+				if ( ! vcd) {
+					fprintf(out, ",0x%8.8x", val);
+					continue;
+				}
+				/* VCD records only the changes. */
+				if (nrec > 0 && val == read_uint32(prev + 8, off))
+					continue;
+				if ( ! stamped++)
+					fprintf(out, "#%llu\n", (unsigned long long)t);
+				fputc('b', out);
+				for (bit = 31; bit > 0 && ! ((val >> bit) & 1); bit--)
+					;
+				for (; bit >= 0; bit--)
+					fputc('0' + ((val >> bit) & 1), out);
+				fprintf(out, " %s\n", stl_vcd_id(id));
+			}
+		if ( ! vcd)
+			fprintf(out, "\n");
+		memcpy(prev, rec, rec_len);
+		nrec++;
+	}
+	ret = 0;
+done:
+	free(rec);
+	free(prev);
+	fclose(in);
+	if (fclose(out) != 0)
+		ret = -1;
+	if (ret == 0)
+		fprintf(stderr, " Exported %d samples to %s.\n", nrec, out_path);
+	return ret;
 }
 
-static void stm_show_dev(struct stlink* sl, struct dev_peripheral *dp,
-							 uint32_t data[])
+/* Execute "watch:<log>=<addr>[+<len>],...[@<seconds>]".
+ * Sampling runs for the given time, or until interrupted.
+ */
+static int stl_watch(struct stlink *sl, char *spec)
 {
-	int i;
-	printf("%s at %8.8x:", dp->name, dp->addr);
-	for (i = 0; i < dp->extent/4; i++)
-		printf(" %4.4x", data[i]);
-	printf("\n");
+	struct stl_rd_req ranges[STL_WATCH_MAX], xfers[STL_QUEUE_LEN];
+	struct stl_watch_sample {
+		unsigned char *buf;
+		unsigned int first_seq;		/* Queue sequence of its first read */
+		uint64_t t_submit;
+	} samples[STL_WATCH_INFLIGHT] = {};
+	struct sigaction sa = {}, old_sa;
+	char *log_path = spec, *eq = strchr(spec, '='), *at;
+	unsigned char hdr[8];
+	uint32_t buf_len, data_len;
+	uint64_t t0, t_end = 0;
+	unsigned long nsamples = 0, nfailed = 0, k, r;
+	int n, nx, inflight, i, ret = 0;
+	FILE *log;
+
+	if (eq == NULL || (n = stl_watch_parse(eq + 1, ranges)) <= 0) {
+		fprintf(stderr, "Bad watch specification '%s'.\n", spec);
+		return -1;
+	}
+	*eq = 0;
+	if ((at = strchr(eq + 1, '@')) != NULL)
+		t_end = strtod(at + 1, NULL) * 1e9;
+	if (sl->rd_max == 0)
+		stl_xfer_calibrate(sl, 0);
+	nx = stl_read_plan(sl, ranges, n, STL_READ_GAP, xfers, STL_QUEUE_LEN,
+					   &buf_len);
+	if (nx < 0) {
+		fprintf(stderr, "The watched ranges need too many reads.\n");
+		*eq = '=';
+		return -1;
+	}
+	/* Keep the reads of every sample in flight within one trip around the
+	 * command ring, so their status is still there when the sample is
+	 * retired. */
+	inflight = STL_QUEUE_LEN / nx;
+	if (inflight > STL_WATCH_INFLIGHT)
+		inflight = STL_WATCH_INFLIGHT;
+
+	log = strcmp(log_path, "-") == 0 ? fdopen(dup(1), "wb") :
+		fopen(log_path, "wb");
+	if (log == NULL) {
+		fprintf(stderr, " Failed to open '%s': %s\n", log_path,
+				strerror(errno));
+		*eq = '=';
+		return -1;
+	}
+	for (i = 0, data_len = 0; i < n; i++)
+		data_len += ranges[i].len;
+	fwrite(STL_WATCH_MAGIC, 8, 1, log);
+	write_uint32(hdr, n);
+	write_uint32(hdr + 4, data_len);
+	fwrite(hdr, 8, 1, log);
+	for (i = 0; i < n; i++) {
+		write_uint32(hdr, ranges[i].addr);
+		write_uint32(hdr + 4, ranges[i].len);
+		fwrite(hdr, 8, 1, log);
+	}
+	for (i = 0; i < inflight; i++)
+		if ((samples[i].buf = malloc(buf_len)) == NULL)
+			ret = -1;
+	if (sl->verbose)
+		printf(" Watching %d ranges with %d reads of %d bytes per sample.\n",
+			   n, nx, buf_len);
+
+	stl_watch_stop = 0;
+	sa.sa_handler = stl_watch_sigint;
+	sigaction(SIGINT, &sa, &old_sa);
+	t0 = stl_now_ns();
+	/* Queue sample K while there is a free slot, otherwise retire sample
+	 * R, the oldest in flight.  Once stopped, only retire. */
+	for (k = r = 0; ret == 0; ) {
+		int stop = stl_watch_stop || (t_end && stl_now_ns() - t0 >= t_end);
+		unsigned int first;
+		uint64_t t;
+		int failed = 0;
+
+		if ( ! stop && k - r < inflight) {
+			struct stl_watch_sample *sp = &samples[k++ % inflight];
+			sp->first_seq = sl->q_head;
+			sp->t_submit = stl_now_ns();
+			for (i = 0; i < nx; i++)
+				stl_queue_rd32(sl, xfers[i].addr, xfers[i].len,
+							   sp->buf + xfers[i].buf_off);
+			continue;
+		}
+		if (r == k)
+			break;
+		first = samples[r % inflight].first_seq;
+		while ((int)(sl->q_tail - (first + nx)) < 0)
+			stl_queue_retire(sl);
+		t = stl_now_ns();
+		for (i = 0; i < nx; i++)
+			failed |= stl_req_failed(&sl->queue[(first + i) % STL_QUEUE_LEN]);
+		if (failed) {
+			nfailed++;
+		} else {
+			unsigned char ts[8];
+			t = (samples[r % inflight].t_submit + t) / 2 - t0;
+			write_uint32(ts, t);
+			write_uint32(ts + 4, t >> 32);
+			fwrite(ts, 8, 1, log);
+			for (i = 0; i < n; i++)
+				fwrite(samples[r % inflight].buf + ranges[i].buf_off,
+					   ranges[i].len, 1, log);
+			nsamples++;
+		}
+		r++;
+	}
+	sigaction(SIGINT, &old_sa, NULL);
+	stl_queue_flush(sl);
+	t0 = stl_now_ns() - t0;
+	for (i = 0; i < inflight; i++)
+		free(samples[i].buf);
+	if (fclose(log) != 0)
+		ret = -1;
+
+	fprintf(stderr, " Watched %lu samples in %.3f seconds, %.0f per second"
+			"%s.\n", nsamples, t0 / 1e9, nsamples * 1e9 / (t0 ? t0 : 1),
+			nfailed ? ", some reads failed" : "");
+	if (ret == 0 && export_path && strcmp(log_path, "-") != 0)
+		ret = stl_watch_export(log_path, export_path);
+	*eq = '=';
+	return ret;
 }
 
-struct dev_peripheral dev_per[] = {
-	{"SysTick", 0xE000E010, 0, arm_show_systick, 16},
-	{"CAN1", 0x40006400, 1, stm_show_CAN, 32},
-	{"CAN2", 0x40006800, 2, stm_show_CAN, 32},
-	{"DMA1", 0x40020000, 1, stm_show_DMA, 8 + 20*7},
-	{"DMA2", 0x40020400, 2, stm_show_DMA, 8 + 20*7},
-	{"PORTA", 0x40010800, 0, stm_show_dev, 28},
-	{"PORTB", 0x40010C00, 0, stm_show_dev, 28},
-	{"PORTC", 0x40011000, 0, stm_show_dev, 28},
-	{"PORTD", 0x40011400, 0, stm_show_dev, 28},
-	{"PORTE", 0x40011800, 0, stm_show_dev, 28},
-	{"PORTF", 0x40011C00, 0, stm_show_dev, 28},
-	{"PORTG", 0x40012000, 0, stm_show_dev, 28},
-	{"SPI1", 0x40013000, 1, stm_show_SPI, 36},
-	{"SPI2", 0x40003800, 2, stm_show_SPI, 36},
-	{"SPI3", 0x40003C00, 3, stm_show_SPI, 36},
-	{"TIM1", 0x40012C00, 1, stm_show_timer, 76}, /* Do not read TIMx_DMAR */
-	{"TIM1a",0x40010000, 1, stm_show_timer, 76}, /* 32F4xx only */
-	{"TIM2", 0x40000000, 2, stm_show_timer, 76},
-	{"TIM3", 0x40000400, 3, stm_show_timer, 76},
-	{"TIM4", 0x40000800, 4, stm_show_timer, 76},
-	{"TIM5", 0x40000C00, 5, stm_show_timer, 76},
-	{"TIM6", 0x40001000, 6, stm_show_timer, 76},
-	{"TIM7", 0x40001400, 7, stm_show_timer, 76},
-	{"TIM8", 0x40010400, 8, stm_show_timer, 76}, 	/* 32F4xx */
-	{"TIM9", 0x40014000, 9, stm_show_timer, 76}, 	/* 32F4xx */
-	{"TIM10", 0x40014400, 10, stm_show_timer, 76}, /* 32F4xx */
-	{"TIM11", 0x40014800, 11, stm_show_timer, 76}, /* 32F4xx */
-	{"TIM12", 0x40001800, 12, stm_show_timer, 76},
-	{"TIM13", 0x40001C00, 13, stm_show_timer, 76},
-	{"TIM14", 0x40002000, 14, stm_show_timer, 76},
-	{"TIM15", 0x40014000, 15, stm_show_timer, 76},
-	{"TIM16", 0x40014400, 16, stm_show_timer, 76},
-	{"TIM17", 0x40014800, 17, stm_show_timer, 76},
-	{"USART1", 0x40013800, 1, stm_show_USART, 7*4},
-	{"USART2", 0x40004400, 2, stm_show_USART, 7*4},
-	{"USART3", 0x40004800, 3, stm_show_USART, 7*4},
-	{"USART4", 0x40004C00, 4, stm_show_USART, 7*4},
-	{"USART5", 0x40005000, 5, stm_show_USART, 7*4},
-	{"USART1a", 0x40011000, 1, stm_show_USART, 7*4}, /* 32F4xx */
-	{"USART6", 0x40011400, 6, stm_show_USART, 7*4},
-	{"I2C1", 0x40005400, 1, stm_show_dev, 36},
-	{"I2C2", 0x40005800, 2, stm_show_dev, 36},
-	{"I2C3", 0x40005C00, 3, stm_show_dev, 36},
-	{"DAC",  0x40007400, 3, stm_show_dev, 56},
+/* Execute a single command-line command CMD.
+ * Returns 0 on success, 1 if the command ran but failed, or -1 if the
+ * command was not recognized.
+ */
+static int stl_do_command(struct stlink *sl, char *cmd)
+{
+	int result = 0;
+
+	if (verbose) printf("Executing command %s.\n", cmd);
+
+	if (strcmp("regs", cmd) == 0) {
+		/* We must be stopped for this to work! */
+		stl_get_allregs(sl);
+		sl->reg = *(struct ARMcoreRegs*)sl->data_buf;
+		stlink_print_arm_regs(&sl->reg);
+	} else if (strncmp("reg", cmd, 3) == 0) {
+		/* We must be stopped for this to work! */
+		int regnum = strtoul(cmd+3, 0, 0); /* Super sleazy */
+		printf("Register %d is %8.8x.\n", regnum, stl_get_reg(sl, regnum));
+	} else if (strncmp("wreg", cmd, 3) == 0) {
+		int regnum, regval;
+		if (sscanf(cmd, "wreg%d=%i", &regnum, &regval) == 2) {
+			stl_write_reg(sl, regval, regnum);
+		} else
+			fprintf(stderr, "Unknown register write specification '%s'.\n",
+					cmd);
+	} else if (strncmp("program=", cmd, 8) == 0) {
+		char *path = cmd + 8;
+		uint32_t flash_base = stm_devids[sl->chip_index].flash_base;
+		uint32_t flash_size;
+		unsigned char *image;
+		size_t size;
+		int res;
+		/* Write the user flash area. */
+		fprintf(stderr, " Writing program from %s into STM32 flash at "
+				"0x%8.8x.\n", path, flash_base);
+		stl_enter_debug(sl);
+		stl_reset(sl);
+		flash_size = stl_flash_size(sl);
+		image = stl_image_load(path, 0, &size);
+		if (image == NULL)
+			return 1;
+		if (size > flash_size)
+			fprintf(stderr, " Program is LARGER THAN FLASH and may not fit."
+					"  Trying anyway.\n"
+					"  Program at %s is %#8.8x bytes, flash is %#8.8x "
+					"bytes.\n", path, (int)size, flash_size);
+		/* Erase only what the image needs, or all of it if that is faster. */
+		stl_flash_erase_range(sl, flash_base, size);
+		stl_flash_write(sl, flash_base, image, size);
+		free(image);
+		printf(" Verifying flash write...");
+		fflush(stdout);
+		res = stlink_fverify(sl, path, flash_base);
+		printf("file %s %s flash contents\n", path,
+			   res == 0 ? "matched" : "did not match");
+		result = res != 0;
+	} else if (strncmp("update=", cmd, 7) == 0) {
+		char *path = cmd + 7;
+		/* Write only the flash pages that differ from the file. */
+		fprintf(stderr, " Updating STM32 flash from %s.\n", path);
+		stl_enter_debug(sl);
+		stl_reset(sl);
+		result = stl_flash_update(sl, path) != 0;
+		printf(" Flash %s %s\n", result ? "does not match" : "matches", path);
+	} else if (strncmp("read", cmd, 4) == 0) {
+		/* Read memory location */
+		int memaddr = strtoul(cmd+4, 0, 0); /* Super sleazy */
+		uint32_t *result = (void*)sl->data_buf;
+		write_uint32(sl->cmd_buf + 2, memaddr);
+		write_uint16(sl->cmd_buf + 6, 16);
+		stlink_cmd(sl, STLinkDebugReadMem32bit, memaddr, 16);
+		printf("Memory %8.8x is %8.8x %8.8x %8.8x %8.8x.\n",
+			   memaddr, result[0], result[1], result[2], result[3]);
 #if 0
-	{"I2S2", 0x40003400, 2, stm_show_dev, 0},
-	{"RTC", 0x40002800, 0, stm_show_RTC, 0},
-	{"WWDG", 0x40002C00, 0, stm_show_WWDG, 0},
-	{"IWDG", 0x40003000, 0, stm_show_IWDG, 0},
-#endif
-	/* I/O pin configuration on new F3; use 'GPIO' instead of PORT. */
-	{"GPIOA", 0x48000000, 0, stm_show_dev, 44},
-	{"GPIOB", 0x48000400, 0, stm_show_dev, 44},
-	{"GPIOC", 0x48000800, 0, stm_show_dev, 44},
-	{"GPIOD", 0x48000C00, 0, stm_show_dev, 44},
-	{"GPIOE", 0x48001000, 0, stm_show_dev, 44},
-	{"GPIOF", 0x48001400, 0, stm_show_dev, 44},
-};
+		printf("Memory %8.8x is %8.8x.\n",
+			   memaddr, sl_rd32(sl, memaddr));
+#endif
+	} else if (strncmp("write", cmd, 3) == 0) {
+		int memaddr, memval;
+		if (sscanf(cmd, "write%i=%i", &memaddr, &memval) == 2) {
+			printf("Memory write %8.8x = %8.8x.\n", memaddr, memval);
+			sl_wr32(sl, memaddr, memval);
+		} else
+			fprintf(stderr, "Unknown memory write specification '%s'.\n",
+					cmd);
+	} else if (strncmp("flash:r:", cmd, 8) == 0) {
+		char *path = cmd + 8;
+		uint32_t flash_base = stm_devids[sl->chip_index].flash_base;
+		uint32_t flash_size = stl_flash_size(sl);
+		/* Read the program area. */
+		fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
+				flash_base, flash_base+flash_size, path);
+		result = stl_fread(sl, path, flash_base, flash_size) != 0;
+	} else if (strncmp("flash:w:", cmd, 8) == 0) {
+		char *path = cmd + 8;
+		uint32_t flash_base = stm_devids[sl->chip_index].flash_base;
+		uint32_t flash_size = stl_flash_size(sl);
+		/* Write the user flash area. */
+		fprintf(stderr, " Writing ARM memory 0x%8.8x..0x%8.8x from %s.\n",
+				flash_base, flash_base+flash_size, path);
+		stl_flash_fwrite(sl, path, flash_base, flash_size);
+	} else if (strncmp("flash:v:", cmd, 8) == 0) {
+		char *path = cmd + 8;
+		uint32_t flash_base = stm_devids[sl->chip_index].flash_base;
+		const int res = stlink_fverify(sl, path, flash_base);
+		printf("  Check flash: file %s %s flash contents\n", path,
+			   res == 0 ? "matched" : "did not match");
+	} else if (strncmp("sys:r:", cmd, 6) == 0) {
+		char *path = cmd + 6;
+		uint32_t membase = stm_devids[sl->chip_index].sysflash_base;
+		uint32_t size = stm_devids[sl->chip_index].sysflash_size;
+		/* Read the system flash memory. */
+		fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
+				membase, membase+size, path);
+		result = stl_fread(sl, path, membase, size) != 0;
+	} else if (strcmp("status", cmd) == 0) {
+		sl->core_state = stl_get_status(sl);
+		printf("ARM status is 0x%4.4x: %s.\n", sl->core_state,
+			   sl->core_state==STLINK_CORE_RUNNING ? "running" :
+			   (sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
+	} else if (strcmp("stats", cmd) == 0) {
+		stl_stats_json(sl, stdout);
+	} else if (strncmp("stats=", cmd, 6) == 0) {
+		result = stl_stats_write(sl, cmd + 6);
+	} else if (strncmp("watch:", cmd, 6) == 0) {
+		result = stl_watch(sl, cmd + 6) != 0;
+	} else if (strcmp("calibrate", cmd) == 0) {
+		result = stl_xfer_calibrate(sl, 1) != 0;
+	} else if (strcmp("blink", cmd) == 0) {
+		stm_discovery_blink(sl);
+	} else if (strcmp("info", cmd) == 0) {
+		stm_info(sl);
+	} else if (strcmp("reset", cmd) == 0) {
+		stl_reset(sl);
+	} else if (strcmp("version", cmd) == 0) {
+		stl_get_version(sl);
+		sl->ver = *(struct STLinkVersion *)sl->data_buf;
+		stl_print_version(&sl->ver);
+	} else if (strcmp("debug", cmd) == 0) {
+		stl_enter_debug(sl);
+	} else if (strcmp("run", cmd) == 0) {
+		stl_state_run(sl);
+	} else if (strncmp("run=", cmd, 4) == 0) {
+		/* Run until a breakpoint halts the core, at most the seconds given. */
+		unsigned int msecs = strtod(cmd + 4, 0) * 1000;
+		int ret;
+		stl_state_run(sl);
+		ret = stl_wait(sl, STL_WAIT_HALT, 0, 0, NULL, 0, msecs);
+		if (ret == -EIO)
+			fprintf(stderr, "The STLink failed reading the core status.\n");
+		else
+			printf("The ARM core %s.\n", ret ? "is still running" : "halted");
+		result = ret != 0;
+	} else if (strcmp("step", cmd) == 0) {
+		int ret;
+		stl_step(sl);
+		ret = stl_wait(sl, STL_WAIT_HALT, 0, 0, NULL, 0, 100);
+		if (ret != 0) {
+			fprintf(stderr, ret == -EIO ? "The STLink failed reading the "
+					"core status.\n" : "The ARM core did not halt after "
+					"the step.\n");
+			result = 1;
+		}
+	} else if (strcmp("sleep", cmd) == 0) {
+		sleep(5);
+	} else if (strcmp("erase", cmd) == 0) {
+		/* The user usually wants to do an erase-all.  Make it simple. */
+		stl_enter_debug(sl);
+		stl_reset(sl);
+		if (stl_flash_erase_page(sl, 0xa11) != 0)
+			stl_flash_erase_page(sl, 0xa11);
+	} else if (strncmp("erase=", cmd, 6) == 0) {
+		/* Erase a flash page at location */
+		int memaddr = strcmp(cmd+6, "all") == 0 ? 0xa11
+			: strtoul(cmd+6, 0, 0); /* Sleazy parse. */
+		stl_enter_debug(sl);
+		stl_flash_erase_page(sl, memaddr);
+	} else if (strncmp("loader=", cmd, 7) == 0) {
+		/* Write a flash location */
+		int memaddr = strtoul(cmd+7, 0, 0); /* Super sleazy */
+		uint32_t buf = 0x6524dbec;
+		stl_flash_write(sl, memaddr, &buf, sizeof buf);
+	} else if (strcmp("cmd12", cmd) == 0) {
+		printf("Result of Commmand12 is %2.2x.\n",
+			   stlink_cmd(sl, 0x0c, 0, 0));
+	}
+	/* The table-driven peripheral device display commands. */
+	else if (stm32_dev_show(sl, cmd) == 0) {
+		;			/* dev_show() has already done the work.  */
+	}
+	else {
+		fprintf(stderr, "Unrecognized command '%s'.\n", cmd);
+		return -1;
+	}
+	return result;
+}
 
-/* Previously I had hoped to use a single table, but
- * chips increasing shuffle perhiperals.
- * Put the L1 series on its own table.
+#if defined(__linux__) || defined(__APPLE__)
+/* The probe server.
+ * Attaching to a STLink takes far longer than a simple command, so a
+ * test bench may instead keep one stlinkv2-util attached and send it
+ * commands over a socket.  The protocol is line based: each request is a
+ * command as on the command line, and the reply is the command's output
+ * followed by a status line of '.' and the stl_do_command() result.
+ * Requests may be pipelined, and replies are only pushed out when the
+ * server has run out of requests to work on.  Consecutive read<addr> and
+ * write<addr>=<val> requests are queued to the STLink without waiting
+ * for each one, so a stream of pokes runs at the STLink's rate rather
+ * than one USB round trip each.
+ * ADDR is a Unix socket path, or <host>:<port> for TCP.  ":<port>" binds
+ * to the loopback interface only.  One client is served at a time.
  */
-struct dev_peripheral dev_per_L1[] = {
-	{"SysTick", 0xE000E010, 0, arm_show_systick, 16},
-	{"LCD", 	0x40002400, 0, stm_show_LCD, 84},
-	{"PWR", 	0x40007000, 0, stm_show_dev, 32},
-	{"RI",		0x40007C00, 0, stm_show_dev, 32},
-	{"OPAMP",	0x40007C5C, 0, stm_show_dev, 32},
-	/* APB2 */
-	{"SYSCFG",	0x40010000, 0, stm_show_dev, 32},
-	{"EXTI",	0x40010400, 0, stm_show_dev, 32},
-	{"TIM9",	0x40010800, 9, stm_show_timer, 76},
-	{"TIM10",	0x40010C00, 10, stm_show_timer, 76},
-	{"TIM11",	0x40011000, 11, stm_show_timer, 76},
-	{"ADC",		0x40012400, 1, stm_show_dev, 32},
-	{"SDIO",	0x40012C00, 1, stm_show_dev, 32},
-	/* AHB perhiperals, all with new locations */
-	{"CRC",		0x40023000, 0, stm_show_dev, 32},
-	{"RCC",		0x40023800, 0, stm_show_dev, 56},
-	{"FLASH",	0x40023C00, 0, stm_show_dev, 32},
-	{"DMA1",	0x40026000, 1, stm_show_DMA, 8 + 20*7},
-	{"DMA2",	0x40026400, 2, stm_show_DMA, 8 + 20*7},
-	{"AES",		0x50060000, 0, stm_show_dev, 32},
-	/* I/O pin configuration on new F3; use 'GPIO' instead of PORT. */
-	{"GPIOA", 0x40020000, 0, stm_show_dev, 44},
-	{"GPIOB", 0x40020400, 0, stm_show_dev, 44},
-	{"GPIOC", 0x40020800, 0, stm_show_dev, 44},
-	{"GPIOD", 0x40020C00, 0, stm_show_dev, 44},
-	{"GPIOE", 0x40021000, 0, stm_show_dev, 44},
-	{"GPIOF", 0x40021800, 0, stm_show_dev, 44}, /* Not in address order */
-	{"GPIOG", 0x40021C00, 0, stm_show_dev, 44},
-	{"GPIOH", 0x40021400, 0, stm_show_dev, 44},
+#define STL_SERVER_BATCH	64
+
+struct stl_server_req {
+	int is_read, failed;
+	unsigned int seq;			/* Its STLink queue sequence number. */
+	uint32_t addr, val;
+	uint32_t words[4];
 };
 
-static int stm32_dev_show(struct stlink* sl, const char *cmd_name)
+/* Open a listening (SERVE) or connected socket for ADDR. */
+static int stl_sock_open(const char *addr, int serve)
+{
+	const char *colon = strrchr(addr, ':');
+	int fd, one = 1;
+
+	if (colon == NULL || addr[0] == '/' || addr[0] == '.') {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof sun.sun_path) {
+			fprintf(stderr, "The socket path '%s' is too long.\n", addr);
+			return -1;
+		}
+		strcpy(sun.sun_path, addr);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (serve) {
+			struct stat st;
+			if (stat(addr, &st) == 0 && S_ISSOCK(st.st_mode))
+				unlink(addr);
+			if (bind(fd, (struct sockaddr *)&sun, sizeof sun) < 0 ||
+				listen(fd, 4) < 0) {
+				close(fd);
+				return -1;
+			}
+		} else if (connect(fd, (struct sockaddr *)&sun, sizeof sun) < 0) {
+			close(fd);
+			return -1;
+		}
+	} else {
+		struct addrinfo hints, *ai;
+		char host[256];
+		int len = colon - addr;
+
+		snprintf(host, sizeof host, "%.*s", len, addr);
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(len ? host : "localhost", colon + 1, &hints, &ai) != 0)
+			return -1;
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+			if (serve ? (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+						 listen(fd, 4) < 0)
+				: connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+				close(fd);
+				fd = -1;
+			} else
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		}
+		freeaddrinfo(ai);
+	}
+	return fd;
+}
+
+/* Retire the oldest queued command, noting its result in the request
+ * it belongs to.  The first *NDONE of the NREQS requests have theirs.
+ * A batch is longer than the queue, so this is done before the slot is
+ * reused. */
+static void stl_server_retire(struct stlink *sl, struct stl_server_req *reqs,
+							  int nreqs, int *ndone)
+{
+	unsigned int seq = sl->q_tail;
+
+	stl_queue_retire(sl);
+	if (*ndone < nreqs && reqs[*ndone].seq == seq)
+		reqs[(*ndone)++].failed =
+			stl_req_failed(&sl->queue[seq % STL_QUEUE_LEN]);
+}
+
+/* Make room in the queue, and return the next request to fill. */
+static struct stl_server_req *stl_server_next(struct stlink *sl,
+											 struct stl_server_req *reqs,
+											 int *nreqs, int *ndone)
+{
+	while (sl->q_head - sl->q_tail >= sl->q_depth)
+		stl_server_retire(sl, reqs, *nreqs, ndone);
+	reqs[*nreqs].seq = sl->q_head;
+	reqs[*nreqs].failed = 0;
+	return &reqs[(*nreqs)++];
+}
+
+/* Finish the queued memory requests and send their replies, each with
+ * the status of its own transfer. */
+static void stl_server_drain(struct stlink *sl, struct stl_server_req *reqs,
+							 int *nreqs, int *ndone)
 {
 	int i;
 
-	if (stm_devids[sl->chip_index].cap_flags & ChipCapL1Addrs) {
-		for (i = 0; i < sizeof(dev_per_L1)/sizeof(dev_per_L1[0]); i++) {
-			struct dev_peripheral *dp = &dev_per_L1[i];
-			if (strcasecmp(dp->name, cmd_name) == 0) {
-				uint32_t *result = (void*)sl->data_buf;
-				if (dp->extent)
-					stl_rd32_cmd(sl, dp->addr, dp->extent);
-				dp->show_func1(sl, dp, result);
-				return 0;
+	while (sl->q_tail != sl->q_head)
+		stl_server_retire(sl, reqs, *nreqs, ndone);
+	for (i = 0; i < *nreqs; i++) {
+		struct stl_server_req *rq = &reqs[i];
+		if (rq->is_read && rq->failed)
+			printf("Memory %8.8x read failed.\n", rq->addr);
+		else if (rq->is_read)
+			printf("Memory %8.8x is %8.8x %8.8x %8.8x %8.8x.\n", rq->addr,
+				   rq->words[0], rq->words[1], rq->words[2], rq->words[3]);
+		else
+			printf("Memory write %8.8x = %8.8x.\n", rq->addr, rq->val);
+		printf(".%d\n", rq->failed);
+	}
+	*nreqs = *ndone = 0;
+}
+
+/* Serve one client until it disconnects.
+ * Returns 1 if it asked for the server to shut down. */
+static int stl_serve_client(struct stlink *sl, int fd)
+{
+	struct stl_server_req reqs[STL_SERVER_BATCH];
+	char buf[4096];
+	int nreqs = 0, ndone = 0, len = 0, shutdown_req = 0;
+	int discard = 0;			/* Dropping the rest of an overlong line */
+
+	while ( ! shutdown_req) {
+		char *line, *eol;
+		int n, addr, val;
+
+		/* Out of complete requests: finish everything and push the
+		 * replies out before blocking for more.  An overlong line is
+		 * dropped up to its end, and fails. */
+		if (memchr(buf, '\n', len) == NULL) {
+			stl_server_drain(sl, reqs, &nreqs, &ndone);
+			fflush(stdout);
+			if (len == sizeof buf) {
+				discard = 1;
+				len = 0;
 			}
+			n = read(fd, buf + len, sizeof buf - len);
+			if (n <= 0)
+				break;
+			len += n;
+			continue;
 		}
-	}
-	for (i = 0; i < sizeof(dev_per)/sizeof(dev_per[0]); i++) {
-		struct dev_peripheral *dp = &dev_per[i];
-		if (strcasecmp(dp->name, cmd_name) == 0) {
-			uint32_t *result = (void*)sl->data_buf;
-			if (dp->extent)
-				stl_rd32_cmd(sl, dp->addr, dp->extent);
-			dp->show_func1(sl, dp, result);
-			return 0;
+		line = buf;
+		eol = memchr(buf, '\n', len);
+		*eol = 0;
+		if (eol > line && eol[-1] == '\r')
+			eol[-1] = 0;
+
+		if (discard) {
+			printf("Request longer than %d bytes.\n.1\n", (int)sizeof buf);
+			discard = 0;
+		} else if (strncmp("read", line, 4) == 0 && line[4] != 0) {
+			struct stl_server_req *rq =
+				stl_server_next(sl, reqs, &nreqs, &ndone);
+			rq->is_read = 1;
+			rq->addr = strtoul(line + 4, 0, 0);
+			stl_queue_rd32(sl, rq->addr, sizeof rq->words, rq->words);
+		} else if (sscanf(line, "write%i=%i", &addr, &val) == 2) {
+			struct stl_server_req *rq =
+				stl_server_next(sl, reqs, &nreqs, &ndone);
+			rq->is_read = 0;
+			rq->addr = addr;
+			rq->val = val;
+			write_uint32((unsigned char *)rq->words, val);
+			stl_queue_wr32(sl, addr, rq->words, sizeof(uint32_t));
+		} else {
+			stl_server_drain(sl, reqs, &nreqs, &ndone);
+			if (strcmp("quit", line) == 0)
+				break;
+			if (strcmp("shutdown", line) == 0) {
+				printf(".0\n");
+				shutdown_req = 1;
+			} else if (line[0])
+				printf(".%d\n", stl_do_command(sl, line));
 		}
+		if (nreqs == STL_SERVER_BATCH)
+			stl_server_drain(sl, reqs, &nreqs, &ndone);
+		len -= eol + 1 - buf;
+		memmove(buf, eol + 1, len);
 	}
-	return -1;
+	stl_server_drain(sl, reqs, &nreqs, &ndone);
+	fflush(stdout);
+	return shutdown_req;
 }
 
-struct stlink *stl_usb_scan(struct stlink *sl, const char *dev_name)
+/* Accept clients on ADDR until one sends "shutdown".
+ * The client's connection temporarily becomes our stdout, so that every
+ * command's normal output goes to it.  Diagnostics stay on stderr. */
+static int stl_serve(struct stlink *sl, const char *addr)
 {
-	libusb_device_handle *dev_handle;
-	libusb_device **devs;
-	int r;
-	ssize_t cnt;
+	static char out_buf[64*1024];
+	int listen_fd = stl_sock_open(addr, 1);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int done = 0;
 
-	r = libusb_init(NULL);
-
-	if (r < 0) {
-		fprintf(stderr, "Failed to scan USB devices: %s\n",
+	if (listen_fd < 0) {
+		fprintf(stderr, "Unable to serve on '%s': %s.\n", addr,
 				strerror(errno));
-		return NULL;
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	fflush(stdout);
+	setvbuf(stdout, out_buf, _IOFBF, sizeof out_buf);
+	fprintf(stderr, "Serving STLink %s on %s.\n", sl->dev_path, addr);
+	while ( ! done) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (verbose)
+			fprintf(stderr, " Client connected.\n");
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+		done = stl_serve_client(sl, STDOUT_FILENO);
+		fflush(stdout);
+		dup2(saved_stdout, STDOUT_FILENO);
 	}
+	close(listen_fd);
+	close(saved_stdout);
+	if (addr[0] == '/' || addr[0] == '.' || strchr(addr, ':') == NULL)
+		unlink(addr);
+	return 0;
+}
 
-	cnt = libusb_get_device_list(NULL, &devs);
-	if (cnt < 0) {
-		fprintf(stderr, "USB access failed, %s.\n", strerror(errno));
-		
-		return 0;
+/* The client side: send the commands CMDS, or our stdin if there are
+ * none, to the server at ADDR and print the replies.
+ * Everything is sent as fast as the server will take it.
+ * Returns the number of failed commands. */
+static int stl_client(const char *addr, char **cmds)
+{
+	char out[4096], in[4096];
+	int fd = stl_sock_open(addr, 0);
+	int out_len = 0, out_pos = 0, in_len = 0, failures = 0;
+	int from_stdin = *cmds == NULL, more = 1;
+
+	if (fd < 0) {
+		fprintf(stderr, "Unable to connect to the STLink server '%s': %s.\n",
+				addr, strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		struct pollfd pfd;
+		char *line, *eol;
+
+		/* Refill the output buffer from the argument list or stdin. */
+		while (more && out_pos == out_len) {
+			out_pos = out_len = 0;
+			if (from_stdin) {
+				int n = read(STDIN_FILENO, out, sizeof out);
+				if (n > 0)
+					out_len = n;
+				else
+					more = 0;
+			} else if (*cmds)
+				out_len = snprintf(out, sizeof out, "%s\n", *cmds++);
+			else
+				more = 0;
+			if ( ! more)
+				shutdown(fd, SHUT_WR);
+		}
+		pfd.fd = fd;
+		pfd.events = POLLIN | (out_pos < out_len ? POLLOUT : 0);
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		if (pfd.revents & POLLOUT) {
+			int n = write(fd, out + out_pos, out_len - out_pos);
+			if (n < 0)
+				break;
+			out_pos += n;
+		}
+		if (pfd.revents & (POLLIN | POLLHUP)) {
+			int n = read(fd, in + in_len, sizeof in - in_len);
+			if (n <= 0)
+				break;
+			in_len += n;
+			line = in;
+			while ((eol = memchr(line, '\n', in + in_len - line)) != NULL) {
+				*eol = 0;
+				if (line[0] == '.' && line[1] != 0)
+					failures += atoi(line + 1) != 0;
+				else
+					printf("%s\n", line);
+				line = eol + 1;
+			}
+			in_len -= line - in;
+			memmove(in, line, in_len);
+			if (in_len == sizeof in)	/* An overlong line, pass it on */
+				fwrite(in, 1, in_len, stdout), in_len = 0;
+		}
 	}
+	close(fd);
+	return failures;
+}
+#endif
 
-	dev_handle = libusb_open_device_with_vid_pid(NULL,
-												 USB_ST_VID, USB_STLINKv2_PID);
+/* The complete session with one STLink: attach, do any -U upload, run
+ * the command list and close.  Returns the number of failed commands. */
+static int stl_session(struct stlink *sl, char **cmds, const char *upload_path,
+					   const char *stats_file)
+{
+	int failures = 0;
 
-	if (dev_handle == NULL) {
-		if (verbose)
-			printf("No USB STLink found.\n");
-		libusb_free_device_list(devs, 0);
-		return NULL;
+	if (stl_attach(sl) != 0) {
+		stl_close(sl);
+		return 1;
+	}
+
+	/* Do any -C/-D/-U operations. */
+	if (upload_path) {
+		uint32_t flash_base = stm_devids[sl->chip_index].flash_base;
+		uint32_t flash_size = stl_flash_size(sl);
+		/* Read the program area. */
+		fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
+				flash_base, flash_base+flash_size, upload_path);
+		if (stl_fread(sl, upload_path, flash_base, flash_size) != 0)
+			failures++;
 	}
 
-	if (verbose) {
-		libusb_device *this_dev = libusb_get_device(dev_handle);
-		printf("Found a STLink v2 on USB bus %d device %d.\n",
-			   libusb_get_bus_number(this_dev),
-			   libusb_get_device_address(this_dev));
+	for (; *cmds; cmds++) {
+		int res = stl_do_command(sl, *cmds);
+		if (res != 0)
+			failures++;
+		if (res < 0)
+			break;
 	}
+#if defined(__linux__) || defined(__APPLE__)
+	if (server_addr)
+		failures += stl_serve(sl, server_addr);
+#endif
+
+	/* A list of the features/bugs that I still need to check.
+	 * Read the CPU ID base register at 0xe000ed00  -> 0x411fc231
+	 * MPU type at 0xe000ed90 -> 0  (none)
+	 * DHCSR  0xe000edf0
+	 * GPIOC_ODR  0x4001100c
+	 * Check for a write bug on 1K/2K/3K/4K boundaries.
+	 *  Reads are checked by stl_xfer_calibrate().
+	 * - Both aligned and unaligned with target page boundaries.
+	 * - Pre-fill the SCSI transfer buffer to check for transfer size overrun.
+	 * - Check for transfer overrun on 1, 2 and 3 byte transfers.
+	 * Check what happens with unaligned mem32 transfers, read and write.
+	 *  - Note state of STLink after failure, including next command response.
+	 */
 
-	/* We know that configuration 1 is the only one. */
-	r = libusb_reset_device(dev_handle);
-	r = libusb_set_configuration(dev_handle, 1);
-	r = libusb_claim_interface(dev_handle, 0);
 #if 0
-	if (libusb_set_interface_alt_setting(dev_handle, 0, 0) < 0){
-		printf("usb_set_altinterface failed.\n");
-	}
+	/* Switch back to mass storage mode before closing. */
+	stl_state_run(sl);
+	stl_exit_debug_mode(sl);
 #endif
+	/* Commands tend to 'stick' in the stlink.  Flush them. */
+	stl_get_status(sl);
+	if (stats_file && stl_stats_write(sl, stats_file) != 0)
+		failures++;
+	stl_close(sl);
+	return failures;
+}
 
-	memset(sl, 0, sizeof *sl);
-	sl->dev_path = "/dev/stlink";
-	sl->fd = -1;
-	sl->verbose = verbose;
-	sl->usb_hand = dev_handle;
-	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+/* Gang programming: one worker thread per STLink.
+ * Each worker owns its struct stlink and libusb context outright, so the
+ * only shared state is the read-only command list and device tables.
+ */
+struct stl_probe_job {
+	struct stl_usb_probe probe;
+	struct stlink sl;
+	pthread_t thread;
+	int started;
+	const char *transport;		/* NULL for USB */
+	char **cmds;
+	char upload_path[256];
+	char stats_path[256];
+	int failures;
+};
 
-	return sl;
+/* Open the STLink for a job with the transport it names. */
+static struct stlink *stl_job_open(struct stl_probe_job *job)
+{
+	if (job->transport == NULL)
+		return stl_usb_open(&job->sl, &job->probe);
+	if (strncmp(job->transport, "sim", 3) == 0)
+		return stl_sim_open(&job->sl, job->transport);
+#if defined(__linux__)
+	return stl_init(&job->sl, job->transport);
+#else
+	fprintf(stderr, "Unknown transport '%s'.\n", job->transport);
+	return NULL;
+#endif
 }
 
+static void *stl_probe_worker(void *arg)
+{
+	struct stl_probe_job *job = arg;
+
+	if (stl_job_open(job) == NULL)
+		job->failures = 1;
+	else
+		job->failures = stl_session(&job->sl, job->cmds,
+									job->upload_path[0] ? job->upload_path
+									: NULL,
+									job->stats_path[0] ? job->stats_path
+									: NULL);
+	return NULL;
+}
 
 int main(int argc, char *argv[])
 {
     char *program;				/* Program name without path. */
     int c, errflag = 0;
-	char *dev_name;				/* Path of STLink device e.g. "/dev/stlink" */
 	char *upload_path = 0, *download_path = 0, *verify_path = 0;
-	int do_blink = 0;
-	struct stlink *sl;
+	char *probe_sel = 0;		/* --probe=<serial or bus-port path> */
+	char *transport = 0;		/* --transport=, NULL or "usb" for USB */
+	char *connect_addr = 0;		/* --connect=<socket or host:port> */
+	int do_blink = 0, do_all = 0, do_list = 0;
+	struct stl_usb_probe probes[STL_MAX_PROBES];
+	struct stl_probe_job *jobs;
+	libusb_context *scan_ctx;
+	int i, nprobes, njobs, failures = 0;
 
     program = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
 
 	while ((c = getopt_long(argc, argv, short_opts, long_options, 0)) != -1) {
 		switch (c) {
+		case 'a': do_all++; break;
 		case 'B': do_blink++; break;
+		case 'c': connect_addr = optarg; break;
 		case 'C': verify_path = optarg; break;
 		case 'D': download_path = optarg; break;
+		case 'E': export_path = optarg; break;
+		case 'K': cache_dir = optarg; break;
+		case 'l': do_list++; break;
+		case 'L': server_addr = optarg; break;
+		case 'P': probe_sel = optarg; break;
 		case 'U': upload_path = optarg; break;
 		case 'h':
 		case 'u': printf(usage_msg, program); return 0;
+		case 'R': usb_reset_attach++; break;
+		case 'S': stats_path = optarg; break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			if (queue_depth < 1 || queue_depth > STL_QUEUE_LEN) {
+				fprintf(stderr, "The queue depth must be 1..%d.\n",
+						STL_QUEUE_LEN);
+				errflag++;
+			}
+			break;
+		case 'T': transport = optarg; break;
 		case 'v': verbose++; break;
 		case 'V': printf("%s\n", version_msg); return 0;
+		case 'W': wait_secs = atoi(optarg); break;
+		case 'X': f4_vpp++; break;
 		default:
 		case '?': errflag++; break;
 		}
     }
 
-    if (errflag || argv[optind] == NULL) {
+    if (errflag ||
+		(argv[optind] == NULL && ! do_list && ! server_addr && ! connect_addr)) {
 		fprintf(stderr, usage_msg, program);
 		return errflag ? 1 : 2;
     }
 
-	sl = stl_usb_scan(&global_stlink, "USB STLink");
-	if (sl == NULL) {
-		fprintf(stderr, "Could not find a STLink.\n");
+	if (connect_addr)
+		return stl_client(connect_addr, argv + optind) ?
+			EXIT_FAILURE : EXIT_SUCCESS;
+	if (server_addr && do_all) {
+		fprintf(stderr, "A server uses a single STLink, select it with "
+				"--probe.\n");
 		return EXIT_FAILURE;
 	}
 
-	stl_get_version(sl);
-	sl->ver = *(struct STLinkVersion *)sl->data_buf;
-	if (sl->ver.ST_VendorID == 0 && sl->ver.ST_ProductID == 0) {
-		fprintf(stderr, "The device %s is reporting an ID of 0/0.\n"
-				"  Either the STLink is not plugged in or it is still "
-				"being initialized.\n",
-				sl->dev_path);
+	if (transport && strcmp(transport, "usb") == 0)
+		transport = NULL;
+	if (transport) {
+		/* A simulated or SCSI STLink: there is exactly one. */
+		memset(probes, 0, sizeof probes);
+		snprintf(probes[0].path, sizeof probes[0].path, "%s", transport);
+		nprobes = 1;
+	} else if (libusb_init(&scan_ctx) < 0) {
+		fprintf(stderr, "Failed to initialize USB access.\n");
 		return EXIT_FAILURE;
+	} else {
+		/* With --wait, keep looking until the STLink we want arrives. */
+		uint64_t deadline = stl_now_ns() + (uint64_t)wait_secs * 1000000000;
+		while ((nprobes = stl_usb_list(scan_ctx, probes, STL_MAX_PROBES)) >= 0
+			   && stl_probe_find(probes, nprobes, probe_sel) < 0 && wait_secs
+			   && stl_usb_wait_arrival(scan_ctx, deadline))
+			;
+		libusb_exit(scan_ctx);
 	}
 
-	if (sl->verbose)
-		stl_print_version(&sl->ver);
+	if (do_list) {
+		for (i = 0; i < nprobes; i++)
+			printf("STLink v2 at USB %-12s serial '%s'\n",
+				   probes[i].path, probes[i].serial);
+		return nprobes > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-	if (sl->ver.ST_VendorID != USB_ST_VID  ||
-		(sl->ver.ST_ProductID != USB_STLINK_PID &&
-		 sl->ver.ST_ProductID != USB_STLINKv2_PID)) {
-		fprintf(stderr, "The device %s is not a STLink\n"
-				"       VID/PID %04x/%04x instead of %04x/%04x.\n",
-				dev_name, sl->ver.ST_VendorID, sl->ver.ST_ProductID,
-				USB_ST_VID, USB_STLINK_PID);
+	/* Select the probes to use: all of them, the one named by --probe, or
+	 * by default the first one found. */
+	for (i = 0, njobs = 0; i < nprobes; i++) {
+		if (stl_probe_find(probes + i, 1, probe_sel) < 0)
+			continue;
+		probes[njobs++] = probes[i];
+		if ( ! do_all)
+			break;
+	}
+	if (njobs <= 0) {
+		fprintf(stderr, "Could not find a STLink.\n");
 		return EXIT_FAILURE;
 	}
 
-	/* When we open the device it is in an unknown mode.
-	 * The v1 is likely in mass storage mode.
-	 * Switch to Single Wire Debug (SWD) mode and issue the required
-	 * first command, reading the core ID.
-	 */
-#if 0
-	fprintf(stderr, "STLink status is %8.8x\n", stl_mode(sl));
-	stl_enter_SWD_mode(sl);
-	sleep(1);
-	fprintf(stderr, "STLink status is %8.8x\n", stl_mode(sl));
-
-	fprintf(stderr, "Target core ID is %8.8x\n", stl_get_core_id(sl));
-#endif
-	stl_kick_mode(sl);
-	stl_enter_SWD_mode(sl);
-	if (stl_mode(sl) != STLinkDevMode_Debug) {
-		fprintf(stderr, "Warning: Failed to switch the STLink into "
-				"debug mode.\n");
+	jobs = calloc(njobs, sizeof *jobs);
+	if (jobs == NULL) {
+		fprintf(stderr, "Failed to allocate the probe state.\n");
+		return EXIT_FAILURE;
 	}
-
-	/* At this point we have identified a working STLink programmer.
-	 * We now check on the target chip ID and state. */
-	stm_id_chip(sl);
-
-	/* Do any -C/-D/-U operations. */
-	if (upload_path) {
-		uint32_t flash_base = stm_devids[sl->chip_index].flash_base;
-		uint32_t flash_size = stm_devids[sl->chip_index].flash_size;
-		/* Read the program area. */
-		fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
-				flash_base, flash_base+flash_size, upload_path);
-		stl_fread(sl, upload_path, flash_base, flash_size);
-	}
-
-	while (argv[optind]) {
-		char *cmd = argv[optind];
-		if (verbose) printf("Executing command %s.\n", argv[optind]);
-
-		if (strcmp("regs", cmd) == 0) {
-			/* We must be stopped for this to work! */
-			stl_get_allregs(sl);
-			sl->reg = *(struct ARMcoreRegs*)sl->data_buf;
-			stlink_print_arm_regs(&sl->reg);
-		} else if (strncmp("reg", cmd, 3) == 0) {
-			/* We must be stopped for this to work! */
-			int regnum = strtoul(cmd+3, 0, 0); /* Super sleazy */
-			printf("Register %d is %8.8x.\n", regnum, stl_get_reg(sl, regnum));
-		} else if (strncmp("wreg", cmd, 3) == 0) {
-			int regnum, regval;
-			if (sscanf(cmd, "wreg%d=%i", &regnum, &regval) == 2) {
-				stl_write_reg(sl, regval, regnum);
-			} else
-				fprintf(stderr, "Unknown register write specification '%s'.\n",
-						cmd);
-		} else if (strncmp("program=", cmd, 8) == 0) {
-			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			uint32_t flash_size = stm_devids[0].flash_size;
-			int res;
-			/* Write the user flash area. */
-			fprintf(stderr, " Writing program from %s into STM32 flash at "
-					"0x%8.8x.\n", path, flash_base);
-			stl_enter_debug(sl);
-			stl_reset(sl);
-			stl_flash_erase_page(sl, 0xa11);
-			stl_flash_erase_page(sl, 0xa11);
-			stl_flash_fwrite(sl, path, flash_base, flash_size);
-			printf(" Verifying flash write...");
-			fflush(stdout);
-			res = stlink_fverify(sl, path, flash_base);
-			printf("file %s %s flash contents\n", path,
-				   res == 0 ? "matched" : "did not match");
-		} else if (strncmp("read", cmd, 4) == 0) {
-			/* Read memory location */
-			int memaddr = strtoul(cmd+4, 0, 0); /* Super sleazy */
-			uint32_t *result = (void*)sl->data_buf;
-			write_uint32(sl->cmd_buf + 2, memaddr);
-			write_uint16(sl->cmd_buf + 6, 16);
-			stlink_cmd(sl, STLinkDebugReadMem32bit, memaddr, 16);
-			printf("Memory %8.8x is %8.8x %8.8x %8.8x %8.8x.\n",
-				   memaddr, result[0], result[1], result[2], result[3]);
-#if 0
-			printf("Memory %8.8x is %8.8x.\n",
-				   memaddr, sl_rd32(sl, memaddr));
-#endif
-		} else if (strncmp("write", cmd, 3) == 0) {
-			int memaddr, memval;
-			if (sscanf(cmd, "write%i=%i", &memaddr, &memval) == 2) {
-				printf("Memory write %8.8x = %8.8x.\n", memaddr, memval);
-				sl_wr32(sl, memaddr, memval);
-			} else
-				fprintf(stderr, "Unknown memory write specification '%s'.\n",
-						cmd);
-		} else if (strncmp("flash:r:", cmd, 8) == 0) {
-			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			uint32_t flash_size = stm_devids[0].flash_size;
-			/* Read the program area. */
-			fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
-					flash_base, flash_base+flash_size, path);
-			stl_fread(sl, path, flash_base, flash_size);
-		} else if (strncmp("flash:w:", cmd, 8) == 0) {
-			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			uint32_t flash_size = stm_devids[0].flash_size;
-			/* Write the user flash area. */
-			fprintf(stderr, " Writing ARM memory 0x%8.8x..0x%8.8x from %s.\n",
-					flash_base, flash_base+flash_size, path);
-			stl_flash_fwrite(sl, path, flash_base, flash_size);
-		} else if (strncmp("flash:v:", cmd, 8) == 0) {
-			char *path = cmd + 8;
-			uint32_t flash_base = stm_devids[0].flash_base;
-			const int res = stlink_fverify(sl, path, flash_base);
-			printf("  Check flash: file %s %s flash contents\n", path,
-				   res == 0 ? "matched" : "did not match");
-		} else if (strncmp("sys:r:", cmd, 6) == 0) {
-			char *path = cmd + 6;
-			uint32_t membase = stm_devids[0].sysflash_base;
-			uint32_t size = stm_devids[0].sysflash_size;
-			/* Read the system flash memory. */
-			fprintf(stderr, " Reading ARM memory 0x%8.8x..0x%8.8x into %s.\n",
-					membase, membase+size, path);
-			stl_fread(sl, path, membase, size);
-		} else if (strcmp("status", cmd) == 0) {
-			sl->core_state = stl_get_status(sl);
-			printf("ARM status is 0x%4.4x: %s.\n", sl->core_state,
-				   sl->core_state==STLINK_CORE_RUNNING ? "running" :
-				   (sl->core_state==STLINK_CORE_HALTED ? "halted" : "unknown"));
-		} else if (strcmp("blink", cmd) == 0) {
-			stm_discovery_blink(sl);
-		} else if (strcmp("info", cmd) == 0) {
-			stm_info(sl);
-		} else if (strcmp("reset", cmd) == 0) {
-			stl_reset(sl);
-		} else if (strcmp("version", cmd) == 0) {
-			stl_get_version(sl);
-			sl->ver = *(struct STLinkVersion *)sl->data_buf;
-			stl_print_version(&sl->ver);
-		} else if (strcmp("debug", cmd) == 0) {
-			stl_enter_debug(sl);
-		} else if (strcmp("run", cmd) == 0) {
-			stl_state_run(sl);
-		} else if (strcmp("step", cmd) == 0) {
-			stl_step(sl);
-		} else if (strcmp("sleep", cmd) == 0) {
-			sleep(5);
-		} else if (strcmp("erase", cmd) == 0) {
-			/* The user usually wants to do an erase-all.  Make it simple. */
-			stl_enter_debug(sl);
-			stl_reset(sl);
-			if (stl_flash_erase_page(sl, 0xa11) != 0)
-				stl_flash_erase_page(sl, 0xa11);
-		} else if (strncmp("erase=", cmd, 6) == 0) {
-			/* Erase a flash page at location */
-			int memaddr = strcmp(cmd+6, "all") == 0 ? 0xa11
-				: strtoul(cmd+6, 0, 0); /* Sleazy parse. */
-			stl_enter_debug(sl);
-			stl_flash_erase_page(sl, memaddr);
-		} else if (strncmp("loader=", cmd, 7) == 0) {
-			/* Write a flash location */
-			int memaddr = strtoul(cmd+7, 0, 0); /* Super sleazy */
-			uint32_t buf = 0x6524dbec;
-			stl_flash_write(sl, memaddr, &buf, sizeof buf);
-		} else if (strcmp("cmd12", cmd) == 0) {
-			printf("Result of Commmand12 is %2.2x.\n",
-				   stlink_cmd(sl, 0x0c, 0, 0));
-		}
-		/* The table-driven peripheral device display commands. */
-		else if (stm32_dev_show(sl, cmd) == 0) {
-			;			/* dev_show() has already done the work.  */
-		}
-		else {
-			fprintf(stderr, "Unrecognized command '%s'.\n", cmd);
-			break;
-		}
-		optind++;
+	for (i = 0; i < njobs; i++) {
+		jobs[i].probe = probes[i];
+		jobs[i].transport = transport;
+		jobs[i].cmds = argv + optind;
+		/* With several probes each upload gets its own file. */
+		if (upload_path && njobs > 1)
+			snprintf(jobs[i].upload_path, sizeof jobs[i].upload_path,
+					 "%s.%s", upload_path, probes[i].path);
+		else if (upload_path)
+			snprintf(jobs[i].upload_path, sizeof jobs[i].upload_path,
+					 "%s", upload_path);
+		if (stats_path && njobs > 1 && strcmp(stats_path, "-") != 0)
+			snprintf(jobs[i].stats_path, sizeof jobs[i].stats_path,
+					 "%s.%s", stats_path, probes[i].path);
+		else if (stats_path)
+			snprintf(jobs[i].stats_path, sizeof jobs[i].stats_path,
+					 "%s", stats_path);
 	}
 
-	/* A list of the features/bugs that I still need to check.
-	 * Read the CPU ID base register at 0xe000ed00  -> 0x411fc231
-	 * MPU type at 0xe000ed90 -> 0  (none)
-	 * DHCSR  0xe000edf0
-	 * GPIOC_ODR  0x4001100c
-	 * Try 5.99 and 6KB reads.
-	 * Check for a read or write bug on 1K/2K/3K/4K boundaries.
-	 * - Both aligned and unaligned with target page boundaries.
-	 * - Pre-fill the SCSI transfer buffer to check for transfer size overrun.
-	 * - Check for transfer overrun on 1, 2 and 3 byte transfers.
-	 * Check what happens with unaligned mem32 transfers, read and write.
-	 *  - Note state of STLink after failure, including next command response.
-	 */
-
-#if 0
-	/* Switch back to mass storage mode before closing. */
-	stl_state_run(sl);
-	stl_exit_debug_mode(sl);
-#endif
-	/* Commands tend to 'stick' in the stlink.  Flush them. */
-	stl_get_status(sl);
-	stl_close(sl);
+	if (njobs == 1) {
+		stl_probe_worker(&jobs[0]);
+	} else {
+		for (i = 0; i < njobs; i++)
+			if (pthread_create(&jobs[i].thread, NULL, stl_probe_worker,
+							   &jobs[i]) == 0)
+				jobs[i].started = 1;
+			else {
+				fprintf(stderr, "Failed to start the worker for %s.\n",
+						jobs[i].probe.path);
+				jobs[i].failures = 1;
+			}
+		for (i = 0; i < njobs; i++)
+			if (jobs[i].started)
+				pthread_join(jobs[i].thread, NULL);
+		for (i = 0; i < njobs; i++)
+			printf("STLink %-12s %-24s %s\n", jobs[i].probe.path,
+				   jobs[i].probe.serial,
+				   jobs[i].failures ? "FAILED" : "done");
+	}
+	for (i = 0; i < njobs; i++)
+		failures += jobs[i].failures;
+	free(jobs);
 
-	return EXIT_SUCCESS;
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-
+
 /*
  * Local variables:
- *  compile-command: "cc -O -Wall -Wstrict-prototypes -o stlinkv2-util stlinkv2-util.c -lusb-1.0"
+ *  compile-command: "cc -O -Wall -Wstrict-prototypes -o stlinkv2-util stlinkv2-util.c -lusb-1.0 -lpthread"
  *  c-indent-level: 4
  *  c-basic-offset: 4
  *  tab-width: 4
@@ -195,6 +195,9 @@ struct stm_chip_params {			/* Unused/placeholder parameter table. */
  */
 #define Q_BUF_LEN	(6*1024 + 4)
 
+/* The number of commands we keep outstanding on the sg device. */
+#define SG_QUEUE_LEN	8
+
 /* Many commands return two bytes of status.
  * Only the lower byte has useful bits, so we often check only that. */
 #define STLINK_OK			0x80
@@ -295,9 +298,21 @@ struct stlink {
 	unsigned char sense_buf[SENSE_BUF_LEN];
 	int q_len;
 	unsigned char q_buf[Q_BUF_LEN];
+
+	/* Commands submitted to the sg driver but not yet retired. */
+	struct sg_req {
+		struct sg_io_hdr io_hdr;
+		unsigned char scsi_cmd_blk[CDB_SIZE];
+		unsigned char sense_buf[SENSE_BUF_LEN];
+		unsigned char resp_buf[4];	/* Discarded short responses. */
+	} sg_queue[SG_QUEUE_LEN];
+	unsigned int sg_head, sg_tail;
 };
 
 int stl_do_scsi_op(struct stlink *stl, int sg_xfer_dir);
+int stl_queue_scsi_op(struct stlink *stl, int sg_xfer_dir, void *data);
+int stl_queue_retire(struct stlink *stl);
+int stl_queue_flush(struct stlink *stl);
 
 // Endianness
 // http://www.ibm.com/developerworks/aix/library/au-endianc/index.html
@@ -375,6 +390,13 @@ struct stlink *stl_init(struct stlink *sl, const char *dev_name, int fd)
 
 	sl->verbose = verbose;
 	sl->core_state = STLINK_CORE_UNKNOWN_STATE;
+	{
+		/* Have each read() return the request with the pack_id we ask
+		 * for, and allow several commands to be outstanding. */
+		int one = 1;
+		ioctl(fd, SG_SET_FORCE_PACK_ID, &one);
+		ioctl(fd, SG_SET_COMMAND_Q, &one);
+	}
 
 	return sl;
 }
@@ -383,6 +405,7 @@ struct stlink *stl_init(struct stlink *sl, const char *dev_name, int fd)
  * We are always exiting and thus do not need to free any structures. */
 void stl_close(struct stlink *sl)
 {
+	stl_queue_flush(sl);
 	close(sl->fd);
 }
 
@@ -455,6 +478,18 @@ int stlink_cmd(struct stlink *sl, uint8_t st_cmd1, uint8_t st_cmd2, int q_len)
 
 #define is_core_halted(sl)  (stl_get_status(sl) == STLINK_CORE_HALTED)
 
+/* Queue a regular-form Debug command without waiting for its response.
+ * The short status response is discarded. */
+static int stlink_cmd_queue(struct stlink *sl, uint8_t st_cmd1,
+							uint8_t st_cmd2, int q_len)
+{
+	sl->scsi_cmd_blk[0] = STLinkDebugCommand;
+	sl->scsi_cmd_blk[1] = st_cmd1;
+	sl->scsi_cmd_blk[2] = st_cmd2;
+	sl->q_len = q_len;
+	return stl_queue_scsi_op(sl, SG_DXFER_FROM_DEV, NULL);
+}
+
 /* Basic target memory read and write functions.
  * Both bulk and single 32 bit word functions are here.
  * The bulk version has the caller uses the SCSI buffer.
@@ -464,7 +499,8 @@ int stlink_cmd(struct stlink *sl, uint8_t st_cmd1, uint8_t st_cmd2, int q_len)
  * The *_mem8 variant has a maximum LEN of 64 bytes.
  * The *_mem32 variant must have LEN be a multiple of 4.
  */
-static inline int stl_wr32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
+static inline int stl_wr32_queue(struct stlink* sl, uint32_t addr,
+								 uint16_t len)
 {
 	sl->scsi_cmd_blk[0] = STLinkDebugCommand;
 	if ((len & 3) == 0)
@@ -477,8 +513,13 @@ static inline int stl_wr32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
 	write_uint16(sl->scsi_cmd_blk + 6, len);
 	sl->q_len = len;
 
-	stl_do_scsi_op(sl, SG_DXFER_TO_DEV);
-	return 0;
+	return stl_queue_scsi_op(sl, SG_DXFER_TO_DEV, sl->q_buf);
+}
+static inline int stl_wr32_cmd(struct stlink* sl, uint32_t addr, uint16_t len)
+{
+	if (stl_wr32_queue(sl, addr, len) < 0)
+		return -1;
+	return stl_queue_flush(sl);
 }
 static inline void sl_wr32(struct stlink* sl, uint32_t addr, uint32_t val)
 {
@@ -509,50 +550,124 @@ static inline uint32_t sl_rd32(struct stlink *sl, uint32_t addr)
 	stl_rd32_cmd(sl, addr, sizeof(uint32_t));
 	return *(uint32_t*)sl->q_buf;
 }
+/* Queue a read of LEN bytes at ADDR directly into DEST, with the same
+ * +1 request size as stl_rd32_cmd().
+ * DEST is filled in when the command is retired. */
+static int stl_rd32_queue(struct stlink* sl, uint32_t addr, uint16_t len,
+						  void *dest)
+{
+	sl->scsi_cmd_blk[0] = STLinkDebugCommand;
+	sl->scsi_cmd_blk[1] = STLinkDebugReadMem32bit;
+	write_uint32(sl->scsi_cmd_blk + 2, addr);
+	write_uint16(sl->scsi_cmd_blk + 6, len+1);
+	sl->q_len = len;
+	return stl_queue_scsi_op(sl, SG_DXFER_FROM_DEV, dest);
+}
 
 /* Enqueue a command to the SCSI Generic driver.
  * Most of the work is filling in the struct sg_io_hdr.
+ * We use the asynchronous sg write()/read() interface rather than a
+ * blocking ioctl(SG_IO), so several commands may be outstanding.  Each is
+ * tagged with its queue slot as the pack_id.  Outgoing data is copied at
+ * write() time, so sl->q_buf may be reused immediately.  Incoming DATA is
+ * filled in when the command is retired.  A NULL DATA discards a short
+ * response.
  */
-int stl_do_scsi_op(struct stlink *stl, int sg_xfer_dir)
+int stl_queue_scsi_op(struct stlink *stl, int sg_xfer_dir, void *data)
 {
-    struct sg_io_hdr io_hdr = {0,};
-	int ret;
+	struct sg_req *rq;
+	struct sg_io_hdr *io_hdr;
+
+	if (stl->sg_head - stl->sg_tail >= SG_QUEUE_LEN &&
+		stl_queue_retire(stl) < 0)
+		return -1;
+	rq = &stl->sg_queue[stl->sg_head % SG_QUEUE_LEN];
+	io_hdr = &rq->io_hdr;
+	memset(io_hdr, 0, sizeof *io_hdr);
+	memcpy(rq->scsi_cmd_blk, stl->scsi_cmd_blk, sizeof rq->scsi_cmd_blk);
+	if (data == NULL && stl->q_len <= sizeof rq->resp_buf)
+		data = rq->resp_buf;
 
-	io_hdr.interface_id = 'S';
-    io_hdr.pack_id = 0;
+	io_hdr->interface_id = 'S';
+	io_hdr->pack_id = stl->sg_head % SG_QUEUE_LEN;
 
 	/* Provide buffers for the SCSI transfer.
 	 * The Request Sense (error info) command is used for responses.
 	 * http://en.wikipedia.org/wiki/SCSI_Request_Sense_Command
 	 */
-	io_hdr.cmdp = stl->scsi_cmd_blk;
-	io_hdr.cmd_len = sizeof(stl->scsi_cmd_blk);
-	io_hdr.sbp = stl->sense_buf;
-	io_hdr.mx_sb_len = sizeof(stl->sense_buf);
-	memset(io_hdr.sbp, 0, io_hdr.sb_len_wr);
+	io_hdr->cmdp = rq->scsi_cmd_blk;
+	io_hdr->cmd_len = sizeof(rq->scsi_cmd_blk);
+	io_hdr->sbp = rq->sense_buf;
+	io_hdr->mx_sb_len = sizeof(rq->sense_buf);
 
 	/* Set a buffer to be used for data transferred from/to device */
-	io_hdr.iovec_count = 0;
-	io_hdr.dxferp = stl->q_buf;
-	io_hdr.dxfer_len = stl->q_len;
-	io_hdr.dxfer_direction = sg_xfer_dir;
-
-	io_hdr.timeout = SG_TIMEOUT_MSEC;
-	io_hdr.flags = 0;
-	ret = ioctl(stl->fd, SG_IO, &io_hdr);
+	io_hdr->iovec_count = 0;
+	io_hdr->dxferp = data;
+	io_hdr->dxfer_len = stl->q_len;
+	io_hdr->dxfer_direction = sg_xfer_dir;
+
+	io_hdr->timeout = SG_TIMEOUT_MSEC;
+	io_hdr->flags = 0;
+	if (write(stl->fd, io_hdr, sizeof *io_hdr) < 0) {
+		fprintf(stderr, " SCSI command %2.2x %2.2x submit failed: %s.\n",
+				rq->scsi_cmd_blk[0], rq->scsi_cmd_blk[1], strerror(errno));
+		return -1;
+	}
+	stl->sg_head++;
+	return 0;
+}
+
+/* Wait for the oldest queued command to complete and report its results. */
+int stl_queue_retire(struct stlink *stl)
+{
+	struct sg_req *rq = &stl->sg_queue[stl->sg_tail % SG_QUEUE_LEN];
+	struct sg_io_hdr *io_hdr = &rq->io_hdr;
+	int ret;
+
+	if (stl->sg_tail == stl->sg_head)
+		return 0;
+	/* The read() blocks until the request with io_hdr->pack_id is done. */
+	ret = read(stl->fd, io_hdr, sizeof *io_hdr);
+	stl->sg_tail++;
+	if (ret < 0) {
+		fprintf(stderr, " SCSI command %2.2x %2.2x failed: %s.\n",
+				rq->scsi_cmd_blk[0], rq->scsi_cmd_blk[1], strerror(errno));
+		return -1;
+	}
 	/* Report SCSI results.  Really, note useful variable if we need
 	 * to write better reporting code. */
 	if (stl->verbose) {
 		if (stl->verbose > 1)
 			fprintf(stderr, " SCSI command status %4.4x, took %d ms.\n",
-					io_hdr.status, io_hdr.duration);
-		if (io_hdr.resid || io_hdr.sb_len_wr)
+					io_hdr->status, io_hdr->duration);
+		if (io_hdr->resid || io_hdr->sb_len_wr)
 			fprintf(stderr, " SCSI residue was %d, sense length %d.\n",
-					io_hdr.resid, io_hdr.sb_len_wr);
+					io_hdr->resid, io_hdr->sb_len_wr);
 	}
+	return 0;
+}
+
+/* Wait for all queued commands. */
+int stl_queue_flush(struct stlink *stl)
+{
+	int ret = 0;
+
+	while (stl->sg_tail != stl->sg_head)
+		if (stl_queue_retire(stl) < 0)
+			ret = -1;
 	return ret;
 }
 
+/* Execute a command, waiting for it and anything queued before it. */
+int stl_do_scsi_op(struct stlink *stl, int sg_xfer_dir)
+{
+	if (stl_queue_scsi_op(stl, sg_xfer_dir, stl->q_buf) < 0) {
+		stl_queue_flush(stl);
+		return -1;
+	}
+	return stl_queue_flush(stl);
+}
+
 static void stl_print_version(struct STLinkVersion *ver)
 {
 	if (ver->ST_VendorID == USB_ST_VID && ver->ST_ProductID == USB_STLINK_PID)
@@ -796,12 +911,17 @@ static int stl_loader(struct stlink *sl, stm32_addr_t flash_addr,
 	params[-2] = flash_addr;
 	params[-1] = size>>1;
 	memcpy(params, buf, size);
-
-	/* Transfer both the loader and data at once. */
-	stl_wr32_cmd(sl, prog_base, offset + size);
-	/* Run the program by setting the PC aka r15. */
-	stl_write_reg(sl, prog_base, 15);
-	stl_state_run(sl);
+	/* The 32 bit write needs a whole number of words. */
+	while (size & 3)
+		sl->q_buf[offset + size++] = 0xff;
+
+	/* Transfer both the loader and data at once, run the program by
+	 * setting the PC aka r15.  These are queued back-to-back, and
+	 * complete with the caller's first status poll. */
+	stl_wr32_queue(sl, prog_base, offset + size);
+	write_uint32(sl->scsi_cmd_blk + 3, prog_base);
+	stlink_cmd_queue(sl, STLinkDebugWriteReg, 15, 2);
+	stlink_cmd_queue(sl, STLinkDebugRunCore, 0, 2);
 
 	return 0;
 }
@@ -888,27 +1008,31 @@ static int stl_flash_erase_page(struct stlink *sl, stm32_addr_t addr_page)
 int stl_read(struct stlink* sl, stm32_addr_t addr, char *buf, ssize_t size)
 {
 	size_t offset = 0;
+	int ret;
 
 	if (addr & 3) {
 		int psz = 4 - (addr & 3);
+		if (psz > size)
+			psz = size;
 		stl_rd32_cmd(sl, addr & ~3, sizeof(uint32_t));
 		memcpy(buf, sl->q_buf + (addr & 3), psz);
 		offset = psz;
+		size -= psz;
 	}
-	do {
-		int xfer_size;
-		if (size > READ_BLK_SIZE)
-			xfer_size = READ_BLK_SIZE;
-		else
-			xfer_size = (size+3)&~3;
-		stl_rd32_cmd(sl, addr+offset, xfer_size);
-		if (size & 3)
-			xfer_size = size;
-		memcpy(buf + offset, sl->q_buf, xfer_size);
+	/* Queue the whole-word blocks to read directly into BUF, keeping
+	 * several requests in flight. */
+	while (size >= 4) {
+		int xfer_size = size > READ_BLK_SIZE ? READ_BLK_SIZE : size & ~3;
+		stl_rd32_queue(sl, addr + offset, xfer_size, buf + offset);
 		offset += xfer_size;
 		size -= xfer_size;
-	} while (size > 0);
-	return size;
+	}
+	ret = stl_queue_flush(sl);
+	if (size > 0) {
+		stl_rd32_cmd(sl, addr + offset, sizeof(uint32_t));
+		memcpy(buf + offset, sl->q_buf, size);
+	}
+	return ret;
 }
 
 